@@ -0,0 +1,869 @@
+#ifndef BINARYLOG_HPP
+#define BINARYLOG_HPP
+
+#include "PerThread.hpp"
+#include "cpplog.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <time.h>
+
+
+// Binary logging, with the formatting deferred: a BINLOG() call only
+// copies its arguments' raw bytes, along with the ID of a static
+// description of the call site (level, file, line and format), into a
+// buffer belonging to the calling thread.  A background thread turns them
+// into text later - or writes them to a file as they are, to be turned
+// into text offline by binlogdump.
+//
+// Formats use "{}" for each argument, e.g.:
+//
+//      BINLOG(LL_DEBUG, logger, "{}: probe {} took {} us", host, index, us);
+//
+// Arguments can be integers, enums, bools, chars, floating point numbers,
+// strings (std::string or C strings, which are copied) and pointers.
+namespace binlog {
+
+    enum class ArgType : uint8_t {
+        Int,
+        UInt,
+        Double,
+        Bool,
+        Char,
+        String,
+        Pointer,
+    };
+
+    // Longer strings are truncated.
+    enum { MAX_STRING = 4096 };
+
+
+    // How each type of argument is stored.
+    // --------------------------------------------------
+    template <typename T, typename Enable = void>
+    struct ArgTraits;
+
+    template <typename T>
+    struct ArgTraits<T, typename std::enable_if<
+            (std::is_integral<T>::value && std::is_signed<T>::value &&
+             !std::is_same<T, char>::value) || std::is_enum<T>::value>::type>
+    {
+        static ArgType Type() { return ArgType::Int; }
+        static size_t Size(const T&) { return sizeof(int64_t); }
+        static void Encode(char*& out, const T& value)
+        {
+            int64_t v = static_cast<int64_t>(value);
+            std::memcpy(out, &v, sizeof(v));
+            out += sizeof(v);
+        }
+    };
+
+    template <typename T>
+    struct ArgTraits<T, typename std::enable_if<
+            std::is_integral<T>::value && std::is_unsigned<T>::value &&
+            !std::is_same<T, bool>::value && !std::is_same<T, char>::value>::type>
+    {
+        static ArgType Type() { return ArgType::UInt; }
+        static size_t Size(const T&) { return sizeof(uint64_t); }
+        static void Encode(char*& out, const T& value)
+        {
+            uint64_t v = static_cast<uint64_t>(value);
+            std::memcpy(out, &v, sizeof(v));
+            out += sizeof(v);
+        }
+    };
+
+    template <typename T>
+    struct ArgTraits<T, typename std::enable_if<std::is_floating_point<T>::value>::type>
+    {
+        static ArgType Type() { return ArgType::Double; }
+        static size_t Size(const T&) { return sizeof(double); }
+        static void Encode(char*& out, const T& value)
+        {
+            double v = static_cast<double>(value);
+            std::memcpy(out, &v, sizeof(v));
+            out += sizeof(v);
+        }
+    };
+
+    template <>
+    struct ArgTraits<bool>
+    {
+        static ArgType Type() { return ArgType::Bool; }
+        static size_t Size(const bool&) { return 1; }
+        static void Encode(char*& out, const bool& value)
+        {
+            *out++ = value ? 1 : 0;
+        }
+    };
+
+    template <>
+    struct ArgTraits<char>
+    {
+        static ArgType Type() { return ArgType::Char; }
+        static size_t Size(const char&) { return 1; }
+        static void Encode(char*& out, const char& value)
+        {
+            *out++ = value;
+        }
+    };
+
+    // Strings are a 32-bit length, then the bytes.
+    inline size_t stringSize(size_t length)
+    {
+        return sizeof(uint32_t) + std::min<size_t>(length, MAX_STRING);
+    }
+
+    inline void encodeString(char*& out, const char* str, size_t length)
+    {
+        uint32_t len = static_cast<uint32_t>(std::min<size_t>(length, MAX_STRING));
+        std::memcpy(out, &len, sizeof(len));
+        out += sizeof(len);
+        std::memcpy(out, str, len);
+        out += len;
+    }
+
+    template <>
+    struct ArgTraits<const char*>
+    {
+        static ArgType Type() { return ArgType::String; }
+        static size_t Size(const char* const& value)
+        {
+            return stringSize(value ? std::strlen(value) : 6);
+        }
+        static void Encode(char*& out, const char* const& value)
+        {
+            if( value ) {
+                encodeString(out, value, std::strlen(value));
+            } else {
+                encodeString(out, "(null)", 6);
+            }
+        }
+    };
+
+    template <>
+    struct ArgTraits<char*> : public ArgTraits<const char*>
+    { };
+
+    template <>
+    struct ArgTraits<std::string>
+    {
+        static ArgType Type() { return ArgType::String; }
+        static size_t Size(const std::string& value) { return stringSize(value.size()); }
+        static void Encode(char*& out, const std::string& value)
+        {
+            encodeString(out, value.data(), value.size());
+        }
+    };
+
+    template <typename T>
+    struct ArgTraits<T*, typename std::enable_if<
+            !std::is_same<typename std::remove_cv<T>::type, char>::value>::type>
+    {
+        static ArgType Type() { return ArgType::Pointer; }
+        static size_t Size(T* const&) { return sizeof(uint64_t); }
+        static void Encode(char*& out, T* const& value)
+        {
+            uint64_t v = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(value));
+            std::memcpy(out, &v, sizeof(v));
+            out += sizeof(v);
+        }
+    };
+
+    // Arrays (e.g. string literals) decay to pointers.
+    template <typename T>
+    struct Traits : public ArgTraits<typename std::decay<T>::type>
+    { };
+
+    // The total encoded size of some arguments.
+    inline size_t ArgSize()
+    {
+        return 0;
+    }
+
+    template <typename T, typename... Rest>
+    size_t ArgSize(const T& first, const Rest&... rest)
+    {
+        return Traits<T>::Size(first) + ArgSize(rest...);
+    }
+
+    // Encode some arguments, advancing 'out' past them.  There must be
+    // ArgSize() bytes of room.
+    inline void EncodeArgs(char*&)
+    { }
+
+    template <typename T, typename... Rest>
+    void EncodeArgs(char*& out, const T& first, const Rest&... rest)
+    {
+        Traits<T>::Encode(out, first);
+        EncodeArgs(out, rest...);
+    }
+
+
+    // Call sites.
+    // --------------------------------------------------
+
+    // Everything about a BINLOG() call that doesn't change from one call
+    // to the next.
+    struct Descriptor {
+        uint32_t                id;
+        cpplog::loglevel_t      level;
+        std::string             file;
+        uint32_t                line;
+        std::string             format;
+        std::vector<ArgType>    types;
+    };
+
+    // A BINLOG() call site's static state.  The ID is zero until it's
+    // first logged from.
+    struct CallSite {
+        cpplog::loglevel_t      level;
+        const char*             file;
+        uint32_t                line;
+        const char*             format;
+        std::atomic<uint32_t>   id;
+    };
+
+    // Every call site that has logged anything, by ID.
+    class Registry {
+    public:
+        // How many descriptors can be found without taking the lock.
+        enum { MAX_UNLOCKED = 4096 };
+
+    private:
+        std::mutex                                  m_mutex;
+        std::vector<std::unique_ptr<Descriptor>>    m_descriptors;
+
+        // The first MAX_UNLOCKED descriptors again, for Find().
+        std::atomic<const Descriptor*>              m_table[MAX_UNLOCKED];
+        std::atomic<uint32_t>                       m_count;
+
+        Registry()
+            : m_count(1)
+        {
+            // IDs start at one.
+            m_descriptors.emplace_back();
+            for( auto& it : m_table ) {
+                it.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+    public:
+        static Registry& Instance()
+        {
+            static Registry registry;
+            return registry;
+        }
+
+        // Delete copy constructor and assignment.
+        Registry(Registry const&) = delete;
+        Registry& operator=(Registry const&) = delete;
+
+        uint32_t Register(CallSite& site, std::vector<ArgType> types)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            // Another thread might have beaten us to it.
+            uint32_t id = site.id.load(std::memory_order_acquire);
+            if( 0 != id ) {
+                return id;
+            }
+
+            std::unique_ptr<Descriptor> desc(new Descriptor());
+            desc->id = static_cast<uint32_t>(m_descriptors.size());
+            desc->level = site.level;
+            desc->file = cpplog::helpers::fileNameFromPath(site.file);
+            desc->line = site.line;
+            desc->format = site.format;
+            desc->types = std::move(types);
+
+            id = desc->id;
+            if( id < MAX_UNLOCKED ) {
+                m_table[id].store(desc.get(), std::memory_order_release);
+                m_count.store(id + 1, std::memory_order_release);
+            }
+            m_descriptors.push_back(std::move(desc));
+            site.id.store(id, std::memory_order_release);
+            return id;
+        }
+
+        // Descriptors are never freed, so this stays valid.  Returns null
+        // for an unknown ID.
+        const Descriptor* Get(uint32_t id)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            return id > 0 && id < m_descriptors.size() ? m_descriptors[id].get() : nullptr;
+        }
+
+        // The same, without taking any locks, so that it's safe to call
+        // from a signal handler.  Only finds the first MAX_UNLOCKED.
+        const Descriptor* Find(uint32_t id) const
+        {
+            return id < MAX_UNLOCKED ? m_table[id].load(std::memory_order_acquire) : nullptr;
+        }
+
+        // One more than the highest ID that Find() can find.
+        uint32_t FindableCount() const
+        {
+            return m_count.load(std::memory_order_acquire);
+        }
+    };
+
+
+    // Rendering.
+    // --------------------------------------------------
+
+    // Append the text of a message, given its descriptor and encoded
+    // arguments.  Placeholders without arguments are left as "{}", and
+    // arguments without placeholders are dropped.  Returns false if the
+    // arguments don't match the descriptor.
+    inline bool Render(const Descriptor& desc, const char* args, size_t length,
+                       std::string& out)
+    {
+        const char* end = args + length;
+        size_t next = 0;
+        bool ok = true;
+
+        const std::string& format = desc.format;
+        for( size_t i = 0; i < format.size(); i++ ) {
+            if( '{' != format[i] || i + 1 >= format.size() || '}' != format[i + 1] ||
+                next >= desc.types.size() || !ok )
+            {
+                out += format[i];
+                continue;
+            }
+            i++;
+
+            // Nothing left to fill it in with.
+            if( args == end ) {
+                out += "{}";
+                ok = false;
+                continue;
+            }
+
+            char buff[64];
+            switch( desc.types[next++] ) {
+                case ArgType::Int:
+                case ArgType::UInt:
+                case ArgType::Double:
+                case ArgType::Pointer: {
+                    if( end - args < 8 ) {
+                        ok = false;
+                        break;
+                    }
+
+                    uint64_t raw;
+                    std::memcpy(&raw, args, sizeof(raw));
+                    args += sizeof(raw);
+
+                    ArgType type = desc.types[next - 1];
+                    if( ArgType::Int == type ) {
+                        snprintf(buff, sizeof(buff), "%lld", static_cast<long long>(raw));
+                    } else if( ArgType::UInt == type ) {
+                        snprintf(buff, sizeof(buff), "%llu", static_cast<unsigned long long>(raw));
+                    } else if( ArgType::Double == type ) {
+                        double d;
+                        std::memcpy(&d, &raw, sizeof(d));
+                        snprintf(buff, sizeof(buff), "%g", d);
+                    } else {
+                        snprintf(buff, sizeof(buff), "0x%llx", static_cast<unsigned long long>(raw));
+                    }
+                    out += buff;
+                    break;
+                }
+
+                case ArgType::Bool:
+                case ArgType::Char:
+                    if( end - args < 1 ) {
+                        ok = false;
+                        break;
+                    }
+                    if( ArgType::Bool == desc.types[next - 1] ) {
+                        out += *args ? "true" : "false";
+                    } else {
+                        out += *args;
+                    }
+                    args++;
+                    break;
+
+                case ArgType::String: {
+                    uint32_t len;
+                    if( end - args < static_cast<ptrdiff_t>(sizeof(len)) ) {
+                        ok = false;
+                        break;
+                    }
+                    std::memcpy(&len, args, sizeof(len));
+                    args += sizeof(len);
+                    if( end - args < static_cast<ptrdiff_t>(len) ) {
+                        ok = false;
+                        break;
+                    }
+                    out.append(args, len);
+                    args += len;
+                    break;
+                }
+            }
+        }
+
+        return ok;
+    }
+
+    // Format a timestamp as UTC, to the nanosecond.
+    inline std::string FormatTime(uint64_t timeNs)
+    {
+        time_t seconds = static_cast<time_t>(timeNs / 1000000000);
+        struct tm utc;
+        cpplog::helpers::sgmtime(&utc, &seconds);
+
+        char buff[64];
+        size_t len = strftime(buff, sizeof(buff), "%Y-%m-%d %H:%M:%S", &utc);
+        snprintf(buff + len, sizeof(buff) - len, ".%09llu",
+                 static_cast<unsigned long long>(timeNs % 1000000000));
+        return buff;
+    }
+
+
+    // The binary file format.
+    // --------------------------------------------------
+    //
+    // A file starts with FILE_MAGIC, followed by entries, each starting with
+    // a one-byte kind:
+    //
+    //      'D'  A descriptor, before any message that uses it:
+    //           u32 id, u32 level, u32 line, u16 length + file,
+    //           u16 length + format, u8 count + that many ArgType bytes.
+    //      'M'  A message: u32 thread, u32 descriptor id, u64 time (ns
+    //           since the epoch), u32 length + the encoded arguments.
+    //
+    // All integers are little-endian (i.e. native, on the machines we run
+    // on).
+    static const char FILE_MAGIC[8] = { 'B', 'I', 'N', 'L', 'O', 'G', '1', '\n' };
+
+
+    // Per-thread buffers.
+    // --------------------------------------------------
+
+    // A ring buffer of encoded messages, with a single producer (the
+    // thread it belongs to) and a single consumer (whichever thread holds
+    // the logger's drain lock).  Each message is:
+    //
+    //      u32 descriptor id, u32 length of arguments, u64 time,
+    //      the arguments, padding to a multiple of 8 bytes.
+    //
+    // A descriptor ID of zero marks padding to the end of the buffer, for
+    // when a message wouldn't fit in the space that's left.
+    class ThreadBuffer {
+    public:
+        enum { HEADER_SIZE = 16 };
+
+    private:
+        std::unique_ptr<char[]> m_data;
+        size_t                  m_size;
+        uint32_t                m_thread;
+
+        std::atomic<uint64_t>   m_head;     // Bytes ever written.
+        std::atomic<uint64_t>   m_tail;     // Bytes ever consumed.
+        uint64_t                m_cachedTail;
+        std::atomic<uint64_t>   m_dropped;
+
+    public:
+        // The size must be a power of two.
+        ThreadBuffer(size_t size, uint32_t thread)
+            : m_data(new char[size]), m_size(size), m_thread(thread)
+            , m_head(0), m_tail(0), m_cachedTail(0), m_dropped(0)
+        { }
+
+        // Delete copy constructor and assignment.
+        ThreadBuffer(ThreadBuffer const&) = delete;
+        ThreadBuffer& operator=(ThreadBuffer const&) = delete;
+
+        uint32_t Thread() const { return m_thread; }
+        uint64_t Dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+        // Room for a message with this many bytes of arguments, or null if
+        // there isn't any (in which case the message is counted as
+        // dropped).  Follow with Commit().
+        char* Reserve(size_t argBytes, size_t& total)
+        {
+            total = (HEADER_SIZE + argBytes + 7) & ~size_t(7);
+            if( total > m_size / 2 ) {
+                IncrementOwned(m_dropped, 1);
+                return nullptr;
+            }
+
+            uint64_t head = m_head.load(std::memory_order_relaxed);
+            size_t offset = head & (m_size - 1);
+            size_t padding = offset + total > m_size ? m_size - offset : 0;
+
+            if( head + padding + total - m_cachedTail > m_size ) {
+                m_cachedTail = m_tail.load(std::memory_order_acquire);
+                if( head + padding + total - m_cachedTail > m_size ) {
+                    IncrementOwned(m_dropped, 1);
+                    return nullptr;
+                }
+            }
+
+            if( padding > 0 ) {
+                uint32_t zero = 0;
+                std::memcpy(m_data.get() + offset, &zero, sizeof(zero));
+                m_head.store(head + padding, std::memory_order_release);
+                offset = 0;
+            }
+            return m_data.get() + offset;
+        }
+
+        void Commit(size_t total)
+        {
+            m_head.store(m_head.load(std::memory_order_relaxed) + total,
+                         std::memory_order_release);
+        }
+
+        // Call f(id, time, args, length) for every message written so far,
+        // and free their space.
+        template <typename F>
+        size_t Drain(F f)
+        {
+            uint64_t head = m_head.load(std::memory_order_acquire);
+            uint64_t tail = m_tail.load(std::memory_order_relaxed);
+            size_t count = 0;
+
+            while( tail < head ) {
+                size_t offset = tail & (m_size - 1);
+                const char* p = m_data.get() + offset;
+
+                uint32_t id, length;
+                std::memcpy(&id, p, sizeof(id));
+                if( 0 == id ) {
+                    tail += m_size - offset;
+                    continue;
+                }
+
+                uint64_t time;
+                std::memcpy(&length, p + 4, sizeof(length));
+                std::memcpy(&time, p + 8, sizeof(time));
+                f(id, time, p + HEADER_SIZE, length);
+                count++;
+
+                tail += (HEADER_SIZE + length + 7) & ~uint64_t(7);
+            }
+
+            m_tail.store(tail, std::memory_order_release);
+            return count;
+        }
+    };
+
+
+    // Logging.
+    // --------------------------------------------------
+
+    // Collects BINLOG() messages from every thread, and either passes them
+    // on as text to a cpplog logger, or writes them to a binary file.  A
+    // background thread does this every so often; Flush() does it now.
+    //
+    // If a thread logs faster than that, and its buffer fills up, further
+    // messages are dropped (and counted) rather than wait.
+    class BinaryLogger {
+    private:
+        // The buffer is made by the thread that owns it, on its first
+        // message, while the background thread might be looking at it.
+        struct Slot {
+            std::atomic<ThreadBuffer*>  buffer;
+
+            Slot() : buffer(nullptr) { }
+            ~Slot() { delete buffer.load(); }
+        };
+
+        size_t                  m_bufferSize;
+        PerThread<Slot>         m_slots;
+
+        // Only one thread at a time can drain, or log through the shared
+        // slot.
+        std::mutex              m_drainMutex;
+        std::mutex              m_sharedMutex;
+
+        cpplog::BaseLogger*     m_textLogger;
+        std::ofstream           m_file;
+        std::vector<bool>       m_written;      // Descriptors in the file.
+
+        std::vector<const Descriptor*> m_descriptors;   // Cached from the registry.
+
+        std::chrono::milliseconds m_interval;
+        bool                    m_stopping;
+        std::mutex              m_stopMutex;
+        std::condition_variable m_stopCond;
+        std::thread             m_thread;
+
+    public:
+        // Render messages as text, and pass them to a cpplog logger.
+        BinaryLogger(cpplog::BaseLogger& textLogger,
+                     size_t bufferSize = 1 << 20,
+                     std::chrono::milliseconds interval = std::chrono::milliseconds(50))
+            : m_bufferSize(roundUp(bufferSize))
+            , m_textLogger(&textLogger)
+            , m_interval(interval)
+            , m_stopping(false)
+        {
+            m_thread = std::thread(&BinaryLogger::run, this);
+        }
+
+        // Write messages to a file, for binlogdump to render.
+        BinaryLogger(const std::string& path,
+                     size_t bufferSize = 1 << 20,
+                     std::chrono::milliseconds interval = std::chrono::milliseconds(50))
+            : m_bufferSize(roundUp(bufferSize))
+            , m_textLogger(nullptr)
+            , m_file(path, std::ios::binary | std::ios::trunc)
+            , m_interval(interval)
+            , m_stopping(false)
+        {
+            m_file.write(FILE_MAGIC, sizeof(FILE_MAGIC));
+            m_thread = std::thread(&BinaryLogger::run, this);
+        }
+
+        ~BinaryLogger()
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_stopMutex);
+                m_stopping = true;
+            }
+            m_stopCond.notify_one();
+            m_thread.join();
+
+            Flush();
+        }
+
+        // Delete copy constructor and assignment.
+        BinaryLogger(BinaryLogger const&) = delete;
+        BinaryLogger& operator=(BinaryLogger const&) = delete;
+
+        bool IsOpen() const
+        {
+            return m_textLogger != nullptr || m_file.is_open();
+        }
+
+        template <typename... Args>
+        void Log(CallSite& site, const Args&... args)
+        {
+            uint32_t id = site.id.load(std::memory_order_acquire);
+            if( 0 == id ) {
+                std::vector<ArgType> types = { Traits<Args>::Type()... };
+                id = Registry::Instance().Register(site, std::move(types));
+            }
+
+            size_t argBytes = ArgSize(args...);
+
+            bool exclusive;
+            Slot& slot = m_slots.Local(exclusive);
+            std::unique_lock<std::mutex> lock(m_sharedMutex, std::defer_lock);
+            if( !exclusive ) {
+                lock.lock();
+            }
+
+            ThreadBuffer* buffer = slot.buffer.load(std::memory_order_relaxed);
+            if( !buffer ) {
+                buffer = new ThreadBuffer(m_bufferSize,
+                                          static_cast<uint32_t>(CurrentThreadIndex()));
+                slot.buffer.store(buffer, std::memory_order_release);
+            }
+
+            size_t total;
+            char* out = buffer->Reserve(argBytes, total);
+            if( !out ) {
+                return;
+            }
+
+            uint32_t length = static_cast<uint32_t>(argBytes);
+            uint64_t time = nowNs();
+            std::memcpy(out, &id, sizeof(id));
+            std::memcpy(out + 4, &length, sizeof(length));
+            std::memcpy(out + 8, &time, sizeof(time));
+
+            char* p = out + ThreadBuffer::HEADER_SIZE;
+            EncodeArgs(p, args...);
+            buffer->Commit(total);
+        }
+
+        // Write out everything logged so far.
+        void Flush()
+        {
+            std::unique_lock<std::mutex> lock(m_drainMutex);
+            m_slots.ForEach([this](const Slot& slot) {
+                ThreadBuffer* buffer = slot.buffer.load(std::memory_order_acquire);
+                if( buffer ) {
+                    uint32_t thread = buffer->Thread();
+                    buffer->Drain([this, thread](uint32_t id, uint64_t time,
+                                                 const char* args, uint32_t length) {
+                        output(thread, id, time, args, length);
+                    });
+                }
+            });
+
+            if( m_file.is_open() ) {
+                m_file.flush();
+            }
+        }
+
+        // Messages dropped because a thread's buffer was full.
+        uint64_t Dropped() const
+        {
+            uint64_t dropped = 0;
+            m_slots.ForEach([&dropped](const Slot& slot) {
+                ThreadBuffer* buffer = slot.buffer.load(std::memory_order_acquire);
+                if( buffer ) {
+                    dropped += buffer->Dropped();
+                }
+            });
+            return dropped;
+        }
+
+    private:
+        static size_t roundUp(size_t size)
+        {
+            size_t ret = 4096;
+            while( ret < size ) {
+                ret *= 2;
+            }
+            return ret;
+        }
+
+        static uint64_t nowNs()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+        }
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(m_stopMutex);
+            while( !m_stopping ) {
+                m_stopCond.wait_for(lock, m_interval);
+
+                lock.unlock();
+                Flush();
+                lock.lock();
+            }
+        }
+
+        const Descriptor* descriptor(uint32_t id)
+        {
+            if( id >= m_descriptors.size() ) {
+                m_descriptors.resize(id + 1, nullptr);
+            }
+            if( !m_descriptors[id] ) {
+                m_descriptors[id] = Registry::Instance().Get(id);
+            }
+            return m_descriptors[id];
+        }
+
+        // Called with the drain lock held.
+        void output(uint32_t thread, uint32_t id, uint64_t time,
+                    const char* args, uint32_t length)
+        {
+            const Descriptor* desc = descriptor(id);
+            if( !desc ) {
+                return;
+            }
+
+            if( m_textLogger ) {
+                outputText(*desc, time, args, length);
+            } else if( m_file.is_open() ) {
+                outputBinary(*desc, thread, time, args, length);
+            }
+        }
+
+        void outputText(const Descriptor& desc, uint64_t time,
+                        const char* args, uint32_t length)
+        {
+            cpplog::LogData* logData = cpplog::allocLogData(desc.level);
+            logData->fullPath = desc.file.c_str();
+            logData->fileName = desc.file.c_str();
+            logData->line = desc.line;
+            logData->messageTime = static_cast<time_t>(time / 1000000000);
+            cpplog::helpers::sgmtime(&logData->utcTime, &logData->messageTime);
+
+            std::string text = cpplog::LogMessage::getLevelName(desc.level);
+            text.resize(5, ' ');
+            text += " - " + desc.file + "(" + std::to_string(desc.line) + "): ";
+            Render(desc, args, length, text);
+            text += '\n';
+
+            logData->streamBuffer.sputn(text.data(), static_cast<std::streamsize>(text.size()));
+            if( m_textLogger->sendLogMessage(logData) ) {
+                cpplog::freeLogData(logData);
+            }
+        }
+
+        template <typename T>
+        void put(const T& value)
+        {
+            m_file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        void putString16(const std::string& str)
+        {
+            uint16_t len = static_cast<uint16_t>(std::min<size_t>(str.size(), 0xffff));
+            put(len);
+            m_file.write(str.data(), len);
+        }
+
+        void outputBinary(const Descriptor& desc, uint32_t thread, uint64_t time,
+                          const char* args, uint32_t length)
+        {
+            if( desc.id >= m_written.size() ) {
+                m_written.resize(desc.id + 1, false);
+            }
+            if( !m_written[desc.id] ) {
+                m_file.put('D');
+                put(desc.id);
+                put(static_cast<uint32_t>(desc.level));
+                put(desc.line);
+                putString16(desc.file);
+                putString16(desc.format);
+                put(static_cast<uint8_t>(desc.types.size()));
+                for( auto type : desc.types ) {
+                    put(static_cast<uint8_t>(type));
+                }
+                m_written[desc.id] = true;
+            }
+
+            m_file.put('M');
+            put(thread);
+            put(desc.id);
+            put(time);
+            put(length);
+            m_file.write(args, length);
+        }
+    };
+
+}
+
+
+// Log a message through a binlog::BinaryLogger, e.g.:
+//
+//      BINLOG(LL_INFO, logger, "scanning {}:{}", host, port);
+//
+// Messages below CPPLOG_FILTER_LEVEL compile to nothing, as with LOG().
+#define BINLOG(level, logger, format, ...)                                      \
+    do {                                                                        \
+        if( (level) >= CPPLOG_FILTER_LEVEL ) {                                  \
+            static ::binlog::CallSite binlogSite_ =                             \
+                { (level), __FILE__, __LINE__, (format), { 0 } };               \
+            (logger).Log(binlogSite_, ##__VA_ARGS__);                           \
+        }                                                                       \
+    } while( false )
+
+#endif
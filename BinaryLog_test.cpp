@@ -0,0 +1,120 @@
+#include <gtest/gtest.h>
+
+#include "BinaryLog.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+
+static std::string render(const char* format, std::vector<binlog::ArgType> types,
+                          const std::string& args)
+{
+    binlog::Descriptor desc;
+    desc.id = 1;
+    desc.level = LL_INFO;
+    desc.line = 1;
+    desc.format = format;
+    desc.types = types;
+
+    std::string out;
+    EXPECT_TRUE(binlog::Render(desc, args.data(), args.size(), out));
+    return out;
+}
+
+template <typename... Args>
+static std::string encode(const Args&... args)
+{
+    // Big enough for anything in these tests.
+    char buff[256];
+    char* p = buff;
+    int dummy[] = { 0, (binlog::Traits<Args>::Encode(p, args), 0)... };
+    (void)dummy;
+    return std::string(buff, p);
+}
+
+TEST(BinaryLogTest, RendersEachType) {
+    using binlog::ArgType;
+
+    EXPECT_EQ("a -5 b 7 c",
+              render("a {} b {} c", { ArgType::Int, ArgType::UInt },
+                     encode(-5, 7u)));
+    EXPECT_EQ("true x 1.5 host",
+              render("{} {} {} {}",
+                     { ArgType::Bool, ArgType::Char, ArgType::Double, ArgType::String },
+                     encode(true, 'x', 1.5, std::string("host"))));
+    EXPECT_EQ("0x10", render("{}", { ArgType::Pointer },
+                             encode(reinterpret_cast<void*>(16))));
+
+    // Too few arguments leaves the placeholders alone.
+    EXPECT_EQ("1 {}", render("{} {}", { ArgType::Int }, encode(1)));
+}
+
+TEST(BinaryLogTest, RendersThroughTextLogger) {
+    cpplog::StringLogger text;
+    {
+        binlog::BinaryLogger logger(text);
+        for( int i = 0; i < 3; i++ ) {
+            BINLOG(LL_INFO, logger, "probe {} of {}: {}", i, "example.com", i == 1);
+        }
+        BINLOG(LL_WARN, logger, "no arguments");
+    }
+
+    std::string out = text.getString();
+    EXPECT_NE(std::string::npos, out.find("INFO  - BinaryLog_test.cpp("));
+    EXPECT_NE(std::string::npos, out.find("probe 0 of example.com: false\n"));
+    EXPECT_NE(std::string::npos, out.find("probe 1 of example.com: true\n"));
+    EXPECT_NE(std::string::npos, out.find("probe 2 of example.com: false\n"));
+    EXPECT_NE(std::string::npos, out.find("WARN  - "));
+    EXPECT_NE(std::string::npos, out.find("no arguments\n"));
+}
+
+TEST(BinaryLogTest, DropsWhenFull) {
+    cpplog::StringLogger text;
+    binlog::BinaryLogger logger(text, 4096, std::chrono::milliseconds(60000));
+
+    // Each message is 16 bytes of header plus 8 of argument, so 4096 bytes
+    // holds 170 of them.
+    for( int i = 0; i < 500; i++ ) {
+        BINLOG(LL_INFO, logger, "message {}", i);
+    }
+    EXPECT_EQ(330u, logger.Dropped());
+
+    // Once drained, there's room again, wrapping around the end.
+    logger.Flush();
+    for( int i = 0; i < 100; i++ ) {
+        BINLOG(LL_INFO, logger, "again {}", i);
+    }
+    logger.Flush();
+    EXPECT_EQ(330u, logger.Dropped());
+
+    std::string out = text.getString();
+    EXPECT_NE(std::string::npos, out.find("message 169\n"));
+    EXPECT_EQ(std::string::npos, out.find("message 170\n"));
+    EXPECT_NE(std::string::npos, out.find("again 99\n"));
+}
+
+TEST(BinaryLogTest, WritesFile) {
+    const char* path = "BinaryLog_test.binlog";
+    {
+        binlog::BinaryLogger logger(path);
+        for( auto name : { "world", "again" } ) {
+            BINLOG(LL_INFO, logger, "hello {}", name);
+        }
+    }
+
+    std::ifstream in(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::remove(path);
+
+    ASSERT_GE(data.size(), sizeof(binlog::FILE_MAGIC));
+    EXPECT_EQ(0, data.compare(0, sizeof(binlog::FILE_MAGIC),
+                              binlog::FILE_MAGIC, sizeof(binlog::FILE_MAGIC)));
+
+    // One descriptor for both messages.
+    EXPECT_NE(std::string::npos, data.find("hello {}"));
+    EXPECT_EQ(data.find("hello {}"), data.rfind("hello {}"));
+    EXPECT_NE(std::string::npos, data.find("world"));
+    EXPECT_NE(std::string::npos, data.find("again"));
+}
@@ -0,0 +1,178 @@
+#ifndef CANCELLATION_HPP
+#define CANCELLATION_HPP
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+
+// Tells work to stop: anything queued shouldn't start, and anything running
+// should wrap up at its next chance, keeping what it has done so far.  A
+// token is cancelled by calling Cancel() (e.g. on SIGINT), or by its
+// deadline passing.  Safe to use from any number of threads.
+//
+// Nothing is interrupted by force - work has to check Cancelled(), and
+// shouldn't wait past Deadline(), or for long at a time.
+class CancellationToken {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // How often long waits should wake up to check for Cancel().
+    enum { CHECK_INTERVAL_MS = 100 };
+
+private:
+    std::atomic<bool>   m_cancelled;
+    Clock::time_point   m_deadline;
+
+public:
+    explicit CancellationToken(Clock::time_point deadline = Clock::time_point::max())
+        : m_cancelled(false), m_deadline(deadline)
+    { }
+
+    // Delete copy constructor and assignment.
+    CancellationToken(CancellationToken const&) = delete;
+    CancellationToken& operator=(CancellationToken const&) = delete;
+
+    void Cancel()
+    {
+        m_cancelled.store(true, std::memory_order_release);
+    }
+
+    // Whether Cancel() has been called, or the deadline has passed.
+    bool Cancelled() const
+    {
+        return m_cancelled.load(std::memory_order_acquire) || Expired();
+    }
+
+    // Whether the deadline has passed.
+    bool Expired() const
+    {
+        return Clock::time_point::max() != m_deadline && Clock::now() >= m_deadline;
+    }
+
+    Clock::time_point Deadline() const
+    {
+        return m_deadline;
+    }
+};
+
+
+// How long we may spend on each host.  A host's clock starts when the first
+// of its targets asks for its deadline, and every target on that host
+// shares it.  A budget of zero means there's no limit.
+class HostBudgets {
+public:
+    typedef CancellationToken::Clock Clock;
+
+private:
+    Clock::duration     m_budget;
+
+    std::mutex          m_mutex;
+    std::unordered_map<std::string, Clock::time_point> m_deadlines;
+
+public:
+    explicit HostBudgets(Clock::duration budget = Clock::duration::zero())
+        : m_budget(budget)
+    { }
+
+    // Delete copy constructor and assignment.
+    HostBudgets(HostBudgets const&) = delete;
+    HostBudgets& operator=(HostBudgets const&) = delete;
+
+    Clock::time_point Deadline(const std::string& host)
+    {
+        if( Clock::duration::zero() == m_budget ) {
+            return Clock::time_point::max();
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto it = m_deadlines.find(host);
+        if( it == m_deadlines.end() ) {
+            it = m_deadlines.emplace(host, Clock::now() + m_budget).first;
+        }
+        return it->second;
+    }
+};
+
+
+// Block SIGINT and SIGTERM in the calling thread, and any threads it later
+// creates, so that only the InterruptWatcher sees them.  Call this before
+// starting any threads.
+inline void BlockInterruptSignals()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+
+
+// Calls 'onInterrupt' the first time we get SIGINT or SIGTERM, so that the
+// scan can wind down cleanly.  If another arrives before we're done, we
+// give up on that and exit at once.
+//
+// As with the stats and flight recorder signals, these are taken by a
+// thread waiting in sigwait(), and must be blocked everywhere else (see
+// BlockInterruptSignals()).
+class InterruptWatcher {
+private:
+    std::function<void()>   m_onInterrupt;
+    std::atomic<bool>       m_stopping;
+    std::thread             m_thread;
+
+public:
+    explicit InterruptWatcher(std::function<void()> onInterrupt)
+        : m_onInterrupt(onInterrupt), m_stopping(false)
+    {
+        m_thread = std::thread(&InterruptWatcher::run, this);
+    }
+
+    ~InterruptWatcher()
+    {
+        m_stopping = true;
+        pthread_kill(m_thread.native_handle(), SIGTERM);
+        m_thread.join();
+    }
+
+    // Delete copy constructor and assignment.
+    InterruptWatcher(InterruptWatcher const&) = delete;
+    InterruptWatcher& operator=(InterruptWatcher const&) = delete;
+
+private:
+    void run()
+    {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
+
+        bool interrupted = false;
+        while( true ) {
+            int sig;
+            if( 0 != sigwait(&set, &sig) || m_stopping ) {
+                return;
+            }
+
+            if( interrupted ) {
+                static const char message[] = "Interrupted again - exiting now\n";
+                ssize_t ret = write(STDERR_FILENO, message, sizeof(message) - 1);
+                (void)ret;
+                _exit(128 + sig);
+            }
+
+            interrupted = true;
+            m_onInterrupt();
+        }
+    }
+};
+
+#endif
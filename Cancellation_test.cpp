@@ -0,0 +1,129 @@
+#include <gtest/gtest.h>
+
+#include "Cancellation.hpp"
+#include "Ciphers.hpp"
+#include "Probe.hpp"
+#include "TestServer.hpp"
+
+#include <signal.h>
+
+
+namespace {
+
+typedef CancellationToken::Clock Clock;
+
+// A server slow enough that a full scan of it takes a good few seconds.
+struct SlowServer {
+    TestCertificate             cert;
+    TestServer                  server;
+    std::vector<CipherProbe>    probes;
+    ScanOptions                 options;
+    HostTimings                 timings;
+    RetryPolicy                 retries;
+
+    SlowServer()
+        : server(config(), cert)
+        , timings(5000, false)
+        , retries(0, 0, 0)
+    {
+        for( auto& cipher : getSupportedCiphers(::TLSv1_2_method()) ) {
+            CipherProbe probe = { ::TLSv1_2_method(), "TLSv1.2", cipher };
+            probes.push_back(probe);
+        }
+        options.adaptiveTimeouts = false;
+        options.abortiveClose = true;
+    }
+
+    static TestServerConfig config()
+    {
+        signal(SIGPIPE, SIG_IGN);
+
+        TestServerConfig config;
+        config.handshakeDelayMs = 100;
+        return config;
+    }
+
+    // Run a scan to the end, returning how long it took.
+    Clock::duration Scan(TargetScan& scan)
+    {
+        auto started = Clock::now();
+        ProbeClock::duration retryAfter;
+        EXPECT_TRUE(scan.Run(retryAfter));
+        return Clock::now() - started;
+    }
+};
+
+}
+
+
+TEST(CancellationTokenTest, CancelAndDeadline) {
+    CancellationToken token;
+    EXPECT_FALSE(token.Cancelled());
+    token.Cancel();
+    EXPECT_TRUE(token.Cancelled());
+    EXPECT_FALSE(token.Expired());
+
+    CancellationToken expired(Clock::now() - std::chrono::seconds(1));
+    EXPECT_TRUE(expired.Cancelled());
+    EXPECT_TRUE(expired.Expired());
+
+    CancellationToken later(Clock::now() + std::chrono::hours(1));
+    EXPECT_FALSE(later.Cancelled());
+}
+
+TEST(HostBudgetsTest, SharedPerHost) {
+    HostBudgets unlimited;
+    EXPECT_EQ(Clock::time_point::max(), unlimited.Deadline("a"));
+
+    HostBudgets budgets(std::chrono::seconds(10));
+    auto first = budgets.Deadline("a");
+    EXPECT_GT(first, Clock::now() + std::chrono::seconds(9));
+
+    usleep(10 * 1000);
+    EXPECT_EQ(first, budgets.Deadline("a"));
+    EXPECT_LT(first, budgets.Deadline("b"));
+}
+
+TEST(TargetScanCancelTest, Cancelled) {
+    SlowServer slow;
+    CancellationToken token;
+    std::vector<SocketAddress> addresses(1, slow.server.Address());
+    TargetScan scan("127.0.0.1", addresses[0].Port(), addresses, slow.probes,
+                    slow.options, slow.timings, slow.retries,
+                    nullptr, nullptr, nullptr, nullptr, nullptr, &token);
+
+    std::thread canceller([&token]() {
+        usleep(300 * 1000);
+        token.Cancel();
+    });
+    Clock::duration elapsed = slow.Scan(scan);
+    canceller.join();
+
+    EXPECT_EQ(ScanStop::Cancelled, scan.Stopped());
+    EXPECT_LT(scan.Results().size(), slow.probes.size());
+    EXPECT_LT(elapsed, std::chrono::milliseconds(1000));
+
+    // A cut-short probe leaves no result, rather than a bogus timeout.
+    for( auto& result : scan.Results() ) {
+        EXPECT_NE(ProbeStatus::Timeout, result.status);
+    }
+}
+
+TEST(TargetScanCancelTest, DeadlineAndBudget) {
+    SlowServer slow;
+    std::vector<SocketAddress> addresses(1, slow.server.Address());
+
+    CancellationToken token(Clock::now() + std::chrono::milliseconds(300));
+    TargetScan deadline("127.0.0.1", addresses[0].Port(), addresses, slow.probes,
+                        slow.options, slow.timings, slow.retries,
+                        nullptr, nullptr, nullptr, nullptr, nullptr, &token);
+    EXPECT_LT(slow.Scan(deadline), std::chrono::milliseconds(1000));
+    EXPECT_EQ(ScanStop::Deadline, deadline.Stopped());
+
+    TargetScan budget("127.0.0.1", addresses[0].Port(), addresses, slow.probes,
+                      slow.options, slow.timings, slow.retries,
+                      nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+                      Clock::now() + std::chrono::milliseconds(300));
+    EXPECT_LT(slow.Scan(budget), std::chrono::milliseconds(1000));
+    EXPECT_EQ(ScanStop::HostBudget, budget.Stopped());
+}
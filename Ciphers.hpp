@@ -0,0 +1,23 @@
+#ifndef CIPHERS_HPP
+#define CIPHERS_HPP
+
+#include "SSL.hpp"
+
+#include <vector>
+
+
+typedef std::vector<ssl::SSLCipher> CipherList;
+
+
+// Get every cipher that our OpenSSL supports for the given method.  The
+// returned ciphers are static in OpenSSL, so outlive the context we use
+// to look them up.
+inline CipherList getSupportedCiphers(const SSL_METHOD* method) {
+    ssl::SSLContext ctx(method);
+    ctx.SetCipherList("ALL:COMPLEMENTOFALL");
+
+    ssl::SSL ssl(ctx);
+    return ssl.GetCipherList();
+}
+
+#endif
@@ -0,0 +1,277 @@
+#ifndef CONCURRENCYCONTROLLER_HPP
+#define CONCURRENCYCONTROLLER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+
+// Picks how many targets to have in flight at once, rather than leaving
+// us to guess: too few wastes hours, and too many has us dropping our own
+// packets and reporting the result as the server's.
+//
+// This works like TCP's congestion control.  Every so often, it's shown
+// what the scan has done since last time (see Update()).  While things
+// look healthy, the limit grows - doubling at first, then by one at a
+// time - and as soon as they don't, it's halved.  "Unhealthy" is any of:
+//  - running short of local resources (descriptors, ports, buffers);
+//  - the share of probes that time out, or are refused, rising well above
+//    what it was at the start; or
+//  - connects taking much longer than the fastest we've seen them.
+//
+// Timeouts and refusals are judged against a baseline, since some of
+// both is normal - firewalled or closed ports - and only a rise in them
+// says that we're the problem.
+class ConcurrencyController {
+public:
+    // What the scan has done so far, as running totals.  Update() looks
+    // at how much each has grown since the last time.
+    struct Sample {
+        uint64_t    probes;
+        uint64_t    timeouts;
+        uint64_t    refused;
+        uint64_t    localErrors;
+        uint64_t    connects;           // Successful connects...
+        double      connectSeconds;     // ... and the time they took, in all.
+        size_t      inFlight;           // Targets in flight right now.
+    };
+
+    enum {
+        // How often the scan should be sampled.
+        INTERVAL_MS = 500,
+
+        // Fewer probes or connects than this since the last sample
+        // aren't enough to judge the rates or latency by.
+        MIN_PROBES = 20,
+        MIN_CONNECTS = 10,
+
+        // A rate is rising once it's this many times the baseline, plus
+        // this many percentage points.
+        RATE_FACTOR = 2,
+        RATE_SLACK_PERCENT = 5,
+
+        // Connects are slow once they take this many times the fastest
+        // we've seen, plus this many milliseconds (so that jitter on a
+        // fast network doesn't count).
+        LATENCY_FACTOR = 2,
+        LATENCY_SLACK_MS = 5,
+
+        // How much each healthy interval moves the baseline rates.
+        BASELINE_WEIGHT_PERCENT = 20,
+
+        // After a cut, wait this many intervals for the targets started
+        // under the old limit to finish before judging the new one.
+        COOLDOWN_INTERVALS = 2,
+
+        // We only grow a limit that we're using this much of.
+        BUSY_PERCENT = 90,
+    };
+
+private:
+    size_t                  m_min;
+    size_t                  m_max;
+    std::atomic<size_t>     m_limit;
+    std::atomic<uint64_t>   m_cuts;
+
+    // Only Update() touches these.
+    bool                    m_slowStart;
+    bool                    m_primed;       // Whether m_last is set.
+    bool                    m_haveBaseline;
+    Sample                  m_last;
+    double                  m_timeoutRate;  // Baselines.
+    double                  m_refusedRate;
+    double                  m_bestLatency;  // Seconds, or 0 if unknown.
+    size_t                  m_cooldown;
+
+public:
+    ConcurrencyController(size_t initial, size_t min, size_t max)
+        : m_min(std::max<size_t>(min, 1))
+        , m_max(std::max(max, m_min))
+        , m_limit(std::min(std::max(initial, m_min), m_max))
+        , m_cuts(0)
+        , m_slowStart(true)
+        , m_primed(false)
+        , m_haveBaseline(false)
+        , m_last()
+        , m_timeoutRate(0)
+        , m_refusedRate(0)
+        , m_bestLatency(0)
+        , m_cooldown(0)
+    { }
+
+    // Delete copy constructor and assignment.
+    ConcurrencyController(ConcurrencyController const&) = delete;
+    ConcurrencyController& operator=(ConcurrencyController const&) = delete;
+
+    // How many targets may be in flight.  Safe to call from any thread.
+    size_t Limit() const
+    {
+        return m_limit.load(std::memory_order_relaxed);
+    }
+
+    size_t Max() const
+    {
+        return m_max;
+    }
+
+    // How many times we've had to back off.
+    uint64_t Cuts() const
+    {
+        return m_cuts.load(std::memory_order_relaxed);
+    }
+
+    // Look at what the scan has done since the last call, and pick a new
+    // limit, which is returned.  Only call this from one thread at a time.
+    size_t Update(const Sample& sample)
+    {
+        size_t limit = Limit();
+        if( !m_primed ) {
+            m_last = sample;
+            m_primed = true;
+            return limit;
+        }
+
+        uint64_t probes = sample.probes - m_last.probes,
+                 timeouts = sample.timeouts - m_last.timeouts,
+                 refused = sample.refused - m_last.refused,
+                 localErrors = sample.localErrors - m_last.localErrors,
+                 connects = sample.connects - m_last.connects;
+        double connectSeconds = sample.connectSeconds - m_last.connectSeconds;
+        m_last = sample;
+
+        if( m_cooldown > 0 ) {
+            m_cooldown--;
+            return limit;
+        }
+
+        bool judgeRates = probes >= MIN_PROBES,
+             judgeLatency = connects >= MIN_CONNECTS;
+        double timeoutRate = judgeRates ? static_cast<double>(timeouts) / probes : 0,
+               refusedRate = judgeRates ? static_cast<double>(refused) / probes : 0,
+               latency = judgeLatency ? connectSeconds / connects : 0;
+
+        bool unhealthy = localErrors > 0;
+        if( judgeRates && m_haveBaseline ) {
+            unhealthy = unhealthy || rising(timeoutRate, m_timeoutRate) ||
+                                     rising(refusedRate, m_refusedRate);
+        }
+        if( judgeLatency && m_bestLatency > 0 ) {
+            unhealthy = unhealthy ||
+                        latency > LATENCY_FACTOR * m_bestLatency + LATENCY_SLACK_MS / 1000.0;
+        }
+
+        if( unhealthy ) {
+            limit = std::max(m_min, limit / 2);
+            m_slowStart = false;
+            m_cooldown = COOLDOWN_INTERVALS;
+            m_cuts.fetch_add(1, std::memory_order_relaxed);
+            m_limit.store(limit, std::memory_order_relaxed);
+            return limit;
+        }
+
+        // Learn what healthy looks like.  The first rates we see, at the
+        // initial limit, are taken as normal for this scan.
+        if( judgeRates ) {
+            if( !m_haveBaseline ) {
+                m_timeoutRate = timeoutRate;
+                m_refusedRate = refusedRate;
+                m_haveBaseline = true;
+            } else {
+                m_timeoutRate += (timeoutRate - m_timeoutRate) * BASELINE_WEIGHT_PERCENT / 100;
+                m_refusedRate += (refusedRate - m_refusedRate) * BASELINE_WEIGHT_PERCENT / 100;
+            }
+        }
+        if( judgeLatency && (0 == m_bestLatency || latency < m_bestLatency) ) {
+            m_bestLatency = latency;
+        }
+
+        // There's no telling whether more would be healthy too unless
+        // we're using what we have.
+        if( 100 * sample.inFlight >= BUSY_PERCENT * limit ) {
+            limit = m_slowStart ? 2 * limit : limit + 1;
+            limit = std::min(limit, m_max);
+            m_limit.store(limit, std::memory_order_relaxed);
+        }
+        return limit;
+    }
+
+private:
+    static bool rising(double rate, double baseline)
+    {
+        return rate > RATE_FACTOR * baseline + RATE_SLACK_PERCENT / 100.0;
+    }
+};
+
+
+// Runs a ConcurrencyController as the scan goes: every 'interval', it
+// takes a sample, updates the controller, and calls 'onChange' with the
+// new limit if it's moved.
+class ConcurrencyTuner {
+public:
+    typedef std::function<ConcurrencyController::Sample()> Sampler;
+    typedef std::function<void(size_t limit)> ChangeCallback;
+
+private:
+    ConcurrencyController&      m_controller;
+    Sampler                     m_sample;
+    ChangeCallback              m_onChange;
+    std::chrono::milliseconds   m_interval;
+
+    std::mutex                  m_mutex;
+    std::condition_variable     m_condition;
+    bool                        m_stopping;
+    std::thread                 m_thread;
+
+public:
+    ConcurrencyTuner(ConcurrencyController& controller, Sampler sample,
+                     ChangeCallback onChange, std::chrono::milliseconds interval)
+        : m_controller(controller)
+        , m_sample(sample)
+        , m_onChange(onChange)
+        , m_interval(interval)
+        , m_stopping(false)
+    {
+        m_thread = std::thread(&ConcurrencyTuner::run, this);
+    }
+
+    ~ConcurrencyTuner()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_condition.notify_all();
+        m_thread.join();
+    }
+
+    // Delete copy constructor and assignment.
+    ConcurrencyTuner(ConcurrencyTuner const&) = delete;
+    ConcurrencyTuner& operator=(ConcurrencyTuner const&) = delete;
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while( true ) {
+            size_t before = m_controller.Limit();
+            lock.unlock();
+            size_t after = m_controller.Update(m_sample());
+            if( after != before ) {
+                m_onChange(after);
+            }
+            lock.lock();
+
+            if( m_condition.wait_for(lock, m_interval, [this]() { return m_stopping; }) ) {
+                return;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+
+#include "ConcurrencyController.hpp"
+
+
+namespace {
+
+// Feeds a controller an interval at a time, as the scan would.
+class Driver {
+private:
+    ConcurrencyController::Sample   m_totals;
+
+public:
+    ConcurrencyController           controller;
+
+    Driver(size_t initial, size_t max)
+        : m_totals(), controller(initial, 1, max)
+    {
+        controller.Update(m_totals);
+    }
+
+    // An interval with this many probes, of which so many timed out, were
+    // refused or ran out of local resources - and every target we may
+    // have in flight busy.
+    size_t Interval(uint64_t probes, uint64_t timeouts = 0, uint64_t refused = 0,
+                    uint64_t localErrors = 0, double connectMs = 1)
+    {
+        m_totals.probes += probes;
+        m_totals.timeouts += timeouts;
+        m_totals.refused += refused;
+        m_totals.localErrors += localErrors;
+
+        uint64_t connects = probes - timeouts - refused - localErrors;
+        m_totals.connects += connects;
+        m_totals.connectSeconds += connects * connectMs / 1000;
+
+        m_totals.inFlight = controller.Limit();
+        return controller.Update(m_totals);
+    }
+};
+
+}
+
+
+TEST(ConcurrencyControllerTest, GrowsWhileHealthy) {
+    Driver driver(4, 100);
+
+    // Doubling at first...
+    EXPECT_EQ(8u, driver.Interval(100));
+    EXPECT_EQ(16u, driver.Interval(100));
+    EXPECT_EQ(32u, driver.Interval(100));
+    EXPECT_EQ(64u, driver.Interval(100));
+    EXPECT_EQ(100u, driver.Interval(100));
+    EXPECT_EQ(100u, driver.Interval(100));
+    EXPECT_EQ(0u, driver.controller.Cuts());
+}
+
+TEST(ConcurrencyControllerTest, OnlyGrowsWhatsUsed) {
+    ConcurrencyController controller(10, 1, 100);
+    ConcurrencyController::Sample sample = ConcurrencyController::Sample();
+    controller.Update(sample);
+
+    sample.probes = 100;
+    sample.connects = 100;
+    sample.inFlight = 3;
+    EXPECT_EQ(10u, controller.Update(sample));
+}
+
+TEST(ConcurrencyControllerTest, BacksOffOnLocalErrors) {
+    Driver driver(8, 100);
+    EXPECT_EQ(16u, driver.Interval(100));
+    EXPECT_EQ(8u, driver.Interval(100, 0, 0, 1));
+    EXPECT_EQ(1u, driver.controller.Cuts());
+
+    // ... waits for things to settle, then grows again - a step at a time.
+    EXPECT_EQ(8u, driver.Interval(100));
+    EXPECT_EQ(8u, driver.Interval(100));
+    EXPECT_EQ(9u, driver.Interval(100));
+    EXPECT_EQ(10u, driver.Interval(100));
+}
+
+TEST(ConcurrencyControllerTest, JudgesRatesAgainstBaseline) {
+    // A third of the probes timing out from the start is just what this
+    // scan looks like.
+    Driver driver(8, 100);
+    EXPECT_EQ(16u, driver.Interval(90, 30, 10));
+    EXPECT_EQ(32u, driver.Interval(90, 30, 10));
+
+    // ... but a rise in either isn't.
+    EXPECT_EQ(16u, driver.Interval(90, 80, 0));
+    driver.Interval(90, 30, 10);
+    driver.Interval(90, 30, 10);
+    EXPECT_EQ(17u, driver.Interval(90, 30, 10));
+    EXPECT_EQ(8u, driver.Interval(90, 0, 60));
+    EXPECT_EQ(2u, driver.controller.Cuts());
+}
+
+TEST(ConcurrencyControllerTest, BacksOffOnSlowConnects) {
+    Driver driver(8, 100);
+    EXPECT_EQ(16u, driver.Interval(100, 0, 0, 0, 10));
+    EXPECT_EQ(32u, driver.Interval(100, 0, 0, 0, 20));
+    EXPECT_EQ(16u, driver.Interval(100, 0, 0, 0, 40));
+}
+
+TEST(ConcurrencyControllerTest, StaysInBounds) {
+    Driver driver(8, 100);
+    for( int i = 0; i < 10; i++ ) {
+        driver.Interval(100, 0, 0, 1);
+    }
+    EXPECT_EQ(1u, driver.controller.Limit());
+
+    ConcurrencyController clamped(500, 1, 100);
+    EXPECT_EQ(100u, clamped.Limit());
+}
@@ -93,6 +93,16 @@ public:
     static Expected<T> fromException() {
        return fromException(std::current_exception());
     }
+    // Propagate the exception held by another, failed Expected.
+    template <class U>
+    static Expected<T> fromException(const Expected<U>& other) {
+        try {
+            other.get();
+        } catch (...) {
+            return fromException();
+        }
+        throw std::invalid_argument("no exception to propagate");
+    }
 
     // Access
     bool valid() const {
@@ -99,3 +99,14 @@ TEST(ExpectedTest, swap) {
     EXPECT_TRUE(seven.hasException<std::length_error>());
     EXPECT_TRUE(eight.hasException<std::invalid_argument>());
 }
+
+TEST(ExpectedTest, fromOtherExpected) {
+    auto one = Expected<std::string>::fromException(std::invalid_argument("foo"));
+    auto two = Expected<int>::fromException(one);
+    EXPECT_TRUE(two.hasException<std::invalid_argument>());
+
+    auto three = Expected<std::string>("bar");
+    EXPECT_THROW({
+        Expected<int>::fromException(three);
+    }, std::invalid_argument);
+}
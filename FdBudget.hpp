@@ -0,0 +1,258 @@
+#ifndef FDBUDGET_HPP
+#define FDBUDGET_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <utility>
+
+#include <sys/resource.h>
+
+
+// The most descriptors any process may have open (fs.nr_open), or 0 if
+// we can't tell.
+inline size_t SystemFdLimit()
+{
+    std::ifstream in("/proc/sys/fs/nr_open");
+    size_t limit = 0;
+    if( !(in >> limit) ) {
+        return 0;
+    }
+    return limit;
+}
+
+// Raise our soft limit on open descriptors as far as the hard limit
+// allows.  Returns the limit we end up with.
+inline size_t RaiseFdLimit()
+{
+    struct rlimit lim;
+    if( 0 != getrlimit(RLIMIT_NOFILE, &lim) ) {
+        return 0;
+    }
+
+    // NOTE: setrlimit() fails with EPERM when asked for more than
+    // fs.nr_open - which an unlimited hard limit always is - so we only
+    // ask for that much.
+    rlim_t target = lim.rlim_max;
+    size_t system = SystemFdLimit();
+    if( system > 0 && (RLIM_INFINITY == target || target > system) ) {
+        target = static_cast<rlim_t>(system);
+    }
+
+    if( lim.rlim_cur < target ) {
+        struct rlimit raised = lim;
+        raised.rlim_cur = target;
+        if( 0 == setrlimit(RLIMIT_NOFILE, &raised) ) {
+            lim = raised;
+        }
+    }
+
+    if( RLIM_INFINITY == lim.rlim_cur ) {
+        return std::numeric_limits<size_t>::max();
+    }
+    return static_cast<size_t>(lim.rlim_cur);
+}
+
+
+class FdBudget;
+
+
+// One descriptor's worth of an FdBudget, handed back when this goes away
+// (see Socket).  An empty permit - from a budget that had none to spare -
+// is false.
+class FdPermit {
+private:
+    FdBudget*   m_budget;
+
+public:
+    FdPermit()
+        : m_budget(nullptr)
+    { }
+
+    explicit FdPermit(FdBudget* budget)
+        : m_budget(budget)
+    { }
+
+    FdPermit(FdPermit&& other)
+        : m_budget(nullptr)
+    {
+        std::swap(m_budget, other.m_budget);
+    }
+
+    ~FdPermit()
+    {
+        Release();
+    }
+
+    FdPermit& operator=(FdPermit&& other)
+    {
+        if( this != &other ) {
+            Release();
+            std::swap(m_budget, other.m_budget);
+        }
+        return *this;
+    }
+
+    // Delete copy constructor and assignment.
+    FdPermit(FdPermit const&) = delete;
+    FdPermit& operator=(FdPermit const&) = delete;
+
+    explicit operator bool() const
+    {
+        return m_budget != nullptr;
+    }
+
+    inline void Release();
+};
+
+
+// How many descriptors the scan's probes may have open at once, so that
+// they wait for one to come free rather than failing with EMFILE - and so
+// that what's left over is still there for the log and result files.
+// Safe to use from any number of threads.
+//
+// Whoever can't get a descriptor right away can queue to be handed one
+// (see Acquire()).  A released descriptor goes straight to the first in
+// the queue, so nobody has to keep trying.  Only TryAcquire() can jump the
+// queue, and only if it happens to catch a descriptor on its way from one
+// holder to the next.
+class FdBudget {
+public:
+    // Descriptors to leave for everything but the probes' sockets: the
+    // standard streams, log, result and trace files, epoll and eventfd
+    // descriptors, the stats server, and name resolution.
+    enum { HEADROOM = 64 };
+
+    // Handed the permit that a waiter queued for.
+    typedef std::function<void(FdPermit permit)> Waiter;
+
+private:
+    size_t                  m_capacity;
+    std::atomic<size_t>     m_inUse;
+    std::atomic<uint64_t>   m_waits;
+
+    // Taken to queue a waiter, or to give back a descriptor while there
+    // are any - so that one can't be given back just as the queue is
+    // joined, leaving a waiter with nobody to wake it.
+    std::mutex              m_mutex;
+    std::deque<Waiter>      m_waiters;
+
+    // How many are queued, so that giving a descriptor back only takes
+    // the lock when someone might be waiting for it.
+    std::atomic<size_t>     m_waiting;
+
+public:
+    explicit FdBudget(size_t capacity)
+        : m_capacity(capacity > 0 ? capacity : 1)
+        , m_inUse(0)
+        , m_waits(0)
+        , m_waiting(0)
+    { }
+
+    // Delete copy constructor and assignment.
+    FdBudget(FdBudget const&) = delete;
+    FdBudget& operator=(FdBudget const&) = delete;
+
+    // Take a descriptor's worth, if there's one to spare - otherwise the
+    // permit is empty.
+    FdPermit TryAcquire()
+    {
+        return take() ? FdPermit(this) : FdPermit();
+    }
+
+    // As TryAcquire(), but if there's nothing to spare, 'waiter' is queued
+    // and the permit is empty.  The waiter is later handed a permit, on
+    // whichever thread gave one back, and mustn't block.
+    FdPermit Acquire(Waiter waiter)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        // NOTE: Counted before we look for a descriptor, while release()
+        // gives one back before it looks for waiters - so either we see
+        // that it's free, or it sees us, and takes the lock to hand it on.
+        m_waiting.fetch_add(1, std::memory_order_seq_cst);
+        if( take() ) {
+            m_waiting.fetch_sub(1, std::memory_order_relaxed);
+            return FdPermit(this);
+        }
+
+        m_waits.fetch_add(1, std::memory_order_relaxed);
+        m_waiters.push_back(std::move(waiter));
+        return FdPermit();
+    }
+
+    size_t Capacity() const
+    {
+        return m_capacity;
+    }
+
+    size_t InUse() const
+    {
+        return m_inUse.load(std::memory_order_relaxed);
+    }
+
+    // How many times Acquire() has had to queue a waiter.
+    uint64_t Waits() const
+    {
+        return m_waits.load(std::memory_order_relaxed);
+    }
+
+private:
+    friend class FdPermit;
+
+    bool take()
+    {
+        size_t inUse = m_inUse.load(std::memory_order_seq_cst);
+        do {
+            if( inUse >= m_capacity ) {
+                return false;
+            }
+        } while( !m_inUse.compare_exchange_weak(inUse, inUse + 1, std::memory_order_seq_cst) );
+        return true;
+    }
+
+    void release()
+    {
+        // Nobody waiting, which is the usual case, so there's no need for
+        // the lock.
+        m_inUse.fetch_sub(1, std::memory_order_seq_cst);
+        if( 0 == m_waiting.load(std::memory_order_seq_cst) ) {
+            return;
+        }
+
+        Waiter waiter;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            // Take it back for the first waiter - unless a TryAcquire() got
+            // there first, in which case it's up to that one's release().
+            if( m_waiters.empty() || !take() ) {
+                return;
+            }
+            waiter = std::move(m_waiters.front());
+            m_waiters.pop_front();
+            m_waiting.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        waiter(FdPermit(this));
+    }
+};
+
+
+inline void FdPermit::Release()
+{
+    // NOTE: Emptied first, since giving it back can call a waiter, which
+    // might do anything.
+    if( m_budget ) {
+        FdBudget* budget = m_budget;
+        m_budget = nullptr;
+        budget->release();
+    }
+}
+
+#endif
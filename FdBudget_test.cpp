@@ -0,0 +1,196 @@
+#include <gtest/gtest.h>
+
+#include "Ciphers.hpp"
+#include "FdBudget.hpp"
+#include "ScanReactor.hpp"
+#include "TestServer.hpp"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+
+
+TEST(FdBudgetTest, Permits) {
+    FdBudget budget(2);
+    FdPermit first = budget.TryAcquire(),
+             second = budget.TryAcquire();
+    EXPECT_TRUE(first);
+    EXPECT_TRUE(second);
+    EXPECT_EQ(2u, budget.InUse());
+
+    EXPECT_FALSE(budget.TryAcquire());
+    EXPECT_EQ(0u, budget.Waits());
+
+    // Permits go back when they're released, or go away.
+    first.Release();
+    EXPECT_FALSE(first);
+    {
+        FdPermit third = budget.TryAcquire();
+        EXPECT_TRUE(third);
+        EXPECT_FALSE(budget.TryAcquire());
+    }
+    EXPECT_EQ(1u, budget.InUse());
+
+    FdPermit moved(std::move(second));
+    EXPECT_FALSE(second);
+    EXPECT_EQ(1u, budget.InUse());
+}
+
+TEST(FdBudgetTest, WaitersAreHandedPermits) {
+    FdBudget budget(1);
+    FdPermit held = budget.Acquire([](FdPermit) { FAIL(); });
+    EXPECT_TRUE(held);
+    EXPECT_EQ(0u, budget.Waits());
+
+    // Waiters are queued once each, and handed permits in turn.
+    FdPermit handed[2];
+    std::vector<int> order;
+    for( int i = 0; i < 2; i++ ) {
+        FdPermit permit = budget.Acquire([&handed, &order, i](FdPermit permit) {
+            EXPECT_TRUE(permit);
+            handed[i] = std::move(permit);
+            order.push_back(i);
+        });
+        EXPECT_FALSE(permit);
+    }
+    EXPECT_EQ(2u, budget.Waits());
+
+    // Nobody gets ahead of them, either.
+    held.Release();
+    EXPECT_EQ(std::vector<int>({ 0 }), order);
+    EXPECT_FALSE(budget.TryAcquire());
+    EXPECT_EQ(1u, budget.InUse());
+
+    handed[0].Release();
+    EXPECT_EQ(std::vector<int>({ 0, 1 }), order);
+    handed[1].Release();
+    EXPECT_EQ(0u, budget.InUse());
+    EXPECT_TRUE(budget.TryAcquire());
+}
+
+TEST(FdBudgetTest, NoWaiterIsForgotten) {
+    FdBudget budget(2);
+
+    // Threads take turns with too few descriptors.  Were one given back
+    // just as a waiter queued, without it being handed on, that thread
+    // would wait forever.
+    struct Turn {
+        FdPermit            permit;
+        std::atomic<bool>   handed;
+    };
+    std::vector<std::thread> threads;
+    for( int t = 0; t < 8; t++ ) {
+        threads.emplace_back([&budget]() {
+            Turn turn;
+            for( int i = 0; i < 2000; i++ ) {
+                turn.handed.store(false);
+                turn.permit = budget.Acquire([&turn](FdPermit permit) {
+                    turn.permit = std::move(permit);
+                    turn.handed.store(true, std::memory_order_release);
+                });
+                if( !turn.permit ) {
+                    while( !turn.handed.load(std::memory_order_acquire) ) {
+                        std::this_thread::yield();
+                    }
+                }
+                turn.permit.Release();
+            }
+        });
+    }
+    for( auto& thread : threads ) {
+        thread.join();
+    }
+    EXPECT_EQ(0u, budget.InUse());
+}
+
+TEST(FdBudgetTest, HeldBySocket) {
+    FdBudget budget(1);
+    SocketAddress addr = SocketAddress::ResolveHost("127.0.0.1").get().at(0);
+    {
+        Socket sock(addr, budget.TryAcquire());
+        EXPECT_EQ(1u, budget.InUse());
+
+        Socket moved(std::move(sock));
+        EXPECT_EQ(1u, budget.InUse());
+
+        moved = Socket();
+        EXPECT_EQ(0u, budget.InUse());
+
+        Socket again(addr, budget.TryAcquire());
+        EXPECT_EQ(1u, budget.InUse());
+    }
+    EXPECT_EQ(0u, budget.InUse());
+}
+
+TEST(FdBudgetTest, RaiseFdLimit) {
+    struct rlimit before;
+    ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &before));
+
+    size_t limit = RaiseFdLimit();
+    EXPECT_GE(limit, static_cast<size_t>(before.rlim_cur));
+}
+
+TEST(FdBudgetTest, ScansWaitForDescriptors) {
+    signal(SIGPIPE, SIG_IGN);
+
+    TestCertificate cert;
+    TestServerConfig config;
+    config.method = ::TLSv1_2_server_method();
+    config.ciphers = "ECDHE-RSA-AES128-GCM-SHA256:AES128-SHA";
+    config.workers = 4;
+    TestServer server(config, cert);
+
+    std::vector<CipherProbe> probes;
+    for( auto& cipher : getSupportedCiphers(::TLSv1_2_method()) ) {
+        CipherProbe probe = { ::TLSv1_2_method(), "TLSv1.2", cipher };
+        probes.push_back(probe);
+    }
+    HostTimings timings(2000, false);
+    RetryPolicy retries(0, 0, 0);
+
+    ScanOptions options;
+    options.adaptiveTimeouts = false;
+    options.abortiveClose = true;
+
+    // What the scans should find, with descriptors to spare.
+    std::vector<SocketAddress> addresses(1, server.Address());
+    TargetScan unlimited("127.0.0.1", server.Address().Port(), addresses,
+                         probes, options, timings, retries);
+    ProbeClock::duration retryAfter;
+    ASSERT_TRUE(unlimited.Run(retryAfter));
+
+    // Every scan has to share the one descriptor, which we're holding for
+    // now.
+    FdBudget budget(1);
+    options.fds = &budget;
+    FdPermit held = budget.TryAcquire();
+
+    std::vector<std::shared_ptr<TargetScan>> done;
+    {
+        ScanReactor reactor([&done](std::shared_ptr<TargetScan> scan) {
+            done.push_back(std::move(scan));
+        });
+        for( int i = 0; i < 4; i++ ) {
+            reactor.Add(std::make_shared<TargetScan>(
+                    "127.0.0.1", server.Address().Port(), addresses,
+                    probes, options, timings, retries));
+        }
+
+        // Each waits once, rather than trying again and again.
+        usleep(100 * 1000);
+        EXPECT_TRUE(done.empty());
+        EXPECT_EQ(4u, budget.Waits());
+        held.Release();
+    }
+
+    ASSERT_EQ(4u, done.size());
+    for( auto& scan : done ) {
+        ASSERT_EQ(unlimited.Results().size(), scan->Results().size());
+        for( size_t i = 0; i < scan->Results().size(); i++ ) {
+            EXPECT_EQ(unlimited.Results()[i].status, scan->Results()[i].status);
+        }
+    }
+    EXPECT_EQ(0u, budget.InUse());
+}
@@ -0,0 +1,459 @@
+#ifndef FLIGHTRECORDER_HPP
+#define FLIGHTRECORDER_HPP
+
+#include "BinaryLog.hpp"
+#include "PerThread.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// One recorded event: a binlog descriptor ID, and its arguments encoded in
+// the same way.  Events are a fixed size, so that recording one is a few
+// stores into the next slot of a ring.
+struct FlightEvent {
+    enum {
+        SIZE = 192,
+        MAX_ARGS = SIZE - 16,
+
+        // The arguments didn't fit, so weren't recorded.
+        TRUNCATED = 0xffffffff,
+    };
+
+    uint32_t    id;
+    uint32_t    length;
+    uint64_t    timeNs;
+    char        args[MAX_ARGS];
+};
+
+
+// Keeps the last few events of every thread - which probes it started,
+// what happened to their sockets, what alerts OpenSSL sent and received -
+// so that when something goes wrong, we have its recent history without
+// paying for debug logging all the time.
+//
+// Events are recorded with FLIGHT(), which works like BINLOG(), but
+// doesn't need a logger: it records into the current recorder, if there
+// is one.  Each thread has its own ring of events, so recording takes no
+// locks, and old events are overwritten rather than ever waiting.
+//
+// Dump() writes everything kept to a file in the binary log format (see
+// BinaryLog.hpp), to be read with binlogdump.  It's safe to call from a
+// signal handler, and InstallCrashHandlers() arranges for that to happen
+// on a crash or fatal log message.
+class FlightRecorder {
+private:
+    struct Ring {
+        // Made by the thread that owns the ring, on its first event, while
+        // a dump might be looking at it.
+        std::atomic<FlightEvent*>   events;
+        std::atomic<uint64_t>       written;
+        uint32_t                    thread;
+
+        Ring() : events(nullptr), written(0), thread(0) { }
+        ~Ring() { delete[] events.load(); }
+    };
+
+    size_t                  m_capacity;
+    PerThread<Ring>         m_rings;
+
+    // For the shared ring, when there are too many threads for one each.
+    std::mutex              m_sharedMutex;
+
+    // Where crash dumps go, set up in advance, since a signal handler
+    // can't allocate.
+    char                    m_crashPath[1024];
+
+public:
+    // Keep the last 'capacity' events of each thread (rounded up to a
+    // power of two).  Dumps leave out the oldest of them, whose slot the
+    // next event is written into.
+    FlightRecorder(size_t capacity = 1024)
+        : m_capacity(2)
+    {
+        while( m_capacity < capacity ) {
+            m_capacity *= 2;
+        }
+        m_crashPath[0] = '\0';
+    }
+
+    ~FlightRecorder()
+    {
+        FlightRecorder* self = this;
+        current().compare_exchange_strong(self, nullptr);
+    }
+
+    // Delete copy constructor and assignment.
+    FlightRecorder(FlightRecorder const&) = delete;
+    FlightRecorder& operator=(FlightRecorder const&) = delete;
+
+    // The recorder that FLIGHT() records into, if any.
+    static FlightRecorder* Current()
+    {
+        return current().load(std::memory_order_acquire);
+    }
+
+    // Make this the current recorder.
+    void Install()
+    {
+        current().store(this, std::memory_order_release);
+    }
+
+    template <typename... Args>
+    void Record(binlog::CallSite& site, const Args&... args)
+    {
+        uint32_t id = site.id.load(std::memory_order_acquire);
+        if( 0 == id ) {
+            std::vector<binlog::ArgType> types = { binlog::Traits<Args>::Type()... };
+            id = binlog::Registry::Instance().Register(site, std::move(types));
+        }
+
+        bool exclusive;
+        Ring& ring = m_rings.Local(exclusive);
+
+        std::unique_lock<std::mutex> lock(m_sharedMutex, std::defer_lock);
+        if( !exclusive ) {
+            lock.lock();
+        }
+
+        FlightEvent* events = ring.events.load(std::memory_order_relaxed);
+        if( !events ) {
+            events = new FlightEvent[m_capacity];
+            ring.thread = static_cast<uint32_t>(CurrentThreadIndex());
+            ring.events.store(events, std::memory_order_release);
+        }
+
+        uint64_t written = ring.written.load(std::memory_order_relaxed);
+
+        // Like a seqlock's writer: the count that says this slot is being
+        // reused (stored by the last event) has to be seen before anything
+        // we put in it.  See Dump().
+        std::atomic_thread_fence(std::memory_order_release);
+
+        FlightEvent& event = events[written & (m_capacity - 1)];
+        event.id = id;
+        event.timeNs = nowNs();
+
+        size_t length = binlog::ArgSize(args...);
+        if( length <= FlightEvent::MAX_ARGS ) {
+            char* p = event.args;
+            binlog::EncodeArgs(p, args...);
+            event.length = static_cast<uint32_t>(length);
+        } else {
+            event.length = FlightEvent::TRUNCATED;
+        }
+
+        ring.written.store(written + 1, std::memory_order_release);
+    }
+
+    // Write everything kept to a file descriptor.  This only uses
+    // async-signal-safe calls.  Returns false if writing failed.
+    //
+    // Other threads can carry on recording while this runs; any event
+    // that's overwritten while we copy it is left out, as is the oldest,
+    // since its slot might be being written to already.
+    bool Dump(int fd) const
+    {
+        FdWriter out(fd);
+        out.Put(binlog::FILE_MAGIC, sizeof(binlog::FILE_MAGIC));
+
+        // Every descriptor, since working out which ones the events use
+        // would need somewhere to keep track.
+        binlog::Registry& registry = binlog::Registry::Instance();
+        uint32_t count = registry.FindableCount();
+        for( uint32_t id = 1; id < count; id++ ) {
+            const binlog::Descriptor* desc = registry.Find(id);
+            if( desc ) {
+                writeDescriptor(out, *desc);
+            }
+        }
+
+        m_rings.ForEach([this, &out](const Ring& ring) {
+            const FlightEvent* events = ring.events.load(std::memory_order_acquire);
+            if( !events ) {
+                return;
+            }
+
+            uint64_t written = ring.written.load(std::memory_order_acquire);
+            uint64_t kept = std::min<uint64_t>(written, m_capacity - 1);
+            for( uint64_t i = written - kept; i < written; i++ ) {
+                FlightEvent event;
+                std::memcpy(&event, &events[i & (m_capacity - 1)], sizeof(event));
+
+                // Skip it if it was overwritten as we copied it.  Event i's
+                // slot is reused by event i + capacity, which is being
+                // written as soon as the count reaches that - and the fence
+                // keeps the copy from being read after the count is.
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if( ring.written.load(std::memory_order_relaxed) - i >= m_capacity ) {
+                    continue;
+                }
+                writeEvent(out, ring.thread, event);
+            }
+        });
+
+        return out.Flush();
+    }
+
+    // Dump to a file.  Returns false if it couldn't be written.
+    bool DumpFile(const char* path) const
+    {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if( fd < 0 ) {
+            return false;
+        }
+        bool ok = Dump(fd);
+        return 0 == close(fd) && ok;
+    }
+
+    // Make this the current recorder, and dump it to 'path' if the process
+    // crashes (SIGSEGV, SIGBUS, SIGILL, SIGFPE or SIGABRT, which includes
+    // uncaught exceptions), or logs a fatal message through cpplog.
+    void InstallCrashHandlers(const std::string& path)
+    {
+        size_t len = std::min(path.size(), sizeof(m_crashPath) - 1);
+        std::memcpy(m_crashPath, path.data(), len);
+        m_crashPath[len] = '\0';
+        Install();
+
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &FlightRecorder::onCrash;
+        sigemptyset(&sa.sa_mask);
+
+        // Put back the default action first, so a crash while dumping, or
+        // the re-raise afterwards, ends the process.
+        sa.sa_flags = SA_RESETHAND;
+
+        const int signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+        for( int sig : signals ) {
+            sigaction(sig, &sa, nullptr);
+        }
+
+        cpplog::setFatalHandler(&FlightRecorder::onFatal);
+    }
+
+    // Dump to wherever InstallCrashHandlers() said, and return whether it
+    // worked.
+    bool DumpCrashFile() const
+    {
+        return '\0' != m_crashPath[0] && DumpFile(m_crashPath);
+    }
+
+    const char* CrashPath() const { return m_crashPath; }
+
+private:
+    static std::atomic<FlightRecorder*>& current()
+    {
+        static std::atomic<FlightRecorder*> recorder(nullptr);
+        return recorder;
+    }
+
+    static uint64_t nowNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    static void onCrash(int sig)
+    {
+        // Only dump once, if several threads crash at the same time.
+        static std::atomic<bool> dumped(false);
+
+        FlightRecorder* recorder = Current();
+        if( recorder && !dumped.exchange(true) ) {
+            recorder->DumpCrashFile();
+        }
+        raise(sig);
+    }
+
+    static void onFatal()
+    {
+        FlightRecorder* recorder = Current();
+        if( recorder ) {
+            recorder->DumpCrashFile();
+        }
+    }
+
+    // Buffers writes to a file descriptor, without allocating.
+    class FdWriter {
+    private:
+        int     m_fd;
+        size_t  m_used;
+        bool    m_ok;
+        char    m_buff[4096];
+
+    public:
+        explicit FdWriter(int fd) : m_fd(fd), m_used(0), m_ok(true) { }
+
+        void Put(const void* data, size_t length)
+        {
+            const char* p = static_cast<const char*>(data);
+            while( length > 0 ) {
+                if( m_used == sizeof(m_buff) ) {
+                    Flush();
+                }
+                size_t n = std::min(length, sizeof(m_buff) - m_used);
+                std::memcpy(m_buff + m_used, p, n);
+                m_used += n;
+                p += n;
+                length -= n;
+            }
+        }
+
+        template <typename T>
+        void PutValue(T value)
+        {
+            Put(&value, sizeof(value));
+        }
+
+        bool Flush()
+        {
+            size_t done = 0;
+            while( m_ok && done < m_used ) {
+                ssize_t ret = write(m_fd, m_buff + done, m_used - done);
+                if( ret < 0 && EINTR == errno ) {
+                    continue;
+                }
+                if( ret <= 0 ) {
+                    m_ok = false;
+                    break;
+                }
+                done += static_cast<size_t>(ret);
+            }
+            m_used = 0;
+            return m_ok;
+        }
+    };
+
+    static void putString16(FdWriter& out, const std::string& str)
+    {
+        uint16_t len = static_cast<uint16_t>(std::min<size_t>(str.size(), 0xffff));
+        out.PutValue(len);
+        out.Put(str.data(), len);
+    }
+
+    static void writeDescriptor(FdWriter& out, const binlog::Descriptor& desc)
+    {
+        out.PutValue('D');
+        out.PutValue(desc.id);
+        out.PutValue(static_cast<uint32_t>(desc.level));
+        out.PutValue(desc.line);
+        putString16(out, desc.file);
+        putString16(out, desc.format);
+        out.PutValue(static_cast<uint8_t>(desc.types.size()));
+        for( auto type : desc.types ) {
+            out.PutValue(static_cast<uint8_t>(type));
+        }
+    }
+
+    static void writeEvent(FdWriter& out, uint32_t thread, const FlightEvent& event)
+    {
+        // Arguments that didn't fit are left out, so the format's
+        // placeholders are shown as they are.
+        uint32_t length = FlightEvent::TRUNCATED == event.length ? 0
+                        : std::min<uint32_t>(event.length, FlightEvent::MAX_ARGS);
+
+        out.PutValue('M');
+        out.PutValue(thread);
+        out.PutValue(event.id);
+        out.PutValue(event.timeNs);
+        out.PutValue(length);
+        out.Put(event.args, length);
+    }
+};
+
+
+// Record an event in the current FlightRecorder, if there is one, e.g.:
+//
+//      FLIGHT("{}: connecting to {}", host, addr.ToString());
+//
+// The arguments are only evaluated if there's a recorder.
+#define FLIGHT(format, ...)                                                     \
+    do {                                                                        \
+        FlightRecorder* flightRecorder_ = FlightRecorder::Current();            \
+        if( flightRecorder_ ) {                                                 \
+            static ::binlog::CallSite flightSite_ =                             \
+                { LL_DEBUG, __FILE__, __LINE__, (format), { 0 } };              \
+            flightRecorder_->Record(flightSite_, ##__VA_ARGS__);                \
+        }                                                                       \
+    } while( false )
+
+
+// SIGUSR2 dumps the flight recorder.  Like SIGUSR1 for the stats, it must
+// be blocked in every thread (by calling this before starting any), and is
+// taken by a FlightDumper.
+inline void BlockFlightSignal()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+
+
+// Dumps a flight recorder to a file whenever we get SIGUSR2 - e.g. from
+// `kill -USR2 <pid>`.  Each dump replaces the last.
+class FlightDumper {
+private:
+    const FlightRecorder&   m_recorder;
+    std::string             m_path;
+    std::atomic<bool>       m_stopping;
+    std::thread             m_thread;
+
+public:
+    FlightDumper(const FlightRecorder& recorder, const std::string& path)
+        : m_recorder(recorder), m_path(path), m_stopping(false)
+    {
+        m_thread = std::thread(&FlightDumper::run, this);
+    }
+
+    ~FlightDumper()
+    {
+        m_stopping = true;
+        pthread_kill(m_thread.native_handle(), SIGUSR2);
+        m_thread.join();
+    }
+
+    // Delete copy constructor and assignment.
+    FlightDumper(FlightDumper const&) = delete;
+    FlightDumper& operator=(FlightDumper const&) = delete;
+
+private:
+    void run()
+    {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR2);
+
+        while( true ) {
+            int sig;
+            if( 0 != sigwait(&set, &sig) || m_stopping ) {
+                return;
+            }
+
+            if( m_recorder.DumpFile(m_path.c_str()) ) {
+                std::cerr << "Wrote flight recorder to: '" << m_path << "'" << std::endl;
+            } else {
+                std::cerr << "Could not write flight recorder to: '" << m_path << "'" << std::endl;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include <gtest/gtest.h>
+
+#include "FlightRecorder.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <atomic>
+#include <iterator>
+#include <string>
+#include <thread>
+
+
+static std::string readFile(const char* path)
+{
+    std::ifstream in(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+static size_t countOf(const std::string& haystack, const std::string& needle)
+{
+    size_t count = 0;
+    for( size_t pos = haystack.find(needle); pos != std::string::npos;
+         pos = haystack.find(needle, pos + 1) ) {
+        count++;
+    }
+    return count;
+}
+
+TEST(FlightRecorderTest, RecordsOnlyWhenInstalled) {
+    EXPECT_EQ(nullptr, FlightRecorder::Current());
+
+    int evaluated = 0;
+    FLIGHT("not recorded {}", ++evaluated);
+    EXPECT_EQ(0, evaluated);
+
+    {
+        FlightRecorder recorder;
+        recorder.Install();
+        EXPECT_EQ(&recorder, FlightRecorder::Current());
+    }
+    EXPECT_EQ(nullptr, FlightRecorder::Current());
+}
+
+TEST(FlightRecorderTest, KeepsLatestEvents) {
+    const char* path = "FlightRecorder_test.flight";
+    FlightRecorder recorder(4);
+    recorder.Install();
+
+    for( int i = 0; i < 6; i++ ) {
+        FLIGHT("event {} on {}", i, i < 3 ? "old-host" : "new-host");
+    }
+    ASSERT_TRUE(recorder.DumpFile(path));
+
+    std::string data = readFile(path);
+    std::remove(path);
+
+    EXPECT_EQ(0, data.compare(0, sizeof(binlog::FILE_MAGIC),
+                              binlog::FILE_MAGIC, sizeof(binlog::FILE_MAGIC)));
+    EXPECT_NE(std::string::npos, data.find("event {} on {}"));
+    EXPECT_EQ(0u, countOf(data, "old-host"));
+    EXPECT_EQ(3u, countOf(data, "new-host"));
+}
+
+TEST(FlightRecorderTest, LeavesOutLongArguments) {
+    const char* path = "FlightRecorder_test.flight";
+    FlightRecorder recorder(4);
+    recorder.Install();
+
+    FLIGHT("long {}", std::string(FlightEvent::MAX_ARGS, 'x'));
+    ASSERT_TRUE(recorder.DumpFile(path));
+
+    std::string data = readFile(path);
+    std::remove(path);
+
+    EXPECT_NE(std::string::npos, data.find("long {}"));
+    EXPECT_EQ(std::string::npos, data.find("xxxx"));
+}
+
+TEST(FlightRecorderTest, DumpsWhileRecording) {
+    const char* path = "FlightRecorder_test.flight";
+    FlightRecorder recorder(4);
+    recorder.Install();
+
+    // Each event's argument is one letter over and over, so one that was
+    // overwritten as it was dumped would show up as a mix of two.
+    const size_t LENGTH = 100;
+    std::atomic<bool> stop(false);
+    std::thread writer([&stop, LENGTH]() {
+        for( int i = 0; !stop.load(std::memory_order_relaxed); i++ ) {
+            FLIGHT("busy {}", std::string(LENGTH, static_cast<char>('A' + i % 26)));
+        }
+    });
+
+    size_t events = 0;
+    for( int dump = 0; dump < 200; dump++ ) {
+        ASSERT_TRUE(recorder.DumpFile(path));
+        std::string data = readFile(path);
+
+        const std::string prefix("\x64\0\0\0", 4);
+        for( size_t pos = data.find(prefix); pos != std::string::npos;
+             pos = data.find(prefix, pos + 1) ) {
+            size_t start = pos + prefix.size();
+            if( start + LENGTH > data.size() || data[start] < 'A' || data[start] > 'Z' ) {
+                continue;
+            }
+            EXPECT_EQ(std::string(LENGTH, data[start]), data.substr(start, LENGTH));
+            events++;
+        }
+    }
+    stop.store(true);
+    writer.join();
+    std::remove(path);
+
+    EXPECT_GT(events, 0u);
+}
+
+static void recordAndCrash(const char* path)
+{
+    FlightRecorder recorder;
+    recorder.InstallCrashHandlers(path);
+    FLIGHT("about to crash on {}", "example.com");
+    raise(SIGSEGV);
+}
+
+TEST(FlightRecorderDeathTest, DumpsOnCrash) {
+    const char* path = "FlightRecorder_test.crash";
+    std::remove(path);
+
+    EXPECT_DEATH(recordAndCrash(path), "");
+
+    std::string data = readFile(path);
+    std::remove(path);
+    EXPECT_NE(std::string::npos, data.find("about to crash on {}"));
+    EXPECT_NE(std::string::npos, data.find("example.com"));
+}
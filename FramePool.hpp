@@ -0,0 +1,164 @@
+#ifndef FRAMEPOOL_HPP
+#define FRAMEPOOL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+
+// A pool of same-sized blocks of memory, for objects that are made and
+// destroyed at a high rate - e.g. the frame of a suspended scan.  Freed
+// blocks go on a free list and are handed out again, so once the pool has
+// grown to the peak number of live objects it stops allocating; its
+// memory is only given back when the pool itself is destroyed.
+//
+// The block size is set by the first allocation.  Anything bigger than
+// that is passed on to operator new.  Safe to use from any number of
+// threads.
+class FramePool {
+private:
+    struct FreeBlock {
+        FreeBlock*  next;
+    };
+
+    std::mutex                          m_mutex;
+    size_t                              m_blockSize;
+    size_t                              m_blocksPerChunk;
+    std::vector<std::unique_ptr<char[]>> m_chunks;
+    FreeBlock*                          m_free;
+    size_t                              m_live;
+
+public:
+    explicit FramePool(size_t blocksPerChunk = 256)
+        : m_blockSize(0)
+        , m_blocksPerChunk(blocksPerChunk > 0 ? blocksPerChunk : 1)
+        , m_free(nullptr)
+        , m_live(0)
+    { }
+
+    // Delete copy constructor and assignment.
+    FramePool(FramePool const&) = delete;
+    FramePool& operator=(FramePool const&) = delete;
+
+    void* Allocate(size_t size)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        if( 0 == m_blockSize ) {
+            const size_t align = alignof(std::max_align_t);
+            m_blockSize = (std::max(size, sizeof(FreeBlock)) + align - 1) / align * align;
+        }
+        if( size > m_blockSize ) {
+            lock.unlock();
+            return ::operator new(size);
+        }
+
+        if( nullptr == m_free ) {
+            grow();
+        }
+
+        FreeBlock* block = m_free;
+        m_free = block->next;
+        m_live++;
+        return block;
+    }
+
+    // 'size' must be what was passed to Allocate().
+    void Deallocate(void* p, size_t size)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if( size > m_blockSize ) {
+            lock.unlock();
+            ::operator delete(p);
+            return;
+        }
+
+        FreeBlock* block = static_cast<FreeBlock*>(p);
+        block->next = m_free;
+        m_free = block;
+        m_live--;
+    }
+
+    // Blocks in use, and blocks the pool has made altogether.
+    size_t Live()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_live;
+    }
+
+    size_t Capacity()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_chunks.size() * m_blocksPerChunk;
+    }
+
+private:
+    void grow()
+    {
+        m_chunks.emplace_back(new char[m_blockSize * m_blocksPerChunk]);
+        char* chunk = m_chunks.back().get();
+
+        for( size_t i = m_blocksPerChunk; i-- > 0; ) {
+            FreeBlock* block = reinterpret_cast<FreeBlock*>(chunk + i * m_blockSize);
+            block->next = m_free;
+            m_free = block;
+        }
+    }
+};
+
+
+// An allocator that takes single objects from a FramePool, e.g. for
+// std::allocate_shared().  Arrays go to operator new.
+template <typename T>
+class FrameAllocator {
+private:
+    FramePool*  m_pool;
+
+    template <typename U> friend class FrameAllocator;
+
+public:
+    typedef T value_type;
+
+    explicit FrameAllocator(FramePool& pool)
+        : m_pool(&pool)
+    { }
+
+    template <typename U>
+    FrameAllocator(const FrameAllocator<U>& other)
+        : m_pool(other.m_pool)
+    { }
+
+    T* allocate(size_t n)
+    {
+        if( 1 != n ) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(m_pool->Allocate(sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        if( 1 != n ) {
+            ::operator delete(p);
+            return;
+        }
+        m_pool->Deallocate(p, sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const FrameAllocator<U>& other) const
+    {
+        return m_pool == other.m_pool;
+    }
+
+    template <typename U>
+    bool operator!=(const FrameAllocator<U>& other) const
+    {
+        return m_pool != other.m_pool;
+    }
+};
+
+#endif
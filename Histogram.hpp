@@ -0,0 +1,319 @@
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include "PerThread.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <vector>
+
+
+// A histogram of non-negative values (we use nanoseconds) with log-linear
+// buckets, in the style of HdrHistogram: each power of two is split into
+// 32 equal sub-buckets, so any recorded value is known to within about 3%,
+// over a range from 1 up to 2^40 (about 18 minutes, in nanoseconds).
+class LatencyHistogram {
+public:
+    enum {
+        SUB_BUCKET_BITS = 5,
+        SUB_BUCKETS     = 1 << SUB_BUCKET_BITS,
+        MAX_EXPONENT    = 40,
+        NUM_BUCKETS     = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS,
+    };
+
+private:
+    std::vector<uint64_t>   m_counts;
+    uint64_t                m_count;
+    uint64_t                m_sum;
+    uint64_t                m_max;
+
+public:
+    LatencyHistogram()
+        : m_counts(NUM_BUCKETS, 0), m_count(0), m_sum(0), m_max(0)
+    { }
+
+    static size_t BucketFor(uint64_t value)
+    {
+        if( value < SUB_BUCKETS ) {
+            return static_cast<size_t>(value);
+        }
+
+        int exponent = 63 - __builtin_clzll(value);
+        if( exponent > MAX_EXPONENT ) {
+            return NUM_BUCKETS - 1;
+        }
+
+        int shift = exponent - SUB_BUCKET_BITS;
+        return static_cast<size_t>((shift + 1) * SUB_BUCKETS +
+                                   ((value >> shift) - SUB_BUCKETS));
+    }
+
+    // The smallest value that falls in the given bucket, and how many
+    // values it covers.
+    static uint64_t BucketLow(size_t bucket)
+    {
+        if( bucket < 2 * SUB_BUCKETS ) {
+            return bucket;
+        }
+        int shift = static_cast<int>(bucket / SUB_BUCKETS) - 1;
+        return static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    }
+
+    static uint64_t BucketWidth(size_t bucket)
+    {
+        if( bucket < 2 * SUB_BUCKETS ) {
+            return 1;
+        }
+        return uint64_t(1) << (bucket / SUB_BUCKETS - 1);
+    }
+
+    void Record(uint64_t value)
+    {
+        m_counts[BucketFor(value)]++;
+        m_count++;
+        m_sum += value;
+        m_max = std::max(m_max, value);
+    }
+
+    // Add a bucket's worth of values at once, when merging.
+    void AddBucket(size_t bucket, uint64_t count)
+    {
+        m_counts[bucket] += count;
+        m_count += count;
+    }
+
+    void AddTotals(uint64_t sum, uint64_t max)
+    {
+        m_sum += sum;
+        m_max = std::max(m_max, max);
+    }
+
+    uint64_t Count() const { return m_count; }
+    uint64_t Max() const { return m_max; }
+
+    double Mean() const
+    {
+        return m_count > 0 ? static_cast<double>(m_sum) / m_count : 0;
+    }
+
+    // The value below which the given fraction (0-1) of samples fall.  This
+    // is the middle of the bucket that holds that sample, so is accurate to
+    // within half a bucket.
+    uint64_t Percentile(double fraction) const
+    {
+        uint64_t total = m_count;
+        if( 0 == total ) {
+            return 0;
+        }
+
+        uint64_t rank = static_cast<uint64_t>(fraction * total);
+        if( rank >= total ) {
+            rank = total - 1;
+        }
+
+        uint64_t seen = 0;
+        for( size_t bucket = 0; bucket < NUM_BUCKETS; bucket++ ) {
+            seen += m_counts[bucket];
+            if( seen > rank ) {
+                uint64_t value = BucketLow(bucket) + BucketWidth(bucket) / 2;
+                return m_max > 0 ? std::min(value, m_max) : value;
+            }
+        }
+        return m_max;
+    }
+};
+
+
+// The stages of scanning a target, each of which gets its own histogram.
+enum class ScanPhase {
+    Resolve,        // Name resolution.
+    Sweep,          // The liveness check's connect.
+    Connect,        // Each probe's TCP connect.
+    Handshake,      // Each probe's TLS handshake, whatever the outcome.
+    Verify,         // The HTTP request over the first accepted handshake.
+};
+
+enum { NUM_SCAN_PHASES = 5 };
+
+inline const char* ScanPhaseName(ScanPhase phase)
+{
+    switch( phase ) {
+        case ScanPhase::Resolve:    return "resolve";
+        case ScanPhase::Sweep:      return "sweep";
+        case ScanPhase::Connect:    return "connect";
+        case ScanPhase::Handshake:  return "handshake";
+        case ScanPhase::Verify:     return "verify";
+    }
+    return "unknown";
+}
+
+
+// Collects the time spent in each phase, from any number of threads.
+//
+// Every thread writes to its own set of histograms, so recording is just a
+// couple of uncontended loads and stores - no locks, and no atomic
+// read-modify-write.  Snapshot() merges them all; it may run while other
+// threads are still recording, in which case the result is only
+// approximate.
+class LatencyRecorder {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    struct Slot {
+        std::atomic<uint64_t>   counts[NUM_SCAN_PHASES][LatencyHistogram::NUM_BUCKETS];
+        std::atomic<uint64_t>   sum[NUM_SCAN_PHASES];
+        std::atomic<uint64_t>   max[NUM_SCAN_PHASES];
+
+        Slot()
+        {
+            for( int p = 0; p < NUM_SCAN_PHASES; p++ ) {
+                for( int b = 0; b < LatencyHistogram::NUM_BUCKETS; b++ ) {
+                    counts[p][b].store(0, std::memory_order_relaxed);
+                }
+                sum[p].store(0, std::memory_order_relaxed);
+                max[p].store(0, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    PerThread<Slot> m_slots;
+
+public:
+    LatencyRecorder()
+    { }
+
+    // Delete copy constructor and assignment.
+    LatencyRecorder(LatencyRecorder const&) = delete;
+    LatencyRecorder& operator=(LatencyRecorder const&) = delete;
+
+    void Record(ScanPhase phase, Clock::duration elapsed)
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        uint64_t value = ns > 0 ? static_cast<uint64_t>(ns) : 0;
+
+        size_t bucket = LatencyHistogram::BucketFor(value);
+        int p = static_cast<int>(phase);
+
+        bool exclusive;
+        Slot& slot = m_slots.Local(exclusive);
+        Increment(slot.counts[p][bucket], 1, exclusive);
+        Increment(slot.sum[p], value, exclusive);
+
+        uint64_t max = slot.max[p].load(std::memory_order_relaxed);
+        if( exclusive ) {
+            if( value > max ) {
+                slot.max[p].store(value, std::memory_order_relaxed);
+            }
+        } else {
+            while( value > max &&
+                   !slot.max[p].compare_exchange_weak(max, value, std::memory_order_relaxed) )
+            { }
+        }
+    }
+
+    // Merge every thread's samples for a phase.  Values are in
+    // nanoseconds.
+    LatencyHistogram Snapshot(ScanPhase phase) const
+    {
+        LatencyHistogram ret;
+        int p = static_cast<int>(phase);
+
+        m_slots.ForEach([&ret, p](const Slot& slot) {
+            for( size_t b = 0; b < LatencyHistogram::NUM_BUCKETS; b++ ) {
+                uint64_t count = slot.counts[p][b].load(std::memory_order_relaxed);
+                if( count > 0 ) {
+                    ret.AddBucket(b, count);
+                }
+            }
+            ret.AddTotals(slot.sum[p].load(std::memory_order_relaxed),
+                          slot.max[p].load(std::memory_order_relaxed));
+        });
+
+        return ret;
+    }
+};
+
+
+// Print a table of each phase's latency percentiles, in milliseconds.
+inline void PrintLatencies(std::ostream& out, const LatencyRecorder& recorder)
+{
+    const double perMs = 1e6;
+
+    out << std::left << std::setw(12) << "Phase (ms)"
+        << std::right << std::setw(10) << "count"
+        << std::setw(10) << "mean"
+        << std::setw(10) << "p50"
+        << std::setw(10) << "p90"
+        << std::setw(10) << "p99"
+        << std::setw(10) << "p99.9"
+        << std::setw(10) << "max" << std::endl;
+
+    for( int p = 0; p < NUM_SCAN_PHASES; p++ ) {
+        ScanPhase phase = static_cast<ScanPhase>(p);
+        LatencyHistogram histogram = recorder.Snapshot(phase);
+        if( 0 == histogram.Count() ) {
+            continue;
+        }
+
+        out << std::left << std::setw(12) << ScanPhaseName(phase)
+            << std::right << std::setw(10) << histogram.Count()
+            << std::fixed << std::setprecision(2)
+            << std::setw(10) << histogram.Mean() / perMs
+            << std::setw(10) << histogram.Percentile(0.50) / perMs
+            << std::setw(10) << histogram.Percentile(0.90) / perMs
+            << std::setw(10) << histogram.Percentile(0.99) / perMs
+            << std::setw(10) << histogram.Percentile(0.999) / perMs
+            << std::setw(10) << histogram.Max() / perMs
+            << std::defaultfloat << std::endl;
+    }
+}
+
+
+// Times a phase from construction until Stop() (or destruction, if Stop()
+// was never called).  A null recorder turns this into a no-op.
+class PhaseTimer {
+private:
+    LatencyRecorder*                m_recorder;
+    ScanPhase                       m_phase;
+    LatencyRecorder::Clock::time_point m_started;
+
+public:
+    PhaseTimer(LatencyRecorder* recorder, ScanPhase phase)
+        : m_recorder(recorder), m_phase(phase)
+    {
+        if( m_recorder ) {
+            m_started = LatencyRecorder::Clock::now();
+        }
+    }
+
+    ~PhaseTimer()
+    {
+        Stop();
+    }
+
+    // Delete copy constructor and assignment.
+    PhaseTimer(PhaseTimer const&) = delete;
+    PhaseTimer& operator=(PhaseTimer const&) = delete;
+
+    void Stop()
+    {
+        if( m_recorder ) {
+            m_recorder->Record(m_phase, LatencyRecorder::Clock::now() - m_started);
+            m_recorder = nullptr;
+        }
+    }
+
+    // Throw the measurement away.
+    void Cancel()
+    {
+        m_recorder = nullptr;
+    }
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+
+#include "Histogram.hpp"
+
+#include <thread>
+#include <vector>
+
+
+TEST(LatencyHistogramTest, Buckets) {
+    // Small values get a bucket each.
+    for( uint64_t v = 0; v < 64; v++ ) {
+        EXPECT_EQ(v, LatencyHistogram::BucketFor(v));
+        EXPECT_EQ(v, LatencyHistogram::BucketLow(v));
+    }
+
+    // Every value lies within its bucket, and the buckets are in order.
+    size_t last = 0;
+    for( uint64_t v = 64; v < (uint64_t(1) << 40); v = v * 17 / 16 + 1 ) {
+        size_t bucket = LatencyHistogram::BucketFor(v);
+        EXPECT_GE(bucket, last);
+        EXPECT_LE(LatencyHistogram::BucketLow(bucket), v);
+        EXPECT_GT(LatencyHistogram::BucketLow(bucket) + LatencyHistogram::BucketWidth(bucket), v);
+        last = bucket;
+    }
+
+    // Huge values go in the last bucket.
+    EXPECT_EQ(size_t(LatencyHistogram::NUM_BUCKETS - 1),
+              LatencyHistogram::BucketFor(uint64_t(1) << 50));
+}
+
+TEST(LatencyHistogramTest, Percentiles) {
+    LatencyHistogram histogram;
+    for( uint64_t v = 1; v <= 10000; v++ ) {
+        histogram.Record(v * 1000);
+    }
+
+    EXPECT_EQ(10000u, histogram.Count());
+    EXPECT_EQ(10000000u, histogram.Max());
+    EXPECT_NEAR(5000500.0, histogram.Mean(), 1);
+
+    // Within the ~3% bucket precision.
+    EXPECT_NEAR(5000000.0, histogram.Percentile(0.50), 5000000.0 * 0.03);
+    EXPECT_NEAR(9900000.0, histogram.Percentile(0.99), 9900000.0 * 0.03);
+    EXPECT_LE(histogram.Percentile(1.0), histogram.Max());
+}
+
+TEST(LatencyRecorderTest, MergesThreads) {
+    LatencyRecorder recorder;
+
+    std::vector<std::thread> threads;
+    for( int t = 0; t < 4; t++ ) {
+        threads.emplace_back([&recorder, t]() {
+            for( int i = 0; i < 1000; i++ ) {
+                recorder.Record(ScanPhase::Connect, std::chrono::microseconds(100 * (t + 1)));
+            }
+        });
+    }
+    for( auto& thread : threads ) {
+        thread.join();
+    }
+
+    recorder.Record(ScanPhase::Verify, std::chrono::milliseconds(3));
+
+    LatencyHistogram connect = recorder.Snapshot(ScanPhase::Connect);
+    EXPECT_EQ(4000u, connect.Count());
+    EXPECT_EQ(400000u, connect.Max());
+    EXPECT_NEAR(250000.0, connect.Mean(), 1);
+
+    EXPECT_EQ(1u, recorder.Snapshot(ScanPhase::Verify).Count());
+    EXPECT_EQ(0u, recorder.Snapshot(ScanPhase::Handshake).Count());
+}
@@ -0,0 +1,371 @@
+#ifndef IOURING_HPP
+#define IOURING_HPP
+
+#include "Socket.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef __linux__
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+// A minimal io_uring: a submission queue of operations for the kernel to
+// start, and a completion queue it reports their results on, both shared
+// with the kernel so that many operations can be started and reaped with
+// a single system call.  This talks to the kernel directly, rather than
+// through liburing, and only has the operations the scanner needs.
+//
+// Only one thread should use a ring at once.
+//
+// On kernels (or builds) without io_uring, or without the operations we
+// use, Supported() returns false and the constructor throws a SocketError;
+// callers should fall back to poll().
+class IoUring {
+#ifdef HAVE_IO_URING
+private:
+    int                     m_fd;
+
+    void*                   m_sqRing;
+    size_t                  m_sqRingSize;
+    unsigned*               m_sqHead;
+    unsigned*               m_sqTail;
+    unsigned*               m_sqMask;
+    unsigned*               m_sqArray;
+    unsigned                m_sqEntries;
+    struct io_uring_sqe*    m_sqes;
+    size_t                  m_sqesSize;
+
+    void*                   m_cqRing;
+    size_t                  m_cqRingSize;
+    unsigned*               m_cqHead;
+    unsigned*               m_cqTail;
+    unsigned*               m_cqMask;
+    struct io_uring_cqe*    m_cqes;
+
+    // Entries we've filled in, but not yet passed to the kernel.
+    unsigned                m_unsubmitted;
+
+    // ConnectWithin()'s timeouts, by the index of their entry.
+    std::vector<struct __kernel_timespec> m_timeouts;
+
+public:
+    // Set in the user data of ConnectWithin()'s timeouts, so callers
+    // should leave the bottom bit of their own clear.
+    enum : uint64_t { TIMEOUT_BIT = 1 };
+
+    // The ring holds at least 'entries' submissions, and twice that many
+    // completions.
+    explicit IoUring(unsigned entries)
+        : m_fd(-1)
+        , m_sqRing(MAP_FAILED)
+        , m_sqes(static_cast<struct io_uring_sqe*>(MAP_FAILED))
+        , m_cqRing(MAP_FAILED)
+        , m_unsubmitted(0)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if( -1 == m_fd ) {
+            throw SocketError();
+        }
+
+        try {
+            mapRings(params);
+        } catch( ... ) {
+            unmap();
+            throw;
+        }
+        m_timeouts.resize(m_sqEntries);
+    }
+
+    ~IoUring()
+    {
+        unmap();
+    }
+
+    // Delete copy constructor and assignment.
+    IoUring(IoUring const&) = delete;
+    IoUring& operator=(IoUring const&) = delete;
+
+    // Whether this kernel has io_uring, with linked timeouts and connect.
+    static bool Supported()
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        int fd = static_cast<int>(syscall(__NR_io_uring_setup, 1, &params));
+        if( -1 == fd ) {
+            return false;
+        }
+
+        // The probe itself needs 5.6, which is also when connect arrived.
+        const unsigned ops = IORING_OP_LAST;
+        char buffer[sizeof(struct io_uring_probe) + ops * sizeof(struct io_uring_probe_op)];
+        memset(buffer, 0, sizeof(buffer));
+        struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(buffer);
+
+        bool supported =
+            0 == syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, ops) &&
+            opSupported(probe, IORING_OP_CONNECT) &&
+            opSupported(probe, IORING_OP_LINK_TIMEOUT) &&
+            opSupported(probe, IORING_OP_TIMEOUT);
+
+        close(fd);
+        return supported;
+    }
+
+    // Queue a connect.  If 'linked' is set, the next entry queued (e.g. a
+    // LinkTimeout()) is tied to this one.  Returns false if the submission
+    // queue is full.
+    //
+    // NOTE: The address must stay valid until the connect completes.
+    bool Connect(int fd, const struct sockaddr* addr, socklen_t addrLen,
+                 uint64_t userData, bool linked = false)
+    {
+        struct io_uring_sqe* sqe = next(IORING_OP_CONNECT, fd, userData);
+        if( nullptr == sqe ) {
+            return false;
+        }
+
+        sqe->addr = reinterpret_cast<uintptr_t>(addr);
+        sqe->off = addrLen;
+        if( linked ) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        return true;
+    }
+
+    // Cancel the previous (linked) entry if it hasn't completed within
+    // 'timeout'; it then completes with -ECANCELED, and this with -ETIME.
+    // If the previous entry completes first, this completes with
+    // -ECANCELED.
+    //
+    // NOTE: The timeout must stay valid until Submit() is called.
+    bool LinkTimeout(const struct __kernel_timespec* timeout, uint64_t userData)
+    {
+        struct io_uring_sqe* sqe = next(IORING_OP_LINK_TIMEOUT, -1, userData);
+        if( nullptr == sqe ) {
+            return false;
+        }
+
+        sqe->addr = reinterpret_cast<uintptr_t>(timeout);
+        sqe->len = 1;
+        return true;
+    }
+
+    // Complete with -ETIME after 'timeout', to bound a wait.
+    //
+    // NOTE: The timeout must stay valid until Submit() is called.
+    bool Timeout(const struct __kernel_timespec* timeout, uint64_t userData)
+    {
+        struct io_uring_sqe* sqe = next(IORING_OP_TIMEOUT, -1, userData);
+        if( nullptr == sqe ) {
+            return false;
+        }
+
+        sqe->addr = reinterpret_cast<uintptr_t>(timeout);
+        sqe->len = 1;
+        return true;
+    }
+
+    // Queue a connect, with a linked timeout of 'timeoutMs'.  The connect
+    // completes with 'userData' - and -ECANCELED, if it timed out - and
+    // the timeout with 'userData | TIMEOUT_BIT', which can be ignored.
+    // Returns false, having queued neither, if there isn't room for both.
+    //
+    // NOTE: The address must stay valid until the connect completes.
+    bool ConnectWithin(int fd, const SocketAddress& addr, int timeoutMs, uint64_t userData)
+    {
+        if( Space() < 2 ) {
+            return false;
+        }
+
+        Connect(fd, addr.ai_addr(), addr.ai_addrlen(), userData, true);
+
+        struct __kernel_timespec& timeout = m_timeouts[*m_sqTail & *m_sqMask];
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = static_cast<long long>(timeoutMs % 1000) * 1000000;
+        return LinkTimeout(&timeout, userData | TIMEOUT_BIT);
+    }
+
+    // The ring's descriptor, which polls readable while there are
+    // completions to reap.
+    int Fd() const
+    {
+        return m_fd;
+    }
+
+    // Submission entries that are free.
+    unsigned Space() const
+    {
+        unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        return m_sqEntries - (*m_sqTail - head);
+    }
+
+    // Pass everything queued to the kernel, and wait until there are at
+    // least 'waitFor' completions to reap.  A signal may cut the wait
+    // short.
+    void Submit(unsigned waitFor = 0)
+    {
+        unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS : 0;
+        for(;;) {
+            long status = syscall(__NR_io_uring_enter, m_fd, m_unsubmitted, waitFor,
+                                  flags, nullptr, 0);
+            if( status >= 0 ) {
+                m_unsubmitted -= static_cast<unsigned>(status);
+                if( 0 == m_unsubmitted ) {
+                    return;
+                }
+
+                // The kernel couldn't take everything (e.g. it was short of
+                // memory) - reap what we have, and try again later.
+                if( flags != 0 ) {
+                    return;
+                }
+                continue;
+            }
+            if( EINTR == errno ) {
+                return;
+            }
+
+            // The completion queue is full; we'll submit the rest once
+            // the caller has reaped some.
+            if( EBUSY == errno || EAGAIN == errno ) {
+                return;
+            }
+            throw SocketError();
+        }
+    }
+
+    // Call f(userData, result) for every completion that's ready, where
+    // the result is what the equivalent system call would have returned,
+    // or minus its errno.  Returns how many there were.
+    template <typename F>
+    unsigned Reap(F f)
+    {
+        unsigned head = *m_cqHead;
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+
+        for( ; head != tail; head++, count++ ) {
+            const struct io_uring_cqe& cqe = m_cqes[head & *m_cqMask];
+            f(cqe.user_data, cqe.res);
+        }
+
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+private:
+    static bool opSupported(const struct io_uring_probe* probe, unsigned op)
+    {
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    void mapRings(const struct io_uring_params& params)
+    {
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if( MAP_FAILED == m_sqRing ) {
+            throw SocketError();
+        }
+
+        char* sq = static_cast<char*>(m_sqRing);
+        m_sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        m_sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        m_sqEntries = params.sq_entries;
+
+        m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        m_sqes = static_cast<struct io_uring_sqe*>(
+                mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+        if( MAP_FAILED == m_sqes ) {
+            throw SocketError();
+        }
+
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if( MAP_FAILED == m_cqRing ) {
+            throw SocketError();
+        }
+
+        char* cq = static_cast<char*>(m_cqRing);
+        m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        m_cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    void unmap()
+    {
+        if( MAP_FAILED != m_cqRing ) {
+            munmap(m_cqRing, m_cqRingSize);
+        }
+        if( MAP_FAILED != m_sqes ) {
+            munmap(m_sqes, m_sqesSize);
+        }
+        if( MAP_FAILED != m_sqRing ) {
+            munmap(m_sqRing, m_sqRingSize);
+        }
+        if( -1 != m_fd ) {
+            close(m_fd);
+        }
+    }
+
+    // Claim the next submission entry, or return null if they're all in
+    // use.  It's handed to the kernel on the next Submit().
+    struct io_uring_sqe* next(uint8_t opcode, int fd, uint64_t userData)
+    {
+        if( 0 == Space() ) {
+            return nullptr;
+        }
+
+        unsigned tail = *m_sqTail;
+        unsigned index = tail & *m_sqMask;
+
+        struct io_uring_sqe* sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = userData;
+
+        m_sqArray[index] = index;
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+        m_unsubmitted++;
+        return sqe;
+    }
+
+#else
+public:
+    explicit IoUring(unsigned)
+    {
+        throw SocketError(ENOSYS);
+    }
+
+    static bool Supported()
+    {
+        return false;
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef PERTHREAD_HPP
+#define PERTHREAD_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+// A small number identifying the calling thread, handed out in the order
+// that threads first ask for one.  Numbers are never reused.
+inline size_t CurrentThreadIndex()
+{
+    static std::atomic<size_t> next(0);
+
+    // Constant-initialized, so that reading it doesn't need a check for
+    // whether it's been set up yet.
+    static thread_local size_t index = SIZE_MAX;
+    if( SIZE_MAX == index ) {
+        index = next++;
+    }
+    return index;
+}
+
+
+// One T for each thread that uses it, created on first use, so that each
+// thread can update its own without contending with the others.  Readers
+// can visit every thread's T with ForEach().
+//
+// Threads past the first MAX_THREADS all get the same, shared T (see
+// Local()), which must be updated with atomic read-modify-write instead.
+template <class T, size_t MAX_THREADS = 256>
+class PerThread {
+private:
+    std::atomic<T*> m_slots[MAX_THREADS];
+    T               m_shared;
+
+public:
+    PerThread()
+    {
+        for( auto& slot : m_slots ) {
+            slot.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~PerThread()
+    {
+        for( auto& slot : m_slots ) {
+            delete slot.load();
+        }
+    }
+
+    // Delete copy constructor and assignment.
+    PerThread(PerThread const&) = delete;
+    PerThread& operator=(PerThread const&) = delete;
+
+    // The calling thread's T.  Sets 'exclusive' to whether the T belongs
+    // to this thread alone, or is the shared one.
+    T& Local(bool& exclusive)
+    {
+        size_t index = CurrentThreadIndex();
+        if( index >= MAX_THREADS ) {
+            exclusive = false;
+            return m_shared;
+        }
+
+        exclusive = true;
+        T* slot = m_slots[index].load(std::memory_order_acquire);
+        if( nullptr == slot ) {
+            // Only this thread ever fills in its own slot.
+            slot = new T;
+            m_slots[index].store(slot, std::memory_order_release);
+        }
+        return *slot;
+    }
+
+    // Call f(const T&) for every thread's T, including the shared one.
+    template <class F>
+    void ForEach(F f) const
+    {
+        for( auto& it : m_slots ) {
+            const T* slot = it.load(std::memory_order_acquire);
+            if( nullptr != slot ) {
+                f(*slot);
+            }
+        }
+        f(m_shared);
+    }
+};
+
+
+// Add to a counter that only the calling thread writes to.  This is a
+// plain load and store, which is much cheaper than an atomic increment,
+// but still safe to read from other threads.
+inline void IncrementOwned(std::atomic<uint64_t>& value, uint64_t by)
+{
+    value.store(value.load(std::memory_order_relaxed) + by,
+                std::memory_order_relaxed);
+}
+
+// Add to a counter, using the cheap single-writer increment if we can.
+inline void Increment(std::atomic<uint64_t>& value, uint64_t by, bool exclusive)
+{
+    if( exclusive ) {
+        IncrementOwned(value, by);
+    } else {
+        value.fetch_add(by, std::memory_order_relaxed);
+    }
+}
+
+#endif
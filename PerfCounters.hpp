@@ -0,0 +1,406 @@
+#ifndef PERFCOUNTERS_HPP
+#define PERFCOUNTERS_HPP
+
+#include "PerThread.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+// What we count, for the calling thread only.  Not every kernel or
+// container lets us open all of these - hardware counters are often
+// missing in VMs and containers, and kernel cycles need a
+// perf_event_paranoid of 1 or less - so each one is optional.
+enum class PerfCounter {
+    TaskClock,          // CPU time, in nanoseconds (software; always tried first).
+    ContextSwitches,    // (software)
+    Cycles,             // User-space cycles - our code, and OpenSSL's.
+    KernelCycles,       // Kernel cycles - i.e. syscalls and the network stack.
+    Instructions,       // User-space instructions.
+};
+
+enum { NUM_PERF_COUNTERS = 5 };
+
+inline const char* PerfCounterName(PerfCounter counter)
+{
+    switch( counter ) {
+        case PerfCounter::TaskClock:        return "task-clock";
+        case PerfCounter::ContextSwitches:  return "context-switches";
+        case PerfCounter::Cycles:           return "cycles";
+        case PerfCounter::KernelCycles:     return "kernel-cycles";
+        case PerfCounter::Instructions:     return "instructions";
+    }
+    return "unknown";
+}
+
+
+// The counters' values at one point in time.
+struct PerfReading {
+    uint64_t values[NUM_PERF_COUNTERS];
+};
+
+
+// A set of perf_event_open() counters for the thread that created it,
+// read all at once with a single read() of the group.
+class PerfCounterGroup {
+private:
+    int         m_fds[NUM_PERF_COUNTERS];
+    int         m_leader;
+
+    // Which counter is at each position in a group read.
+    PerfCounter m_order[NUM_PERF_COUNTERS];
+    size_t      m_count;
+
+public:
+    PerfCounterGroup()
+        : m_leader(-1), m_count(0)
+    {
+        for( auto& fd : m_fds ) {
+            fd = -1;
+        }
+
+        open(PerfCounter::TaskClock, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, true, false);
+        open(PerfCounter::ContextSwitches, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, true, false);
+        open(PerfCounter::Cycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, false, true);
+        open(PerfCounter::KernelCycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, true, false);
+        open(PerfCounter::Instructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, false, true);
+    }
+
+    ~PerfCounterGroup()
+    {
+        // Close the leader last.
+        for( int i = NUM_PERF_COUNTERS - 1; i >= 0; i-- ) {
+            if( m_fds[i] >= 0 && m_fds[i] != m_leader ) {
+                close(m_fds[i]);
+            }
+        }
+        if( m_leader >= 0 ) {
+            close(m_leader);
+        }
+    }
+
+    // Delete copy constructor and assignment.
+    PerfCounterGroup(PerfCounterGroup const&) = delete;
+    PerfCounterGroup& operator=(PerfCounterGroup const&) = delete;
+
+    bool Has(PerfCounter counter) const
+    {
+        return m_fds[static_cast<int>(counter)] >= 0;
+    }
+
+    // A bit for each counter that we have.
+    unsigned Mask() const
+    {
+        unsigned mask = 0;
+        for( int i = 0; i < NUM_PERF_COUNTERS; i++ ) {
+            if( m_fds[i] >= 0 ) {
+                mask |= 1u << i;
+            }
+        }
+        return mask;
+    }
+
+    // Read every counter.  Missing ones read as zero.
+    bool Read(PerfReading& reading) const
+    {
+        std::memset(&reading, 0, sizeof(reading));
+        if( m_leader < 0 ) {
+            return false;
+        }
+
+        // With PERF_FORMAT_GROUP, we get the number of counters, and then
+        // their values in the order that they were added.
+        uint64_t buff[1 + NUM_PERF_COUNTERS];
+        ssize_t got = ::read(m_leader, buff, sizeof(buff));
+        if( got < static_cast<ssize_t>(sizeof(uint64_t)) ||
+            buff[0] != m_count ||
+            got < static_cast<ssize_t>((1 + m_count) * sizeof(uint64_t)) )
+        {
+            return false;
+        }
+
+        for( size_t i = 0; i < m_count; i++ ) {
+            reading.values[static_cast<int>(m_order[i])] = buff[1 + i];
+        }
+        return true;
+    }
+
+private:
+    void open(PerfCounter counter, uint32_t type, uint64_t config,
+              bool kernel, bool user)
+    {
+        struct perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = kernel ? 0 : 1;
+        attr.exclude_user = user ? 0 : 1;
+        attr.exclude_hv = 1;
+
+        // Software clocks don't split into user and kernel time.
+        if( PERF_TYPE_SOFTWARE == type ) {
+            attr.exclude_kernel = 0;
+            attr.exclude_user = 0;
+        }
+
+        // This thread, on any CPU.
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, m_leader, 0));
+        if( fd < 0 && PERF_TYPE_SOFTWARE == type ) {
+            // Without kernel access, we can still count in user space.
+            attr.exclude_kernel = 1;
+            fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, m_leader, 0));
+        }
+        if( fd < 0 ) {
+            return;
+        }
+
+        if( m_leader < 0 ) {
+            m_leader = fd;
+        }
+        m_fds[static_cast<int>(counter)] = fd;
+        m_order[m_count++] = counter;
+    }
+};
+
+
+// The CPU cost of probes, broken down by protocol and outcome, from
+// per-thread hardware counters (or software ones, if that's all there
+// is).  Call Begin() before a probe and End() after it, on the same
+// thread.
+//
+// Each thread opens its own counters the first time it calls Begin(), and
+// adds its totals to its own slot, so the only cost is two read()s per
+// probe.
+class PerfProfiler {
+public:
+    enum {
+        MAX_PROTOCOLS   = 8,
+        MAX_OUTCOMES    = 8,
+    };
+
+    // Everything spent on probes of one protocol, with one outcome.
+    struct Totals {
+        uint64_t probes;
+        uint64_t values[NUM_PERF_COUNTERS];
+    };
+
+private:
+    struct Slot {
+        std::unique_ptr<PerfCounterGroup> group;
+        std::atomic<uint64_t> probes[MAX_PROTOCOLS][MAX_OUTCOMES];
+        std::atomic<uint64_t> values[MAX_PROTOCOLS][MAX_OUTCOMES][NUM_PERF_COUNTERS];
+
+        Slot()
+        {
+            for( int p = 0; p < MAX_PROTOCOLS; p++ ) {
+                for( int o = 0; o < MAX_OUTCOMES; o++ ) {
+                    probes[p][o].store(0, std::memory_order_relaxed);
+                    for( int c = 0; c < NUM_PERF_COUNTERS; c++ ) {
+                        values[p][o][c].store(0, std::memory_order_relaxed);
+                    }
+                }
+            }
+        }
+    };
+
+    std::vector<std::string>    m_protocols;
+    std::vector<std::string>    m_outcomes;
+    PerThread<Slot>             m_slots;
+
+    // Which counters any thread managed to open.
+    std::atomic<unsigned>       m_available;
+
+public:
+    // The names of the protocols and outcomes, in the order of their
+    // indexes.  Anything past the first MAX_PROTOCOLS or MAX_OUTCOMES is
+    // ignored.
+    PerfProfiler(std::vector<std::string> protocols,
+                 std::vector<std::string> outcomes)
+        : m_protocols(std::move(protocols))
+        , m_outcomes(std::move(outcomes))
+        , m_available(0)
+    {
+        if( m_protocols.size() > MAX_PROTOCOLS ) {
+            m_protocols.resize(MAX_PROTOCOLS);
+        }
+        if( m_outcomes.size() > MAX_OUTCOMES ) {
+            m_outcomes.resize(MAX_OUTCOMES);
+        }
+    }
+
+    // Delete copy constructor and assignment.
+    PerfProfiler(PerfProfiler const&) = delete;
+    PerfProfiler& operator=(PerfProfiler const&) = delete;
+
+    // Which counters we have, so far.  Nothing is opened until the first
+    // call to Begin().
+    bool Has(PerfCounter counter) const
+    {
+        return 0 != (m_available.load(std::memory_order_relaxed) &
+                     (1u << static_cast<int>(counter)));
+    }
+
+    // The index of a protocol, by name, or MAX_PROTOCOLS if it's not one
+    // of ours.
+    size_t ProtocolIndex(const std::string& name) const
+    {
+        for( size_t i = 0; i < m_protocols.size(); i++ ) {
+            if( m_protocols[i] == name ) {
+                return i;
+            }
+        }
+        return MAX_PROTOCOLS;
+    }
+
+    const std::vector<std::string>& Protocols() const { return m_protocols; }
+    const std::vector<std::string>& Outcomes() const { return m_outcomes; }
+
+    // Read the calling thread's counters at the start of a probe.  Returns
+    // false if we can't count on this thread - in which case, don't call
+    // End().
+    bool Begin(PerfReading& start)
+    {
+        bool exclusive;
+        Slot& slot = m_slots.Local(exclusive);
+        if( !exclusive ) {
+            // Counters belong to a thread, so the shared slot can't have
+            // any.
+            return false;
+        }
+
+        if( !slot.group ) {
+            slot.group.reset(new PerfCounterGroup());
+            m_available.fetch_or(slot.group->Mask(), std::memory_order_relaxed);
+        }
+        return slot.group->Read(start);
+    }
+
+    // Add up what a probe cost, since Begin().
+    void End(const PerfReading& start, size_t protocol, size_t outcome)
+    {
+        bool exclusive;
+        Slot& slot = m_slots.Local(exclusive);
+
+        PerfReading end;
+        if( !exclusive || !slot.group || !slot.group->Read(end) ||
+            protocol >= m_protocols.size() || outcome >= m_outcomes.size() )
+        {
+            return;
+        }
+
+        IncrementOwned(slot.probes[protocol][outcome], 1);
+        for( int c = 0; c < NUM_PERF_COUNTERS; c++ ) {
+            IncrementOwned(slot.values[protocol][outcome][c],
+                           end.values[c] - start.values[c]);
+        }
+    }
+
+    Totals Get(size_t protocol, size_t outcome) const
+    {
+        Totals ret;
+        std::memset(&ret, 0, sizeof(ret));
+        if( protocol >= MAX_PROTOCOLS || outcome >= MAX_OUTCOMES ) {
+            return ret;
+        }
+
+        m_slots.ForEach([&ret, protocol, outcome](const Slot& slot) {
+            ret.probes += slot.probes[protocol][outcome].load(std::memory_order_relaxed);
+            for( int c = 0; c < NUM_PERF_COUNTERS; c++ ) {
+                ret.values[c] += slot.values[protocol][outcome][c].load(std::memory_order_relaxed);
+            }
+        });
+        return ret;
+    }
+
+    // Print a table of the cost per probe, by protocol and outcome, with
+    // an overall total.
+    void Print(std::ostream& out) const
+    {
+        bool hardware = Has(PerfCounter::Cycles) && Has(PerfCounter::Instructions);
+        out << "CPU cost per probe ("
+            << (hardware ? "hardware counters" : "software counters only - no cycles or IPC")
+            << (Has(PerfCounter::KernelCycles) ? "" : ", no kernel cycles")
+            << ")" << std::endl;
+
+        out << std::left << std::setw(10) << "Protocol"
+            << std::setw(16) << "Outcome"
+            << std::right << std::setw(10) << "probes"
+            << std::setw(12) << "cpu us"
+            << std::setw(10) << "ctx sw"
+            << std::setw(14) << "cycles"
+            << std::setw(14) << "kern cycles"
+            << std::setw(8) << "IPC" << std::endl;
+
+        Totals all;
+        std::memset(&all, 0, sizeof(all));
+        for( size_t p = 0; p < m_protocols.size(); p++ ) {
+            for( size_t o = 0; o < m_outcomes.size(); o++ ) {
+                Totals totals = Get(p, o);
+                if( 0 == totals.probes ) {
+                    continue;
+                }
+
+                printRow(out, m_protocols[p], m_outcomes[o], totals);
+                all.probes += totals.probes;
+                for( int c = 0; c < NUM_PERF_COUNTERS; c++ ) {
+                    all.values[c] += totals.values[c];
+                }
+            }
+        }
+        printRow(out, "all", "", all);
+    }
+
+private:
+    void printRow(std::ostream& out, const std::string& protocol,
+                  const std::string& outcome, const Totals& totals) const
+    {
+        double probes = totals.probes > 0 ? static_cast<double>(totals.probes) : 1;
+        auto perProbe = [&totals, probes](PerfCounter c) {
+            return totals.values[static_cast<int>(c)] / probes;
+        };
+
+        out << std::left << std::setw(10) << protocol
+            << std::setw(16) << outcome
+            << std::right << std::setw(10) << totals.probes
+            << std::fixed << std::setprecision(1)
+            << std::setw(12) << perProbe(PerfCounter::TaskClock) / 1000
+            << std::setprecision(2)
+            << std::setw(10) << perProbe(PerfCounter::ContextSwitches)
+            << std::setprecision(0);
+
+        if( Has(PerfCounter::Cycles) ) {
+            out << std::setw(14) << perProbe(PerfCounter::Cycles);
+        } else {
+            out << std::setw(14) << "-";
+        }
+
+        if( Has(PerfCounter::KernelCycles) ) {
+            out << std::setw(14) << perProbe(PerfCounter::KernelCycles);
+        } else {
+            out << std::setw(14) << "-";
+        }
+
+        uint64_t cycles = totals.values[static_cast<int>(PerfCounter::Cycles)];
+        if( Has(PerfCounter::Instructions) && cycles > 0 ) {
+            out << std::setprecision(2) << std::setw(8)
+                << static_cast<double>(totals.values[static_cast<int>(PerfCounter::Instructions)]) / cycles;
+        } else {
+            out << std::setw(8) << "-";
+        }
+        out << std::defaultfloat << std::endl;
+    }
+};
+
+#endif
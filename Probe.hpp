@@ -0,0 +1,1144 @@
+#ifndef PROBE_HPP
+#define PROBE_HPP
+
+#include "Cancellation.hpp"
+#include "FdBudget.hpp"
+#include "FlightRecorder.hpp"
+#include "Histogram.hpp"
+#include "IoUring.hpp"
+#include "PerfCounters.hpp"
+#include "RetryPolicy.hpp"
+#include "RttEstimator.hpp"
+#include "SSL.hpp"
+#include "Socket.hpp"
+#include "Stats.hpp"
+#include "Target.hpp"
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <poll.h>
+
+#include <boost/asio/coroutine.hpp>
+
+
+// Settings that apply to every probe in a scan.  This is shared (read-only)
+// between all the worker threads.
+struct ScanOptions {
+    // Local addresses to connect from.  If empty, the kernel chooses.
+    SourceAddressPool sources;
+
+    // Reset connections once a probe is done with them, rather than
+    // closing them normally.
+    bool abortiveClose;
+
+    // Check that each (host, port) accepts connections before spending a
+    // full set of TLS probes on it, and how many of those checks may be
+    // outstanding at once.
+    bool   sweep;
+    size_t sweepConcurrency;
+
+    // Drive the sweep's connects, and those of scans run on a ScanReactor,
+    // through io_uring, where the kernel has it.
+    bool   ioUring;
+
+    // If set, every probe's socket counts against this, and waits for it
+    // to have room.
+    FdBudget* fds;
+
+    // Timeouts, in milliseconds.  These are used as-is until we've
+    // measured the round-trip time to a host; after that, that host's
+    // timeouts are derived from the measurements, up to maxTimeoutMs.
+    int  connectTimeoutMs;
+    int  handshakeTimeoutMs;
+    int  maxTimeoutMs;
+    bool adaptiveTimeouts;
+
+    ScanOptions()
+        : abortiveClose(false)
+        , sweep(true)
+        , sweepConcurrency(512)
+        , ioUring(true)
+        , fds(nullptr)
+        , connectTimeoutMs(5000)
+        , handshakeTimeoutMs(10000)
+        , maxTimeoutMs(30000)
+        , adaptiveTimeouts(true)
+    { }
+};
+
+
+// The outcome of a single cipher probe.
+enum class ProbeStatus {
+    Accepted,       // The handshake completed with this cipher.
+    Rejected,       // The server refused the handshake, or hung up.
+    ConnectFailed,  // We couldn't connect at all.
+    Timeout,        // The connect or handshake took too long.
+    Reset,          // The connection was reset during the handshake.
+    Error,          // Some other local or protocol error.
+};
+
+enum { NUM_PROBE_STATUSES = 6 };
+
+inline const char* ProbeStatusName(ProbeStatus status)
+{
+    switch( status ) {
+        case ProbeStatus::Accepted:         return "accepted";
+        case ProbeStatus::Rejected:         return "rejected";
+        case ProbeStatus::ConnectFailed:    return "connect failed";
+        case ProbeStatus::Timeout:          return "timeout";
+        case ProbeStatus::Reset:            return "reset";
+        case ProbeStatus::Error:            return "error";
+    }
+    return "unknown";
+}
+
+
+typedef std::chrono::steady_clock ProbeClock;
+
+
+// Why a TargetScan stopped before running every probe, if it did.
+enum class ScanStop {
+    None,           // It didn't - every probe ran.
+    HostBudget,     // The host's time budget ran out.
+    Deadline,       // The whole scan's deadline passed.
+    Cancelled,      // The scan was cancelled, e.g. by SIGINT.
+    Failed,         // Whatever was running the scan couldn't carry on.
+};
+
+inline const char* ScanStopName(ScanStop stop)
+{
+    switch( stop ) {
+        case ScanStop::None:        return "none";
+        case ScanStop::HostBudget:  return "host budget";
+        case ScanStop::Deadline:    return "deadline";
+        case ScanStop::Cancelled:   return "cancelled";
+        case ScanStop::Failed:      return "failed";
+    }
+    return "unknown";
+}
+
+
+// A single (protocol, cipher) combination to try against each target.
+struct CipherProbe {
+    const ::SSL_METHOD* method;
+    const char*         methodName;
+    ssl::SSLCipher      cipher;
+};
+
+struct ProbeResult {
+    const CipherProbe*  probe;
+    ProbeStatus         status;
+
+    // The errno value behind a failure, if there was one.
+    int                 error;
+
+    // How many times the probe was run, including retries.
+    int                 attempts;
+
+    // The deadlines the final attempt ran with, and how long it took.
+    ProbeTimeouts       timeouts;
+    ProbeClock::duration elapsed;
+};
+
+
+// Whether a failure might go away if we try again.  Resets, timeouts and
+// running short of local resources are transient; an alert from the
+// server, or a refused connection, is a definitive answer.
+inline bool IsRetryable(const ProbeResult& result)
+{
+    switch( result.status ) {
+        case ProbeStatus::Timeout:
+        case ProbeStatus::Reset:
+            return true;
+
+        case ProbeStatus::ConnectFailed:
+        case ProbeStatus::Error:
+            switch( result.error ) {
+                case ETIMEDOUT:
+                case ECONNRESET:
+                case ECONNABORTED:
+                case EAGAIN:
+                case EADDRNOTAVAIL:
+                case EADDRINUSE:
+                case EMFILE:
+                case ENFILE:
+                case ENOBUFS:
+                    return true;
+                default:
+                    return false;
+            }
+
+        default:
+            return false;
+    }
+}
+
+
+// Whether an error means we're short of something locally - descriptors,
+// ports or buffers - rather than anything to do with the server.
+inline bool IsLocalResourceError(int error)
+{
+    switch( error ) {
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+        case EADDRNOTAVAIL:
+        case EADDRINUSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+// Milliseconds left until the given deadline, or zero if it has passed.
+inline int remainingMs(ProbeClock::time_point deadline)
+{
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - ProbeClock::now()).count();
+    return left > 0 ? static_cast<int>(left) : 0;
+}
+
+// Wait until the socket has one of the given events, or the deadline
+// passes.  Returns the events that occurred, or zero on timeout.
+inline short waitUntil(Socket& sock, short events, ProbeClock::time_point deadline)
+{
+    for(;;) {
+        int left = remainingMs(deadline);
+        short revents = sock.Wait(events, left);
+        if( 0 != revents || 0 == left ) {
+            return revents;
+        }
+    }
+}
+
+
+// What a suspended TargetScan is waiting for: an event on its socket, or -
+// if 'fd' is -1 - just for the deadline to pass, before retrying a probe.
+struct ScanWait {
+    int                     fd;
+    short                   events;     // As for poll().
+    ProbeClock::time_point  deadline;
+};
+
+
+// Runs every cipher probe against a single (host, port) pair, one
+// connection per probe.
+//
+// Probes that fail in a way that might be transient are retried, as the
+// RetryPolicy allows.  Rather than sleeping until the retry is due, Run()
+// returns early and expects to be called again later, so the thread
+// running it is free to do other work in the meantime.
+//
+// The scan is a stackless coroutine (see Resume()), so it can equally be
+// driven without blocking at all, by something that waits on many scans'
+// sockets at once.  Run() just drives it on the calling thread.
+//
+// A scan can be cut short, by a cancellation token or a time budget.  It
+// then runs no more probes, abandons the one in progress (unless it has
+// already got an answer), and is done; Stopped() says why.
+class TargetScan {
+private:
+    std::string                     m_host;
+    uint16_t                        m_port;
+    std::vector<SocketAddress>      m_addresses;
+    size_t                          m_addrIndex;
+
+    const std::vector<CipherProbe>& m_probes;
+    const ScanOptions&              m_options;
+    HostTimings&                    m_timings;
+    RetryPolicy&                    m_retries;
+    LatencyRecorder*                m_latencies;
+    ScanStats*                      m_stats;
+    Tracer*                         m_tracer;
+    uint32_t                        m_traceId;
+    PerfProfiler*                   m_perf;
+    ssl::SSLContextCache*           m_contexts;
+    const CancellationToken*        m_cancel;
+    ProbeClock::time_point          m_budget;
+    ProbeClock::time_point          m_stopBy;           // The earlier of the two deadlines.
+    ScanStop                        m_stop;
+
+    std::vector<ProbeResult>        m_results;
+    int                             m_retriesUsed;
+    bool                            m_sendHostName;
+    bool                            m_verified;
+
+    // Resume()'s state.  It's stackless, so everything that has to live
+    // across a wait is kept here.
+    enum class ConnectStep { Connected, Pending, Queued, Failed };
+
+    boost::asio::coroutine          m_coro;
+    ProbeResult                     m_current;
+    ProbeClock::time_point          m_started;          // This attempt at the probe.
+    ProbeClock::time_point          m_phaseStarted;
+    ProbeClock::time_point          m_deadline;         // ... for the current phase.
+    ProbeClock::duration            m_retryAfter;
+    size_t                          m_tried;            // Addresses tried for this connect.
+    ConnectStep                     m_connectStep;
+    bool                            m_timedOut;         // Whether the last connect timed out.
+    FdPermit                        m_permit;           // For the next socket.
+    bool                            m_waitingForFd;
+    IoUring*                        m_ring;             // To connect through, if set.
+    uint64_t                        m_ringTag;
+    int32_t                         m_ringResult;       // Of the last connect through it.
+    bool                            m_waitingForRing;
+    Socket                          m_sock;
+    std::unique_ptr<ssl::SSLContext> m_ownContext;
+    std::unique_ptr<ssl::SSL>       m_ssl;
+    int                             m_want;             // SSL_ERROR_WANT_READ or _WRITE.
+    std::string                     m_request;
+    size_t                          m_written;
+    PerfReading                     m_perfStart;
+    bool                            m_counting;
+
+public:
+    // The addresses should already have the right port set.  If given a
+    // latency recorder, the time spent in each phase of each probe is
+    // recorded in it, and if given stats, each probe and its outcome is
+    // counted there.  If given a tracer, and it samples this target, every
+    // probe and phase is traced.  If given a profiler, the CPU cost of
+    // each probe is counted in it.  If given a context cache (with an entry
+    // per probe), the probes' SSL contexts come from it, rather than each
+    // making its own.  If given a cancellation token, the scan stops once
+    // it's cancelled, and likewise once 'budget' passes.
+    TargetScan(std::string host,
+               uint16_t port,
+               std::vector<SocketAddress> addresses,
+               const std::vector<CipherProbe>& probes,
+               const ScanOptions& options,
+               HostTimings& timings,
+               RetryPolicy& retries,
+               LatencyRecorder* latencies = nullptr,
+               ScanStats* stats = nullptr,
+               Tracer* tracer = nullptr,
+               PerfProfiler* perf = nullptr,
+               ssl::SSLContextCache* contexts = nullptr,
+               const CancellationToken* cancel = nullptr,
+               ProbeClock::time_point budget = ProbeClock::time_point::max())
+        : m_host(host)
+        , m_port(port)
+        , m_addresses(std::move(addresses))
+        , m_addrIndex(0)
+        , m_probes(probes)
+        , m_options(options)
+        , m_timings(timings)
+        , m_retries(retries)
+        , m_latencies(latencies)
+        , m_stats(stats)
+        , m_tracer(nullptr)
+        , m_traceId(0)
+        , m_perf(perf)
+        , m_contexts(contexts)
+        , m_cancel(cancel)
+        , m_budget(budget)
+        , m_stopBy(cancel ? std::min(budget, cancel->Deadline()) : budget)
+        , m_stop(ScanStop::None)
+        , m_retriesUsed(0)
+        , m_sendHostName(false)
+        , m_verified(false)
+        , m_tried(0)
+        , m_connectStep(ConnectStep::Failed)
+        , m_timedOut(false)
+        , m_waitingForFd(false)
+        , m_ring(nullptr)
+        , m_ringTag(0)
+        , m_ringResult(0)
+        , m_waitingForRing(false)
+        , m_want(0)
+        , m_written(0)
+        , m_counting(false)
+    {
+        // Only send SNI for names, not address literals.
+        unsigned char buff[sizeof(struct in6_addr)];
+        m_sendHostName = inet_pton(AF_INET, host.c_str(), buff) != 1 &&
+                         inet_pton(AF_INET6, host.c_str(), buff) != 1;
+
+        m_results.reserve(m_probes.size());
+
+        std::string endpoint = Target::Endpoint(host, port);
+        if( tracer && tracer->Sampled(endpoint) ) {
+            m_tracer = tracer;
+            m_traceId = tracer->Register(endpoint);
+        }
+    }
+
+    // Run probes until either all of them are done (in which case this
+    // returns true), or one needs to be retried.  In that case, this
+    // returns false, and 'retryAfter' is set to how long to wait before
+    // calling Run() again - unless WaitingForFd() says the scan is waiting
+    // for a descriptor instead, in which case see AwaitFd().
+    bool Run(ProbeClock::duration& retryAfter)
+    {
+        ScanWait wait;
+        short revents = 0;
+        while( !Resume(revents, wait) ) {
+            if( -1 == wait.fd ) {
+                retryAfter = m_waitingForFd ? ProbeClock::duration::zero() : m_retryAfter;
+                return false;
+            }
+
+            // If we can be cancelled, wake up now and then to check.
+            for(;;) {
+                ProbeClock::time_point until = wait.deadline;
+                if( m_cancel ) {
+                    until = std::min(until, ProbeClock::now() + std::chrono::milliseconds(
+                            CancellationToken::CHECK_INTERVAL_MS));
+                }
+                revents = waitUntil(m_sock, wait.events, until);
+                if( 0 != revents || until == wait.deadline || stopping() ) {
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Run probes until either all of them are done (in which case this
+    // returns true), or the scan has to wait - for its socket, or before
+    // retrying a probe.  In that case, this returns false, with 'wait'
+    // saying what for; call it again once the wait is over, with the
+    // events that ended it, or zero if the deadline passed first.
+    //
+    // This never blocks.  If the scan is cut short while it's waiting,
+    // calling this (with zero) finishes it.
+    bool Resume(short revents, ScanWait& wait)
+    {
+        m_waitingForFd = false;
+        m_waitingForRing = false;
+        BOOST_ASIO_CORO_REENTER(m_coro) {
+            while( m_results.size() < m_probes.size() && !stopping() ) {
+                beginProbe();
+
+                // Try each address in turn, starting from the one that
+                // worked last time.
+                for( m_tried = 0; m_tried < m_addresses.size(); m_tried++ ) {
+                    // Wait for a descriptor to come free, rather than
+                    // failing for want of one.
+                    while( !acquireFd() && !stopping() ) {
+                        BOOST_ASIO_CORO_YIELD return waitForFd(wait);
+                    }
+                    if( stopping() ) {
+                        m_permit.Release();
+                        m_timedOut = true;
+                        m_connectStep = ConnectStep::Failed;
+                        break;
+                    }
+
+                    m_connectStep = startConnect();
+                    if( ConnectStep::Queued == m_connectStep ) {
+                        BOOST_ASIO_CORO_YIELD return waitForRing(wait);
+                        m_connectStep = finishRingConnect();
+                    }
+                    if( ConnectStep::Pending == m_connectStep ) {
+                        BOOST_ASIO_CORO_YIELD return waitFor(POLLOUT, wait);
+                        m_connectStep = finishConnect(revents);
+                    }
+                    if( ConnectStep::Connected == m_connectStep || stopping() ) {
+                        break;
+                    }
+                }
+
+                if( ConnectStep::Connected != m_connectStep ) {
+                    connectGaveUp();
+                } else {
+                    if( startHandshake() ) {
+                        while( handshakeWaits() ) {
+                            BOOST_ASIO_CORO_YIELD return waitFor(sslEvents(), wait);
+                            if( 0 == revents ) {
+                                m_current.status = ProbeStatus::Timeout;
+                                break;
+                            }
+                        }
+                        endHandshake();
+
+                        if( ProbeStatus::Accepted == m_current.status && !m_verified &&
+                            !stopping() )
+                        {
+                            startVerify();
+                            while( verifyWaits() ) {
+                                BOOST_ASIO_CORO_YIELD return waitFor(sslEvents(), wait);
+                                if( 0 == revents ) {
+                                    ERR_clear_error();
+                                    break;
+                                }
+                            }
+                            endVerify();
+                        }
+                    }
+                    closeConnection();
+                }
+
+                // A timeout may just be us being cut short, so it isn't an
+                // answer we can trust.
+                if( stopping() && ProbeStatus::Timeout == m_current.status ) {
+                    abandonProbe();
+                    break;
+                }
+
+                if( !endProbe() ) {
+                    BOOST_ASIO_CORO_YIELD {
+                        wait.fd = -1;
+                        wait.events = 0;
+                        wait.deadline = ProbeClock::now() + m_retryAfter;
+                        return false;
+                    }
+                }
+            }
+        }
+
+        return true;
+    }
+
+    const std::string& Host() const { return m_host; }
+    uint16_t Port() const { return m_port; }
+
+    // The tracer to record this target's events in, and the ID to tag
+    // them with - or null, if this target isn't being traced.
+    Tracer* GetTracer() const { return m_tracer; }
+    uint32_t TraceId() const { return m_traceId; }
+
+    // Every address of the target, in the order we try them.
+    const std::vector<SocketAddress>& Addresses() const
+    {
+        return m_addresses;
+    }
+
+    // The descriptor of the socket the scan has open, or -1.
+    int SocketFd() const
+    {
+        return m_sock.GetFd();
+    }
+
+    // Give up on the scan, because whatever is running it can't wait for
+    // it any more (e.g. epoll won't take its socket).  As when it's
+    // cancelled, the probe in progress is abandoned and no more are run;
+    // call Resume() with zero to finish it.
+    void Fail(int error)
+    {
+        FLIGHT("{}:{}: failed (errno {})", m_host, m_port, error);
+        if( ScanStop::None == m_stop ) {
+            m_stop = ScanStop::Failed;
+        }
+    }
+
+    // Whether the scan is waiting for a descriptor to come free, rather
+    // than for its socket or a retry - in which case, instead of waiting
+    // for 'wait' to pass, call AwaitFd().
+    bool WaitingForFd() const
+    {
+        return m_waitingForFd;
+    }
+
+    // Once the scan has a descriptor to use, call 'wake' - right away, if
+    // one is free, or else on whichever thread gives one back - and then
+    // Resume() the scan.  'wake' mustn't block.
+    //
+    // A scan waiting for a descriptor isn't woken by its deadline, or by
+    // being cancelled, since it only has to wait for one of the probes
+    // holding them to finish.
+    void AwaitFd(std::function<void()> wake)
+    {
+        FdPermit permit = m_options.fds->Acquire([this, wake](FdPermit handed) {
+            m_permit = std::move(handed);
+            wake();
+        });
+        if( permit ) {
+            m_permit = std::move(permit);
+            wake();
+        }
+    }
+
+    // Connect through 'ring' from now on, while it has room, rather than
+    // waiting for the socket to be writable.  The connect completes with
+    // 'tag', which must have IoUring::TIMEOUT_BIT clear.  Only the thread
+    // running the scan may use the ring.
+    void UseRing(IoUring* ring, uint64_t tag)
+    {
+        m_ring = ring;
+        m_ringTag = tag;
+    }
+
+    // Whether the scan is waiting for a connect through its ring - in which
+    // case, instead of waiting for 'wait' to pass, pass the connect's result
+    // to ConnectCompleted() once it's reaped, and then Resume() the scan.
+    //
+    // The ring times the connect out, so it isn't woken by its deadline,
+    // or by being cancelled, either.
+    bool WaitingForRing() const
+    {
+        return m_waitingForRing;
+    }
+
+    void ConnectCompleted(int32_t result)
+    {
+        m_ringResult = result;
+    }
+
+    // The address that we last connected to.
+    std::string Address() const
+    {
+        return m_addresses.empty() ? "" : m_addresses[m_addrIndex].ToString();
+    }
+
+    const std::vector<ProbeResult>& Results() const
+    {
+        return m_results;
+    }
+
+    // Why the scan stopped before running every probe, if it did.
+    ScanStop Stopped() const
+    {
+        return m_stop;
+    }
+
+    // Whether a request sent over an accepted connection got a response.
+    bool Verified() const
+    {
+        return m_verified;
+    }
+
+    void Print(std::ostream& out) const
+    {
+        out << Target::Endpoint(m_host, m_port);
+        if( !m_addresses.empty() ) {
+            out << " (" << Address() << ")";
+        }
+        out << std::endl;
+
+        std::map<ProbeStatus, size_t> failures;
+        ProbeTimeouts lastTimeouts = { 0, 0 };
+        for( auto& result : m_results ) {
+            switch( result.status ) {
+                case ProbeStatus::Accepted:
+                    out << "    Accepted  "
+                        << std::left << std::setw(8) << result.probe->methodName
+                        << std::right << std::setw(4) << result.probe->cipher.Bits() << " bits  "
+                        << result.probe->cipher.Name()
+                        << std::endl;
+                    break;
+
+                case ProbeStatus::Rejected:
+                    break;
+
+                case ProbeStatus::Timeout:
+                    lastTimeouts = result.timeouts;
+                    failures[result.status]++;
+                    break;
+
+                default:
+                    failures[result.status]++;
+                    break;
+            }
+        }
+
+        for( auto& it : failures ) {
+            out << "    " << it.second << " probe(s) failed: "
+                << ProbeStatusName(it.first);
+            if( ProbeStatus::Timeout == it.first ) {
+                out << " (last deadlines: connect " << lastTimeouts.connectMs
+                    << " ms, handshake " << lastTimeouts.handshakeMs << " ms)";
+            }
+            out << std::endl;
+        }
+
+        if( ScanStop::None != m_stop ) {
+            out << "    Stopped early (" << ScanStopName(m_stop) << "): "
+                << (m_probes.size() - m_results.size()) << " probe(s) not run" << std::endl;
+        }
+    }
+
+private:
+    // Whether the scan should stop, noting why the first time it's true.
+    bool stopping()
+    {
+        if( ScanStop::None != m_stop ) {
+            return true;
+        }
+
+        if( m_cancel && m_cancel->Cancelled() ) {
+            m_stop = m_cancel->Expired() ? ScanStop::Deadline : ScanStop::Cancelled;
+        } else if( ProbeClock::time_point::max() != m_budget && ProbeClock::now() >= m_budget ) {
+            m_stop = ScanStop::HostBudget;
+        }
+
+        if( ScanStop::None != m_stop ) {
+            FLIGHT("{}:{}: stopping ({})", m_host, m_port, ScanStopName(m_stop));
+            return true;
+        }
+        return false;
+    }
+
+    // Start a new attempt at the next probe.
+    void beginProbe()
+    {
+        const CipherProbe& probe = m_probes[m_results.size()];
+
+        m_current = ProbeResult();
+        m_current.probe = &probe;
+        m_current.status = ProbeStatus::ConnectFailed;
+        m_current.error = 0;
+        m_current.attempts = m_retriesUsed + 1;
+        m_current.timeouts = m_timings.Timeouts(m_host,
+                                                m_options.connectTimeoutMs,
+                                                m_options.handshakeTimeoutMs);
+        m_connectStep = ConnectStep::Failed;
+        m_timedOut = false;
+        m_counting = m_perf && m_perf->Begin(m_perfStart);
+
+        FLIGHT("{}:{}: probe {} {} (attempt {})", m_host, m_port,
+               probe.methodName, probe.cipher.Name(), m_current.attempts);
+
+        m_started = ProbeClock::now();
+    }
+
+    // Finish the current attempt at a probe.  Returns false if it should
+    // be retried after m_retryAfter.
+    bool endProbe()
+    {
+        const CipherProbe& probe = *m_current.probe;
+        auto now = ProbeClock::now();
+        m_current.elapsed = now - m_started;
+
+        FLIGHT("{}:{}: probe {} {}: {} (errno {})", m_host, m_port,
+               probe.methodName, probe.cipher.Name(),
+               ProbeStatusName(m_current.status), m_current.error);
+
+        if( m_counting ) {
+            m_perf->End(m_perfStart, m_perf->ProtocolIndex(probe.methodName),
+                        static_cast<size_t>(m_current.status));
+        }
+        if( m_tracer ) {
+            m_tracer->Record(probe.methodName, "probe", m_traceId, m_started, now,
+                             probe.cipher.Name(), ProbeStatusName(m_current.status));
+        }
+
+        if( m_stats ) {
+            m_stats->Add(ScanCounter::Probes);
+            if( ProbeStatus::Timeout == m_current.status ) {
+                m_stats->Add(ScanCounter::Timeouts);
+            } else if( ECONNREFUSED == m_current.error ) {
+                m_stats->Add(ScanCounter::Refused);
+            } else if( IsLocalResourceError(m_current.error) ) {
+                m_stats->Add(ScanCounter::LocalErrors);
+            }
+        }
+
+        if( IsRetryable(m_current) && !stopping() &&
+            m_retries.Acquire(m_host, m_retriesUsed) )
+        {
+            // No point waiting past the time we'd stop anyway.
+            m_retryAfter = std::min(m_retries.Backoff(m_retriesUsed), m_stopBy - now);
+            m_retriesUsed++;
+            if( m_stats ) {
+                m_stats->Add(ScanCounter::Retries);
+            }
+            return false;
+        }
+
+        if( m_stats ) {
+            m_stats->AddOutcome(static_cast<size_t>(m_current.status));
+        }
+
+        m_results.push_back(m_current);
+        m_retriesUsed = 0;
+        return true;
+    }
+
+    // Give up on the current attempt at a probe, without a result, since
+    // the scan is stopping.
+    void abandonProbe()
+    {
+        const CipherProbe& probe = *m_current.probe;
+        auto now = ProbeClock::now();
+
+        FLIGHT("{}:{}: probe {} {}: abandoned", m_host, m_port,
+               probe.methodName, probe.cipher.Name());
+
+        if( m_tracer ) {
+            m_tracer->Record(probe.methodName, "probe", m_traceId, m_started, now,
+                             probe.cipher.Name(), "abandoned");
+        }
+        if( m_stats ) {
+            m_stats->Add(ScanCounter::Probes);
+        }
+    }
+
+    // Start connecting to the next address to try.
+    ConnectStep startConnect()
+    {
+        size_t index = (m_addrIndex + m_tried) % m_addresses.size();
+        const SocketAddress& addr = m_addresses[index];
+
+        m_phaseStarted = ProbeClock::now();
+        m_deadline = m_phaseStarted + std::chrono::milliseconds(m_current.timeouts.connectMs);
+
+        try {
+            Socket sock(addr, std::move(m_permit));
+
+            const SocketAddress* source = m_options.sources.Next(addr.ai_family());
+            if( source != nullptr ) {
+                sock.Bind(*source);
+            }
+
+            sock.SetNonBlocking(true);
+            if( queueConnect(sock, addr) ) {
+                m_sock = std::move(sock);
+                return ConnectStep::Queued;
+            }
+
+            bool connected = sock.StartConnect(addr);
+            m_sock = std::move(sock);
+
+            return connected ? connectedTo(index) : ConnectStep::Pending;
+        } catch( const SocketError& e ) {
+            return connectFailed(e.Code());
+        }
+    }
+
+    // Check on a pending connect, once its socket is writable or the
+    // deadline has passed.
+    ConnectStep finishConnect(short revents)
+    {
+        if( 0 == revents ) {
+            m_timedOut = true;
+            m_current.error = 0;
+            m_sock = Socket();
+            return ConnectStep::Failed;
+        }
+
+        try {
+            m_sock.FinishConnect();
+        } catch( const SocketError& e ) {
+            return connectFailed(e.Code());
+        }
+        return connectedTo((m_addrIndex + m_tried) % m_addresses.size());
+    }
+
+    // Queue the connect on our ring, if we have one with room, to give up
+    // at the phase's deadline - or the scan's, if that's sooner.
+    bool queueConnect(const Socket& sock, const SocketAddress& addr)
+    {
+#ifdef HAVE_IO_URING
+        if( nullptr == m_ring ) {
+            return false;
+        }
+
+        auto wait = std::min(m_deadline, m_stopBy) - m_phaseStarted;
+        long long waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                wait + std::chrono::microseconds(999)).count();
+        int timeoutMs = static_cast<int>(std::max(1LL, std::min<long long>(
+                waitMs, m_current.timeouts.connectMs)));
+
+        return m_ring->ConnectWithin(sock.GetFd(), addr, timeoutMs, m_ringTag);
+#else
+        (void)sock;
+        (void)addr;
+        return false;
+#endif
+    }
+
+    // As finishConnect(), with the result of a connect through the ring.
+    ConnectStep finishRingConnect()
+    {
+        // Older kernels hand a non-blocking connect back rather than
+        // waiting for it, so then we wait ourselves.
+        if( -EINPROGRESS == m_ringResult || -EALREADY == m_ringResult ) {
+            return ConnectStep::Pending;
+        }
+
+        // The linked timeout cancelled it.
+        if( -ECANCELED == m_ringResult ) {
+            return finishConnect(0);
+        }
+
+        if( m_ringResult < 0 ) {
+            return connectFailed(-m_ringResult);
+        }
+        return connectedTo((m_addrIndex + m_tried) % m_addresses.size());
+    }
+
+    ConnectStep connectFailed(int error)
+    {
+        m_timedOut = false;
+        m_current.error = error;
+        m_sock = Socket();
+        return ConnectStep::Failed;
+    }
+
+    // Every address has failed.
+    void connectGaveUp()
+    {
+        if( m_timedOut ) {
+            FLIGHT("connect timed out after {} ms", m_current.timeouts.connectMs);
+            m_current.status = ProbeStatus::Timeout;
+        } else {
+            FLIGHT("connect failed (errno {})", m_current.error);
+            m_current.status = ProbeStatus::ConnectFailed;
+        }
+    }
+
+    // Record a successful connect.  Later probes try this address first.
+    ConnectStep connectedTo(size_t index)
+    {
+        m_addrIndex = index;
+
+        auto now = ProbeClock::now();
+        auto connectTime = now - m_phaseStarted;
+        FLIGHT("connected to {} (fd {}) in {} us", Address(), m_sock.GetFd(),
+               std::chrono::duration_cast<std::chrono::microseconds>(connectTime).count());
+
+        m_timings.AddSample(m_host, connectTime);
+        if( m_latencies ) {
+            m_latencies->Record(ScanPhase::Connect, connectTime);
+        }
+        if( m_tracer ) {
+            m_tracer->Record("connect", "phase", m_traceId, m_phaseStarted, now);
+        }
+        return ConnectStep::Connected;
+    }
+
+    // Set up the SSL connection over a connected socket.  Returns false
+    // (with the probe's outcome set) if that fails.
+    bool startHandshake()
+    {
+        const CipherProbe& probe = *m_current.probe;
+
+        try {
+            ssl::SSLContext* ctx = nullptr;
+            if( m_contexts ) {
+                ctx = m_contexts->Get(&probe - m_probes.data(), probe.method,
+                                      probe.cipher.Name());
+            } else {
+                m_ownContext.reset(new ssl::SSLContext(probe.method));
+                if( m_ownContext->SetCipherList(probe.cipher.Name()) ) {
+                    ctx = m_ownContext.get();
+                }
+            }
+            if( !ctx ) {
+                ERR_clear_error();
+                m_current.status = ProbeStatus::Error;
+                return false;
+            }
+
+            m_ssl.reset(new ssl::SSL(*ctx));
+            m_ssl->SetFd(m_sock.GetFd());
+            if( FlightRecorder::Current() ) {
+                m_ssl->SetInfoCallback(&TargetScan::recordAlerts);
+            }
+            if( m_sendHostName ) {
+                m_ssl->SetHostName(m_host);
+            }
+        } catch( const ssl::SSLError& ) {
+            m_current.status = ProbeStatus::Error;
+            return false;
+        } catch( const SocketError& e ) {
+            m_current.error = e.Code();
+            m_current.status = ProbeStatus::Error;
+            return false;
+        }
+
+        m_phaseStarted = ProbeClock::now();
+        m_deadline = m_phaseStarted + std::chrono::milliseconds(m_current.timeouts.handshakeMs);
+        ERR_clear_error();
+        return true;
+    }
+
+    // Take the handshake as far as it will go without waiting.  Returns
+    // true if it has to wait for the socket, or false once it's over, with
+    // the probe's outcome set.
+    bool handshakeWaits()
+    {
+        int ret = m_ssl->Connect();
+        int savedErrno = errno;
+        if( 1 == ret ) {
+            m_current.status = ProbeStatus::Accepted;
+            return false;
+        }
+
+        int err = m_ssl->GetError(ret);
+        if( SSL_ERROR_WANT_READ == err || SSL_ERROR_WANT_WRITE == err ) {
+            m_want = err;
+            return true;
+        }
+        ERR_clear_error();
+
+        if( SSL_ERROR_SYSCALL == err ) {
+            // A zero return means the server just hung up on us, which is
+            // a common way of refusing a cipher.
+            if( 0 == ret ) {
+                m_current.status = ProbeStatus::Rejected;
+            } else {
+                m_current.error = savedErrno;
+                m_current.status = ECONNRESET == savedErrno ? ProbeStatus::Reset
+                                                            : ProbeStatus::Error;
+            }
+        } else {
+            // An alert, or some other protocol failure.
+            m_current.status = ProbeStatus::Rejected;
+        }
+        return false;
+    }
+
+    void endHandshake()
+    {
+        auto now = ProbeClock::now();
+        const char* status = ProbeStatusName(m_current.status);
+
+        // A timeout would only tell us what the deadline was.
+        if( m_latencies && ProbeStatus::Timeout != m_current.status ) {
+            m_latencies->Record(ScanPhase::Handshake, now - m_phaseStarted);
+        }
+        FLIGHT("handshake {}", status);
+        if( m_tracer ) {
+            m_tracer->Record("handshake", "phase", m_traceId, m_phaseStarted, now,
+                             nullptr, status);
+        }
+    }
+
+    // Send a (very) simple request over the established connection, to
+    // verify that the connection is actually working.  This has until the
+    // handshake's deadline.
+    void startVerify()
+    {
+        m_request = "GET / HTTP/1.1\r\n"
+                    "User-Agent: SSLScan\r\n"
+                    "Host: " + m_host + "\r\n\r\n";
+        m_written = 0;
+        m_phaseStarted = ProbeClock::now();
+    }
+
+    // As handshakeWaits(), for the request and the start of its response.
+    // Once it's over, m_verified says whether we got a response.
+    bool verifyWaits()
+    {
+        while( m_written < m_request.length() ) {
+            int ret = m_ssl->Write(m_request.data() + m_written,
+                                   static_cast<int>(m_request.length() - m_written));
+            if( ret <= 0 ) {
+                return sslWaits(ret);
+            }
+            m_written += ret;
+        }
+
+        char buff[512];
+        int ret = m_ssl->Read(buff, sizeof(buff));
+        if( ret > 0 ) {
+            m_verified = true;
+            return false;
+        }
+        return sslWaits(ret);
+    }
+
+    void endVerify()
+    {
+        auto now = ProbeClock::now();
+        if( m_latencies ) {
+            m_latencies->Record(ScanPhase::Verify, now - m_phaseStarted);
+        }
+        if( m_tracer ) {
+            m_tracer->Record("verify", "phase", m_traceId, m_phaseStarted, now);
+        }
+    }
+
+    // After an OpenSSL call didn't succeed: returns true if it just has to
+    // wait for the socket, or false if it has failed.
+    bool sslWaits(int ret)
+    {
+        int err = m_ssl->GetError(ret);
+        if( SSL_ERROR_WANT_READ == err || SSL_ERROR_WANT_WRITE == err ) {
+            m_want = err;
+            return true;
+        }
+        ERR_clear_error();
+        return false;
+    }
+
+    void closeConnection()
+    {
+        FLIGHT("closing fd {}{}", m_sock.GetFd(),
+               m_options.abortiveClose ? " with a reset" : "");
+        m_ssl.reset();
+        m_ownContext.reset();
+
+        if( m_options.abortiveClose ) {
+            try {
+                m_sock.SetAbortiveClose();
+            } catch( const SocketError& ) {
+                // Not fatal - we just fall back to a normal close.
+            }
+        }
+        m_sock = Socket();
+    }
+
+    // What the last OpenSSL call is waiting for, as poll() events.
+    short sslEvents() const
+    {
+        return SSL_ERROR_WANT_READ == m_want ? POLLIN : POLLOUT;
+    }
+
+    // Get a permit for the next socket from the descriptor budget, if
+    // there is one.  Returns whether we have one, or don't need one.
+    bool acquireFd()
+    {
+        if( nullptr == m_options.fds || m_permit ) {
+            return true;
+        }
+        m_permit = m_options.fds->TryAcquire();
+        return static_cast<bool>(m_permit);
+    }
+
+    // Suspend until we're handed a descriptor (see AwaitFd()).
+    bool waitForFd(ScanWait& wait)
+    {
+        m_waitingForFd = true;
+        wait.fd = -1;
+        wait.events = 0;
+        wait.deadline = ProbeClock::time_point::max();
+        return false;
+    }
+
+    // Suspend until the connect we queued on the ring completes (see
+    // WaitingForRing()).
+    bool waitForRing(ScanWait& wait)
+    {
+        m_waitingForRing = true;
+        wait.fd = -1;
+        wait.events = 0;
+        wait.deadline = ProbeClock::time_point::max();
+        return false;
+    }
+
+    // Suspend until the socket has one of the given events, or the current
+    // phase's deadline passes - or the scan's, if that's sooner.
+    bool waitFor(short events, ScanWait& wait) const
+    {
+        wait.fd = m_sock.GetFd();
+        wait.events = events;
+        wait.deadline = std::min(m_deadline, m_stopBy);
+        return false;
+    }
+
+    // Records the alerts that OpenSSL sends and receives.
+    static void recordAlerts(const ::SSL*, int where, int ret)
+    {
+        if( where & SSL_CB_ALERT ) {
+            FLIGHT("alert {}: {} {}", (where & SSL_CB_READ) ? "received" : "sent",
+                   SSL_alert_type_string_long(ret), SSL_alert_desc_string_long(ret));
+        }
+    }
+};
+
+#endif
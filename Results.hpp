@@ -0,0 +1,256 @@
+#ifndef RESULTS_HPP
+#define RESULTS_HPP
+
+#include "Histogram.hpp"
+#include "PerfCounters.hpp"
+#include "Probe.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+
+// Writes scan results as JSON, one object per line.  Safe to call from
+// any number of threads.
+//
+// When the scan is split into shards, each shard's targets are collected
+// in a buffer of the shard's own and written out in batches, so that the
+// shards only contend for the file once a batch.  Flush() writes out
+// whatever is buffered.
+class ResultWriter {
+public:
+    enum { BATCH_BYTES = 64 * 1024 };
+
+private:
+    // Padded, so neighbouring shards' locks don't share a cache line.
+    struct Buffer {
+        std::mutex      mutex;
+        std::string     lines;
+        char            padding[64];
+    };
+
+    std::ofstream               m_out;
+    std::mutex                  m_mutex;
+    size_t                      m_shards;
+    std::unique_ptr<Buffer[]>   m_buffers;
+
+public:
+    explicit ResultWriter(const std::string& path, size_t shards = 1)
+        : m_out(path.c_str(), std::ios_base::out | std::ios_base::trunc)
+        , m_shards(shards)
+    {
+        if( m_shards > 1 ) {
+            m_buffers.reset(new Buffer[m_shards]);
+        }
+    }
+
+    ~ResultWriter()
+    {
+        Flush();
+    }
+
+    // Delete copy constructor and assignment.
+    ResultWriter(ResultWriter const&) = delete;
+    ResultWriter& operator=(ResultWriter const&) = delete;
+
+    bool IsOpen() const
+    {
+        return m_out.is_open();
+    }
+
+    // 'shard' is the shard the target was scanned on.  A target that was
+    // cut short gets a "stopped" field, saying why.
+    void Write(const TargetScan& scan, size_t shard = 0)
+    {
+        std::string line;
+        line.reserve(256 + 160 * scan.Results().size());
+
+        line += "{\"type\":\"target\",\"host\":";
+        AppendString(line, scan.Host());
+        line += ",\"port\":" + std::to_string(scan.Port());
+        line += ",\"address\":";
+        AppendString(line, scan.Address());
+        line += ",\"verified\":";
+        line += scan.Verified() ? "true" : "false";
+        if( ScanStop::None != scan.Stopped() ) {
+            line += ",\"stopped\":";
+            AppendString(line, ScanStopName(scan.Stopped()));
+        }
+        line += ",\"probes\":[";
+
+        bool first = true;
+        for( auto& result : scan.Results() ) {
+            if( !first ) {
+                line += ",";
+            }
+            first = false;
+
+            line += "{\"protocol\":";
+            AppendString(line, result.probe->methodName);
+            line += ",\"cipher\":";
+            AppendString(line, result.probe->cipher.Name());
+            line += ",\"bits\":" + std::to_string(result.probe->cipher.Bits());
+            line += ",\"status\":";
+            AppendString(line, ProbeStatusName(result.status));
+            line += ",\"error\":" + std::to_string(result.error);
+            line += ",\"attempts\":" + std::to_string(result.attempts);
+            line += ",\"connect_timeout_ms\":" + std::to_string(result.timeouts.connectMs);
+            line += ",\"handshake_timeout_ms\":" + std::to_string(result.timeouts.handshakeMs);
+            line += ",\"elapsed_us\":" + std::to_string(
+                    std::chrono::duration_cast<std::chrono::microseconds>(result.elapsed).count());
+            line += "}";
+        }
+
+        line += "]}\n";
+
+        if( !m_buffers ) {
+            WriteLine(line);
+            return;
+        }
+
+        Buffer& buffer = m_buffers[shard % m_shards];
+        std::string batch;
+        {
+            std::unique_lock<std::mutex> lock(buffer.mutex);
+            buffer.lines += line;
+            if( buffer.lines.size() < BATCH_BYTES ) {
+                return;
+            }
+            batch.swap(buffer.lines);
+        }
+        WriteLine(batch);
+    }
+
+    // Write the latency percentiles for each phase, in microseconds.
+    void WriteLatencies(const LatencyRecorder& recorder)
+    {
+        std::string line = "{\"type\":\"latency\",\"unit\":\"us\",\"phases\":{";
+
+        const std::pair<const char*, double> percentiles[] = {
+            { "p50", 0.50 }, { "p90", 0.90 }, { "p99", 0.99 }, { "p999", 0.999 },
+        };
+
+        for( int p = 0; p < NUM_SCAN_PHASES; p++ ) {
+            ScanPhase phase = static_cast<ScanPhase>(p);
+            LatencyHistogram histogram = recorder.Snapshot(phase);
+
+            if( p > 0 ) {
+                line += ",";
+            }
+            AppendString(line, ScanPhaseName(phase));
+            line += ":{\"count\":" + std::to_string(histogram.Count());
+            line += ",\"mean\":" + std::to_string(static_cast<uint64_t>(histogram.Mean() / 1000));
+            for( auto& it : percentiles ) {
+                line += ",\"";
+                line += it.first;
+                line += "\":" + std::to_string(histogram.Percentile(it.second) / 1000);
+            }
+            line += ",\"max\":" + std::to_string(histogram.Max() / 1000);
+            line += "}";
+        }
+
+        line += "}}\n";
+        WriteLine(line);
+    }
+
+    // Write the CPU cost of the probes, by protocol and outcome, as totals
+    // for each counter that we had.
+    void WritePerf(const PerfProfiler& profiler)
+    {
+        std::string line = "{\"type\":\"perf\",\"counters\":[";
+
+        bool first = true;
+        for( int c = 0; c < NUM_PERF_COUNTERS; c++ ) {
+            if( profiler.Has(static_cast<PerfCounter>(c)) ) {
+                line += first ? "" : ",";
+                AppendString(line, PerfCounterName(static_cast<PerfCounter>(c)));
+                first = false;
+            }
+        }
+
+        line += "],\"probes\":[";
+        first = true;
+        for( size_t p = 0; p < profiler.Protocols().size(); p++ ) {
+            for( size_t o = 0; o < profiler.Outcomes().size(); o++ ) {
+                PerfProfiler::Totals totals = profiler.Get(p, o);
+                if( 0 == totals.probes ) {
+                    continue;
+                }
+
+                line += first ? "{" : ",{";
+                line += "\"protocol\":";
+                AppendString(line, profiler.Protocols()[p]);
+                line += ",\"outcome\":";
+                AppendString(line, profiler.Outcomes()[o]);
+                line += ",\"count\":" + std::to_string(totals.probes);
+                for( int c = 0; c < NUM_PERF_COUNTERS; c++ ) {
+                    if( profiler.Has(static_cast<PerfCounter>(c)) ) {
+                        line += ",";
+                        AppendString(line, PerfCounterName(static_cast<PerfCounter>(c)));
+                        line += ":" + std::to_string(totals.values[c]);
+                    }
+                }
+                line += "}";
+                first = false;
+            }
+        }
+
+        line += "]}\n";
+        WriteLine(line);
+    }
+
+    // Write a pre-formatted line, which must include the trailing newline.
+    void WriteLine(const std::string& line)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_out.write(line.data(), line.length());
+    }
+
+    void Flush()
+    {
+        for( size_t i = 0; m_buffers && i < m_shards; i++ ) {
+            std::string batch;
+            {
+                std::unique_lock<std::mutex> lock(m_buffers[i].mutex);
+                batch.swap(m_buffers[i].lines);
+            }
+            if( !batch.empty() ) {
+                WriteLine(batch);
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_out.flush();
+    }
+
+    // Append a string as a quoted, escaped JSON string.
+    static void AppendString(std::string& out, const std::string& str)
+    {
+        out += '"';
+        for( char ch : str ) {
+            switch( ch ) {
+                case '"':   out += "\\\""; break;
+                case '\\':  out += "\\\\"; break;
+                case '\n':  out += "\\n"; break;
+                case '\r':  out += "\\r"; break;
+                case '\t':  out += "\\t"; break;
+                default:
+                    if( static_cast<unsigned char>(ch) < 0x20 ) {
+                        char buff[8];
+                        snprintf(buff, sizeof(buff), "\\u%04x", ch);
+                        out += buff;
+                    } else {
+                        out += ch;
+                    }
+                    break;
+            }
+        }
+        out += '"';
+    }
+};
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef RETRYPOLICY_HPP
+#define RETRYPOLICY_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+
+
+// Decides whether a failed probe may be retried, and how long to wait
+// first.  Retries are limited three ways: attempts per probe, a budget for
+// each host, and a budget for the whole scan, so that a flaky network
+// can't turn into an unbounded amount of extra work.
+//
+// Delays grow exponentially with each attempt, and are jittered ("equal
+// jitter": half fixed, half random) so that probes that failed together
+// don't all retry together.
+class RetryPolicy {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    enum { NUM_SHARDS = 16 };
+
+    struct Shard {
+        std::mutex                              mutex;
+        std::unordered_map<std::string, int>    used;
+    };
+
+    int                         m_maxRetries;
+    int                         m_hostBudget;
+    bool                        m_scanUnlimited;
+    std::atomic<long>           m_scanBudget;
+    std::chrono::milliseconds   m_baseDelay;
+    std::chrono::milliseconds   m_maxDelay;
+
+    Shard                       m_shards[NUM_SHARDS];
+
+    Shard& shardFor(const std::string& host)
+    {
+        return m_shards[std::hash<std::string>()(host) % NUM_SHARDS];
+    }
+
+public:
+    // A negative scan budget means "unlimited".
+    RetryPolicy(int maxRetries,
+                int hostBudget,
+                long scanBudget,
+                std::chrono::milliseconds baseDelay = std::chrono::milliseconds(250),
+                std::chrono::milliseconds maxDelay = std::chrono::milliseconds(5000))
+        : m_maxRetries(maxRetries)
+        , m_hostBudget(hostBudget)
+        , m_scanUnlimited(scanBudget < 0)
+        , m_scanBudget(scanBudget)
+        , m_baseDelay(baseDelay)
+        , m_maxDelay(maxDelay)
+    { }
+
+    // Delete copy constructor and assignment.
+    RetryPolicy(RetryPolicy const&) = delete;
+    RetryPolicy& operator=(RetryPolicy const&) = delete;
+
+    // Try to take a retry from the budgets, for a probe that has already
+    // been retried 'retries' times.  Returns false if it may not be
+    // retried again.
+    bool Acquire(const std::string& host, int retries)
+    {
+        if( retries >= m_maxRetries ) {
+            return false;
+        }
+
+        if( !m_scanUnlimited &&
+            m_scanBudget.fetch_sub(1, std::memory_order_relaxed) <= 0 )
+        {
+            m_scanBudget.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        Shard& shard = shardFor(host);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+
+        int& used = shard.used[host];
+        if( used >= m_hostBudget ) {
+            lock.unlock();
+
+            // Give back what we took from the scan budget.
+            if( !m_scanUnlimited ) {
+                m_scanBudget.fetch_add(1, std::memory_order_relaxed);
+            }
+            return false;
+        }
+
+        used++;
+        return true;
+    }
+
+    // How long to wait before retrying a probe that has already been
+    // retried 'retries' times.
+    Clock::duration Backoff(int retries) const
+    {
+        long long cap = m_baseDelay.count() << std::min(retries, 20);
+        cap = std::min<long long>(cap, m_maxDelay.count());
+
+        static thread_local std::minstd_rand rng(std::random_device{}());
+        std::uniform_int_distribution<long long> jitter(0, cap / 2);
+
+        return std::chrono::milliseconds(cap - cap / 2 + jitter(rng));
+    }
+};
+
+#endif
@@ -0,0 +1,57 @@
+#include <gtest/gtest.h>
+
+#include "RetryPolicy.hpp"
+
+
+using std::chrono::milliseconds;
+
+TEST(RetryPolicyTest, MaxRetries) {
+    RetryPolicy policy(2, 100, -1);
+
+    EXPECT_TRUE(policy.Acquire("example.com", 0));
+    EXPECT_TRUE(policy.Acquire("example.com", 1));
+    EXPECT_FALSE(policy.Acquire("example.com", 2));
+}
+
+TEST(RetryPolicyTest, HostBudget) {
+    RetryPolicy policy(10, 3, -1);
+
+    EXPECT_TRUE(policy.Acquire("example.com", 0));
+    EXPECT_TRUE(policy.Acquire("example.com", 0));
+    EXPECT_TRUE(policy.Acquire("example.com", 0));
+    EXPECT_FALSE(policy.Acquire("example.com", 0));
+
+    // Other hosts have their own budget.
+    EXPECT_TRUE(policy.Acquire("example.org", 0));
+}
+
+TEST(RetryPolicyTest, ScanBudget) {
+    RetryPolicy policy(10, 1, 2);
+
+    EXPECT_TRUE(policy.Acquire("one", 0));
+
+    // Refused by the host budget - this shouldn't use up the scan budget.
+    EXPECT_FALSE(policy.Acquire("one", 0));
+
+    EXPECT_TRUE(policy.Acquire("two", 0));
+    EXPECT_FALSE(policy.Acquire("three", 0));
+}
+
+TEST(RetryPolicyTest, Backoff) {
+    RetryPolicy policy(10, 10, -1, milliseconds(100), milliseconds(1000));
+
+    for( int i = 0; i < 100; i++ ) {
+        auto first = std::chrono::duration_cast<milliseconds>(policy.Backoff(0)).count();
+        EXPECT_GE(first, 50);
+        EXPECT_LE(first, 100);
+
+        auto third = std::chrono::duration_cast<milliseconds>(policy.Backoff(2)).count();
+        EXPECT_GE(third, 200);
+        EXPECT_LE(third, 400);
+
+        // Capped at the maximum delay.
+        auto late = std::chrono::duration_cast<milliseconds>(policy.Backoff(30)).count();
+        EXPECT_GE(late, 500);
+        EXPECT_LE(late, 1000);
+    }
+}
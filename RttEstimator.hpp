@@ -0,0 +1,162 @@
+#ifndef RTTESTIMATOR_HPP
+#define RTTESTIMATOR_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+
+// Smoothed round-trip time estimate for a single host, computed the same
+// way as TCP's retransmission timer (RFC 6298).
+class RttEstimator {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    // Both in microseconds.
+    double  m_srtt;
+    double  m_rttvar;
+    bool    m_haveSample;
+
+public:
+    RttEstimator()
+        : m_srtt(0), m_rttvar(0), m_haveSample(false)
+    { }
+
+    void AddSample(Clock::duration rtt)
+    {
+        double r = static_cast<double>(
+                std::chrono::duration_cast<std::chrono::microseconds>(rtt).count());
+
+        if( !m_haveSample ) {
+            m_srtt = r;
+            m_rttvar = r / 2;
+            m_haveSample = true;
+        } else {
+            m_rttvar = 0.75 * m_rttvar + 0.25 * std::fabs(m_srtt - r);
+            m_srtt = 0.875 * m_srtt + 0.125 * r;
+        }
+    }
+
+    bool HaveSample() const
+    {
+        return m_haveSample;
+    }
+
+    // SRTT + 4 * RTTVAR, with a floor of one millisecond for the variance
+    // term (our clock granularity).
+    std::chrono::microseconds Timeout() const
+    {
+        double variance = std::max(1000.0, 4 * m_rttvar);
+        return std::chrono::microseconds(static_cast<long long>(m_srtt + variance));
+    }
+
+    std::chrono::microseconds Smoothed() const
+    {
+        return std::chrono::microseconds(static_cast<long long>(m_srtt));
+    }
+};
+
+
+// The deadlines to use for one probe, in milliseconds.
+struct ProbeTimeouts {
+    int connectMs;
+    int handshakeMs;
+};
+
+
+// RTT estimates for every host in a scan.  The table is split into shards,
+// each with its own lock, so that threads working on different hosts
+// rarely contend.
+//
+// Until a host has been reached once, probes use the default (configured)
+// timeouts.  After that, the connect deadline is twice the estimator's
+// timeout, and the handshake deadline allows for the two round trips of a
+// full handshake plus time for the server's crypto.  Both are clamped
+// between a small floor and the given maximum.
+class HostTimings {
+private:
+    enum {
+        NUM_SHARDS          = 16,
+        MIN_CONNECT_MS      = 100,
+        MIN_HANDSHAKE_MS    = 250,
+        SERVER_SLACK_MS     = 250,
+    };
+
+    struct Shard {
+        std::mutex                                      mutex;
+        std::unordered_map<std::string, RttEstimator>   hosts;
+    };
+
+    Shard   m_shards[NUM_SHARDS];
+    int     m_maxTimeoutMs;
+    bool    m_enabled;
+
+    Shard& shardFor(const std::string& host)
+    {
+        return m_shards[std::hash<std::string>()(host) % NUM_SHARDS];
+    }
+
+    int clamp(long long ms, int minimum) const
+    {
+        return static_cast<int>(std::max<long long>(minimum,
+                                std::min<long long>(ms, m_maxTimeoutMs)));
+    }
+
+public:
+    explicit HostTimings(int maxTimeoutMs, bool enabled = true)
+        : m_maxTimeoutMs(maxTimeoutMs), m_enabled(enabled)
+    { }
+
+    // Delete copy constructor and assignment.
+    HostTimings(HostTimings const&) = delete;
+    HostTimings& operator=(HostTimings const&) = delete;
+
+    // Record how long a successful connect to the host took.
+    void AddSample(const std::string& host, RttEstimator::Clock::duration rtt)
+    {
+        if( !m_enabled ) {
+            return;
+        }
+
+        Shard& shard = shardFor(host);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        shard.hosts[host].AddSample(rtt);
+    }
+
+    // Get the timeouts to use for the next probe to the host.
+    ProbeTimeouts Timeouts(const std::string& host,
+                           int defaultConnectMs,
+                           int defaultHandshakeMs)
+    {
+        ProbeTimeouts ret = { defaultConnectMs, defaultHandshakeMs };
+        if( !m_enabled ) {
+            return ret;
+        }
+
+        RttEstimator estimator;
+        {
+            Shard& shard = shardFor(host);
+            std::unique_lock<std::mutex> lock(shard.mutex);
+
+            auto it = shard.hosts.find(host);
+            if( it == shard.hosts.end() ) {
+                return ret;
+            }
+            estimator = it->second;
+        }
+
+        long long rto = std::chrono::duration_cast<std::chrono::milliseconds>(
+                estimator.Timeout()).count();
+
+        ret.connectMs = clamp(2 * rto, MIN_CONNECT_MS);
+        ret.handshakeMs = clamp(4 * rto + SERVER_SLACK_MS, MIN_HANDSHAKE_MS);
+        return ret;
+    }
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+
+#include "RttEstimator.hpp"
+
+
+using std::chrono::milliseconds;
+
+TEST(RttEstimatorTest, FirstSample) {
+    RttEstimator one;
+    EXPECT_FALSE(one.HaveSample());
+
+    // SRTT = R, RTTVAR = R/2, so the timeout is R + 4 * R/2.
+    one.AddSample(milliseconds(100));
+    EXPECT_TRUE(one.HaveSample());
+    EXPECT_EQ(100000, one.Smoothed().count());
+    EXPECT_EQ(300000, one.Timeout().count());
+}
+
+TEST(RttEstimatorTest, Smoothing) {
+    RttEstimator one;
+    for( int i = 0; i < 50; i++ ) {
+        one.AddSample(milliseconds(20));
+    }
+
+    // A steady RTT converges, with the variance term at its floor.
+    EXPECT_NEAR(20000, one.Smoothed().count(), 10);
+    EXPECT_NEAR(21000, one.Timeout().count(), 100);
+
+    // A single outlier moves the estimate only partway.
+    one.AddSample(milliseconds(100));
+    EXPECT_GT(one.Smoothed().count(), 20000);
+    EXPECT_LT(one.Smoothed().count(), 40000);
+    EXPECT_GT(one.Timeout().count(), 100000);
+}
+
+TEST(HostTimingsTest, Timeouts) {
+    HostTimings timings(5000);
+
+    // No samples - use the defaults.
+    ProbeTimeouts one = timings.Timeouts("example.com", 3000, 6000);
+    EXPECT_EQ(3000, one.connectMs);
+    EXPECT_EQ(6000, one.handshakeMs);
+
+    // A 100ms RTT gives an RTO of 300ms.
+    timings.AddSample("example.com", milliseconds(100));
+    ProbeTimeouts two = timings.Timeouts("example.com", 3000, 6000);
+    EXPECT_EQ(600, two.connectMs);
+    EXPECT_EQ(1450, two.handshakeMs);
+
+    // Other hosts are unaffected.
+    ProbeTimeouts three = timings.Timeouts("example.org", 3000, 6000);
+    EXPECT_EQ(3000, three.connectMs);
+
+    // Very fast and very slow hosts are clamped.
+    timings.AddSample("fast", std::chrono::microseconds(10));
+    EXPECT_EQ(100, timings.Timeouts("fast", 3000, 6000).connectMs);
+    EXPECT_EQ(254, timings.Timeouts("fast", 3000, 6000).handshakeMs);
+
+    timings.AddSample("slow", milliseconds(2000));
+    EXPECT_EQ(5000, timings.Timeouts("slow", 3000, 6000).connectMs);
+    EXPECT_EQ(5000, timings.Timeouts("slow", 3000, 6000).handshakeMs);
+}
+
+TEST(HostTimingsTest, Disabled) {
+    HostTimings timings(5000, false);
+    timings.AddSample("example.com", milliseconds(100));
+
+    ProbeTimeouts one = timings.Timeouts("example.com", 3000, 6000);
+    EXPECT_EQ(3000, one.connectMs);
+    EXPECT_EQ(6000, one.handshakeMs);
+}
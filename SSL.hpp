@@ -1,6 +1,9 @@
 #ifndef SSL_H
 #define SSL_H
 
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
 #include <openssl/err.h>
@@ -95,6 +98,48 @@ namespace ssl {
     };
 
 
+    // Contexts for a fixed list of configurations - a method and a cipher
+    // list each - made the first time each one is asked for, and then
+    // shared by every connection that uses it, rather than built afresh
+    // for every connection.
+    class SSLContextCache {
+    private:
+        std::mutex                                  m_mutex;
+        std::vector<std::unique_ptr<SSLContext>>    m_contexts;
+        std::vector<bool>                           m_rejected;
+
+    public:
+        explicit SSLContextCache(size_t size)
+            : m_contexts(size), m_rejected(size, false)
+        { }
+
+        // Delete copy constructor and assignment.
+        SSLContextCache(SSLContextCache const&) = delete;
+        SSLContextCache& operator=(SSLContextCache const&) = delete;
+
+        // The context for configuration 'index', which must always be
+        // asked for with the same method and ciphers.  Returns null if
+        // OpenSSL rejects the cipher list.
+        SSLContext* Get(size_t index, const ::SSL_METHOD* method, const char* ciphers)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if( m_rejected.at(index) ) {
+                return nullptr;
+            }
+
+            if( !m_contexts[index] ) {
+                std::unique_ptr<SSLContext> ctx(new SSLContext(method));
+                if( !ctx->SetCipherList(ciphers) ) {
+                    m_rejected[index] = true;
+                    return nullptr;
+                }
+                m_contexts[index] = std::move(ctx);
+            }
+            return m_contexts[index].get();
+        }
+    };
+
+
     class SSLCipher {
     private:
         ::SSL_CIPHER* m_cipher;
@@ -157,6 +202,46 @@ namespace ssl {
             return ret;
         }
 
+        // Connection setup.
+        // --------------------------------------------------
+        bool SetFd(int fd) {
+            return ::SSL_set_fd(m_ssl, fd) == 1;
+        }
+
+        // Set the server name to send (SNI).
+        bool SetHostName(const std::string& name) {
+            return SSL_set_tlsext_host_name(m_ssl, name.c_str()) == 1;
+        }
+
+        // Have OpenSSL call 'callback' as the connection changes state,
+        // e.g. on sending or receiving an alert.
+        void SetInfoCallback(void (*callback)(const ::SSL*, int, int)) {
+            ::SSL_set_info_callback(m_ssl, callback);
+        }
+
+        // These map directly onto the OpenSSL functions, and are meant to
+        // be used on non-blocking sockets: on failure, pass the return
+        // value to GetError() to find out whether to wait and retry.
+        int Connect() {
+            return ::SSL_connect(m_ssl);
+        }
+
+        int Accept() {
+            return ::SSL_accept(m_ssl);
+        }
+
+        int Read(void* buff, int len) {
+            return ::SSL_read(m_ssl, buff, len);
+        }
+
+        int Write(const void* buff, int len) {
+            return ::SSL_write(m_ssl, buff, len);
+        }
+
+        int GetError(int ret) const {
+            return ::SSL_get_error(m_ssl, ret);
+        }
+
         operator ::SSL* () {
             return m_ssl;
         }
@@ -0,0 +1,427 @@
+#ifndef SCANREACTOR_HPP
+#define SCANREACTOR_HPP
+
+#include "Cancellation.hpp"
+#include "FramePool.hpp"
+#include "IoUring.hpp"
+#include "Probe.hpp"
+#include "Socket.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+// Runs any number of TargetScans on a single thread.  Each scan runs until
+// it has to wait - for its socket, or for a retry to be due - and is then
+// parked until epoll says its socket is ready, or its deadline passes.  One
+// waiting for a descriptor is parked until it's handed one.  A
+// parked scan holds no thread, just its frame (see FramePool) and its
+// socket, so a reactor can have as many in flight as there are
+// descriptors for.
+//
+// If asked to, and the kernel has io_uring, a reactor starts its scans'
+// connects through a ring of its own, which its epoll set watches for
+// completions, rather than waiting for each socket to be writable and
+// asking how the connect went.  Only connects use the ring; the rest of
+// each probe is OpenSSL's, on the socket itself.
+//
+// Once a scan is done, it's handed to the 'done' callback, on the
+// reactor's thread.  If given a start hook, the thread runs that first
+// (e.g. to pin itself to a CPU).  If given a cancellation token, every
+// parked scan is woken once it's cancelled, so that it can finish.
+class ScanReactor {
+public:
+    typedef std::function<void(std::shared_ptr<TargetScan> scan)> DoneCallback;
+
+private:
+    struct Parked;
+    typedef std::multimap<ProbeClock::time_point, Parked*> Timers;
+
+    // A scan we're running, and what it's waiting for.
+    struct Parked {
+        std::shared_ptr<TargetScan> scan;
+        int                         fd;         // Registered with epoll, or -1.
+        Timers::iterator            timer;
+    };
+
+    enum { MAX_EVENTS = 256, RING_ENTRIES = 512 };
+
+    DoneCallback                m_onDone;
+    const CancellationToken*    m_cancel;
+    int                         m_epoll;
+    int                         m_wakeup;       // An eventfd, for Add() and Finish().
+    std::unique_ptr<IoUring>    m_ring;         // For connects, if we have one.
+
+    // Scans added by other threads, but not started yet, and parked ones
+    // that have been handed a descriptor.
+    std::mutex                  m_mutex;
+    std::vector<std::shared_ptr<TargetScan>> m_incoming;
+    std::vector<Parked*>        m_woken;
+    bool                        m_finished;
+
+    // Only the reactor's thread touches these.
+    FramePool                   m_frames;
+    Timers                      m_timers;
+
+    std::atomic<size_t>         m_running;
+    std::thread                 m_thread;
+
+public:
+    explicit ScanReactor(DoneCallback onDone,
+                         std::function<void()> onStart = std::function<void()>(),
+                         const CancellationToken* cancel = nullptr,
+                         bool useIoUring = false)
+        : m_onDone(onDone)
+        , m_cancel(cancel)
+        , m_epoll(-1)
+        , m_wakeup(-1)
+        , m_finished(false)
+        , m_running(0)
+    {
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if( -1 == m_epoll ) {
+            throw SocketError();
+        }
+
+        m_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if( -1 == m_wakeup ) {
+            SocketError error;
+            close(m_epoll);
+            throw error;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        if( -1 == epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeup, &event) ) {
+            SocketError error;
+            close(m_wakeup);
+            close(m_epoll);
+            throw error;
+        }
+
+#ifdef HAVE_IO_URING
+        if( useIoUring && IoUring::Supported() ) {
+            try {
+                m_ring.reset(new IoUring(RING_ENTRIES));
+
+                // Our own address marks the ring's events.
+                event.events = EPOLLIN;
+                event.data.ptr = this;
+                if( -1 == epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_ring->Fd(), &event) ) {
+                    m_ring.reset();
+                }
+            } catch( const SocketError& ) {
+                // e.g. locked memory limits.
+            }
+        }
+#else
+        (void)useIoUring;
+#endif
+
+        m_thread = std::thread(&ScanReactor::run, this, onStart);
+    }
+
+    // Waits for every scan to finish.
+    ~ScanReactor()
+    {
+        Finish();
+        m_thread.join();
+        close(m_wakeup);
+        close(m_epoll);
+    }
+
+    // Delete copy constructor and assignment.
+    ScanReactor(ScanReactor const&) = delete;
+    ScanReactor& operator=(ScanReactor const&) = delete;
+
+    // Start running a scan.  Safe to call from any thread.
+    void Add(std::shared_ptr<TargetScan> scan)
+    {
+        m_running.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_incoming.push_back(std::move(scan));
+        }
+        wake();
+    }
+
+    // Signal that no more scans will be added.
+    void Finish()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_finished = true;
+        }
+        wake();
+    }
+
+    // How scans' connects are waited for.
+    const char* Backend() const
+    {
+        return m_ring ? "io_uring" : "epoll";
+    }
+
+    // Scans added, but not done yet.
+    size_t Running() const
+    {
+        return m_running.load(std::memory_order_relaxed);
+    }
+
+private:
+    void wake()
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(m_wakeup, &one, sizeof(one));
+        (void)ret;  // If it's already signalled, that's fine.
+    }
+
+    void run(std::function<void()> onStart)
+    {
+        if( onStart ) {
+            onStart();
+        }
+
+        std::vector<std::shared_ptr<TargetScan>> incoming;
+        std::vector<Parked*> woken;
+        std::vector<std::pair<Parked*, int32_t>> connected;
+        struct epoll_event events[MAX_EVENTS];
+        bool finished = false;
+
+        for(;;) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                incoming.swap(m_incoming);
+                woken.swap(m_woken);
+                finished = m_finished;
+            }
+            for( auto& scan : incoming ) {
+                Parked* parked = new (m_frames.Allocate(sizeof(Parked))) Parked();
+                parked->scan = std::move(scan);
+                parked->fd = -1;
+                parked->timer = m_timers.end();
+                if( m_ring ) {
+                    parked->scan->UseRing(m_ring.get(), reinterpret_cast<uintptr_t>(parked));
+                }
+                resume(parked, 0);
+            }
+            incoming.clear();
+
+            for( Parked* parked : woken ) {
+                resume(parked, 0);
+            }
+            woken.clear();
+
+            if( finished && 0 == Running() ) {
+                return;
+            }
+
+            int timeoutMs = -1;
+            if( !m_timers.empty() ) {
+                auto wait = m_timers.begin()->first - ProbeClock::now();
+                timeoutMs = static_cast<int>(std::max<long long>(0,
+                        std::chrono::duration_cast<std::chrono::milliseconds>(
+                                wait + std::chrono::microseconds(999)).count()));
+            }
+            if( m_cancel && !m_timers.empty() &&
+                (-1 == timeoutMs || timeoutMs > CancellationToken::CHECK_INTERVAL_MS) )
+            {
+                timeoutMs = CancellationToken::CHECK_INTERVAL_MS;
+            }
+
+#ifdef HAVE_IO_URING
+            // Start the connects the scans queued.
+            if( m_ring ) {
+                try {
+                    m_ring->Submit();
+                } catch( const SocketError& e ) {
+                    failAll(e.Code());
+                }
+            }
+#endif
+
+            int count = epoll_wait(m_epoll, events, MAX_EVENTS, timeoutMs);
+            if( -1 == count ) {
+                if( EINTR != errno ) {
+                    failAll(errno);
+                }
+                count = 0;
+            }
+
+            for( int i = 0; i < count; i++ ) {
+                Parked* parked = static_cast<Parked*>(events[i].data.ptr);
+                if( nullptr == parked ) {
+                    uint64_t value;
+                    ssize_t ret = read(m_wakeup, &value, sizeof(value));
+                    (void)ret;
+                    continue;
+                }
+                if( this == events[i].data.ptr ) {
+                    reap(connected);
+                    continue;
+                }
+
+                m_timers.erase(parked->timer);
+                parked->timer = m_timers.end();
+
+                // The epoll and poll() event bits are the same.
+                resume(parked, static_cast<short>(events[i].events));
+            }
+
+            // Once we're cancelled, every scan's wait is over.  (A cancelled
+            // scan finishes as soon as it's resumed, so this can't spin.)
+            auto now = ProbeClock::now();
+            if( m_cancel && m_cancel->Cancelled() ) {
+                now = ProbeClock::time_point::max();
+            }
+            while( !m_timers.empty() && m_timers.begin()->first <= now ) {
+                Parked* parked = m_timers.begin()->second;
+                m_timers.erase(m_timers.begin());
+                parked->timer = m_timers.end();
+
+                unregister(parked);
+                resume(parked, 0);
+            }
+        }
+    }
+
+    // Resume every scan whose connect through the ring has completed.
+    void reap(std::vector<std::pair<Parked*, int32_t>>& connected)
+    {
+#ifdef HAVE_IO_URING
+        // Resuming a scan may queue another connect, so collect them first.
+        m_ring->Reap([&connected](uint64_t userData, int32_t result) {
+            if( 0 == (userData & IoUring::TIMEOUT_BIT) ) {
+                connected.push_back(std::make_pair(reinterpret_cast<Parked*>(userData), result));
+            }
+        });
+
+        for( auto& it : connected ) {
+            it.first->scan->ConnectCompleted(it.second);
+            resume(it.first, POLLOUT);
+        }
+        connected.clear();
+#else
+        (void)connected;
+#endif
+    }
+
+    // We can't wait for anything, so every parked scan is done for.
+    void failAll(int error)
+    {
+        while( !m_timers.empty() ) {
+            Parked* parked = m_timers.begin()->second;
+            m_timers.erase(m_timers.begin());
+            parked->timer = m_timers.end();
+
+            unregister(parked);
+            parked->scan->Fail(error);
+            resume(parked, 0);
+        }
+    }
+
+    // Run a scan until it next has to wait, and park it - or, if it's
+    // done, hand it on.
+    void resume(Parked* parked, short revents)
+    {
+        ScanWait wait;
+        bool done = parked->scan->Resume(revents, wait);
+
+        // Closing a socket takes it out of the epoll set, and its number
+        // may since have gone to another scan's socket - so if the scan no
+        // longer has the one we registered, forget it rather than
+        // unregistering someone else's.
+        if( parked->fd != parked->scan->SocketFd() ) {
+            parked->fd = -1;
+        }
+
+        if( !done && -1 != wait.fd ) {
+            int error = watch(parked, wait.fd, wait.events);
+            if( 0 != error ) {
+                // We can't wait for it, so the scan can't go on.
+                parked->scan->Fail(error);
+                done = parked->scan->Resume(0, wait);
+            }
+        }
+
+        if( done ) {
+            unregister(parked);
+            std::shared_ptr<TargetScan> scan = std::move(parked->scan);
+            parked->~Parked();
+            m_frames.Deallocate(parked, sizeof(Parked));
+
+            m_onDone(std::move(scan));
+            m_running.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // A socket the scan still has, but isn't waiting on, mustn't wake it.
+        if( -1 == wait.fd ) {
+            unregister(parked);
+        }
+
+        // The ring wakes it once the connect completes.
+        if( parked->scan->WaitingForRing() ) {
+            return;
+        }
+
+        if( parked->scan->WaitingForFd() ) {
+            parked->scan->AwaitFd([this, parked]() {
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_woken.push_back(parked);
+                }
+                wake();
+            });
+            return;
+        }
+        parked->timer = m_timers.insert(std::make_pair(wait.deadline, parked));
+    }
+
+    // Wait for events on the scan's socket.  A scan uses a new socket for
+    // each probe, and the old one is gone from the epoll set as soon as
+    // it's closed, so we only modify the registration if it's the same
+    // socket as last time.  Returns zero, or the error if epoll won't
+    // take it.
+    int watch(Parked* parked, int fd, short events)
+    {
+        struct epoll_event event;
+        event.events = static_cast<uint32_t>(events) | EPOLLONESHOT;
+        event.data.ptr = parked;
+
+        int op = (fd == parked->fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if( 0 != epoll_ctl(m_epoll, op, fd, &event) ) {
+            // A new socket with the same number as the last.
+            op = (ENOENT == errno) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+            if( 0 != epoll_ctl(m_epoll, op, fd, &event) ) {
+                parked->fd = -1;
+                return errno;
+            }
+        }
+        parked->fd = fd;
+        return 0;
+    }
+
+    // Stop watching the scan's socket.  Only call this while the scan
+    // still has it open.
+    void unregister(Parked* parked)
+    {
+        if( -1 != parked->fd ) {
+            epoll_ctl(m_epoll, EPOLL_CTL_DEL, parked->fd, nullptr);
+            parked->fd = -1;
+        }
+    }
+};
+
+#endif
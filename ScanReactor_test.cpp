@@ -0,0 +1,221 @@
+#include <gtest/gtest.h>
+
+#include "Ciphers.hpp"
+#include "FramePool.hpp"
+#include "ScanReactor.hpp"
+#include "TestServer.hpp"
+
+#include <mutex>
+#include <signal.h>
+
+
+namespace {
+
+struct ScanFixture {
+    TestCertificate             cert;
+    TestServer                  server;
+    std::vector<CipherProbe>    probes;
+    ScanOptions                 options;
+    HostTimings                 timings;
+    RetryPolicy                 retries;
+
+    explicit ScanFixture(const TestServerConfig& config)
+        : server(config, cert)
+        , timings(2000, false)
+        , retries(0, 0, 0)
+    {
+        for( auto& cipher : getSupportedCiphers(::TLSv1_2_method()) ) {
+            CipherProbe probe = { ::TLSv1_2_method(), "TLSv1.2", cipher };
+            probes.push_back(probe);
+        }
+        options.connectTimeoutMs = 2000;
+        options.handshakeTimeoutMs = 2000;
+        options.adaptiveTimeouts = false;
+        options.abortiveClose = true;
+    }
+
+    std::shared_ptr<TargetScan> MakeScan(FramePool& frames)
+    {
+        std::vector<SocketAddress> addresses(1, server.Address());
+        return std::allocate_shared<TargetScan>(
+                FrameAllocator<TargetScan>(frames),
+                "127.0.0.1", server.Address().Port(), addresses,
+                probes, options, timings, retries);
+    }
+};
+
+std::vector<ProbeStatus> statuses(const TargetScan& scan)
+{
+    std::vector<ProbeStatus> result;
+    for( auto& probe : scan.Results() ) {
+        result.push_back(probe.status);
+    }
+    return result;
+}
+
+TestServerConfig modernServer()
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    TestServerConfig config;
+    config.method = ::TLSv1_2_server_method();
+    config.ciphers = "ECDHE-RSA-AES128-GCM-SHA256:AES128-SHA";
+    config.workers = 8;
+    return config;
+}
+
+}
+
+
+TEST(FramePoolTest, ReusesBlocks) {
+    FramePool pool(4);
+
+    std::vector<void*> blocks;
+    for( int i = 0; i < 4; i++ ) {
+        blocks.push_back(pool.Allocate(40));
+    }
+    EXPECT_EQ(4u, pool.Live());
+    EXPECT_EQ(4u, pool.Capacity());
+
+    pool.Deallocate(blocks[2], 40);
+    EXPECT_EQ(blocks[2], pool.Allocate(40));
+    EXPECT_EQ(4u, pool.Capacity());
+
+    // Bigger than the first block goes to the heap, not the pool.
+    void* big = pool.Allocate(4096);
+    EXPECT_EQ(4u, pool.Live());
+    pool.Deallocate(big, 4096);
+
+    for( void* block : blocks ) {
+        pool.Deallocate(block, 40);
+    }
+    EXPECT_EQ(0u, pool.Live());
+}
+
+TEST(ScanReactorTest, MatchesBlockingRun) {
+    ScanFixture fixture(modernServer());
+    FramePool frames;
+
+    std::shared_ptr<TargetScan> blocking = fixture.MakeScan(frames);
+    ProbeClock::duration retryAfter;
+    EXPECT_TRUE(blocking->Run(retryAfter));
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<TargetScan>> done;
+    {
+        ScanReactor reactor([&](std::shared_ptr<TargetScan> scan) {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.push_back(std::move(scan));
+        });
+        for( int i = 0; i < 8; i++ ) {
+            reactor.Add(fixture.MakeScan(frames));
+        }
+    }
+
+    ASSERT_EQ(8u, done.size());
+    for( auto& scan : done ) {
+        EXPECT_EQ(statuses(*blocking), statuses(*scan));
+    }
+
+    size_t accepted = 0;
+    for( auto status : statuses(*blocking) ) {
+        accepted += (ProbeStatus::Accepted == status);
+    }
+    EXPECT_EQ(2u, accepted);
+
+    // Every frame goes back to the pool.
+    done.clear();
+    blocking.reset();
+    EXPECT_EQ(0u, frames.Live());
+}
+
+TEST(ScanReactorTest, ConnectRefused) {
+    ScanFixture fixture(modernServer());
+
+    // Nothing listens on 127.0.0.2.
+    std::vector<SocketAddress> addresses = {
+        SocketAddress::ResolveHost("127.0.0.2", "", AF_INET).get().at(0)
+                .WithPort(fixture.server.Address().Port()) };
+    std::shared_ptr<TargetScan> scan = std::make_shared<TargetScan>(
+            "closed", addresses[0].Port(), addresses,
+            fixture.probes, fixture.options, fixture.timings, fixture.retries);
+
+    std::shared_ptr<TargetScan> result;
+    {
+        ScanReactor reactor([&](std::shared_ptr<TargetScan> done) {
+            result = std::move(done);
+        });
+        reactor.Add(scan);
+    }
+
+    ASSERT_TRUE(result);
+    ASSERT_FALSE(result->Results().empty());
+    EXPECT_NE(ProbeStatus::Accepted, result->Results()[0].status);
+}
+
+TEST(ScanReactorTest, FailedScanFinishes) {
+    ScanFixture fixture(modernServer());
+    FramePool frames;
+    std::shared_ptr<TargetScan> scan = fixture.MakeScan(frames);
+
+    // As the reactor does when epoll won't take a scan's socket.
+    ScanWait wait;
+    ASSERT_FALSE(scan->Resume(0, wait));
+    ASSERT_NE(-1, wait.fd);
+    EXPECT_EQ(wait.fd, scan->SocketFd());
+
+    scan->Fail(EBADF);
+    EXPECT_TRUE(scan->Resume(0, wait));
+    EXPECT_EQ(ScanStop::Failed, scan->Stopped());
+    EXPECT_TRUE(scan->Results().empty());
+}
+
+TEST(ScanReactorTest, ConnectsThroughIoUring) {
+    if( !IoUring::Supported() ) {
+        return;
+    }
+
+    ScanFixture fixture(modernServer());
+    FramePool frames;
+
+    std::shared_ptr<TargetScan> blocking = fixture.MakeScan(frames);
+    ProbeClock::duration retryAfter;
+    EXPECT_TRUE(blocking->Run(retryAfter));
+
+    // Nothing listens on 127.0.0.2.
+    std::vector<SocketAddress> closed = {
+        SocketAddress::ResolveHost("127.0.0.2", "", AF_INET).get().at(0)
+                .WithPort(fixture.server.Address().Port()) };
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<TargetScan>> done;
+    std::shared_ptr<TargetScan> refused;
+    {
+        ScanReactor reactor([&](std::shared_ptr<TargetScan> scan) {
+            std::unique_lock<std::mutex> lock(mutex);
+            if( "closed" == scan->Host() ) {
+                refused = std::move(scan);
+            } else {
+                done.push_back(std::move(scan));
+            }
+        }, std::function<void()>(), nullptr, true);
+        EXPECT_STREQ("io_uring", reactor.Backend());
+
+        for( int i = 0; i < 8; i++ ) {
+            reactor.Add(fixture.MakeScan(frames));
+        }
+        reactor.Add(std::make_shared<TargetScan>(
+                "closed", closed[0].Port(), closed,
+                fixture.probes, fixture.options, fixture.timings, fixture.retries));
+    }
+
+    ASSERT_EQ(8u, done.size());
+    for( auto& scan : done ) {
+        EXPECT_EQ(statuses(*blocking), statuses(*scan));
+    }
+
+    ASSERT_TRUE(refused);
+    ASSERT_FALSE(refused->Results().empty());
+    EXPECT_EQ(ProbeStatus::ConnectFailed, refused->Results()[0].status);
+    EXPECT_EQ(ECONNREFUSED, refused->Results()[0].error);
+}
@@ -0,0 +1,274 @@
+#ifndef SHARDEDLOGGER_HPP
+#define SHARDEDLOGGER_HPP
+
+#include "PerThread.hpp"
+#include "cpplog.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+
+// A cpplog logger for any number of threads, that passes every message on
+// to several other loggers (e.g. a summary on stderr, and everything to a
+// file) in the order they were logged.
+//
+// Each thread queues its messages in its own ring, which only it writes
+// to, so logging never waits on a lock that another thread holds.  A
+// merger thread collects from every ring every few milliseconds, orders
+// the messages by when they were logged, and sends each one on to every
+// sink whose level it meets.  A message that arrives more than the
+// reorder window after it was logged - e.g. because its thread was
+// descheduled part-way through - is still sent, just not in order.
+//
+// If a thread logs faster than the merger keeps up, and its ring fills,
+// further messages are dropped and counted rather than wait.
+//
+// Sinks are only ever called from the merger thread, so they don't need
+// to be thread-safe.  Like MultiplexLogger's, they shouldn't keep hold of
+// the messages they're given.
+class ShardedLogger : public cpplog::BaseLogger {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Messages each thread can have queued.
+    enum { RING_SIZE = 4096 };
+
+private:
+    struct Entry {
+        cpplog::LogData*    logData;
+        uint64_t            timeNs;
+    };
+
+    // A single-producer, single-consumer ring.
+    struct Ring {
+        Entry                   entries[RING_SIZE];
+        std::atomic<uint64_t>   head;       // Messages ever pushed.
+        std::atomic<uint64_t>   tail;       // ... and taken by the merger.
+        std::atomic<uint64_t>   dropped;
+
+        Ring() : head(0), tail(0), dropped(0) { }
+    };
+
+    struct Sink {
+        cpplog::BaseLogger*     logger;
+        cpplog::loglevel_t      minLevel;
+    };
+
+    // A message the merger has collected, but not sent yet.
+    struct Pending {
+        uint64_t            timeNs;
+        uint64_t            order;      // Ties go to the first collected.
+        cpplog::LogData*    logData;
+
+        bool operator>(const Pending& other) const
+        {
+            return timeNs != other.timeNs ? timeNs > other.timeNs
+                                          : order > other.order;
+        }
+    };
+
+    std::vector<Sink>       m_sinks;
+    Clock::time_point       m_started;
+    uint64_t                m_windowNs;
+    std::chrono::milliseconds m_interval;
+
+    PerThread<Ring>         m_rings;
+
+    // For the shared ring, when there are too many threads for one each.
+    std::mutex              m_sharedMutex;
+
+    // Only the merger touches these (or Flush(), under m_mergeMutex).
+    std::mutex              m_mergeMutex;
+    std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>> m_pending;
+    uint64_t                m_order;
+    uint64_t                m_lastSentNs;
+    std::atomic<uint64_t>   m_late;
+
+    bool                    m_stopping;
+    std::mutex              m_stopMutex;
+    std::condition_variable m_stopCond;
+    std::thread             m_thread;
+
+public:
+    // Hold messages back for up to 'window' to put them in order, and
+    // collect them every 'interval'.  Add the sinks with AddSink(), and
+    // then Start() before logging anything.
+    ShardedLogger(std::chrono::milliseconds window = std::chrono::milliseconds(20),
+                  std::chrono::milliseconds interval = std::chrono::milliseconds(5))
+        : m_started(Clock::now())
+        , m_windowNs(static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(window).count()))
+        , m_interval(interval)
+        , m_order(0)
+        , m_lastSentNs(0)
+        , m_late(0)
+        , m_stopping(false)
+    { }
+
+    virtual ~ShardedLogger()
+    {
+        Stop();
+    }
+
+    // Delete copy constructor and assignment.
+    ShardedLogger(ShardedLogger const&) = delete;
+    ShardedLogger& operator=(ShardedLogger const&) = delete;
+
+    // Send messages of at least 'minLevel' to 'logger'.  Only call this
+    // before Start().
+    void AddSink(cpplog::BaseLogger& logger, cpplog::loglevel_t minLevel = LL_TRACE)
+    {
+        Sink sink = { &logger, minLevel };
+        m_sinks.push_back(sink);
+    }
+
+    void Start()
+    {
+        if( !m_thread.joinable() ) {
+            m_thread = std::thread(&ShardedLogger::run, this);
+        }
+    }
+
+    // Send everything queued so far, and stop the merger.  Nothing should
+    // be logged after this.
+    void Stop()
+    {
+        if( m_thread.joinable() ) {
+            {
+                std::unique_lock<std::mutex> lock(m_stopMutex);
+                m_stopping = true;
+            }
+            m_stopCond.notify_one();
+            m_thread.join();
+        }
+        Flush();
+    }
+
+    virtual bool sendLogMessage(cpplog::LogData* logData)
+    {
+        Entry entry = { logData, nowNs() };
+
+        bool exclusive;
+        Ring& ring = m_rings.Local(exclusive);
+
+        std::unique_lock<std::mutex> lock(m_sharedMutex, std::defer_lock);
+        if( !exclusive ) {
+            lock.lock();
+        }
+
+        uint64_t head = ring.head.load(std::memory_order_relaxed);
+        if( head - ring.tail.load(std::memory_order_acquire) >= RING_SIZE ) {
+            IncrementOwned(ring.dropped, 1);
+            return true;
+        }
+
+        ring.entries[head % RING_SIZE] = entry;
+        ring.head.store(head + 1, std::memory_order_release);
+
+        // The merger frees it.
+        return false;
+    }
+
+    // Send everything queued so far, without waiting for the window.
+    void Flush()
+    {
+        std::unique_lock<std::mutex> lock(m_mergeMutex);
+        collect();
+        send(UINT64_MAX);
+    }
+
+    // Messages dropped because a thread's ring was full.
+    uint64_t Dropped() const
+    {
+        uint64_t dropped = 0;
+        m_rings.ForEach([&dropped](const Ring& ring) {
+            dropped += ring.dropped.load(std::memory_order_relaxed);
+        });
+        return dropped;
+    }
+
+    // Messages that were sent out of order, having arrived after a later
+    // one was already sent.
+    uint64_t Late() const
+    {
+        return m_late.load(std::memory_order_relaxed);
+    }
+
+private:
+    uint64_t nowNs() const
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now() - m_started).count());
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_stopMutex);
+        while( !m_stopping ) {
+            m_stopCond.wait_for(lock, m_interval);
+            lock.unlock();
+
+            {
+                std::unique_lock<std::mutex> mergeLock(m_mergeMutex);
+                collect();
+
+                uint64_t now = nowNs();
+                send(now > m_windowNs ? now - m_windowNs : 0);
+            }
+
+            lock.lock();
+        }
+    }
+
+    // Move everything queued in the rings into m_pending.
+    void collect()
+    {
+        m_rings.ForEach([this](const Ring& constRing) {
+            // Only the merger writes to the tail.
+            Ring& ring = const_cast<Ring&>(constRing);
+
+            uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+            uint64_t head = ring.head.load(std::memory_order_acquire);
+            for( ; tail < head; tail++ ) {
+                const Entry& entry = ring.entries[tail % RING_SIZE];
+                Pending pending = { entry.timeNs, m_order++, entry.logData };
+                m_pending.push(pending);
+            }
+            ring.tail.store(tail, std::memory_order_release);
+        });
+    }
+
+    // Send every pending message logged up to 'untilNs', in order.
+    void send(uint64_t untilNs)
+    {
+        while( !m_pending.empty() && m_pending.top().timeNs <= untilNs ) {
+            Pending pending = m_pending.top();
+            m_pending.pop();
+
+            if( pending.timeNs < m_lastSentNs ) {
+                m_late.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                m_lastSentNs = pending.timeNs;
+            }
+
+            bool deleteMessage = true;
+            for( auto& sink : m_sinks ) {
+                if( pending.logData->level >= sink.minLevel ) {
+                    deleteMessage = sink.logger->sendLogMessage(pending.logData) && deleteMessage;
+                }
+            }
+            if( deleteMessage ) {
+                cpplog::freeLogData(pending.logData);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include <gtest/gtest.h>
+
+#include "ShardedLogger.hpp"
+
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// Remembers the messages it's sent, one per line.
+class LinesLogger : public cpplog::BaseLogger {
+public:
+    std::vector<std::string> lines;
+
+    virtual bool sendLogMessage(cpplog::LogData* logData)
+    {
+        std::string text(logData->streamBuffer.c_str(), logData->streamBuffer.length());
+        lines.push_back(text.substr(text.find("): ") + 3));
+        return true;
+    }
+};
+
+TEST(ShardedLoggerTest, SendsToEachSinkByLevel) {
+    LinesLogger all, warnings;
+    ShardedLogger logger;
+    logger.AddSink(all);
+    logger.AddSink(warnings, LL_WARN);
+    logger.Start();
+
+    LOG(LL_INFO, logger) << "info";
+    LOG(LL_WARN, logger) << "warning";
+    logger.Stop();
+
+    ASSERT_EQ(2u, all.lines.size());
+    EXPECT_EQ("info\n", all.lines[0]);
+    EXPECT_EQ("warning\n", all.lines[1]);
+    ASSERT_EQ(1u, warnings.lines.size());
+    EXPECT_EQ("warning\n", warnings.lines[0]);
+}
+
+TEST(ShardedLoggerTest, MergesThreadsInOrder) {
+    LinesLogger sink;
+    ShardedLogger logger;
+    logger.AddSink(sink);
+    logger.Start();
+
+    // Each thread logs in turn, so the order they were logged in is known.
+    std::mutex mutex;
+    int next = 0;
+    std::vector<std::thread> threads;
+    for( int t = 0; t < 4; t++ ) {
+        threads.emplace_back([&, t]() {
+            for( int i = 0; i < 100; i++ ) {
+                std::unique_lock<std::mutex> lock(mutex);
+                LOG(LL_INFO, logger) << "thread " << t << " message " << next++;
+            }
+        });
+    }
+    for( auto& thread : threads ) {
+        thread.join();
+    }
+    logger.Stop();
+
+    ASSERT_EQ(400u, sink.lines.size());
+    for( size_t i = 0; i < sink.lines.size(); i++ ) {
+        std::string suffix = " message " + std::to_string(i) + "\n";
+        ASSERT_EQ(suffix, sink.lines[i].substr(sink.lines[i].size() - suffix.size()));
+    }
+    EXPECT_EQ(0u, logger.Dropped());
+    EXPECT_EQ(0u, logger.Late());
+}
+
+TEST(ShardedLoggerTest, FlushSendsEverything) {
+    LinesLogger sink;
+    ShardedLogger logger(std::chrono::milliseconds(60000), std::chrono::milliseconds(60000));
+    logger.AddSink(sink);
+    logger.Start();
+
+    LOG(LL_INFO, logger) << "held back";
+    logger.Flush();
+    ASSERT_EQ(1u, sink.lines.size());
+    EXPECT_EQ("held back\n", sink.lines[0]);
+    logger.Stop();
+}
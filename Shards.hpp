@@ -0,0 +1,95 @@
+#ifndef SHARDS_HPP
+#define SHARDS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+
+// Helpers for running a scan as one shard per CPU: every target is hashed
+// to a shard, and that shard's threads - pinned to its CPU - do all the
+// work for it, so its state stays in that CPU's caches instead of
+// bouncing between them.
+
+
+// The shard a host belongs to.  Every port on a host goes to the same
+// shard, so whatever we learn about the host stays in one place.
+inline size_t ShardFor(const std::string& host, size_t shards)
+{
+    if( shards <= 1 ) {
+        return 0;
+    }
+
+    // FNV-1a, so the mapping is the same from run to run.
+    uint64_t hash = 14695981039346656037ULL;
+    for( unsigned char ch : host ) {
+        hash ^= ch;
+        hash *= 1099511628211ULL;
+    }
+    return static_cast<size_t>(hash % shards);
+}
+
+
+// The number of CPUs we're allowed to run on.
+inline size_t UsableCpus()
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if( 0 == sched_getaffinity(0, sizeof(set), &set) ) {
+        int count = CPU_COUNT(&set);
+        if( count > 0 ) {
+            return static_cast<size_t>(count);
+        }
+    }
+#endif
+
+    unsigned count = std::thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
+
+
+// Pin the calling thread to the n'th CPU we're allowed to run on (modulo
+// how many there are).  Returns false if that isn't supported, or fails;
+// the thread then carries on unpinned.
+inline bool PinToCpu(size_t n)
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if( 0 != sched_getaffinity(0, sizeof(allowed), &allowed) ) {
+        return false;
+    }
+
+    int count = CPU_COUNT(&allowed);
+    if( count <= 0 ) {
+        return false;
+    }
+    size_t wanted = n % static_cast<size_t>(count);
+
+    for( int cpu = 0; cpu < CPU_SETSIZE; cpu++ ) {
+        if( !CPU_ISSET(cpu, &allowed) ) {
+            continue;
+        }
+        if( wanted-- > 0 ) {
+            continue;
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    return false;
+#else
+    (void)n;
+    return false;
+#endif
+}
+
+#endif
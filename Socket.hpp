@@ -0,0 +1,563 @@
+#ifndef SOCKET_HPP
+#define SOCKET_HPP
+
+#include "Expected.hpp"
+#include "FdBudget.hpp"
+#include "ScopeGuard.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <boost/iostreams/stream.hpp>
+#include <boost/iostreams/device/array.hpp>
+
+
+class AddressError : public std::runtime_error {
+private:
+    char m_whatText[200];
+public:
+    AddressError(int status)
+        : std::runtime_error("address error")
+    {
+        boost::iostreams::stream<boost::iostreams::array_sink> out(m_whatText, 200);
+        out << "error resolving address: "
+            << status
+            << " (" << gai_strerror(status) << ")"
+            << std::ends;
+    }
+
+    virtual const char* what() const noexcept override {
+        return m_whatText;
+    }
+};
+
+
+class SocketError : public std::runtime_error {
+private:
+    char m_whatText[200];
+    int  m_code;
+
+    void format()
+    {
+        char errorBuff[200+1];
+        const char* errorText = errorString(strerror_r(m_code, errorBuff, 200), errorBuff);
+
+        boost::iostreams::stream<boost::iostreams::array_sink> out(m_whatText, 200);
+        out << "socket error: "
+            << m_code
+            << " (" << errorText << ")"
+            << std::ends;
+    }
+
+    // strerror_r() is either the XSI version (returns an int) or the GNU
+    // version (returns a pointer to the message); handle both.
+    static const char* errorString(int, const char* buff) { return buff; }
+    static const char* errorString(const char* ret, const char*) { return ret; }
+
+public:
+    // Capture the current value of errno.
+    SocketError()
+        : std::runtime_error("socket error"), m_code(errno)
+    {
+        format();
+    }
+
+    explicit SocketError(int code)
+        : std::runtime_error("socket error"), m_code(code)
+    {
+        format();
+    }
+
+    // The errno value for this error.
+    int Code() const
+    {
+        return m_code;
+    }
+
+    virtual const char* what() const noexcept override {
+        return m_whatText;
+    }
+};
+
+
+// Thrown when an operation on a socket doesn't complete in time.
+class TimeoutError : public std::runtime_error {
+public:
+    TimeoutError()
+        : std::runtime_error("timed out")
+    { }
+};
+
+
+// A resolved address.  Unlike a raw addrinfo, this owns a copy of the
+// socket address itself, so it stays valid after the list returned by
+// getaddrinfo() is freed and can be copied freely between threads.
+class SocketAddress {
+private:
+    struct sockaddr_storage m_addr;
+    socklen_t               m_addrLen;
+    int                     m_flags;
+    int                     m_family;
+    int                     m_socktype;
+    int                     m_protocol;
+
+public:
+    // Resolve the given host.  If no service is given, the returned
+    // addresses have a port of zero; use SetPort() to fill it in.  This
+    // lets a name be resolved once and then reused for several ports.
+    static Expected<std::vector<SocketAddress>> ResolveHost(
+            std::string host,
+            std::string service = "",
+            int family = AF_UNSPEC)
+    {
+        const char* theService = nullptr;
+
+        if( 0 != service.length() ) {
+            theService = service.c_str();
+        }
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = family;
+        hints.ai_socktype = SOCK_STREAM;
+
+        struct addrinfo* addresses = nullptr;
+        int status = getaddrinfo(host.c_str(), theService, &hints, &addresses);
+        if( status != 0 ) {
+            return Expected<std::vector<SocketAddress>>::fromException(AddressError(status));
+        }
+
+        SCOPE_EXIT {
+            if( addresses != nullptr ) {
+                freeaddrinfo(addresses);
+            }
+        };
+
+        std::vector<SocketAddress> ret;
+        for( struct addrinfo *p = addresses;
+             p != nullptr;
+             p = p->ai_next )
+        {
+            ret.emplace_back(p);
+        }
+
+        return ret;
+    }
+
+    explicit SocketAddress(const struct addrinfo* address)
+        : m_addrLen(address->ai_addrlen)
+        , m_flags(address->ai_flags)
+        , m_family(address->ai_family)
+        , m_socktype(address->ai_socktype)
+        , m_protocol(address->ai_protocol)
+    {
+        memset(&m_addr, 0, sizeof(m_addr));
+        memcpy(&m_addr, address->ai_addr, m_addrLen);
+    }
+
+    // From a raw socket address, e.g. one returned by accept() or
+    // getsockname().
+    SocketAddress(const struct sockaddr* addr, socklen_t addrLen, int socktype = SOCK_STREAM)
+        : m_addrLen(addrLen)
+        , m_flags(0)
+        , m_family(addr->sa_family)
+        , m_socktype(socktype)
+        , m_protocol(0)
+    {
+        memset(&m_addr, 0, sizeof(m_addr));
+        memcpy(&m_addr, addr, std::min<size_t>(addrLen, sizeof(m_addr)));
+    }
+
+    // Accessor functions for the members.
+    inline int              ai_flags() const     { return m_flags; }
+    inline int              ai_family() const    { return m_family; }
+    inline int              ai_socktype() const  { return m_socktype; }
+    inline int              ai_protocol() const  { return m_protocol; }
+    inline socklen_t        ai_addrlen() const   { return m_addrLen; }
+    inline const struct sockaddr *ai_addr() const {
+        return reinterpret_cast<const struct sockaddr*>(&m_addr);
+    }
+
+    // Port, in host byte order.
+    uint16_t Port() const
+    {
+        switch( m_family ) {
+            case AF_INET:
+                return ntohs(reinterpret_cast<const struct sockaddr_in*>(&m_addr)->sin_port);
+            case AF_INET6:
+                return ntohs(reinterpret_cast<const struct sockaddr_in6*>(&m_addr)->sin6_port);
+            default:
+                return 0;
+        }
+    }
+
+    void SetPort(uint16_t port)
+    {
+        switch( m_family ) {
+            case AF_INET:
+                reinterpret_cast<struct sockaddr_in*>(&m_addr)->sin_port = htons(port);
+                break;
+            case AF_INET6:
+                reinterpret_cast<struct sockaddr_in6*>(&m_addr)->sin6_port = htons(port);
+                break;
+        }
+    }
+
+    // Returns a copy of this address with the given port.
+    SocketAddress WithPort(uint16_t port) const
+    {
+        SocketAddress ret(*this);
+        ret.SetPort(port);
+        return ret;
+    }
+
+    // The numeric host part of this address, without the port.
+    std::string ToString() const
+    {
+        char hostBuff[NI_MAXHOST];
+        int status = getnameinfo(ai_addr(), m_addrLen,
+                                 hostBuff, sizeof(hostBuff),
+                                 nullptr, 0,
+                                 NI_NUMERICHOST);
+        if( 0 != status ) {
+            return "<unknown>";
+        }
+        return hostBuff;
+    }
+};
+
+
+// A set of local addresses to originate connections from.  Each call to
+// Next() hands out the next address of the requested family in round-robin
+// order, which spreads connections (and their ephemeral ports) over every
+// source address.
+class SourceAddressPool {
+private:
+    std::vector<SocketAddress>  m_v4;
+    std::vector<SocketAddress>  m_v6;
+    mutable std::atomic<size_t> m_nextV4;
+    mutable std::atomic<size_t> m_nextV6;
+
+public:
+    SourceAddressPool()
+        : m_nextV4(0), m_nextV6(0)
+    { }
+
+    // Delete copy constructor and assignment.
+    SourceAddressPool(SourceAddressPool const&) = delete;
+    SourceAddressPool& operator=(SourceAddressPool const&) = delete;
+
+    // Add a local address.  The port is cleared, so that the kernel can
+    // pick one.
+    void Add(const SocketAddress& addr)
+    {
+        switch( addr.ai_family() ) {
+            case AF_INET:
+                m_v4.push_back(addr.WithPort(0));
+                break;
+            case AF_INET6:
+                m_v6.push_back(addr.WithPort(0));
+                break;
+        }
+    }
+
+    bool Empty() const
+    {
+        return m_v4.empty() && m_v6.empty();
+    }
+
+    // Returns the next source address for the given family, or nullptr if
+    // we have none (in which case the kernel chooses).
+    const SocketAddress* Next(int family) const
+    {
+        switch( family ) {
+            case AF_INET:
+                if( m_v4.empty() ) {
+                    return nullptr;
+                }
+                return &m_v4[m_nextV4.fetch_add(1, std::memory_order_relaxed) % m_v4.size()];
+
+            case AF_INET6:
+                if( m_v6.empty() ) {
+                    return nullptr;
+                }
+                return &m_v6[m_nextV6.fetch_add(1, std::memory_order_relaxed) % m_v6.size()];
+
+            default:
+                return nullptr;
+        }
+    }
+};
+
+
+class Socket {
+private:
+    int m_socketDescriptor;
+
+    // If the descriptor was counted against an FdBudget, what to give
+    // back once it's closed.
+    FdPermit m_permit;
+
+    // Take ownership of an existing descriptor.
+    explicit Socket(int fd)
+        : m_socketDescriptor(fd)
+    { }
+
+public:
+    // No socket yet - e.g. to move one into later.
+    Socket()
+        : m_socketDescriptor(-1)
+    { }
+
+    Socket(int family, int socktype, int protocol)
+        : m_socketDescriptor(-1)
+    {
+        int socketDescriptor = -1;
+
+        socketDescriptor = socket(family, socktype, protocol);
+        if( -1 == socketDescriptor ) {
+            throw SocketError();
+        }
+        m_socketDescriptor = socketDescriptor;
+    }
+
+    // Allow creating with the proper params from a resolved address.
+    explicit Socket(const SocketAddress& fromAddr)
+        : Socket(fromAddr.ai_family(),
+                 fromAddr.ai_socktype(),
+                 fromAddr.ai_protocol())
+    { }
+
+    // ... and holding on to a permit from an FdBudget for as long as it's
+    // open.
+    Socket(const SocketAddress& fromAddr, FdPermit permit)
+        : Socket(fromAddr)
+    {
+        m_permit = std::move(permit);
+    }
+
+    Socket(Socket&& other)
+        : m_socketDescriptor(-1)
+    {
+        std::swap(m_socketDescriptor, other.m_socketDescriptor);
+        std::swap(m_permit, other.m_permit);
+    }
+
+    virtual ~Socket()
+    {
+        if( -1 != m_socketDescriptor ) {
+            close(m_socketDescriptor);
+        }
+    }
+
+    Socket& operator=(Socket&& other)
+    {
+        if( this != &other ) {
+            // TODO: abstract from destructor
+            if( -1 != m_socketDescriptor ) {
+                close(m_socketDescriptor);
+                m_socketDescriptor = -1;
+            }
+            m_permit.Release();
+
+            // Swap the two descriptors
+            std::swap(m_socketDescriptor, other.m_socketDescriptor);
+            std::swap(m_permit, other.m_permit);
+        }
+
+        return *this;
+    }
+
+    // Delete copy constructor and assignment.
+    // We want it to be impossible to copy an open socket, though we
+    // allow moving one.
+    Socket(Socket const&) = delete;
+    Socket& operator=(Socket const&) = delete;
+
+    // Bind to the given local address.  The port in the address is
+    // normally zero; where supported, we ask the kernel to defer choosing
+    // the ephemeral port until connect(), so that the same port can be
+    // reused towards different destinations from each source address.
+    void Bind(const SocketAddress& addr)
+    {
+#ifdef IP_BIND_ADDRESS_NO_PORT
+        if( 0 == addr.Port() ) {
+            int one = 1;
+
+            // Failure here isn't fatal - we just fall back to the kernel
+            // picking a port at bind() time.
+            setsockopt(m_socketDescriptor, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+                       &one, sizeof(one));
+        }
+#endif
+
+        int status = bind(m_socketDescriptor, addr.ai_addr(), addr.ai_addrlen());
+        if( -1 == status ) {
+            throw SocketError();
+        }
+    }
+
+    // Make the eventual close() send a RST instead of going through the
+    // normal FIN handshake.  This means that the connection doesn't sit in
+    // TIME_WAIT, holding on to its local port.
+    void SetAbortiveClose()
+    {
+        struct linger lin;
+        lin.l_onoff = 1;
+        lin.l_linger = 0;
+
+        int status = setsockopt(m_socketDescriptor, SOL_SOCKET, SO_LINGER,
+                                &lin, sizeof(lin));
+        if( -1 == status ) {
+            throw SocketError();
+        }
+    }
+
+    void Connect(const SocketAddress& addr)
+    {
+        int status = connect(m_socketDescriptor, addr.ai_addr(), addr.ai_addrlen());
+        if( -1 == status ) {
+            throw SocketError();
+        }
+    }
+
+    void SetNonBlocking(bool nonBlocking)
+    {
+        int flags = fcntl(m_socketDescriptor, F_GETFL, 0);
+        if( -1 == flags ) {
+            throw SocketError();
+        }
+
+        flags = nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+        if( -1 == fcntl(m_socketDescriptor, F_SETFL, flags) ) {
+            throw SocketError();
+        }
+    }
+
+    // Start connecting a non-blocking socket.  Returns true if the
+    // connection completed immediately, and false if it is in progress; in
+    // that case, wait for the socket to become writable and then call
+    // FinishConnect().
+    bool StartConnect(const SocketAddress& addr)
+    {
+        int status = connect(m_socketDescriptor, addr.ai_addr(), addr.ai_addrlen());
+        if( 0 == status ) {
+            return true;
+        }
+        if( EINPROGRESS == errno || EINTR == errno ) {
+            return false;
+        }
+
+        throw SocketError();
+    }
+
+    // Check the result of an in-progress connect.
+    void FinishConnect()
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if( -1 == getsockopt(m_socketDescriptor, SOL_SOCKET, SO_ERROR, &err, &len) ) {
+            throw SocketError();
+        }
+        if( 0 != err ) {
+            throw SocketError(err);
+        }
+    }
+
+    // Wait for any of the given poll() events, for at most the given number
+    // of milliseconds.  Returns the events that occurred, or zero if we
+    // timed out.
+    short Wait(short events, int timeoutMs)
+    {
+        struct pollfd pfd;
+        pfd.fd = m_socketDescriptor;
+        pfd.events = events;
+        pfd.revents = 0;
+
+        int status = poll(&pfd, 1, timeoutMs);
+        if( -1 == status ) {
+            if( EINTR == errno ) {
+                return 0;
+            }
+            throw SocketError();
+        }
+
+        return 0 == status ? 0 : pfd.revents;
+    }
+
+    // Server side.
+    // --------------------------------------------------
+    void SetReuseAddress()
+    {
+        int one = 1;
+        int status = setsockopt(m_socketDescriptor, SOL_SOCKET, SO_REUSEADDR,
+                                &one, sizeof(one));
+        if( -1 == status ) {
+            throw SocketError();
+        }
+    }
+
+    void Listen(int backlog = SOMAXCONN)
+    {
+        if( -1 == listen(m_socketDescriptor, backlog) ) {
+            throw SocketError();
+        }
+    }
+
+    // Accept a connection on a listening socket.  On a non-blocking socket
+    // with nothing to accept, this throws a SocketError with EAGAIN.
+    Socket Accept()
+    {
+        int fd = accept(m_socketDescriptor, nullptr, nullptr);
+        if( -1 == fd ) {
+            throw SocketError();
+        }
+        return Socket(fd);
+    }
+
+    // Shut down one or both directions (SHUT_RD, SHUT_WR or SHUT_RDWR).
+    // On a listening socket, this wakes up any thread blocked in Accept().
+    void Shutdown(int how)
+    {
+        if( -1 == shutdown(m_socketDescriptor, how) ) {
+            throw SocketError();
+        }
+    }
+
+    // The address we're bound to, e.g. to find out which port the kernel
+    // picked.
+    SocketAddress LocalAddress() const
+    {
+        struct sockaddr_storage addr;
+        socklen_t addrLen = sizeof(addr);
+        if( -1 == getsockname(m_socketDescriptor,
+                              reinterpret_cast<struct sockaddr*>(&addr), &addrLen) )
+        {
+            throw SocketError();
+        }
+        return SocketAddress(reinterpret_cast<struct sockaddr*>(&addr), addrLen);
+    }
+
+    int GetFd() const
+    {
+        return m_socketDescriptor;
+    }
+};
+
+#endif
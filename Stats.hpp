@@ -0,0 +1,106 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include "PerThread.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+// The things that a scan counts as it goes.
+enum class ScanCounter {
+    TargetsQueued,   // (host, port) pairs handed to the pool.
+    TargetsStarted,  // ... that a worker has started probing.
+    TargetsDone,     // ... whose probes have all finished.
+    Probes,          // Probe attempts, including retries.
+    Retries,         // Probe attempts that are being retried.
+    SweepAlive,      // Sweep targets that answered.
+    SweepDead,       // Sweep targets that didn't.
+    TargetsCutShort, // Targets that were done, but stopped before every probe ran.
+    TargetsSkipped,  // Targets that were queued, but cancelled before starting.
+    Timeouts,        // Probe attempts that timed out, including retried ones.
+    Refused,         // ... whose connect was refused.
+    LocalErrors,     // ... that we ran out of local resources for (e.g. fds).
+};
+
+enum { NUM_SCAN_COUNTERS = 12 };
+
+// Handshake outcomes are counted by number, so that this doesn't need to
+// know about them; there's room for this many.
+enum { MAX_OUTCOMES = 8 };
+
+
+// Live counts of what a scan has done so far, updated from any number of
+// threads and read at any time.
+//
+// Like the LatencyRecorder, each thread counts in its own slot, so the
+// scan never contends on these; reading one sums every thread's slot.
+class ScanStats {
+private:
+    struct Slot {
+        std::atomic<uint64_t>   counters[NUM_SCAN_COUNTERS];
+        std::atomic<uint64_t>   outcomes[MAX_OUTCOMES];
+
+        Slot()
+        {
+            for( auto& counter : counters ) {
+                counter.store(0, std::memory_order_relaxed);
+            }
+            for( auto& outcome : outcomes ) {
+                outcome.store(0, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    PerThread<Slot> m_slots;
+
+public:
+    ScanStats()
+    { }
+
+    // Delete copy constructor and assignment.
+    ScanStats(ScanStats const&) = delete;
+    ScanStats& operator=(ScanStats const&) = delete;
+
+    void Add(ScanCounter counter, uint64_t by = 1)
+    {
+        bool exclusive;
+        Slot& slot = m_slots.Local(exclusive);
+        Increment(slot.counters[static_cast<int>(counter)], by, exclusive);
+    }
+
+    void AddOutcome(size_t outcome)
+    {
+        if( outcome >= MAX_OUTCOMES ) {
+            return;
+        }
+
+        bool exclusive;
+        Slot& slot = m_slots.Local(exclusive);
+        Increment(slot.outcomes[outcome], 1, exclusive);
+    }
+
+    uint64_t Get(ScanCounter counter) const
+    {
+        uint64_t total = 0;
+        int c = static_cast<int>(counter);
+        m_slots.ForEach([&total, c](const Slot& slot) {
+            total += slot.counters[c].load(std::memory_order_relaxed);
+        });
+        return total;
+    }
+
+    uint64_t Outcome(size_t outcome) const
+    {
+        uint64_t total = 0;
+        if( outcome < MAX_OUTCOMES ) {
+            m_slots.ForEach([&total, outcome](const Slot& slot) {
+                total += slot.outcomes[outcome].load(std::memory_order_relaxed);
+            });
+        }
+        return total;
+    }
+};
+
+#endif
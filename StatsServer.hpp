@@ -0,0 +1,454 @@
+#ifndef STATSSERVER_HPP
+#define STATSSERVER_HPP
+
+#include "ConcurrencyController.hpp"
+#include "FdBudget.hpp"
+#include "Probe.hpp"
+#include "Socket.hpp"
+#include "Stats.hpp"
+#include "ThreadPool.h"
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+
+
+// How many file descriptors this process has open, or -1 if we can't
+// tell.
+inline long CountOpenFds()
+{
+    DIR* dir = opendir("/proc/self/fd");
+    if( !dir ) {
+        return -1;
+    }
+
+    long count = 0;
+    while( struct dirent* entry = readdir(dir) ) {
+        if( '.' != entry->d_name[0] ) {
+            count++;
+        }
+    }
+    closedir(dir);
+
+    // Don't count the descriptor we were reading the directory with.
+    return count - 1;
+}
+
+
+// Everything we report, read at one point in time.
+struct StatsSnapshot {
+    typedef std::chrono::steady_clock Clock;
+
+    Clock::time_point   taken;
+    double              uptimeSeconds;
+
+    uint64_t            counters[NUM_SCAN_COUNTERS];
+    uint64_t            outcomes[NUM_PROBE_STATUSES];
+
+    long                openFds;
+    size_t              fdBudget;       // The probes' share, or 0 if unlimited...
+    size_t              fdBudgetInUse;  // ... how much of it they're using...
+    uint64_t            fdWaits;        // ... and how often they've had to wait.
+    size_t              queueDepth;
+    size_t              workers;
+    size_t              busyWorkers;
+    double              busySeconds;
+
+    // The concurrency picked by the ConcurrencyController, and how many
+    // times it has backed off - or zero, if it isn't running.
+    size_t              concurrencyLimit;
+    uint64_t            concurrencyCuts;
+
+    uint64_t Get(ScanCounter counter) const
+    {
+        return counters[static_cast<int>(counter)];
+    }
+
+    // Targets that have been started, but not finished - including any
+    // waiting for a retry.
+    uint64_t InFlight() const
+    {
+        uint64_t started = Get(ScanCounter::TargetsStarted),
+                 done = Get(ScanCounter::TargetsDone);
+        return started > done ? started - done : 0;
+    }
+};
+
+
+// Reads a scan's statistics, and those of the pool it runs on, and formats
+// them for people (WriteText) or for Prometheus (WritePrometheus).
+class StatsCollector {
+private:
+    const ScanStats&                m_stats;
+    ThreadPool&                     m_pool;
+    const ConcurrencyController*    m_controller;
+    const FdBudget*                 m_fds;
+    StatsSnapshot::Clock::time_point m_started;
+
+public:
+    StatsCollector(const ScanStats& stats, ThreadPool& pool,
+                   const ConcurrencyController* controller = nullptr,
+                   const FdBudget* fds = nullptr)
+        : m_stats(stats)
+        , m_pool(pool)
+        , m_controller(controller)
+        , m_fds(fds)
+        , m_started(StatsSnapshot::Clock::now())
+    { }
+
+    StatsSnapshot Snapshot() const
+    {
+        StatsSnapshot snap;
+        snap.taken = StatsSnapshot::Clock::now();
+        snap.uptimeSeconds = std::chrono::duration<double>(snap.taken - m_started).count();
+
+        for( int c = 0; c < NUM_SCAN_COUNTERS; c++ ) {
+            snap.counters[c] = m_stats.Get(static_cast<ScanCounter>(c));
+        }
+        for( int o = 0; o < NUM_PROBE_STATUSES; o++ ) {
+            snap.outcomes[o] = m_stats.Outcome(o);
+        }
+
+        snap.openFds = CountOpenFds();
+        snap.fdBudget = m_fds ? m_fds->Capacity() : 0;
+        snap.fdBudgetInUse = m_fds ? m_fds->InUse() : 0;
+        snap.fdWaits = m_fds ? m_fds->Waits() : 0;
+        snap.queueDepth = m_pool.QueueDepth();
+        snap.workers = m_pool.Workers();
+        snap.busyWorkers = m_pool.BusyWorkers();
+        snap.busySeconds = std::chrono::duration<double>(m_pool.BusyTime()).count();
+        snap.concurrencyLimit = m_controller ? m_controller->Limit() : 0;
+        snap.concurrencyCuts = m_controller ? m_controller->Cuts() : 0;
+        return snap;
+    }
+
+    // A human-readable summary.  Rates are since 'previous', if given, or
+    // since the start otherwise.
+    static void WriteText(std::ostream& out, const StatsSnapshot& snap,
+                          const StatsSnapshot* previous = nullptr)
+    {
+        double seconds = snap.uptimeSeconds;
+        uint64_t probes = snap.Get(ScanCounter::Probes);
+        double busy = snap.busySeconds;
+        if( previous ) {
+            seconds -= previous->uptimeSeconds;
+            probes -= previous->Get(ScanCounter::Probes);
+            busy -= previous->busySeconds;
+        }
+
+        double rate = seconds > 0 ? probes / seconds : 0,
+               utilization = seconds > 0 && snap.workers > 0
+                           ? 100 * busy / (seconds * snap.workers) : 0;
+
+        out << std::fixed << std::setprecision(1)
+            << "--- stats after " << snap.uptimeSeconds << " s ---" << std::endl
+            << "targets:    " << snap.Get(ScanCounter::TargetsQueued) << " queued, "
+                              << snap.InFlight() << " in flight, "
+                              << snap.Get(ScanCounter::TargetsDone) << " done ("
+                              << snap.Get(ScanCounter::TargetsCutShort) << " cut short), "
+                              << snap.Get(ScanCounter::TargetsSkipped) << " skipped" << std::endl
+            << "sweep:      " << snap.Get(ScanCounter::SweepAlive) << " alive, "
+                              << snap.Get(ScanCounter::SweepDead) << " not responding" << std::endl
+            << "probes:     " << snap.Get(ScanCounter::Probes) << " ("
+                              << rate << "/s), "
+                              << snap.Get(ScanCounter::Retries) << " retried, "
+                              << snap.Get(ScanCounter::Timeouts) << " timed out, "
+                              << snap.Get(ScanCounter::Refused) << " refused, "
+                              << snap.Get(ScanCounter::LocalErrors) << " local errors" << std::endl
+            << "handshakes:";
+        for( int o = 0; o < NUM_PROBE_STATUSES; o++ ) {
+            out << (o > 0 ? ", " : " ") << snap.outcomes[o] << " "
+                << ProbeStatusName(static_cast<ProbeStatus>(o));
+        }
+        out << std::endl
+            << "pool:       " << snap.busyWorkers << "/" << snap.workers << " busy, "
+                              << snap.queueDepth << " queued, "
+                              << utilization << "% utilization" << std::endl;
+        if( snap.concurrencyLimit > 0 ) {
+            out << "concurrency: " << snap.concurrencyLimit << " target(s), backed off "
+                                   << snap.concurrencyCuts << " time(s)" << std::endl;
+        }
+        out << "open fds:   " << snap.openFds;
+        if( snap.fdBudget > 0 ) {
+            out << " (probes: " << snap.fdBudgetInUse << "/" << snap.fdBudget << ", "
+                << snap.fdWaits << " waits)";
+        }
+        out << std::endl
+            << std::defaultfloat;
+    }
+
+    // The Prometheus text exposition format (version 0.0.4).
+    static void WritePrometheus(std::ostream& out, const StatsSnapshot& snap)
+    {
+        metric(out, "sslscan_uptime_seconds", "gauge",
+               "Time since the scan started.", snap.uptimeSeconds);
+        metric(out, "sslscan_targets_queued_total", "counter",
+               "(host, port) pairs queued for probing.",
+               snap.Get(ScanCounter::TargetsQueued));
+        metric(out, "sslscan_targets_in_flight", "gauge",
+               "Targets being probed, or waiting for a retry.", snap.InFlight());
+        metric(out, "sslscan_targets_done_total", "counter",
+               "Targets whose probes have all finished.",
+               snap.Get(ScanCounter::TargetsDone));
+        metric(out, "sslscan_targets_cut_short_total", "counter",
+               "Targets that were stopped before all of their probes ran.",
+               snap.Get(ScanCounter::TargetsCutShort));
+        metric(out, "sslscan_targets_skipped_total", "counter",
+               "Targets that were cancelled before they started.",
+               snap.Get(ScanCounter::TargetsSkipped));
+        metric(out, "sslscan_sweep_alive_total", "counter",
+               "Sweep targets that answered.", snap.Get(ScanCounter::SweepAlive));
+        metric(out, "sslscan_sweep_dead_total", "counter",
+               "Sweep targets that didn't answer.", snap.Get(ScanCounter::SweepDead));
+        metric(out, "sslscan_probes_total", "counter",
+               "Probe attempts, including retries.", snap.Get(ScanCounter::Probes));
+        metric(out, "sslscan_retries_total", "counter",
+               "Probe attempts that were retried.", snap.Get(ScanCounter::Retries));
+        metric(out, "sslscan_probe_timeouts_total", "counter",
+               "Probe attempts that timed out.", snap.Get(ScanCounter::Timeouts));
+        metric(out, "sslscan_probe_refused_total", "counter",
+               "Probe attempts whose connect was refused.", snap.Get(ScanCounter::Refused));
+        metric(out, "sslscan_probe_local_errors_total", "counter",
+               "Probe attempts that ran out of local resources.",
+               snap.Get(ScanCounter::LocalErrors));
+
+        out << "# HELP sslscan_handshakes_total Finished probes, by outcome.\n"
+            << "# TYPE sslscan_handshakes_total counter\n";
+        for( int o = 0; o < NUM_PROBE_STATUSES; o++ ) {
+            std::string outcome = ProbeStatusName(static_cast<ProbeStatus>(o));
+            for( auto& ch : outcome ) {
+                if( ' ' == ch ) {
+                    ch = '_';
+                }
+            }
+            out << "sslscan_handshakes_total{outcome=\"" << outcome << "\"} "
+                << snap.outcomes[o] << "\n";
+        }
+
+        metric(out, "sslscan_open_fds", "gauge",
+               "Open file descriptors.", snap.openFds);
+        if( snap.fdBudget > 0 ) {
+            metric(out, "sslscan_fd_budget", "gauge",
+                   "Descriptors the probes may have open at once.", snap.fdBudget);
+            metric(out, "sslscan_fd_budget_in_use", "gauge",
+                   "Descriptors the probes have open.", snap.fdBudgetInUse);
+            metric(out, "sslscan_fd_waits_total", "counter",
+                   "Times a probe had to wait for a descriptor.", snap.fdWaits);
+        }
+        metric(out, "sslscan_pool_queue_depth", "gauge",
+               "Tasks waiting for a worker.", snap.queueDepth);
+        metric(out, "sslscan_pool_workers", "gauge",
+               "Worker threads in the pool.", snap.workers);
+        metric(out, "sslscan_pool_busy_workers", "gauge",
+               "Workers running a task.", snap.busyWorkers);
+        metric(out, "sslscan_pool_busy_seconds_total", "counter",
+               "Time spent running tasks, over all workers.", snap.busySeconds);
+        if( snap.concurrencyLimit > 0 ) {
+            metric(out, "sslscan_concurrency_limit", "gauge",
+                   "Targets that may be in flight, as picked by the controller.",
+                   snap.concurrencyLimit);
+            metric(out, "sslscan_concurrency_cuts_total", "counter",
+                   "Times the controller has backed off.", snap.concurrencyCuts);
+        }
+    }
+
+private:
+    template <typename T>
+    static void metric(std::ostream& out, const char* name, const char* type,
+                       const char* help, T value)
+    {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " " << type << "\n"
+            << name << " " << value << "\n";
+    }
+};
+
+
+// Block SIGUSR1 in the calling thread, and any threads it later creates,
+// so that only the StatsDumper sees it.  Call this before starting any
+// threads.
+inline void BlockStatsSignal()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+
+
+// Prints the statistics to a stream whenever we get SIGUSR1 - e.g. from
+// `kill -USR1 <pid>`.  Rates are since the last dump.
+//
+// The signal is taken synchronously, by a thread waiting in sigwait(), so
+// the dump can do whatever it likes; it must be blocked everywhere else
+// (see BlockStatsSignal()).
+class StatsDumper {
+private:
+    const StatsCollector&   m_collector;
+    std::ostream&           m_out;
+    std::atomic<bool>       m_stopping;
+    std::thread             m_thread;
+
+public:
+    StatsDumper(const StatsCollector& collector, std::ostream& out)
+        : m_collector(collector), m_out(out), m_stopping(false)
+    {
+        m_thread = std::thread(&StatsDumper::run, this);
+    }
+
+    ~StatsDumper()
+    {
+        m_stopping = true;
+        pthread_kill(m_thread.native_handle(), SIGUSR1);
+        m_thread.join();
+    }
+
+    // Delete copy constructor and assignment.
+    StatsDumper(StatsDumper const&) = delete;
+    StatsDumper& operator=(StatsDumper const&) = delete;
+
+private:
+    void run()
+    {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+
+        StatsSnapshot previous = m_collector.Snapshot();
+        bool first = true;
+
+        while( true ) {
+            int sig;
+            if( 0 != sigwait(&set, &sig) || m_stopping ) {
+                return;
+            }
+
+            StatsSnapshot snap = m_collector.Snapshot();
+            std::ostringstream text;
+            StatsCollector::WriteText(text, snap, first ? nullptr : &previous);
+            m_out << text.str() << std::flush;
+
+            previous = snap;
+            first = false;
+        }
+    }
+};
+
+
+// Serves the statistics in the Prometheus text format, over HTTP on a
+// local port, for as long as this exists.  Any request gets the metrics;
+// connections are handled one at a time.
+class StatsServer {
+private:
+    const StatsCollector&   m_collector;
+    Socket                  m_listener;
+    std::atomic<bool>       m_stopping;
+    std::thread             m_thread;
+
+public:
+    // Listens on the loopback address only, since the numbers aren't
+    // anybody else's business.
+    StatsServer(const StatsCollector& collector, uint16_t port)
+        : m_collector(collector)
+        , m_listener(listenOn(port))
+        , m_stopping(false)
+    {
+        m_thread = std::thread(&StatsServer::run, this);
+    }
+
+    ~StatsServer()
+    {
+        m_stopping = true;
+        m_thread.join();
+    }
+
+    // Delete copy constructor and assignment.
+    StatsServer(StatsServer const&) = delete;
+    StatsServer& operator=(StatsServer const&) = delete;
+
+    uint16_t Port() const
+    {
+        return m_listener.LocalAddress().Port();
+    }
+
+private:
+    static Socket listenOn(uint16_t port)
+    {
+        auto addresses = SocketAddress::ResolveHost("127.0.0.1", std::to_string(port));
+        const SocketAddress& addr = addresses.get().at(0);
+
+        Socket sock(addr);
+        sock.SetReuseAddress();
+        sock.Bind(addr);
+        sock.Listen();
+        return sock;
+    }
+
+    void run()
+    {
+        // Wake up now and then, to see if we're stopping.
+        const int pollMs = 200;
+
+        while( !m_stopping ) {
+            try {
+                if( 0 == (m_listener.Wait(POLLIN, pollMs) & POLLIN) ) {
+                    continue;
+                }
+
+                Socket conn = m_listener.Accept();
+                handle(conn);
+            } catch( const SocketError& ) {
+                // Not worth stopping for - just carry on with the next one.
+            }
+        }
+    }
+
+    void handle(Socket& conn)
+    {
+        // Read (and ignore) the request, up to the end of its headers, but
+        // don't let a slow client hold us up.
+        std::string request;
+        char buff[1024];
+        while( request.find("\r\n\r\n") == std::string::npos &&
+               request.size() < 8192 &&
+               (conn.Wait(POLLIN, 1000) & (POLLIN | POLLHUP)) )
+        {
+            ssize_t got = recv(conn.GetFd(), buff, sizeof(buff), 0);
+            if( got <= 0 ) {
+                break;
+            }
+            request.append(buff, got);
+        }
+
+        std::ostringstream body;
+        StatsCollector::WritePrometheus(body, m_collector.Snapshot());
+
+        std::ostringstream response;
+        response << "HTTP/1.0 200 OK\r\n"
+                 << "Content-Type: text/plain; version=0.0.4\r\n"
+                 << "Content-Length: " << body.str().size() << "\r\n"
+                 << "Connection: close\r\n\r\n"
+                 << body.str();
+
+        std::string data = response.str();
+        size_t sent = 0;
+        while( sent < data.size() ) {
+            ssize_t n = send(conn.GetFd(), data.data() + sent, data.size() - sent,
+                             MSG_NOSIGNAL);
+            if( n <= 0 ) {
+                break;
+            }
+            sent += n;
+        }
+    }
+};
+
+#endif
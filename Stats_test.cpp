@@ -0,0 +1,37 @@
+#include <gtest/gtest.h>
+
+#include "Stats.hpp"
+
+#include <thread>
+#include <vector>
+
+
+TEST(ScanStatsTest, SumsThreads) {
+    ScanStats stats;
+
+    std::vector<std::thread> threads;
+    for( int t = 0; t < 4; t++ ) {
+        threads.emplace_back([&stats, t]() {
+            for( int i = 0; i < 1000; i++ ) {
+                stats.Add(ScanCounter::Probes);
+                stats.AddOutcome(t % 2);
+            }
+            stats.Add(ScanCounter::TargetsDone, 10);
+        });
+    }
+    for( auto& thread : threads ) {
+        thread.join();
+    }
+
+    EXPECT_EQ(4000u, stats.Get(ScanCounter::Probes));
+    EXPECT_EQ(40u, stats.Get(ScanCounter::TargetsDone));
+    EXPECT_EQ(0u, stats.Get(ScanCounter::Retries));
+    EXPECT_EQ(2000u, stats.Outcome(0));
+    EXPECT_EQ(2000u, stats.Outcome(1));
+}
+
+TEST(ScanStatsTest, IgnoresUnknownOutcomes) {
+    ScanStats stats;
+    stats.AddOutcome(MAX_OUTCOMES);
+    EXPECT_EQ(0u, stats.Outcome(MAX_OUTCOMES));
+}
@@ -0,0 +1,332 @@
+#ifndef SUBNETSCHEDULER_HPP
+#define SUBNETSCHEDULER_HPP
+
+#include "Socket.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+
+// Spreads targets over the networks they're in, so that a list of
+// neighbouring hosts doesn't have every probe we're running hitting the
+// same network at once (and its IDS or rate limits).  Targets are keyed by
+// their network prefix - a /24 for IPv4, and a /48 for IPv6 - and no more
+// than 'perPrefix' targets from any one prefix are in flight at once.
+// There may also be a limit on how many are in flight overall, which can
+// be changed as we go (see ConcurrencyController).
+//
+// Submit() runs a target's task at once if there's room for it, and
+// otherwise holds it until there is.  Whenever a target is Done(), the
+// room it leaves goes to the most urgent target waiting, with the prefixes
+// that have one of those taking turns, so that no one network gets ahead
+// of the rest.  As in the ThreadPool, which the tasks are expected to hand
+// their targets on to, priorities are numbered from 0 (most urgent), and
+// every AGING_SHARE'th start goes to a less urgent target instead, if it
+// has waited longer than AGING_MS - so they're never starved.
+//
+// Limits of zero mean there's none.  Safe to use from any number of
+// threads.
+class SubnetScheduler {
+public:
+    typedef std::function<void()> Task;
+
+    enum {
+        IPV4_PREFIX_BITS = 24,
+        IPV6_PREFIX_BITS = 48,
+
+        PRIORITIES = 3,
+        DEFAULT_PRIORITY = 1,
+        AGING_SHARE = 8,
+        AGING_MS = 1000,
+    };
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Held {
+        Task                task;
+        Clock::time_point   queued;
+    };
+
+    struct Prefix {
+        size_t              inFlight;
+        std::deque<Held>    waiting[PRIORITIES];
+        bool                ready[PRIORITIES];      // In m_ready[priority].
+    };
+
+    size_t                  m_perPrefix;
+    bool                    m_limited;      // Whether there's any limit at all.
+
+    std::mutex              m_mutex;
+    std::unordered_map<std::string, Prefix> m_prefixes;
+    size_t                  m_limit;
+    size_t                  m_inFlight;
+    size_t                  m_waiting;
+
+    // For each priority, the prefixes with a target of that priority
+    // waiting, in the order they get their next turn.  A prefix that has
+    // run out of room is only taken out once it comes up.
+    std::deque<std::string> m_ready[PRIORITIES];
+    uint64_t                m_picks;
+
+public:
+    explicit SubnetScheduler(size_t perPrefix = 0, size_t limit = 0)
+        : m_perPrefix(perPrefix)
+        , m_limited(perPrefix > 0 || limit > 0)
+        , m_limit(limit)
+        , m_inFlight(0)
+        , m_waiting(0)
+        , m_picks(0)
+    { }
+
+    // Delete copy constructor and assignment.
+    SubnetScheduler(SubnetScheduler const&) = delete;
+    SubnetScheduler& operator=(SubnetScheduler const&) = delete;
+
+    // The network prefix an address is in, e.g. "192.0.2.0/24".
+    static std::string PrefixOf(const SocketAddress& addr)
+    {
+        char buff[INET6_ADDRSTRLEN];
+        switch( addr.ai_family() ) {
+            case AF_INET: {
+                struct in_addr ip = reinterpret_cast<const struct sockaddr_in*>(addr.ai_addr())->sin_addr;
+                ip.s_addr &= htonl(~0u << (32 - IPV4_PREFIX_BITS));
+                inet_ntop(AF_INET, &ip, buff, sizeof(buff));
+                return std::string(buff) + "/" + std::to_string(IPV4_PREFIX_BITS);
+            }
+
+            case AF_INET6: {
+                struct in6_addr ip = reinterpret_cast<const struct sockaddr_in6*>(addr.ai_addr())->sin6_addr;
+                memset(ip.s6_addr + IPV6_PREFIX_BITS / 8, 0, sizeof(ip.s6_addr) - IPV6_PREFIX_BITS / 8);
+                inet_ntop(AF_INET6, &ip, buff, sizeof(buff));
+                return std::string(buff) + "/" + std::to_string(IPV6_PREFIX_BITS);
+            }
+
+            default:
+                return addr.ToString();
+        }
+    }
+
+    // ... and that of a target, which is where we connect to first.
+    static std::string PrefixOf(const std::vector<SocketAddress>& addresses)
+    {
+        return addresses.empty() ? "" : PrefixOf(addresses.front());
+    }
+
+    // Run 'task' once there's room for it, and no more urgent target is
+    // waiting.  Every submitted task must be matched by a call to Done()
+    // with the same prefix, once its target is finished.
+    void Submit(const std::string& prefix, Task task, size_t priority = DEFAULT_PRIORITY)
+    {
+        if( !m_limited ) {
+            task();
+            return;
+        }
+
+        std::vector<Task> run;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            Held held = { std::move(task), Clock::now() };
+            Prefix& entry = m_prefixes[prefix];
+            entry.waiting[std::min<size_t>(priority, PRIORITIES - 1)].push_back(std::move(held));
+            m_waiting++;
+            makeReady(prefix, entry);
+            dispatch(run);
+        }
+        for( auto& next : run ) {
+            next();
+        }
+    }
+
+    // A target from 'prefix' is finished, so start whatever is next.
+    void Done(const std::string& prefix)
+    {
+        if( !m_limited ) {
+            return;
+        }
+
+        std::vector<Task> run;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            auto it = m_prefixes.find(prefix);
+            if( it == m_prefixes.end() ) {
+                return;
+            }
+
+            Prefix& entry = it->second;
+            entry.inFlight--;
+            m_inFlight--;
+            if( 0 == entry.inFlight && !hasWaiting(entry) ) {
+                m_prefixes.erase(it);
+            } else {
+                makeReady(prefix, entry);
+            }
+            dispatch(run);
+        }
+        for( auto& next : run ) {
+            next();
+        }
+    }
+
+    // Change how many targets may be in flight overall.  Lowering it
+    // doesn't stop any that are already running; it just holds back new
+    // ones until enough have finished.
+    //
+    // NOTE: Only a scheduler created with a limit can be given a new one,
+    // since one without doesn't keep count of what's in flight.
+    void SetLimit(size_t limit)
+    {
+        std::vector<Task> run;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if( 0 == m_limit || 0 == limit ) {
+                return;
+            }
+            m_limit = limit;
+            dispatch(run);
+        }
+        for( auto& next : run ) {
+            next();
+        }
+    }
+
+    size_t Limit()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_limit;
+    }
+
+    // Targets started, but not Done().
+    size_t InFlight()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_inFlight;
+    }
+
+    // Targets held back, for there to be room for them.
+    size_t Waiting()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_waiting;
+    }
+
+    // Prefixes with a target in flight or waiting.
+    size_t Prefixes()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_prefixes.size();
+    }
+
+private:
+    bool hasRoom(const Prefix& entry) const
+    {
+        return 0 == m_perPrefix || entry.inFlight < m_perPrefix;
+    }
+
+    static bool hasWaiting(const Prefix& entry)
+    {
+        for( auto& waiting : entry.waiting ) {
+            if( !waiting.empty() ) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Give the prefix a turn at each priority it has a target waiting at,
+    // if it has room for one.
+    void makeReady(const std::string& prefix, Prefix& entry)
+    {
+        if( !hasRoom(entry) ) {
+            return;
+        }
+        for( size_t p = 0; p < PRIORITIES; p++ ) {
+            if( !entry.ready[p] && !entry.waiting[p].empty() ) {
+                entry.ready[p] = true;
+                m_ready[p].push_back(prefix);
+            }
+        }
+    }
+
+    // Whether a prefix is ready to start a target of the given priority,
+    // dropping any at the front that have run out of room since they were
+    // made ready.
+    bool readyAt(size_t priority)
+    {
+        std::deque<std::string>& ready = m_ready[priority];
+        while( !ready.empty() ) {
+            Prefix& entry = m_prefixes[ready.front()];
+            if( hasRoom(entry) ) {
+                return true;
+            }
+            entry.ready[priority] = false;
+            ready.pop_front();
+        }
+        return false;
+    }
+
+    // The priority to start a target of next: the most urgent one ready -
+    // except that every AGING_SHARE'th pick goes to whichever priority's
+    // next target has waited longest, if that's past AGING_MS.  Returns
+    // PRIORITIES if nothing is ready.
+    size_t pick()
+    {
+        size_t best = 0;
+        while( best < PRIORITIES && !readyAt(best) ) {
+            best++;
+        }
+        if( PRIORITIES == best || 0 != ++m_picks % AGING_SHARE ) {
+            return best;
+        }
+
+        size_t oldest = best;
+        Clock::time_point limit = Clock::now() - std::chrono::milliseconds(AGING_MS);
+        for( size_t p = best + 1; p < PRIORITIES; p++ ) {
+            if( readyAt(p) ) {
+                Clock::time_point queued = m_prefixes[m_ready[p].front()].waiting[p].front().queued;
+                if( queued < limit ) {
+                    limit = queued;
+                    oldest = p;
+                }
+            }
+        }
+        return oldest;
+    }
+
+    // Take as many waiting targets as there's room for, a prefix at a
+    // time, to be run once we've let go of the lock.
+    void dispatch(std::vector<Task>& run)
+    {
+        while( 0 == m_limit || m_inFlight < m_limit ) {
+            size_t priority = pick();
+            if( PRIORITIES == priority ) {
+                break;
+            }
+
+            std::string prefix = std::move(m_ready[priority].front());
+            m_ready[priority].pop_front();
+
+            Prefix& entry = m_prefixes[prefix];
+            entry.ready[priority] = false;
+            run.push_back(std::move(entry.waiting[priority].front().task));
+            entry.waiting[priority].pop_front();
+            entry.inFlight++;
+            m_inFlight++;
+            m_waiting--;
+
+            makeReady(prefix, entry);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,151 @@
+#include <gtest/gtest.h>
+
+#include "SubnetScheduler.hpp"
+
+#include <vector>
+
+
+namespace {
+
+SocketAddress address(const std::string& host)
+{
+    return SocketAddress::ResolveHost(host).get().at(0);
+}
+
+}
+
+
+TEST(SubnetSchedulerTest, PrefixOf) {
+    EXPECT_EQ("192.0.2.0/24", SubnetScheduler::PrefixOf(address("192.0.2.77")));
+    EXPECT_EQ("192.0.2.0/24", SubnetScheduler::PrefixOf(address("192.0.2.1")));
+    EXPECT_EQ("192.0.3.0/24", SubnetScheduler::PrefixOf(address("192.0.3.1")));
+
+    EXPECT_EQ("2001:db8:1::/48", SubnetScheduler::PrefixOf(address("2001:db8:1:2::1")));
+    EXPECT_EQ("2001:db8:1::/48", SubnetScheduler::PrefixOf(address("2001:db8:1:ffff::2")));
+
+    std::vector<SocketAddress> addresses = { address("198.51.100.9"), address("192.0.2.1") };
+    EXPECT_EQ("198.51.100.0/24", SubnetScheduler::PrefixOf(addresses));
+}
+
+TEST(SubnetSchedulerTest, CapsEachPrefix) {
+    SubnetScheduler scheduler(2);
+    std::vector<std::string> started;
+    for( int i = 0; i < 5; i++ ) {
+        scheduler.Submit("a", [&started, i]() { started.push_back("a" + std::to_string(i)); });
+    }
+    scheduler.Submit("b", [&started]() { started.push_back("b0"); });
+
+    // Another prefix isn't held up by the first being full.
+    EXPECT_EQ(std::vector<std::string>({ "a0", "a1", "b0" }), started);
+    EXPECT_EQ(3u, scheduler.Waiting());
+    EXPECT_EQ(2u, scheduler.Prefixes());
+
+    // Each finished target makes room for the next from its prefix.
+    scheduler.Done("b");
+    EXPECT_EQ(3u, started.size());
+    scheduler.Done("a");
+    EXPECT_EQ("a2", started.back());
+    scheduler.Done("a");
+    scheduler.Done("a");
+    EXPECT_EQ("a4", started.back());
+    EXPECT_EQ(0u, scheduler.Waiting());
+
+    scheduler.Done("a");
+    scheduler.Done("a");
+    EXPECT_EQ(0u, scheduler.Prefixes());
+}
+
+TEST(SubnetSchedulerTest, Unlimited) {
+    SubnetScheduler scheduler;
+    int started = 0;
+    for( int i = 0; i < 100; i++ ) {
+        scheduler.Submit("a", [&started]() { started++; });
+    }
+    EXPECT_EQ(100, started);
+    EXPECT_EQ(0u, scheduler.Waiting());
+}
+
+TEST(SubnetSchedulerTest, LimitTakesPrefixesInTurn) {
+    SubnetScheduler scheduler(0, 2);
+    std::vector<std::string> started;
+    auto submit = [&](const std::string& prefix, int i) {
+        scheduler.Submit(prefix, [&started, prefix, i]() {
+            started.push_back(prefix + std::to_string(i));
+        });
+    };
+    for( int i = 0; i < 4; i++ ) {
+        submit("a", i);
+    }
+    submit("b", 0);
+    submit("b", 1);
+    submit("c", 0);
+    EXPECT_EQ(std::vector<std::string>({ "a0", "a1" }), started);
+
+    // As room frees up, each network with a target waiting gets a turn.
+    scheduler.Done("a");
+    scheduler.Done("a");
+    scheduler.Done("a");
+    scheduler.Done("b");
+    EXPECT_EQ(std::vector<std::string>({ "a0", "a1", "a2", "b0", "c0", "a3" }), started);
+
+    // Raising the limit starts more at once.
+    EXPECT_EQ(2u, scheduler.InFlight());
+    scheduler.SetLimit(10);
+    EXPECT_EQ("b1", started.back());
+    EXPECT_EQ(3u, scheduler.InFlight());
+    EXPECT_EQ(0u, scheduler.Waiting());
+}
+
+TEST(SubnetSchedulerTest, MostUrgentFirst) {
+    SubnetScheduler scheduler(0, 1);
+    std::vector<std::string> started;
+    auto submit = [&](const std::string& prefix, const std::string& name, size_t priority) {
+        scheduler.Submit(prefix, [&started, name]() { started.push_back(name); }, priority);
+    };
+
+    // The first takes the only room; the rest wait.
+    submit("a", "a-normal", 1);
+    submit("b", "b-low", 2);
+    submit("a", "a-low", 2);
+    submit("a", "a-high", 0);
+    submit("b", "b-high", 0);
+    submit("c", "c-normal", 1);
+    EXPECT_EQ(std::vector<std::string>({ "a-normal" }), started);
+
+    // Whatever prefix they're from, and whatever was queued ahead of them,
+    // urgent targets go first - with the prefixes still taking turns.
+    for( int i = 0; i < 5; i++ ) {
+        scheduler.Done("a");
+    }
+    EXPECT_EQ(std::vector<std::string>({ "a-normal", "a-high", "b-high", "c-normal",
+                                         "b-low", "a-low" }), started);
+
+    // Raising the limit starts the most urgent too.
+    submit("d", "d-low", 2);
+    submit("e", "e-high", 0);
+    scheduler.SetLimit(2);
+    EXPECT_EQ("e-high", started.back());
+}
+
+TEST(SubnetSchedulerTest, PerPrefixCapWithPriorities) {
+    SubnetScheduler scheduler(1, 2);
+    std::vector<std::string> started;
+    auto submit = [&](const std::string& prefix, const std::string& name, size_t priority) {
+        scheduler.Submit(prefix, [&started, name]() { started.push_back(name); }, priority);
+    };
+
+    submit("a", "a0", 1);
+    submit("a", "a-high", 0);
+    submit("b", "b-low", 2);
+    EXPECT_EQ(std::vector<std::string>({ "a0", "b-low" }), started);
+
+    // 'a' is full, so its urgent target waits for its own room - and
+    // then goes ahead of the rest.
+    submit("c", "c-normal", 1);
+    scheduler.Done("b");
+    EXPECT_EQ("c-normal", started.back());
+    submit("d", "d-normal", 1);
+    scheduler.Done("a");
+    EXPECT_EQ("a-high", started.back());
+    EXPECT_EQ(1u, scheduler.Waiting());
+}
@@ -0,0 +1,540 @@
+#ifndef SWEEP_HPP
+#define SWEEP_HPP
+
+#include "Cancellation.hpp"
+#include "IoUring.hpp"
+#include "RttEstimator.hpp"
+#include "Socket.hpp"
+#include "Target.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+
+
+// A (host, port) pair to check for liveness.  The host's addresses (whose
+// ports are ignored) are tried in order until one accepts a connection.
+struct SweepTarget {
+    std::string                         host;
+    uint16_t                            port;
+
+    // NOTE: This is not owned, and must outlive the sweeper.
+    const std::vector<SocketAddress>*   addresses;
+
+    // Just passed on to the callbacks.  Targets are swept in the order
+    // they're added, so add the most urgent first.
+    TargetPriority                      priority;
+};
+
+
+// The first stage of a scan: a cheap check of whether anything is
+// listening on each (host, port), so that only live targets get the full
+// set of TLS probes.
+//
+// A single background thread drives many non-blocking connects at once.
+// As soon as a target answers, it is handed to the 'alive' callback (which
+// will typically queue it for the TLS stage), so both stages run at the
+// same time.  The connection is then reset rather than closed cleanly,
+// which is as close to a half-open check as we can get without raw
+// sockets.
+//
+// Where the kernel supports it, the connects are driven through io_uring:
+// each is queued along with a linked timeout, a whole batch is started and
+// reaped with one system call, and the result comes back in the
+// completion, so there's no poll() over every outstanding socket or
+// getsockopt() per connect.  Otherwise, we fall back to poll().
+class LivenessSweeper {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    typedef std::function<void(const SweepTarget& target,
+                               const SocketAddress& addr,
+                               Clock::duration rtt)>   AliveCallback;
+    typedef std::function<void(const SweepTarget& target)> DeadCallback;
+
+private:
+    // An outstanding connect.
+    struct Attempt {
+        SweepTarget         target;
+        size_t              addrIndex;
+        Socket              sock;
+        Clock::time_point   started;
+        Clock::time_point   deadline;
+    };
+
+#ifdef HAVE_IO_URING
+    // When using io_uring, an outstanding connect and its timeout.  The
+    // slot can't be reused until both have completed, as the completions
+    // are matched up by slot.
+    struct RingSlot {
+        std::unique_ptr<Attempt>    attempt;
+        struct sockaddr_storage     addr;
+        struct __kernel_timespec    timeout;
+        unsigned                    outstanding;
+    };
+
+    // The completion for a slot's timeout has this bit set in its user
+    // data; the slot's index is in the rest.
+    static const uint64_t TIMEOUT_BIT = 1;
+    static const uint64_t WAKEUP = UINT64_MAX;
+#endif
+
+    size_t                      m_maxInFlight;
+    int                         m_timeoutMs;
+    const SourceAddressPool&    m_sources;
+    HostTimings&                m_timings;
+    AliveCallback               m_onAlive;
+    DeadCallback                m_onDead;
+    const CancellationToken*    m_cancel;
+
+    // Null if we're using poll().
+    std::unique_ptr<IoUring>    m_ring;
+
+    // Targets waiting to be checked, fed from other threads.
+    std::deque<SweepTarget>     m_pending;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_condition;
+    bool                        m_finished;
+    bool                        m_failed;       // We can't wait for connects.
+
+    std::thread                 m_thread;
+
+public:
+    // The timeout is used for hosts we have no RTT measurements for yet;
+    // every successful connect adds a measurement.  If 'useIoUring' is
+    // false, or the kernel doesn't support it, we use poll().  If given a
+    // cancellation token, then once it's cancelled, targets that haven't
+    // been started yet are dropped (and reported neither alive nor dead),
+    // and the sweep finishes as soon as the connects in flight do.
+    LivenessSweeper(size_t maxInFlight,
+                    int timeoutMs,
+                    const SourceAddressPool& sources,
+                    HostTimings& timings,
+                    AliveCallback onAlive,
+                    DeadCallback onDead,
+                    bool useIoUring = true,
+                    const CancellationToken* cancel = nullptr)
+        : m_maxInFlight(maxInFlight > 0 ? maxInFlight : 1)
+        , m_timeoutMs(timeoutMs)
+        , m_sources(sources)
+        , m_timings(timings)
+        , m_onAlive(onAlive)
+        , m_onDead(onDead)
+        , m_cancel(cancel)
+        , m_finished(false)
+        , m_failed(false)
+    {
+        if( useIoUring && IoUring::Supported() ) {
+            try {
+                // Two entries per connect, and one to wake us up.
+                m_ring.reset(new IoUring(static_cast<unsigned>(2 * m_maxInFlight + 1)));
+            } catch( const SocketError& ) {
+                // e.g. too many entries, or locked memory limits.
+            }
+        }
+
+        m_thread = std::thread(&LivenessSweeper::run, this);
+    }
+
+    // Waits for every queued target to be checked.
+    ~LivenessSweeper()
+    {
+        Finish();
+        m_thread.join();
+    }
+
+    // Delete copy constructor and assignment.
+    LivenessSweeper(LivenessSweeper const&) = delete;
+    LivenessSweeper& operator=(LivenessSweeper const&) = delete;
+
+    // Check a target.  If the sweep has failed, it's reported as dead
+    // straight away.
+    void Add(const SweepTarget& target)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if( !m_failed ) {
+                m_pending.push_back(target);
+                lock.unlock();
+                m_condition.notify_one();
+                return;
+            }
+        }
+        m_onDead(target);
+    }
+
+    // Signal that no more targets will be added.
+    void Finish()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_finished = true;
+        }
+        m_condition.notify_one();
+    }
+
+    // How the connects are being driven: "io_uring" or "poll".
+    const char* Backend() const
+    {
+        return m_ring ? "io_uring" : "poll";
+    }
+
+private:
+    void run()
+    {
+#ifdef HAVE_IO_URING
+        if( m_ring ) {
+            runRing();
+            return;
+        }
+#endif
+        runPoll();
+    }
+
+    void runPoll()
+    {
+        std::vector<Attempt> active;
+        std::vector<struct pollfd> fds;
+
+        for(;;) {
+            bool finished = admit(
+                    [&active]() { return active.size(); },
+                    [this, &active](const SweepTarget& target) { start(active, target, 0); });
+            if( active.empty() ) {
+                if( finished ) {
+                    return;
+                }
+                continue;
+            }
+
+            // Wait for at least one connect to finish, but not past the
+            // earliest deadline.  If more targets may still be coming, we
+            // wake up regularly to admit them.
+            auto now = Clock::now();
+            auto wakeup = active[0].deadline;
+            for( auto& attempt : active ) {
+                wakeup = std::min(wakeup, attempt.deadline);
+            }
+            if( !finished ) {
+                wakeup = std::min(wakeup, now + std::chrono::milliseconds(10));
+            }
+            int timeoutMs = static_cast<int>(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(wakeup - now).count());
+
+            fds.resize(active.size());
+            for( size_t i = 0; i < active.size(); i++ ) {
+                fds[i].fd = active[i].sock.GetFd();
+                fds[i].events = POLLOUT;
+                fds[i].revents = 0;
+            }
+
+            if( -1 == poll(fds.data(), fds.size(), std::max(timeoutMs, 0)) && EINTR != errno ) {
+                for( auto& attempt : active ) {
+                    m_onDead(attempt.target);
+                }
+                active.clear();
+                failPending();
+                return;
+            }
+
+            now = Clock::now();
+            for( size_t i = active.size(); i-- > 0; ) {
+                Attempt& attempt = active[i];
+                bool connected = false;
+
+                if( 0 != fds[i].revents ) {
+                    try {
+                        attempt.sock.FinishConnect();
+                        connected = true;
+                    } catch( const SocketError& ) {
+                        // Try the next address, below.
+                    }
+                } else if( now < attempt.deadline ) {
+                    continue;
+                }
+
+                SweepTarget target = attempt.target;
+                size_t nextAddr = attempt.addrIndex + 1;
+
+                if( connected ) {
+                    succeeded(attempt, now);
+                }
+
+                // This attempt is done - remove it.  Anything we add below
+                // goes on the end, which we've already looked at.
+                std::swap(active[i], active.back());
+                active.pop_back();
+
+                if( !connected ) {
+                    start(active, target, nextAddr);
+                }
+            }
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    void runRing()
+    {
+        std::vector<RingSlot> slots(m_maxInFlight);
+        std::vector<size_t> free;
+        for( size_t i = slots.size(); i-- > 0; ) {
+            free.push_back(i);
+        }
+        auto inFlight = [&]() { return slots.size() - free.size(); };
+
+        // Targets to try again at their next address, once there's a slot.
+        std::deque<std::pair<SweepTarget, size_t>> retries;
+
+        // If more targets may still be coming, we wake up regularly to
+        // admit them.
+        struct __kernel_timespec tick = { 0, 10 * 1000 * 1000 };
+        bool wakeupQueued = false;
+
+        for(;;) {
+            while( !retries.empty() && !free.empty() ) {
+                startRing(slots, free, retries, retries.front().first, retries.front().second);
+                retries.pop_front();
+            }
+
+            bool finished = admit(
+                    inFlight,
+                    [&](const SweepTarget& target) { startRing(slots, free, retries, target, 0); });
+            if( 0 == inFlight() ) {
+                if( finished ) {
+                    return;
+                }
+                continue;
+            }
+
+            if( !finished && !wakeupQueued ) {
+                wakeupQueued = m_ring->Timeout(&tick, WAKEUP);
+            }
+
+            try {
+                m_ring->Submit(1);
+            } catch( const SocketError& ) {
+                for( auto& slot : slots ) {
+                    if( slot.attempt ) {
+                        m_onDead(slot.attempt->target);
+                    }
+                }
+                for( auto& retry : retries ) {
+                    m_onDead(retry.first);
+                }
+                failPending();
+                return;
+            }
+
+            auto now = Clock::now();
+            m_ring->Reap([&](uint64_t userData, int32_t result) {
+                if( WAKEUP == userData ) {
+                    wakeupQueued = false;
+                    return;
+                }
+
+                size_t index = static_cast<size_t>(userData >> 1);
+                RingSlot& slot = slots[index];
+
+                std::unique_ptr<Attempt> attempt;
+                if( 0 == (userData & TIMEOUT_BIT) ) {
+                    attempt = std::move(slot.attempt);
+                }
+                if( 0 == --slot.outstanding ) {
+                    free.push_back(index);
+                }
+                if( !attempt ) {
+                    return;
+                }
+
+                // If the timeout fired, the connect was cancelled.  Either
+                // way, move on to the next address.
+                if( 0 == result ) {
+                    succeeded(*attempt, now);
+                } else {
+                    retries.push_back(std::make_pair(attempt->target, attempt->addrIndex + 1));
+                }
+            });
+        }
+    }
+#endif
+
+    // We can't wait for connects any more (e.g. poll() failed), so every
+    // target that's waiting, or is still to come, is reported as dead.
+    // The caller deals with the ones in flight, and then stops.
+    void failPending()
+    {
+        std::deque<SweepTarget> pending;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_failed = true;
+            pending.swap(m_pending);
+        }
+        for( auto& target : pending ) {
+            m_onDead(target);
+        }
+    }
+
+    // Start connects for pending targets while inFlight() is under our
+    // limit.  Returns true if no more targets will arrive.
+    template <typename InFlight, typename Start>
+    bool admit(InFlight inFlight, Start start)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        // Nothing to do - sleep until there is (or we're cancelled).
+        while( 0 == inFlight() && m_pending.empty() && !m_finished ) {
+            if( !m_cancel ) {
+                m_condition.wait(lock);
+                continue;
+            }
+            if( m_cancel->Cancelled() ) {
+                break;
+            }
+            m_condition.wait_for(lock, std::chrono::milliseconds(
+                    CancellationToken::CHECK_INTERVAL_MS));
+        }
+
+        if( m_cancel && m_cancel->Cancelled() ) {
+            m_pending.clear();
+            return true;
+        }
+
+        while( inFlight() < m_maxInFlight && !m_pending.empty() ) {
+            SweepTarget target = m_pending.front();
+            m_pending.pop_front();
+
+            lock.unlock();
+            start(target);
+            lock.lock();
+        }
+
+        return m_finished && m_pending.empty();
+    }
+
+    // Start a connect to the given address of a target, moving on to the
+    // target's next address if this one fails immediately.  If every
+    // address has failed, the target is reported as dead.
+    void start(std::vector<Attempt>& active, const SweepTarget& target, size_t addrIndex)
+    {
+        std::chrono::milliseconds timeout(
+                m_timings.Timeouts(target.host, m_timeoutMs, 0).connectMs);
+
+        for( ; addrIndex < target.addresses->size(); addrIndex++ ) {
+            SocketAddress addr = (*target.addresses)[addrIndex].WithPort(target.port);
+            auto now = Clock::now();
+
+            try {
+                Socket sock(addr);
+
+                const SocketAddress* source = m_sources.Next(addr.ai_family());
+                if( source != nullptr ) {
+                    sock.Bind(*source);
+                }
+
+                sock.SetNonBlocking(true);
+
+                Attempt attempt = {
+                    target,
+                    addrIndex,
+                    std::move(sock),
+                    now,
+                    now + timeout,
+                };
+
+                if( attempt.sock.StartConnect(addr) ) {
+                    succeeded(attempt, now);
+                } else {
+                    active.push_back(std::move(attempt));
+                }
+                return;
+            } catch( const SocketError& ) {
+                continue;
+            }
+        }
+
+        m_onDead(target);
+    }
+
+#ifdef HAVE_IO_URING
+    // As start(), but queueing the connect on the ring (in a free slot) to
+    // be submitted with the rest of the batch.  Sockets are left blocking;
+    // io_uring completes the connect asynchronously regardless.
+    void startRing(std::vector<RingSlot>& slots, std::vector<size_t>& free,
+                   std::deque<std::pair<SweepTarget, size_t>>& retries,
+                   const SweepTarget& target, size_t addrIndex)
+    {
+        if( free.empty() || m_ring->Space() < 2 ) {
+            retries.push_back(std::make_pair(target, addrIndex));
+            return;
+        }
+
+        int timeoutMs = m_timings.Timeouts(target.host, m_timeoutMs, 0).connectMs;
+
+        for( ; addrIndex < target.addresses->size(); addrIndex++ ) {
+            SocketAddress addr = (*target.addresses)[addrIndex].WithPort(target.port);
+            auto now = Clock::now();
+
+            try {
+                Socket sock(addr);
+
+                const SocketAddress* source = m_sources.Next(addr.ai_family());
+                if( source != nullptr ) {
+                    sock.Bind(*source);
+                }
+
+                size_t index = free.back();
+                free.pop_back();
+
+                RingSlot& slot = slots[index];
+                memcpy(&slot.addr, addr.ai_addr(), addr.ai_addrlen());
+                slot.timeout.tv_sec = timeoutMs / 1000;
+                slot.timeout.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+                slot.outstanding = 2;
+
+                int fd = sock.GetFd();
+                slot.attempt.reset(new Attempt{
+                    target,
+                    addrIndex,
+                    std::move(sock),
+                    now,
+                    now + std::chrono::milliseconds(timeoutMs),
+                });
+
+                m_ring->Connect(fd, reinterpret_cast<const struct sockaddr*>(&slot.addr),
+                                addr.ai_addrlen(), index << 1, true);
+                m_ring->LinkTimeout(&slot.timeout, (index << 1) | TIMEOUT_BIT);
+                return;
+            } catch( const SocketError& ) {
+                continue;
+            }
+        }
+
+        m_onDead(target);
+    }
+#endif
+
+    void succeeded(Attempt& attempt, Clock::time_point now)
+    {
+        try {
+            attempt.sock.SetAbortiveClose();
+        } catch( const SocketError& ) {
+            // Not fatal - we just fall back to a normal close.
+        }
+
+        m_timings.AddSample(attempt.target.host, now - attempt.started);
+        m_onAlive(attempt.target,
+                  (*attempt.target.addresses)[attempt.addrIndex].WithPort(attempt.target.port),
+                  now - attempt.started);
+    }
+};
+
+#endif
@@ -0,0 +1,117 @@
+#include <gtest/gtest.h>
+
+#include "Sweep.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <set>
+
+
+namespace {
+
+SocketAddress Loopback(const char* host, uint16_t port = 0)
+{
+    auto resolved = SocketAddress::ResolveHost(host, "", AF_INET);
+    return resolved.get().at(0).WithPort(port);
+}
+
+// Run a sweep of 'targets', returning which were alive and which dead.
+struct SweepOutcome {
+    std::set<std::string>   alive;
+    std::set<std::string>   dead;
+    std::string             backend;
+};
+
+SweepOutcome Sweep(bool useIoUring, const std::vector<SweepTarget>& targets,
+                   int timeoutMs = 2000)
+{
+    SourceAddressPool sources;
+    HostTimings timings(timeoutMs, false);
+    SweepOutcome outcome;
+    std::mutex mutex;
+
+    LivenessSweeper sweeper(
+        4, timeoutMs, sources, timings,
+        [&](const SweepTarget& target, const SocketAddress&, LivenessSweeper::Clock::duration) {
+            std::unique_lock<std::mutex> lock(mutex);
+            outcome.alive.insert(target.host);
+        },
+        [&](const SweepTarget& target) {
+            std::unique_lock<std::mutex> lock(mutex);
+            outcome.dead.insert(target.host);
+        },
+        useIoUring);
+
+    outcome.backend = sweeper.Backend();
+    for( auto& target : targets ) {
+        sweeper.Add(target);
+    }
+    return outcome;
+}
+
+}
+
+
+class SweepTest : public ::testing::TestWithParam<bool> { };
+
+TEST_P(SweepTest, AliveAndDead) {
+    Socket listener(Loopback("127.0.0.1"));
+    listener.Bind(Loopback("127.0.0.1"));
+    listener.Listen();
+    uint16_t port = listener.LocalAddress().Port();
+
+    // Nothing listens on 127.0.0.2, so the first address is refused and
+    // the second should be tried.
+    std::vector<SocketAddress> live = { Loopback("127.0.0.1") };
+    std::vector<SocketAddress> fallback = { Loopback("127.0.0.2"), Loopback("127.0.0.1") };
+    std::vector<SocketAddress> closed = { Loopback("127.0.0.2") };
+
+    std::vector<SweepTarget> targets;
+    for( int i = 0; i < 10; i++ ) {
+        targets.push_back({ "live" + std::to_string(i), port, &live, TargetPriority::Normal });
+    }
+    targets.push_back({ "fallback", port, &fallback, TargetPriority::Normal });
+    targets.push_back({ "closed", port, &closed, TargetPriority::Normal });
+
+    SweepOutcome outcome = Sweep(GetParam(), targets);
+
+    if( GetParam() && IoUring::Supported() ) {
+        EXPECT_EQ("io_uring", outcome.backend);
+    } else {
+        EXPECT_EQ("poll", outcome.backend);
+    }
+
+    EXPECT_EQ(11u, outcome.alive.size());
+    EXPECT_EQ(1u, outcome.alive.count("fallback"));
+    EXPECT_EQ(std::set<std::string>({ "closed" }), outcome.dead);
+}
+
+TEST_P(SweepTest, Timeout) {
+    // A listener whose accept queue is full drops further SYNs, so connects
+    // to it hang until they time out.
+    Socket listener(Loopback("127.0.0.1"));
+    listener.Bind(Loopback("127.0.0.1"));
+    listener.Listen(0);
+    SocketAddress addr = Loopback("127.0.0.1", listener.LocalAddress().Port());
+
+    std::vector<Socket> fillers;
+    for( int i = 0; i < 2; i++ ) {
+        fillers.emplace_back(addr);
+        fillers.back().SetNonBlocking(true);
+        fillers.back().StartConnect(addr);
+    }
+    usleep(100 * 1000);
+
+    std::vector<SocketAddress> addresses = { addr };
+    std::vector<SweepTarget> targets = { { "hung", addr.Port(), &addresses, TargetPriority::Normal } };
+
+    auto started = std::chrono::steady_clock::now();
+    SweepOutcome outcome = Sweep(GetParam(), targets, 300);
+    auto elapsed = std::chrono::steady_clock::now() - started;
+
+    EXPECT_EQ(std::set<std::string>({ "hung" }), outcome.dead);
+    EXPECT_GE(elapsed, std::chrono::milliseconds(250));
+    EXPECT_LT(elapsed, std::chrono::milliseconds(2000));
+}
+
+INSTANTIATE_TEST_CASE_P(Backends, SweepTest, ::testing::Values(false, true));
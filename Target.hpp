@@ -0,0 +1,227 @@
+#ifndef TARGET_HPP
+#define TARGET_HPP
+
+#include "Expected.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/iostreams/stream.hpp>
+#include <boost/iostreams/device/array.hpp>
+
+
+// Thrown when a target or port specification can't be parsed.
+class TargetError : public std::runtime_error {
+private:
+    char m_whatText[200];
+public:
+    TargetError(const char* reason, const std::string& spec)
+        : std::runtime_error("target error")
+    {
+        boost::iostreams::stream<boost::iostreams::array_sink> out(m_whatText, 200);
+        out << reason << ": '" << spec << "'" << std::ends;
+    }
+
+    virtual const char* what() const noexcept override {
+        return m_whatText;
+    }
+};
+
+
+// How urgently a target should be scanned.  More urgent targets are
+// resolved, swept and probed first.
+enum class TargetPriority {
+    High,
+    Normal,
+    Low,
+};
+
+enum { NUM_TARGET_PRIORITIES = 3 };
+
+inline const char* TargetPriorityName(TargetPriority priority)
+{
+    switch( priority ) {
+        case TargetPriority::High:      return "high";
+        case TargetPriority::Normal:    return "normal";
+        case TargetPriority::Low:       return "low";
+    }
+    return "unknown";
+}
+
+
+// A single host to scan, along with every port that should be scanned on
+// it.  A target is written as one of:
+//      host
+//      host:443
+//      host:443,8443,990-995
+//      [2001:db8::1]:443
+//      2001:db8::1                 (bare IPv6, uses the default ports)
+//
+// optionally followed by whitespace and a priority - "high", "normal" (the
+// default) or "low", e.g.:
+//      host:443 high
+struct Target {
+    std::string             host;
+    std::vector<uint16_t>   ports;
+    TargetPriority          priority;
+
+    Target()
+        : priority(TargetPriority::Normal)
+    { }
+
+    // Parse a list of ports, e.g. "443,8443,990-995".  Duplicates are
+    // dropped, and the original order is otherwise preserved.
+    static Expected<std::vector<uint16_t>> ParsePorts(const std::string& spec)
+    {
+        typedef Expected<std::vector<uint16_t>> Result;
+
+        std::vector<uint16_t> ret;
+        size_t start = 0;
+
+        while( start <= spec.length() ) {
+            size_t end = spec.find(',', start);
+            if( std::string::npos == end ) {
+                end = spec.length();
+            }
+
+            std::string item = spec.substr(start, end - start);
+            size_t dash = item.find('-');
+
+            unsigned long first = 0, last = 0;
+            if( std::string::npos == dash ) {
+                if( !parsePort(item, first) ) {
+                    return Result::fromException(TargetError("invalid port", item));
+                }
+                last = first;
+            } else {
+                if( !parsePort(item.substr(0, dash), first) ||
+                    !parsePort(item.substr(dash + 1), last) ||
+                    last < first )
+                {
+                    return Result::fromException(TargetError("invalid port range", item));
+                }
+            }
+
+            for( unsigned long p = first; p <= last; p++ ) {
+                uint16_t port = static_cast<uint16_t>(p);
+                if( std::find(ret.begin(), ret.end(), port) == ret.end() ) {
+                    ret.push_back(port);
+                }
+            }
+
+            start = end + 1;
+        }
+
+        return ret;
+    }
+
+    // Parse a single target specification.  If the specification doesn't
+    // name any ports, the given default ports are used.
+    static Expected<Target> Parse(const std::string& line,
+                                  const std::vector<uint16_t>& defaultPorts)
+    {
+        Target ret;
+        std::string spec = line,
+                    portSpec;
+
+        size_t space = line.find_first_of(" \t");
+        if( std::string::npos != space ) {
+            spec = line.substr(0, space);
+
+            size_t first = line.find_first_not_of(" \t", space);
+            size_t last = line.find_last_not_of(" \t");
+            if( std::string::npos != first &&
+                !parsePriority(line.substr(first, last - first + 1), ret.priority) )
+            {
+                return Expected<Target>::fromException(TargetError("invalid priority", line));
+            }
+        }
+
+        if( spec.empty() ) {
+            return Expected<Target>::fromException(TargetError("empty target", line));
+        }
+
+        if( '[' == spec[0] ) {
+            // Bracketed IPv6 address, optionally followed by ":ports".
+            size_t close = spec.find(']');
+            if( std::string::npos == close || 1 == close ) {
+                return Expected<Target>::fromException(TargetError("invalid IPv6 target", spec));
+            }
+
+            ret.host = spec.substr(1, close - 1);
+            if( close + 1 < spec.length() ) {
+                if( ':' != spec[close + 1] ) {
+                    return Expected<Target>::fromException(TargetError("invalid IPv6 target", spec));
+                }
+                portSpec = spec.substr(close + 2);
+            }
+        } else {
+            size_t colon = spec.find(':');
+            if( std::string::npos != colon && spec.find(':', colon + 1) == std::string::npos ) {
+                // Exactly one colon - "host:ports".
+                ret.host = spec.substr(0, colon);
+                portSpec = spec.substr(colon + 1);
+            } else {
+                // No colon, or a bare IPv6 address.
+                ret.host = spec;
+            }
+        }
+
+        if( ret.host.empty() ) {
+            return Expected<Target>::fromException(TargetError("missing host", spec));
+        }
+
+        if( portSpec.empty() ) {
+            ret.ports = defaultPorts;
+        } else {
+            auto ports = ParsePorts(portSpec);
+            if( !ports.valid() ) {
+                return Expected<Target>::fromException(ports);
+            }
+            ret.ports = ports.get();
+        }
+
+        return ret;
+    }
+
+    // Format a host and port for display, bracketing IPv6 addresses.
+    static std::string Endpoint(const std::string& host, uint16_t port)
+    {
+        std::string ret;
+        if( host.find(':') != std::string::npos ) {
+            ret = "[" + host + "]";
+        } else {
+            ret = host;
+        }
+        return ret + ":" + std::to_string(port);
+    }
+
+private:
+    static bool parsePriority(const std::string& str, TargetPriority& out)
+    {
+        for( int p = 0; p < NUM_TARGET_PRIORITIES; p++ ) {
+            TargetPriority priority = static_cast<TargetPriority>(p);
+            if( str == TargetPriorityName(priority) ) {
+                out = priority;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool parsePort(const std::string& str, unsigned long& out)
+    {
+        if( str.empty() || str.find_first_not_of("0123456789") != std::string::npos ) {
+            return false;
+        }
+
+        out = std::strtoul(str.c_str(), nullptr, 10);
+        return out > 0 && out <= 65535;
+    }
+};
+
+#endif
@@ -0,0 +1,78 @@
+#include <gtest/gtest.h>
+
+#include "Target.hpp"
+
+
+TEST(TargetTest, ParsePorts) {
+    auto one = Target::ParsePorts("443");
+    ASSERT_TRUE(one.valid());
+    EXPECT_EQ(std::vector<uint16_t>({443}), one.get());
+
+    auto two = Target::ParsePorts("443,8443,993-995,443");
+    ASSERT_TRUE(two.valid());
+    EXPECT_EQ(std::vector<uint16_t>({443, 8443, 993, 994, 995}), two.get());
+
+    EXPECT_TRUE(Target::ParsePorts("").hasException<TargetError>());
+    EXPECT_TRUE(Target::ParsePorts("0").hasException<TargetError>());
+    EXPECT_TRUE(Target::ParsePorts("65536").hasException<TargetError>());
+    EXPECT_TRUE(Target::ParsePorts("443,").hasException<TargetError>());
+    EXPECT_TRUE(Target::ParsePorts("995-993").hasException<TargetError>());
+    EXPECT_TRUE(Target::ParsePorts("https").hasException<TargetError>());
+}
+
+TEST(TargetTest, Parse) {
+    std::vector<uint16_t> defaults = {443, 8443};
+
+    auto one = Target::Parse("example.com", defaults);
+    ASSERT_TRUE(one.valid());
+    EXPECT_EQ("example.com", one.get().host);
+    EXPECT_EQ(defaults, one.get().ports);
+
+    auto two = Target::Parse("example.com:993,995", defaults);
+    ASSERT_TRUE(two.valid());
+    EXPECT_EQ("example.com", two.get().host);
+    EXPECT_EQ(std::vector<uint16_t>({993, 995}), two.get().ports);
+
+    auto three = Target::Parse("[2001:db8::1]:465", defaults);
+    ASSERT_TRUE(three.valid());
+    EXPECT_EQ("2001:db8::1", three.get().host);
+    EXPECT_EQ(std::vector<uint16_t>({465}), three.get().ports);
+
+    auto four = Target::Parse("2001:db8::1", defaults);
+    ASSERT_TRUE(four.valid());
+    EXPECT_EQ("2001:db8::1", four.get().host);
+    EXPECT_EQ(defaults, four.get().ports);
+
+    EXPECT_TRUE(Target::Parse("", defaults).hasException<TargetError>());
+    EXPECT_TRUE(Target::Parse(":443", defaults).hasException<TargetError>());
+    EXPECT_TRUE(Target::Parse("[::1", defaults).hasException<TargetError>());
+    EXPECT_TRUE(Target::Parse("[::1]443", defaults).hasException<TargetError>());
+    EXPECT_TRUE(Target::Parse("example.com:x", defaults).hasException<TargetError>());
+}
+
+TEST(TargetTest, Priority) {
+    std::vector<uint16_t> defaults = {443};
+
+    auto plain = Target::Parse("example.com", defaults);
+    ASSERT_TRUE(plain.valid());
+    EXPECT_EQ(TargetPriority::Normal, plain.get().priority);
+
+    auto high = Target::Parse("example.com:8443 high", defaults);
+    ASSERT_TRUE(high.valid());
+    EXPECT_EQ("example.com", high.get().host);
+    EXPECT_EQ(std::vector<uint16_t>({8443}), high.get().ports);
+    EXPECT_EQ(TargetPriority::High, high.get().priority);
+
+    auto low = Target::Parse("[2001:db8::1]\t  low ", defaults);
+    ASSERT_TRUE(low.valid());
+    EXPECT_EQ("2001:db8::1", low.get().host);
+    EXPECT_EQ(TargetPriority::Low, low.get().priority);
+
+    EXPECT_TRUE(Target::Parse("example.com urgent", defaults).hasException<TargetError>());
+    EXPECT_TRUE(Target::Parse("example.com high low", defaults).hasException<TargetError>());
+}
+
+TEST(TargetTest, Endpoint) {
+    EXPECT_EQ("example.com:443", Target::Endpoint("example.com", 443));
+    EXPECT_EQ("[::1]:8443", Target::Endpoint("::1", 8443));
+}
@@ -0,0 +1,296 @@
+#ifndef TESTSERVER_HPP
+#define TESTSERVER_HPP
+
+#include "SSL.hpp"
+#include "ScopeGuard.hpp"
+#include "Socket.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include <sys/time.h>
+
+
+// A throwaway RSA key and a self-signed certificate for it, for test
+// servers.  Generating the key takes a while, so share one of these
+// between servers.
+class TestCertificate {
+private:
+    ::EVP_PKEY* m_key;
+    ::X509*     m_cert;
+
+public:
+    explicit TestCertificate(const std::string& commonName = "localhost", int bits = 2048)
+        : m_key(nullptr), m_cert(nullptr)
+    {
+        m_key = ::EVP_PKEY_new();
+        if( !m_key ) {
+            throw ssl::SSLError("error making key");
+        }
+
+        ::RSA* rsa = ::RSA_new();
+        ::BIGNUM* exponent = ::BN_new();
+        SCOPE_EXIT {
+            ::BN_free(exponent);
+        };
+
+        if( !rsa || !exponent ||
+            !::BN_set_word(exponent, RSA_F4) ||
+            !::RSA_generate_key_ex(rsa, bits, exponent, nullptr) ||
+            !::EVP_PKEY_assign_RSA(m_key, rsa) )
+        {
+            ::RSA_free(rsa);
+            ::EVP_PKEY_free(m_key);
+            throw ssl::SSLError("error generating key");
+        }
+
+        m_cert = ::X509_new();
+        if( !m_cert ) {
+            ::EVP_PKEY_free(m_key);
+            throw ssl::SSLError("error making certificate");
+        }
+
+        ::X509_set_version(m_cert, 2);
+        ::ASN1_INTEGER_set(::X509_get_serialNumber(m_cert), 1);
+        ::X509_gmtime_adj(X509_get_notBefore(m_cert), -60);
+        ::X509_gmtime_adj(X509_get_notAfter(m_cert), 24 * 60 * 60);
+        ::X509_set_pubkey(m_cert, m_key);
+
+        ::X509_NAME* name = ::X509_get_subject_name(m_cert);
+        ::X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                reinterpret_cast<const unsigned char*>(commonName.c_str()),
+                -1, -1, 0);
+        ::X509_set_issuer_name(m_cert, name);
+
+        if( !::X509_sign(m_cert, m_key, ::EVP_sha256()) ) {
+            ::X509_free(m_cert);
+            ::EVP_PKEY_free(m_key);
+            throw ssl::SSLError("error signing certificate");
+        }
+    }
+
+    ~TestCertificate()
+    {
+        ::X509_free(m_cert);
+        ::EVP_PKEY_free(m_key);
+    }
+
+    // Delete copy constructor and assignment.
+    TestCertificate(TestCertificate const&) = delete;
+    TestCertificate& operator=(TestCertificate const&) = delete;
+
+    ::EVP_PKEY* Key() const { return m_key; }
+    ::X509* Certificate() const { return m_cert; }
+};
+
+
+// How a test server should behave.
+struct TestServerConfig {
+    // Where to listen.  A port of zero lets the kernel pick one; use
+    // TestServer::Port() to find out which.
+    std::string         host;
+    uint16_t            port;
+
+    // The protocol(s) to accept, as an OpenSSL server method, and the
+    // ciphers to accept, in the server's order of preference.
+    const ::SSL_METHOD* method;
+    std::string         ciphers;
+
+    // Pick the cipher by our order, rather than the client's.
+    bool                serverPreference;
+
+    // Wait this long after accepting a connection, before starting the
+    // handshake.
+    int                 handshakeDelayMs;
+
+    // How many connections are handled at once.
+    size_t              workers;
+
+    TestServerConfig()
+        : host("127.0.0.1")
+        , port(0)
+        , method(::SSLv23_server_method())
+        , ciphers("ALL:COMPLEMENTOFALL")
+        , serverPreference(false)
+        , handshakeDelayMs(0)
+        , workers(8)
+    { }
+};
+
+
+// A TLS server on a local address, for testing and benchmarking the
+// scanner without going near real hosts.  Each worker thread accepts a
+// connection, does the handshake and, if that works, answers a single
+// HTTP request - enough for a probe and its verification.
+//
+// Ephemeral (DHE) ciphers aren't available, since we don't set up DH
+// parameters.  ECDHE ciphers use P-256.
+class TestServer {
+private:
+    TestServerConfig            m_config;
+    ssl::SSLContext             m_ctx;
+    Socket                      m_listener;
+    SocketAddress               m_address;
+
+    std::atomic<bool>           m_stopping;
+    std::atomic<size_t>         m_accepted;
+    std::atomic<size_t>         m_failed;
+    std::vector<std::thread>    m_workers;
+
+public:
+    TestServer(const TestServerConfig& config, const TestCertificate& cert)
+        : m_config(config)
+        , m_ctx(MakeContext(config, cert))
+        , m_listener(listenOn(config.host, config.port))
+        , m_address(m_listener.LocalAddress())
+        , m_stopping(false)
+        , m_accepted(0)
+        , m_failed(0)
+    {
+        size_t workers = config.workers > 0 ? config.workers : 1;
+        for( size_t i = 0; i < workers; i++ ) {
+            m_workers.emplace_back(&TestServer::serve, this);
+        }
+    }
+
+    ~TestServer()
+    {
+        Stop();
+    }
+
+    // Delete copy constructor and assignment.
+    TestServer(TestServer const&) = delete;
+    TestServer& operator=(TestServer const&) = delete;
+
+    // Stop accepting connections, and wait for the ones in progress.
+    void Stop()
+    {
+        if( m_stopping.exchange(true) ) {
+            return;
+        }
+
+        try {
+            m_listener.Shutdown(SHUT_RDWR);
+        } catch( const SocketError& ) {
+            // Nothing more we can do - the workers will still notice
+            // we're stopping once they're woken.
+        }
+
+        for( auto& worker : m_workers ) {
+            worker.join();
+        }
+    }
+
+    const SocketAddress& Address() const { return m_address; }
+    uint16_t Port() const { return m_address.Port(); }
+    const TestServerConfig& Config() const { return m_config; }
+
+    // Completed and failed handshakes, so far.
+    size_t Accepted() const { return m_accepted.load(); }
+    size_t Failed() const { return m_failed.load(); }
+
+    // A server context with the configured protocols, ciphers and
+    // preference, using the given certificate.
+    static ssl::SSLContext MakeContext(const TestServerConfig& config,
+                                       const TestCertificate& cert)
+    {
+        ssl::SSLContext ctx(config.method);
+
+        if( 1 != ::SSL_CTX_use_certificate(ctx, cert.Certificate()) ||
+            1 != ::SSL_CTX_use_PrivateKey(ctx, cert.Key()) )
+        {
+            throw ssl::SSLError("error setting certificate");
+        }
+
+        if( !ctx.SetCipherList(config.ciphers.c_str()) ) {
+            throw ssl::SSLError("invalid cipher list");
+        }
+
+        if( config.serverPreference ) {
+            ::SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+        }
+
+        ::EC_KEY* ecdh = ::EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+        if( ecdh ) {
+            SSL_CTX_set_tmp_ecdh(static_cast< ::SSL_CTX* >(ctx), ecdh);
+            ::EC_KEY_free(ecdh);
+        }
+
+        return ctx;
+    }
+
+private:
+    static Socket listenOn(const std::string& host, uint16_t port)
+    {
+        auto addresses = SocketAddress::ResolveHost(host, std::to_string(port));
+        const SocketAddress& addr = addresses.get().at(0);
+
+        Socket sock(addr);
+        sock.SetReuseAddress();
+        sock.Bind(addr);
+        sock.Listen();
+        return sock;
+    }
+
+    void serve()
+    {
+        while( !m_stopping ) {
+            try {
+                Socket conn = m_listener.Accept();
+                handle(conn);
+            } catch( const SocketError& ) {
+                // Either we're stopping, or this connection went wrong;
+                // the loop condition sorts out which.
+            } catch( const ssl::SSLError& ) {
+                ERR_clear_error();
+                m_failed++;
+            }
+        }
+    }
+
+    void handle(Socket& conn)
+    {
+        // Don't let a client that goes quiet hold up a worker for long.
+        struct timeval timeout;
+        timeout.tv_sec = 5;
+        timeout.tv_usec = 0;
+        setsockopt(conn.GetFd(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn.GetFd(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        if( m_config.handshakeDelayMs > 0 ) {
+            std::this_thread::sleep_for(
+                    std::chrono::milliseconds(m_config.handshakeDelayMs));
+        }
+
+        ssl::SSL ssl(m_ctx);
+        ssl.SetFd(conn.GetFd());
+
+        if( 1 != ssl.Accept() ) {
+            ERR_clear_error();
+            m_failed++;
+            return;
+        }
+        m_accepted++;
+
+        char buff[1024];
+        if( ssl.Read(buff, sizeof(buff)) > 0 ) {
+            static const char response[] = "HTTP/1.0 200 OK\r\n"
+                                           "Content-Length: 0\r\n"
+                                           "Connection: close\r\n\r\n";
+            ssl.Write(response, sizeof(response) - 1);
+        }
+
+        ::SSL_shutdown(ssl);
+        ERR_clear_error();
+    }
+};
+
+#endif
@@ -25,11 +25,31 @@
  *
  *    3. This notice may not be removed or altered from any source
  *    distribution.
+ *
+ * ------------------------------------------------------------------
+ * ALTERED from the original: the pool keeps statistics - the depth of the
+ * task queue, and how busy each worker is - for live monitoring.  See
+ * QueueDepth(), Workers(), BusyWorkers() and BusyTime().
+ *
+ * ALTERED from the original: the workers can be split into shards, each
+ * with its own task queue, so that related tasks (e.g. everything for one
+ * host) can be kept on one set of threads with enqueueOn(), and threads
+ * in different shards never touch each other's queues.  A hook is run as
+ * each worker starts, e.g. to pin it to a CPU.
+ *
+ * ALTERED from the original: tasks have a priority class, and each shard
+ * keeps a queue per class.  Workers take the most urgent class first, but
+ * tasks that have waited longer than the aging limit get one pick in every
+ * AGING_SHARE, so lower classes are never starved, while higher classes
+ * still start within a bounded number of picks however many lower-class
+ * tasks are queued.  There's still no lock shared by every shard.
  */
 
 #include <vector>
 #include <queue>
 #include <memory>
+#include <atomic>
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
@@ -39,42 +59,123 @@
 
 class ThreadPool {
 public:
-    ThreadPool(size_t);
+    typedef std::function<void(size_t shard)> StartHook;
+    static const size_t NO_SHARD = static_cast<size_t>(-1);
+
+    // priority classes, 0 being the most urgent
+    enum { PRIORITIES = 3, DEFAULT_PRIORITY = 1, AGING_SHARE = 8 };
+
+    // worker i serves shard i % shards, and runs onStart first; tasks that
+    // have waited longer than 'aging' get a share of the workers whatever
+    // their priority
+    ThreadPool(size_t threads, size_t shards = 1, StartHook onStart = StartHook(),
+               std::chrono::milliseconds aging = std::chrono::milliseconds(1000));
+    // spread over the shards in turn
     template<class F, class... Args>
     auto enqueue(F&& f, Args&&... args)
         -> std::future<typename std::result_of<F(Args...)>::type>;
+    template<class F, class... Args>
+    auto enqueueOn(size_t shard, F&& f, Args&&... args)
+        -> std::future<typename std::result_of<F(Args...)>::type>;
+    // with a priority class, rather than the default
+    template<class F, class... Args>
+    auto enqueueWith(size_t shard, size_t priority, F&& f, Args&&... args)
+        -> std::future<typename std::result_of<F(Args...)>::type>;
     ~ThreadPool();
+
+    size_t Shards() const;
+    // the shard the calling thread serves, or NO_SHARD if it isn't a worker
+    static size_t CurrentShard();
+
+    // statistics, safe to call from any thread
+    size_t QueueDepth();
+    size_t Workers() const;
+    size_t BusyWorkers() const;
+    std::chrono::nanoseconds BusyTime() const;
 private:
+    struct Task {
+        std::function<void()> run;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    // a task queue per priority, and the workers waiting on them; padded so
+    // neighbouring shards' locks don't share a cache line
+    struct Shard {
+        std::queue< Task > tasks[PRIORITIES];
+        size_t queued;
+        size_t picks;
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool stop;
+        char padding[64];
+        Shard() : queued(0), picks(0), stop(false) {}
+    };
+
+    static size_t& currentShard();
+    // the queue to take the next task from; the shard's lock must be held
+    size_t pick(Shard& shard);
+
+    // each worker updates only its own stats, so they're never contended;
+    // the padding keeps neighbouring workers' stats off each other's cache
+    // lines (alignas() can't be used with new[] before C++17)
+    struct WorkerStats {
+        std::atomic<bool> busy;
+        std::atomic<uint64_t> busyNs;
+        char padding[128 - sizeof(std::atomic<bool>) - sizeof(std::atomic<uint64_t>)];
+        WorkerStats() : busy(false), busyNs(0) {}
+    };
+
     // need to keep track of threads so we can join them
     std::vector< std::thread > workers;
-    // the task queue
-    std::queue< std::function<void()> > tasks;
-
-    // synchronization
-    std::mutex queue_mutex;
-    std::condition_variable condition;
-    bool stop;
+    std::unique_ptr< WorkerStats[] > stats;
+    // the task queues
+    size_t num_shards;
+    std::unique_ptr< Shard[] > shards;
+    std::atomic<size_t> next_shard;
+    std::chrono::steady_clock::duration aging;
 };
 
 // the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(size_t threads)
-    :   stop(false)
+inline ThreadPool::ThreadPool(size_t threads, size_t numShards, StartHook onStart,
+                              std::chrono::milliseconds agingLimit)
+    :   stats(new WorkerStats[threads])
+    // every shard needs at least one worker
+    ,   num_shards(numShards < 1 ? 1 : numShards > threads && threads > 0 ? threads : numShards)
+    ,   shards(new Shard[num_shards])
+    ,   next_shard(0)
+    ,   aging(agingLimit)
 {
     for(size_t i = 0;i<threads;++i)
         workers.emplace_back(
-            [this]
+            [this, i, onStart]
             {
+                WorkerStats& mine = this->stats[i];
+                size_t index = i % this->num_shards;
+                Shard& shard = this->shards[index];
+                currentShard() = index;
+                if(onStart)
+                    onStart(index);
                 for(;;)
                 {
-                    std::unique_lock<std::mutex> lock(this->queue_mutex);
-                    while(!this->stop && this->tasks.empty())
-                        this->condition.wait(lock);
-                    if(this->stop && this->tasks.empty())
+                    std::unique_lock<std::mutex> lock(shard.mutex);
+                    while(!shard.stop && 0 == shard.queued)
+                        shard.condition.wait(lock);
+                    if(shard.stop && 0 == shard.queued)
                         return;
-                    std::function<void()> task(this->tasks.front());
-                    this->tasks.pop();
+                    std::queue< Task >& queue = shard.tasks[this->pick(shard)];
+                    std::function<void()> task(std::move(queue.front().run));
+                    queue.pop();
+                    shard.queued--;
                     lock.unlock();
+
+                    auto started = std::chrono::steady_clock::now();
+                    mine.busy.store(true, std::memory_order_relaxed);
                     task();
+                    mine.busy.store(false, std::memory_order_relaxed);
+                    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - started).count();
+                    mine.busyNs.store(mine.busyNs.load(std::memory_order_relaxed) + ns,
+                                      std::memory_order_relaxed);
                 }
             }
         );
@@ -84,11 +185,33 @@ inline ThreadPool::ThreadPool(size_t threads)
 template<class F, class... Args>
 auto ThreadPool::enqueue(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type>
+{
+    size_t shard = num_shards > 1
+        ? next_shard.fetch_add(1, std::memory_order_relaxed) % num_shards : 0;
+    return enqueueOn(shard, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+// add new work item to the given shard's queue
+template<class F, class... Args>
+auto ThreadPool::enqueueOn(size_t index, F&& f, Args&&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type>
+{
+    return enqueueWith(index, DEFAULT_PRIORITY, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+// add new work item to the given shard's queue for the given priority
+template<class F, class... Args>
+auto ThreadPool::enqueueWith(size_t index, size_t priority, F&& f, Args&&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type>
 {
     typedef typename std::result_of<F(Args...)>::type return_type;
 
+    Shard& shard = shards[index % num_shards];
+    if(priority >= PRIORITIES)
+        priority = PRIORITIES - 1;
+
     // don't allow enqueueing after stopping the pool
-    if(stop)
+    if(shard.stop)
         throw std::runtime_error("enqueue on stopped ThreadPool");
 
     auto task = std::make_shared< std::packaged_task<return_type()> >(
@@ -96,22 +219,104 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
         );
 
     std::future<return_type> res = task->get_future();
+    Task queued = { [task](){ (*task)(); }, std::chrono::steady_clock::now() };
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        tasks.push([task](){ (*task)(); });
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        shard.tasks[priority].push(std::move(queued));
+        shard.queued++;
     }
-    condition.notify_one();
+    shard.condition.notify_one();
     return res;
 }
 
+inline size_t ThreadPool::Shards() const
+{
+    return num_shards;
+}
+
+inline size_t& ThreadPool::currentShard()
+{
+    static thread_local size_t shard = NO_SHARD;
+    return shard;
+}
+
+inline size_t ThreadPool::CurrentShard()
+{
+    return currentShard();
+}
+
+// the most urgent class with work - except that every AGING_SHARE'th pick
+// goes to whichever task has waited longest, if that's past the aging limit
+inline size_t ThreadPool::pick(Shard& shard)
+{
+    size_t best = 0;
+    while(shard.tasks[best].empty())
+        ++best;
+
+    if(0 == ++shard.picks % AGING_SHARE)
+    {
+        auto oldest = shard.tasks[best].front().queued;
+        auto limit = std::chrono::steady_clock::now() - aging;
+        for(size_t p = best + 1;p<PRIORITIES;++p)
+        {
+            if(shard.tasks[p].empty())
+                continue;
+            auto queued = shard.tasks[p].front().queued;
+            if(queued <= limit && queued < oldest)
+            {
+                best = p;
+                oldest = queued;
+            }
+        }
+    }
+    return best;
+}
+
+inline size_t ThreadPool::QueueDepth()
+{
+    size_t depth = 0;
+    for(size_t i = 0;i<num_shards;++i)
+    {
+        std::unique_lock<std::mutex> lock(shards[i].mutex);
+        depth += shards[i].queued;
+    }
+    return depth;
+}
+
+inline size_t ThreadPool::Workers() const
+{
+    return workers.size();
+}
+
+inline size_t ThreadPool::BusyWorkers() const
+{
+    size_t busy = 0;
+    for(size_t i = 0;i<workers.size();++i)
+        busy += stats[i].busy.load(std::memory_order_relaxed) ? 1 : 0;
+    return busy;
+}
+
+// total time spent running tasks, over all workers - tasks still running
+// aren't counted until they finish
+inline std::chrono::nanoseconds ThreadPool::BusyTime() const
+{
+    uint64_t ns = 0;
+    for(size_t i = 0;i<workers.size();++i)
+        ns += stats[i].busyNs.load(std::memory_order_relaxed);
+    return std::chrono::nanoseconds(ns);
+}
+
 // the destructor joins all threads
 inline ThreadPool::~ThreadPool()
 {
+    for(size_t i = 0;i<num_shards;++i)
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop = true;
+        {
+            std::unique_lock<std::mutex> lock(shards[i].mutex);
+            shards[i].stop = true;
+        }
+        shards[i].condition.notify_all();
     }
-    condition.notify_all();
     for(size_t i = 0;i<workers.size();++i)
         workers[i].join();
 }
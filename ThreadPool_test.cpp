@@ -0,0 +1,101 @@
+#include <gtest/gtest.h>
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <future>
+#include <mutex>
+#include <vector>
+
+#include <unistd.h>
+
+
+namespace {
+
+// A single-worker pool, held up until Release(), so that everything queued
+// before then is picked in the pool's order - which Order() returns.
+class OrderedPool {
+private:
+    std::promise<void>  m_gate;
+    std::mutex          m_mutex;
+    std::vector<int>    m_order;
+
+public:
+    ThreadPool          pool;
+
+    explicit OrderedPool(std::chrono::milliseconds aging)
+        : pool(1, 1, ThreadPool::StartHook(), aging)
+    {
+        std::shared_future<void> gate = m_gate.get_future().share();
+        pool.enqueue([gate]() { gate.wait(); });
+    }
+
+    void Add(size_t priority, int id)
+    {
+        pool.enqueueWith(0, priority, [this, id]() {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_order.push_back(id);
+        });
+    }
+
+    void Release()
+    {
+        m_gate.set_value();
+    }
+
+    // Wait for everything queued so far.
+    std::vector<int> Order()
+    {
+        pool.enqueueWith(0, ThreadPool::PRIORITIES - 1, []() {}).get();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_order;
+    }
+
+    size_t Position(int id)
+    {
+        std::vector<int> order = Order();
+        return std::find(order.begin(), order.end(), id) - order.begin();
+    }
+};
+
+}
+
+
+TEST(ThreadPoolTest, MostUrgentFirst) {
+    OrderedPool ordered(std::chrono::hours(1));
+    ordered.Add(2, 20);
+    ordered.Add(1, 10);
+    ordered.Add(2, 21);
+    ordered.Add(0, 0);
+    ordered.Add(1, 11);
+    ordered.Release();
+
+    EXPECT_EQ(std::vector<int>({ 0, 10, 11, 20, 21 }), ordered.Order());
+}
+
+TEST(ThreadPoolTest, AgingPreventsStarvation) {
+    OrderedPool ordered(std::chrono::milliseconds(20));
+    ordered.Add(2, -1);
+    usleep(50 * 1000);
+
+    for( int i = 0; i < 100; i++ ) {
+        ordered.Add(0, i);
+    }
+    ordered.Release();
+
+    EXPECT_LT(ordered.Position(-1), static_cast<size_t>(ThreadPool::AGING_SHARE));
+}
+
+TEST(ThreadPoolTest, UrgentWorkIsntBuried) {
+    // However many aged, low-priority tasks there are, urgent ones only
+    // give up one pick in every AGING_SHARE to them.
+    OrderedPool ordered(std::chrono::milliseconds(1));
+    for( int i = 0; i < 100000; i++ ) {
+        ordered.Add(2, i);
+    }
+    usleep(10 * 1000);
+    ordered.Add(0, -1);
+    ordered.Release();
+
+    EXPECT_LE(ordered.Position(-1), 1u);
+}
@@ -0,0 +1,112 @@
+#ifndef TIMERQUEUE_HPP
+#define TIMERQUEUE_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+
+// Runs callbacks after a delay, on a single background thread.  Callbacks
+// should be short - typically they just put work back on a ThreadPool - so
+// that waiting for something never ties up a worker.
+//
+// NOTE: Callbacks that are still pending when the queue is destroyed are
+// dropped, so callers should make sure that everything has run first.
+class TimerQueue {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    struct Entry {
+        Clock::time_point       when;
+        uint64_t                seq;
+        std::function<void()>   fn;
+
+        // Earliest first, and FIFO for equal times.
+        bool operator>(const Entry& other) const
+        {
+            if( when != other.when ) {
+                return when > other.when;
+            }
+            return seq > other.seq;
+        }
+    };
+
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> m_entries;
+    uint64_t                m_nextSeq;
+
+    std::mutex              m_mutex;
+    std::condition_variable m_condition;
+    bool                    m_stop;
+    std::thread             m_thread;
+
+public:
+    TimerQueue()
+        : m_nextSeq(0), m_stop(false)
+    {
+        m_thread = std::thread(&TimerQueue::run, this);
+    }
+
+    ~TimerQueue()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_condition.notify_one();
+        m_thread.join();
+    }
+
+    // Delete copy constructor and assignment.
+    TimerQueue(TimerQueue const&) = delete;
+    TimerQueue& operator=(TimerQueue const&) = delete;
+
+    void Schedule(Clock::duration delay, std::function<void()> fn)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            Entry entry = { Clock::now() + delay, m_nextSeq++, std::move(fn) };
+            m_entries.push(std::move(entry));
+        }
+        m_condition.notify_one();
+    }
+
+    size_t Size()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_entries.size();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        while( !m_stop ) {
+            if( m_entries.empty() ) {
+                m_condition.wait(lock);
+                continue;
+            }
+
+            auto when = m_entries.top().when;
+            if( Clock::now() < when ) {
+                m_condition.wait_until(lock, when);
+                continue;
+            }
+
+            std::function<void()> fn = m_entries.top().fn;
+            m_entries.pop();
+
+            lock.unlock();
+            fn();
+            lock.lock();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,288 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include "PerThread.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+// One span of time on one thread, as a Chrome "complete" event.  All the
+// strings must be static (e.g. literals, or cipher names from OpenSSL's
+// table), since they're only read when the trace is written out.
+struct TraceEvent {
+    uint64_t    startNs;    // Since the tracer started.
+    uint64_t    durationNs;
+    const char* name;
+    const char* category;
+    const char* detail;     // Optional, e.g. the probe's cipher.
+    const char* result;     // Optional, e.g. the probe's outcome.
+    uint32_t    target;     // From Tracer::Register().
+    uint32_t    thread;
+};
+
+
+// Records a timeline of what each thread was doing - which target it was
+// working on, and in which phase - and writes it out in the Chrome trace
+// event format, to be viewed in Perfetto (ui.perfetto.dev) or
+// chrome://tracing.
+//
+// Each thread records into its own fixed-size ring buffer, so recording
+// takes no locks, and a long scan keeps only the latest events of each
+// thread.  To keep the cost down on big scans, only a sample of targets
+// is traced at all: one in every 'sampleEvery', picked by a hash of the
+// target's name so that a traced target is traced from start to finish.
+class Tracer {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    struct Ring {
+        std::vector<TraceEvent> events;
+        uint64_t                written;
+
+        Ring() : written(0) { }
+    };
+
+    size_t              m_capacity;
+    size_t              m_sampleEvery;
+    Clock::time_point   m_started;
+
+    PerThread<Ring>     m_rings;
+
+    // For the shared ring, when there are too many threads for one each.
+    std::mutex          m_sharedMutex;
+
+    std::mutex                  m_targetsMutex;
+    std::vector<std::string>    m_targets;
+
+public:
+    // Keep up to 'capacity' events for each thread (rounded up to a power
+    // of two).
+    Tracer(size_t capacity, size_t sampleEvery = 1)
+        : m_capacity(1)
+        , m_sampleEvery(sampleEvery > 0 ? sampleEvery : 1)
+        , m_started(Clock::now())
+    {
+        while( m_capacity < capacity ) {
+            m_capacity *= 2;
+        }
+
+        // Zero is for events that aren't about a particular target.
+        m_targets.push_back("");
+    }
+
+    // Delete copy constructor and assignment.
+    Tracer(Tracer const&) = delete;
+    Tracer& operator=(Tracer const&) = delete;
+
+    // Whether something with the given name should be traced.
+    bool Sampled(const std::string& name) const
+    {
+        return 1 == m_sampleEvery ||
+               0 == std::hash<std::string>()(name) % m_sampleEvery;
+    }
+
+    // Get an ID for a target, to tag its events with.  This takes a lock,
+    // so call it once per (sampled) target, not per event.
+    uint32_t Register(const std::string& name)
+    {
+        std::unique_lock<std::mutex> lock(m_targetsMutex);
+        m_targets.push_back(name);
+        return static_cast<uint32_t>(m_targets.size() - 1);
+    }
+
+    void Record(const char* name, const char* category, uint32_t target,
+                Clock::time_point start, Clock::time_point end,
+                const char* detail = nullptr, const char* result = nullptr)
+    {
+        TraceEvent event;
+        event.startNs = toNs(start - m_started);
+        event.durationNs = end > start ? toNs(end - start) : 0;
+        event.name = name;
+        event.category = category;
+        event.detail = detail;
+        event.result = result;
+        event.target = target;
+        event.thread = static_cast<uint32_t>(CurrentThreadIndex());
+
+        bool exclusive;
+        Ring& ring = m_rings.Local(exclusive);
+
+        std::unique_lock<std::mutex> lock(m_sharedMutex, std::defer_lock);
+        if( !exclusive ) {
+            lock.lock();
+        }
+
+        if( ring.events.empty() ) {
+            ring.events.resize(m_capacity);
+        }
+        ring.events[ring.written & (m_capacity - 1)] = event;
+        ring.written++;
+    }
+
+    // Write out everything we've kept, as Chrome trace JSON.  Only call
+    // this once every thread has stopped recording.
+    void Write(std::ostream& out) const
+    {
+        uint64_t dropped = 0;
+        std::vector<uint32_t> threads;
+
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+
+        m_rings.ForEach([&](const Ring& ring) {
+            uint64_t kept = std::min<uint64_t>(ring.written, m_capacity);
+            dropped += ring.written - kept;
+
+            for( uint64_t i = ring.written - kept; i < ring.written; i++ ) {
+                const TraceEvent& event = ring.events[i & (m_capacity - 1)];
+                writeEvent(out, event, first);
+                first = false;
+
+                if( std::find(threads.begin(), threads.end(), event.thread) == threads.end() ) {
+                    threads.push_back(event.thread);
+                }
+            }
+        });
+
+        for( auto thread : threads ) {
+            out << (first ? "\n" : ",\n")
+                << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << thread
+                << ",\"args\":{\"name\":\"thread " << thread << "\"}}";
+            first = false;
+        }
+
+        out << "\n],\"otherData\":{\"droppedEvents\":" << dropped
+            << ",\"sampleEvery\":" << m_sampleEvery << "}}\n";
+    }
+
+    bool WriteFile(const std::string& path) const
+    {
+        std::ofstream out(path);
+        if( !out ) {
+            return false;
+        }
+        Write(out);
+        return static_cast<bool>(out);
+    }
+
+private:
+    static uint64_t toNs(Clock::duration d)
+    {
+        return static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+    }
+
+    static void writeString(std::ostream& out, const char* str)
+    {
+        out << '"';
+        for( const char* p = str; *p; p++ ) {
+            if( '"' == *p || '\\' == *p ) {
+                out << '\\' << *p;
+            } else if( static_cast<unsigned char>(*p) >= 0x20 ) {
+                out << *p;
+            }
+        }
+        out << '"';
+    }
+
+    void writeEvent(std::ostream& out, const TraceEvent& event, bool first) const
+    {
+        // Timestamps are in microseconds.
+        out << (first ? "\n" : ",\n")
+            << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+            << ",\"ts\":" << event.startNs / 1000 << "." << pad3(event.startNs % 1000)
+            << ",\"dur\":" << event.durationNs / 1000 << "." << pad3(event.durationNs % 1000)
+            << ",\"name\":";
+        writeString(out, event.name);
+        out << ",\"cat\":";
+        writeString(out, event.category);
+
+        out << ",\"args\":{";
+        const char* sep = "";
+        if( event.target > 0 && event.target < m_targets.size() ) {
+            out << "\"target\":";
+            writeString(out, m_targets[event.target].c_str());
+            sep = ",";
+        }
+        if( event.detail ) {
+            out << sep << "\"detail\":";
+            writeString(out, event.detail);
+            sep = ",";
+        }
+        if( event.result ) {
+            out << sep << "\"result\":";
+            writeString(out, event.result);
+        }
+        out << "}}";
+    }
+
+    static std::string pad3(uint64_t value)
+    {
+        std::string ret = std::to_string(value);
+        return std::string(3 - ret.size(), '0') + ret;
+    }
+};
+
+
+// Records a span from construction until End() (or destruction).  A null
+// tracer turns this into a no-op, so untraced targets only pay for a
+// check.
+class TraceSpan {
+private:
+    Tracer*             m_tracer;
+    const char*         m_name;
+    const char*         m_category;
+    uint32_t            m_target;
+    const char*         m_detail;
+    const char*         m_result;
+    Tracer::Clock::time_point m_started;
+
+public:
+    TraceSpan(Tracer* tracer, const char* name, const char* category,
+              uint32_t target = 0, const char* detail = nullptr)
+        : m_tracer(tracer)
+        , m_name(name)
+        , m_category(category)
+        , m_target(target)
+        , m_detail(detail)
+        , m_result(nullptr)
+    {
+        if( m_tracer ) {
+            m_started = Tracer::Clock::now();
+        }
+    }
+
+    ~TraceSpan()
+    {
+        End();
+    }
+
+    // Delete copy constructor and assignment.
+    TraceSpan(TraceSpan const&) = delete;
+    TraceSpan& operator=(TraceSpan const&) = delete;
+
+    void SetResult(const char* result)
+    {
+        m_result = result;
+    }
+
+    void End()
+    {
+        if( m_tracer ) {
+            m_tracer->Record(m_name, m_category, m_target, m_started,
+                             Tracer::Clock::now(), m_detail, m_result);
+            m_tracer = nullptr;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,55 @@
+#include <gtest/gtest.h>
+
+#include "Trace.hpp"
+
+#include <sstream>
+#include <string>
+
+
+static size_t countOf(const std::string& haystack, const std::string& needle)
+{
+    size_t count = 0;
+    for( size_t pos = haystack.find(needle); pos != std::string::npos;
+         pos = haystack.find(needle, pos + 1) ) {
+        count++;
+    }
+    return count;
+}
+
+TEST(TracerTest, KeepsLatestEvents) {
+    Tracer tracer(4);
+    uint32_t id = tracer.Register("example.com:443");
+
+    auto now = Tracer::Clock::now();
+    for( int i = 0; i < 6; i++ ) {
+        tracer.Record(i < 2 ? "old" : "new", "phase", id, now, now, "detail", "accepted");
+    }
+
+    std::ostringstream out;
+    tracer.Write(out);
+    std::string json = out.str();
+
+    EXPECT_EQ(0u, countOf(json, "\"old\""));
+    EXPECT_EQ(4u, countOf(json, "\"new\""));
+    EXPECT_EQ(4u, countOf(json, "\"target\":\"example.com:443\""));
+    EXPECT_NE(std::string::npos, json.find("\"droppedEvents\":2"));
+}
+
+TEST(TracerTest, Sampling) {
+    Tracer all(16, 1);
+    EXPECT_TRUE(all.Sampled("a"));
+
+    Tracer some(16, 4);
+    size_t sampled = 0;
+    for( int i = 0; i < 4000; i++ ) {
+        sampled += some.Sampled("host" + std::to_string(i)) ? 1 : 0;
+    }
+    EXPECT_GT(sampled, 800u);
+    EXPECT_LT(sampled, 1200u);
+}
+
+TEST(TraceSpanTest, NullTracerIsNoOp) {
+    TraceSpan span(nullptr, "handshake", "phase");
+    span.SetResult("accepted");
+    span.End();
+}
@@ -0,0 +1,66 @@
+#ifndef WAITGROUP_HPP
+#define WAITGROUP_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+
+// Counts outstanding pieces of work, and lets a thread wait for all of
+// them to finish.  Work that re-queues itself (e.g. after a delay) stays
+// counted until it's really done, unlike with ThreadPool's destructor,
+// which only waits for the queue to drain.
+class WaitGroup {
+private:
+    size_t                  m_count;
+    std::mutex              m_mutex;
+    std::condition_variable m_condition;
+
+public:
+    WaitGroup()
+        : m_count(0)
+    { }
+
+    // Delete copy constructor and assignment.
+    WaitGroup(WaitGroup const&) = delete;
+    WaitGroup& operator=(WaitGroup const&) = delete;
+
+    void Add(size_t n = 1)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_count += n;
+    }
+
+    void Done()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if( 0 == --m_count ) {
+            m_condition.notify_all();
+        }
+    }
+
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while( m_count > 0 ) {
+            m_condition.wait(lock);
+        }
+    }
+
+    // As Wait(), but give up after 'timeout'.  Returns whether everything
+    // finished.
+    template <typename Rep, typename Period>
+    bool WaitFor(std::chrono::duration<Rep, Period> timeout)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_condition.wait_for(lock, timeout, [this]() { return 0 == m_count; });
+    }
+
+    size_t Count()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_count;
+    }
+};
+
+#endif
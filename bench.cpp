@@ -0,0 +1,661 @@
+// Micro-benchmarks for the scanner's hot paths.  Run with "make bench",
+// which writes the results as JSON so that later changes can be compared
+// against a baseline.
+
+#include "BinaryLog.hpp"
+#include "Ciphers.hpp"
+#include "Expected.hpp"
+#include "FlightRecorder.hpp"
+#include "FramePool.hpp"
+#include "Histogram.hpp"
+#include "Probe.hpp"
+#include "RetryPolicy.hpp"
+#include "RttEstimator.hpp"
+#include "ScanReactor.hpp"
+#include "ShardedLogger.hpp"
+#include "SSL.hpp"
+#include "TestServer.hpp"
+#include "ThreadPool.h"
+#include "Trace.hpp"
+#include "cpplog.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+
+#include <benchmark/benchmark.h>
+
+
+namespace {
+
+// The methods that we benchmark SSL setup with.  SSLv2 and SSLv3 are left
+// out, since they're often compiled out of OpenSSL entirely.
+const ::SSL_METHOD* benchMethod(int index)
+{
+    switch( index ) {
+        case 0:  return ::TLSv1_method();
+        case 1:  return ::TLSv1_1_method();
+        default: return ::TLSv1_2_method();
+    }
+}
+
+
+// ThreadPool
+// --------------------------------------------------
+
+std::unique_ptr<ThreadPool> benchPool;
+std::atomic<long> benchTasks;
+
+void setupPool(const benchmark::State& state)
+{
+    benchTasks = 0;
+    benchPool.reset(new ThreadPool(state.range(0)));
+}
+
+// A worker per shard.
+void setupShardedPool(const benchmark::State& state)
+{
+    benchTasks = 0;
+    benchPool.reset(new ThreadPool(state.range(0), state.range(0)));
+}
+
+void teardownPool(const benchmark::State&)
+{
+    // Waits for every queued task.
+    benchPool.reset();
+}
+
+// Enqueue no-op tasks from every benchmark thread at once, so we measure
+// the cost of queueing (including contention on the pool's lock), not of
+// running tasks.  The argument is the number of workers.
+void BM_ThreadPoolEnqueue(benchmark::State& state)
+{
+    for( auto _ : state ) {
+        benchPool->enqueue([]() {
+            benchTasks.fetch_add(1, std::memory_order_relaxed);
+        });
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ThreadPoolEnqueue)
+    ->Setup(setupPool)->Teardown(teardownPool)
+    ->Arg(1)->Arg(4)->Arg(16)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+// As above, but with each benchmark thread queueing on a shard of its own,
+// so they don't contend for a lock.
+void BM_ThreadPoolEnqueueSharded(benchmark::State& state)
+{
+    size_t shard = static_cast<size_t>(state.thread_index());
+    for( auto _ : state ) {
+        benchPool->enqueueOn(shard, []() {
+            benchTasks.fetch_add(1, std::memory_order_relaxed);
+        });
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ThreadPoolEnqueueSharded)
+    ->Setup(setupShardedPool)->Teardown(teardownPool)
+    ->Arg(4)->Arg(16)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+// Enqueue a task and wait for its result - the latency of a round trip
+// through the pool when it's otherwise idle.
+void BM_ThreadPoolRoundTrip(benchmark::State& state)
+{
+    ThreadPool pool(state.range(0));
+    for( auto _ : state ) {
+        auto result = pool.enqueue([]() { return 1; });
+        benchmark::DoNotOptimize(result.get());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ThreadPoolRoundTrip)->Arg(1)->Arg(4)->UseRealTime();
+
+
+// Expected
+// --------------------------------------------------
+
+void BM_ExpectedSuccess(benchmark::State& state)
+{
+    for( auto _ : state ) {
+        Expected<std::string> value(std::string("example.com"));
+        benchmark::DoNotOptimize(value.valid());
+        benchmark::DoNotOptimize(value.get().data());
+    }
+}
+BENCHMARK(BM_ExpectedSuccess);
+
+void BM_ExpectedFailure(benchmark::State& state)
+{
+    for( auto _ : state ) {
+        auto value = Expected<std::string>::fromException(std::runtime_error("failed"));
+        benchmark::DoNotOptimize(value.valid());
+    }
+}
+BENCHMARK(BM_ExpectedFailure);
+
+// A failed value, unwrapped the usual way - by get() rethrowing.
+void BM_ExpectedFailureGet(benchmark::State& state)
+{
+    auto value = Expected<std::string>::fromException(std::runtime_error("failed"));
+    for( auto _ : state ) {
+        try {
+            benchmark::DoNotOptimize(value.get());
+        } catch( const std::runtime_error& e ) {
+            benchmark::DoNotOptimize(e.what());
+        }
+    }
+}
+BENCHMARK(BM_ExpectedFailureGet);
+
+void BM_ExpectedFromCode(benchmark::State& state)
+{
+    for( auto _ : state ) {
+        auto value = Expected<int>::fromCode([]() { return 42; });
+        benchmark::DoNotOptimize(value.get());
+    }
+}
+BENCHMARK(BM_ExpectedFromCode);
+
+
+// SSL
+// --------------------------------------------------
+
+void BM_SSLContextCreate(benchmark::State& state)
+{
+    const ::SSL_METHOD* method = benchMethod(state.range(0));
+    for( auto _ : state ) {
+        ssl::SSLContext ctx(method);
+        benchmark::DoNotOptimize(static_cast< ::SSL_CTX* >(ctx));
+    }
+}
+BENCHMARK(BM_SSLContextCreate)->DenseRange(0, 2);
+
+// What every probe does: a context restricted to a single cipher, and a
+// connection object for it.
+void BM_SSLProbeSetup(benchmark::State& state)
+{
+    const ::SSL_METHOD* method = benchMethod(state.range(0));
+    CipherList ciphers = getSupportedCiphers(method);
+    const char* cipher = ciphers.front().Name();
+
+    for( auto _ : state ) {
+        ssl::SSLContext ctx(method);
+        ctx.SetCipherList(cipher);
+        ssl::SSL ssl(ctx);
+        benchmark::DoNotOptimize(static_cast< ::SSL* >(ssl));
+    }
+}
+BENCHMARK(BM_SSLProbeSetup)->DenseRange(0, 2);
+
+// The same, with the context from a cache, as the scanner does.
+void BM_SSLProbeSetupCached(benchmark::State& state)
+{
+    const ::SSL_METHOD* method = benchMethod(state.range(0));
+    CipherList ciphers = getSupportedCiphers(method);
+    ssl::SSLContextCache contexts(ciphers.size());
+
+    // TLS 1.3 suites can't be set as a cipher list; skip past them.
+    ssl::SSLContext* ctx = nullptr;
+    for( size_t i = 0; !ctx && i < ciphers.size(); i++ ) {
+        ctx = contexts.Get(i, method, ciphers[i].Name());
+    }
+    if( !ctx ) {
+        state.SkipWithError("no usable cipher");
+        return;
+    }
+
+    for( auto _ : state ) {
+        ssl::SSL ssl(*ctx);
+        benchmark::DoNotOptimize(static_cast< ::SSL* >(ssl));
+    }
+}
+BENCHMARK(BM_SSLProbeSetupCached)->DenseRange(0, 2);
+
+void BM_SSLCreate(benchmark::State& state)
+{
+    ssl::SSLContext ctx(benchMethod(state.range(0)));
+    for( auto _ : state ) {
+        ssl::SSL ssl(ctx);
+        benchmark::DoNotOptimize(static_cast< ::SSL* >(ssl));
+    }
+}
+BENCHMARK(BM_SSLCreate)->DenseRange(0, 2);
+
+void BM_GetSupportedCiphers(benchmark::State& state)
+{
+    const ::SSL_METHOD* method = benchMethod(state.range(0));
+    for( auto _ : state ) {
+        CipherList ciphers = getSupportedCiphers(method);
+        benchmark::DoNotOptimize(ciphers.data());
+    }
+}
+BENCHMARK(BM_GetSupportedCiphers)->DenseRange(0, 2);
+
+
+// cpplog
+// --------------------------------------------------
+
+// Throws every message away, so we measure the cost of LOG itself.
+class NullLogger : public cpplog::BaseLogger {
+public:
+    virtual bool sendLogMessage(cpplog::LogData*)
+    {
+        return true;
+    }
+};
+
+void BM_LogMessage(benchmark::State& state)
+{
+    NullLogger logger;
+    for( auto _ : state ) {
+        LOG(LL_INFO, logger) << "Scanning: " << "example.com" << ":" << 443;
+    }
+}
+BENCHMARK(BM_LogMessage);
+
+// Below CPPLOG_FILTER_LEVEL, so this should compile to nothing.
+void BM_LogFiltered(benchmark::State& state)
+{
+    NullLogger logger;
+    for( auto _ : state ) {
+        LOG(LL_TRACE, logger) << "Scanning: " << "example.com" << ":" << 443;
+    }
+}
+BENCHMARK(BM_LogFiltered);
+
+void BM_LogStringLogger(benchmark::State& state)
+{
+    cpplog::StringLogger logger;
+    for( auto _ : state ) {
+        LOG(LL_INFO, logger) << "Scanning: " << "example.com" << ":" << 443;
+        if( (state.iterations() & 1023) == 0 ) {
+            state.PauseTiming();
+            logger.clear();
+            state.ResumeTiming();
+        }
+    }
+}
+BENCHMARK(BM_LogStringLogger);
+
+// Handing messages to a background thread, from several threads at once.
+// This includes the background thread's work (on the same CPUs), and
+// waiting for it to catch up at the end.
+void BM_LogBackground(benchmark::State& state)
+{
+    static NullLogger logger;
+    static std::unique_ptr<cpplog::BackgroundLogger> background;
+    if( 0 == state.thread_index() ) {
+        background.reset(new cpplog::BackgroundLogger(logger));
+    }
+
+    for( auto _ : state ) {
+        LOG(LL_INFO, *background) << "Scanning: " << "example.com" << ":" << 443;
+    }
+
+    if( 0 == state.thread_index() ) {
+        background.reset();
+    }
+}
+BENCHMARK(BM_LogBackground)->ThreadRange(1, 4);
+
+// Logging through a ShardedLogger, from several threads at once.  The
+// merger runs on its own thread, so this is the cost of queueing.
+void BM_LogSharded(benchmark::State& state)
+{
+    static NullLogger sink;
+    static std::unique_ptr<ShardedLogger> logger;
+    if( 0 == state.thread_index() ) {
+        logger.reset(new ShardedLogger());
+        logger->AddSink(sink);
+        logger->Start();
+    }
+
+    for( auto _ : state ) {
+        LOG(LL_INFO, *logger) << "Scanning: " << "example.com" << ":" << 443;
+    }
+
+    if( 0 == state.thread_index() ) {
+        state.counters["dropped"] = static_cast<double>(logger->Dropped());
+        logger.reset();
+    }
+}
+BENCHMARK(BM_LogSharded)->ThreadRange(1, 4);
+
+// Logging straight to an AsyncFileLogger, which copies the message into
+// its current buffer; the writing happens on its own thread.
+void BM_LogAsyncFile(benchmark::State& state)
+{
+    static std::unique_ptr<cpplog::AsyncFileLogger> logger;
+    if( 0 == state.thread_index() ) {
+        logger.reset(new cpplog::AsyncFileLogger("/dev/null"));
+    }
+
+    for( auto _ : state ) {
+        LOG(LL_INFO, *logger) << "Scanning: " << "example.com" << ":" << 443;
+    }
+
+    if( 0 == state.thread_index() ) {
+        state.counters["dropped"] = static_cast<double>(logger->Dropped());
+        logger.reset();
+    }
+}
+BENCHMARK(BM_LogAsyncFile)->ThreadRange(1, 4);
+
+// The same message through a BinaryLogger, which only copies the arguments
+// on the calling thread.  The output is thrown away, so this measures the
+// call site; messages the drainer doesn't keep up with are dropped.
+void BM_LogBinary(benchmark::State& state)
+{
+    static std::unique_ptr<binlog::BinaryLogger> logger;
+    if( 0 == state.thread_index() ) {
+        logger.reset(new binlog::BinaryLogger("/dev/null", 16 << 20,
+                                              std::chrono::milliseconds(5)));
+    }
+
+    for( auto _ : state ) {
+        BINLOG(LL_INFO, *logger, "Scanning: {}:{}", "example.com", 443);
+    }
+
+    if( 0 == state.thread_index() ) {
+        state.counters["dropped"] = static_cast<double>(logger->Dropped());
+        logger.reset();
+    }
+}
+BENCHMARK(BM_LogBinary)->ThreadRange(1, 4);
+
+// Recording a probe's start in the flight recorder, as every probe does.
+void BM_FlightRecord(benchmark::State& state)
+{
+    static FlightRecorder recorder;
+    recorder.Install();
+
+    std::string host = "example.com";
+    for( auto _ : state ) {
+        FLIGHT("{}:{}: probe {} {} (attempt {})", host, 443, "TLSv1.2",
+               "ECDHE-RSA-AES128-GCM-SHA256", 1);
+    }
+}
+BENCHMARK(BM_FlightRecord)->ThreadRange(1, 4);
+
+
+// Latency histograms
+// --------------------------------------------------
+
+// The cost of recording one sample, from each of several threads at once.
+void BM_LatencyRecord(benchmark::State& state)
+{
+    static LatencyRecorder recorder;
+    std::chrono::nanoseconds elapsed(1000 + state.thread_index() * 7919);
+
+    for( auto _ : state ) {
+        recorder.Record(ScanPhase::Handshake, elapsed);
+        elapsed += std::chrono::nanoseconds(13);
+    }
+}
+BENCHMARK(BM_LatencyRecord)->ThreadRange(1, 8);
+
+
+// Tracing
+// --------------------------------------------------
+
+// The cost of recording one span of a traced target, with the clock reads
+// that TraceSpan does.
+void BM_TraceSpan(benchmark::State& state)
+{
+    static Tracer tracer(1 << 16);
+
+    for( auto _ : state ) {
+        TraceSpan span(&tracer, "handshake", "phase", 1);
+        span.SetResult("accepted");
+    }
+}
+BENCHMARK(BM_TraceSpan)->ThreadRange(1, 8);
+
+// ... and of an untraced one.
+void BM_TraceSpanUnsampled(benchmark::State& state)
+{
+    for( auto _ : state ) {
+        TraceSpan span(nullptr, "handshake", "phase", 1);
+        span.SetResult("accepted");
+        benchmark::DoNotOptimize(&span);
+    }
+}
+BENCHMARK(BM_TraceSpanUnsampled);
+
+
+// Loopback scan
+// --------------------------------------------------
+
+// A set of local TLS servers with a mix of configurations, and the probes
+// that the scanner would run against them.  Built once, on first use.
+struct LoopbackFixture {
+    TestCertificate                             cert;
+    std::vector<std::unique_ptr<TestServer>>    servers;
+    std::vector<CipherProbe>                    probes;
+
+    LoopbackFixture()
+    {
+        TestServerConfig config;
+        config.workers = 16;
+
+        // Anything goes.
+        servers.emplace_back(new TestServer(config, cert));
+
+        // A modern server that picks its own cipher.
+        config.method = ::TLSv1_2_server_method();
+        config.ciphers = "ECDHE-RSA-AES128-GCM-SHA256:AES256-GCM-SHA384:AES128-SHA";
+        config.serverPreference = true;
+        servers.emplace_back(new TestServer(config, cert));
+
+        // An old server with a short cipher list.
+        config.method = ::TLSv1_server_method();
+        config.ciphers = "AES128-SHA:DES-CBC3-SHA";
+        config.serverPreference = false;
+        servers.emplace_back(new TestServer(config, cert));
+
+        // A slow one.
+        config.method = ::SSLv23_server_method();
+        config.ciphers = "HIGH";
+        config.handshakeDelayMs = 2;
+        servers.emplace_back(new TestServer(config, cert));
+
+        const std::pair<const ::SSL_METHOD*, const char*> methods[] = {
+            { ::TLSv1_method(),   "TLSv1" },
+            { ::TLSv1_1_method(), "TLSv1.1" },
+            { ::TLSv1_2_method(), "TLSv1.2" },
+        };
+        for( auto& method : methods ) {
+            for( auto& cipher : getSupportedCiphers(method.first) ) {
+                CipherProbe probe = { method.first, method.second, cipher };
+                probes.push_back(probe);
+            }
+        }
+    }
+};
+
+LoopbackFixture& loopbackFixture()
+{
+    static LoopbackFixture fixture;
+    return fixture;
+}
+
+double percentile(std::vector<double>& values, double p)
+{
+    if( values.empty() ) {
+        return 0;
+    }
+
+    size_t index = static_cast<size_t>(p * (values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+// Run the real per-target scan path against every loopback server, a few
+// times over so there's enough parallel work, on a pool of the given
+// number of threads (the equivalent of --threads).  Reports probes/sec,
+// and the probe latency percentiles in milliseconds.
+void BM_ScanLoopback(benchmark::State& state)
+{
+    const size_t targetsPerServer = 4;
+
+    LoopbackFixture& fixture = loopbackFixture();
+
+    ScanOptions options;
+    options.connectTimeoutMs = 2000;
+    options.handshakeTimeoutMs = 5000;
+    options.adaptiveTimeouts = false;
+    options.abortiveClose = true;
+
+    std::vector<double> latencies;
+    size_t probes = 0;
+    size_t accepted = 0;
+
+    for( auto _ : state ) {
+        HostTimings timings(options.maxTimeoutMs, options.adaptiveTimeouts);
+        RetryPolicy retries(0, 0, 0);
+
+        std::vector<std::future<std::unique_ptr<TargetScan>>> scans;
+        {
+            ThreadPool pool(state.range(0));
+            for( size_t i = 0; i < targetsPerServer; i++ ) {
+                for( auto& server : fixture.servers ) {
+                    std::vector<SocketAddress> addresses(1, server->Address());
+                    scans.push_back(pool.enqueue([&, addresses]() {
+                        std::unique_ptr<TargetScan> scan(new TargetScan(
+                                "127.0.0.1", addresses[0].Port(), addresses,
+                                fixture.probes, options, timings, retries));
+
+                        ProbeClock::duration retryAfter;
+                        scan->Run(retryAfter);
+                        return scan;
+                    }));
+                }
+            }
+        }
+
+        state.PauseTiming();
+        for( auto& scan : scans ) {
+            for( auto& result : scan.get()->Results() ) {
+                latencies.push_back(std::chrono::duration<double, std::milli>(
+                        result.elapsed).count());
+                accepted += (ProbeStatus::Accepted == result.status);
+                probes++;
+            }
+        }
+        state.ResumeTiming();
+    }
+
+    state.counters["probes_per_second"] = benchmark::Counter(
+            static_cast<double>(probes), benchmark::Counter::kIsRate);
+    state.counters["accepted"] = benchmark::Counter(
+            static_cast<double>(accepted), benchmark::Counter::kAvgIterations);
+    state.counters["p50_ms"] = percentile(latencies, 0.50);
+    state.counters["p99_ms"] = percentile(latencies, 0.99);
+}
+BENCHMARK(BM_ScanLoopback)
+    ->RangeMultiplier(2)->Range(1, 32)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// The same scans, driven by the given number of ScanReactors (the
+// equivalent of --reactor), instead of a thread per scan.
+void BM_ScanLoopbackReactor(benchmark::State& state)
+{
+    const size_t targetsPerServer = 4;
+
+    LoopbackFixture& fixture = loopbackFixture();
+
+    ScanOptions options;
+    options.connectTimeoutMs = 2000;
+    options.handshakeTimeoutMs = 5000;
+    options.adaptiveTimeouts = false;
+    options.abortiveClose = true;
+
+    FramePool frames;
+    std::vector<double> latencies;
+    size_t probes = 0;
+    size_t accepted = 0;
+
+    for( auto _ : state ) {
+        HostTimings timings(options.maxTimeoutMs, options.adaptiveTimeouts);
+        RetryPolicy retries(0, 0, 0);
+
+        std::mutex mutex;
+        std::vector<std::shared_ptr<TargetScan>> done;
+        {
+            std::vector<std::unique_ptr<ScanReactor>> reactors;
+            for( int64_t i = 0; i < state.range(0); i++ ) {
+                reactors.emplace_back(new ScanReactor([&](std::shared_ptr<TargetScan> scan) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    done.push_back(std::move(scan));
+                }));
+            }
+
+            size_t next = 0;
+            for( size_t i = 0; i < targetsPerServer; i++ ) {
+                for( auto& server : fixture.servers ) {
+                    std::vector<SocketAddress> addresses(1, server->Address());
+                    reactors[next++ % reactors.size()]->Add(std::allocate_shared<TargetScan>(
+                            FrameAllocator<TargetScan>(frames),
+                            "127.0.0.1", addresses[0].Port(), addresses,
+                            fixture.probes, options, timings, retries));
+                }
+            }
+        }
+
+        state.PauseTiming();
+        for( auto& scan : done ) {
+            for( auto& result : scan->Results() ) {
+                latencies.push_back(std::chrono::duration<double, std::milli>(
+                        result.elapsed).count());
+                accepted += (ProbeStatus::Accepted == result.status);
+                probes++;
+            }
+        }
+        done.clear();
+        state.ResumeTiming();
+    }
+
+    state.counters["probes_per_second"] = benchmark::Counter(
+            static_cast<double>(probes), benchmark::Counter::kIsRate);
+    state.counters["accepted"] = benchmark::Counter(
+            static_cast<double>(accepted), benchmark::Counter::kAvgIterations);
+    state.counters["p50_ms"] = percentile(latencies, 0.50);
+    state.counters["p99_ms"] = percentile(latencies, 0.99);
+}
+BENCHMARK(BM_ScanLoopbackReactor)
+    ->RangeMultiplier(2)->Range(1, 4)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+}
+
+
+int main(int argc, char** argv)
+{
+    SSL_library_init();
+    SSL_load_error_strings();
+
+    // The loopback servers write to connections that probes have reset.
+    signal(SIGPIPE, SIG_IGN);
+
+    benchmark::Initialize(&argc, argv);
+    if( benchmark::ReportUnrecognizedArguments(argc, argv) ) {
+        return 1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
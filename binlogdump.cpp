@@ -0,0 +1,162 @@
+// Renders a binary log (written by a binlog::BinaryLogger) as text, one
+// message per line, in the order they were logged:
+//
+//      2026-10-18 09:14:02.123456789 [3] DEBUG - Probe.hpp(212): ...
+//
+// The number in brackets is the thread that logged the message.
+//
+// Usage:
+//      binlogdump <file>
+
+#include "BinaryLog.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+
+namespace {
+
+struct Message {
+    uint64_t        time;
+    uint32_t        thread;
+    uint32_t        id;
+    std::string     args;
+};
+
+template <typename T>
+bool get(std::istream& in, T& value)
+{
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+bool getBytes(std::istream& in, std::string& out, size_t length)
+{
+    out.resize(length);
+    return length == 0 || static_cast<bool>(in.read(&out[0], length));
+}
+
+bool getString16(std::istream& in, std::string& out)
+{
+    uint16_t length;
+    return get(in, length) && getBytes(in, out, length);
+}
+
+bool readDescriptor(std::istream& in, binlog::Descriptor& desc)
+{
+    uint32_t level;
+    uint8_t count;
+    if( !get(in, desc.id) || !get(in, level) || !get(in, desc.line) ||
+        !getString16(in, desc.file) || !getString16(in, desc.format) ||
+        !get(in, count) )
+    {
+        return false;
+    }
+    desc.level = static_cast<cpplog::loglevel_t>(level);
+
+    desc.types.clear();
+    for( uint8_t i = 0; i < count; i++ ) {
+        uint8_t type;
+        if( !get(in, type) || type > static_cast<uint8_t>(binlog::ArgType::Pointer) ) {
+            return false;
+        }
+        desc.types.push_back(static_cast<binlog::ArgType>(type));
+    }
+    return true;
+}
+
+bool readMessage(std::istream& in, Message& message)
+{
+    uint32_t length;
+    return get(in, message.thread) && get(in, message.id) &&
+           get(in, message.time) && get(in, length) &&
+           getBytes(in, message.args, length);
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    if( argc != 2 ) {
+        std::cerr << "Usage: " << argv[0] << " <file>" << std::endl;
+        return 1;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if( !in ) {
+        std::cerr << "Could not open '" << argv[1] << "'" << std::endl;
+        return 1;
+    }
+
+    char magic[sizeof(binlog::FILE_MAGIC)];
+    if( !in.read(magic, sizeof(magic)) ||
+        !std::equal(magic, magic + sizeof(magic), binlog::FILE_MAGIC) )
+    {
+        std::cerr << "'" << argv[1] << "' is not a binary log" << std::endl;
+        return 1;
+    }
+
+    std::map<uint32_t, binlog::Descriptor> descriptors;
+    std::vector<Message> messages;
+
+    bool truncated = false;
+    int kind;
+    while( (kind = in.get()) != EOF ) {
+        if( 'D' == kind ) {
+            binlog::Descriptor desc;
+            if( !readDescriptor(in, desc) ) {
+                truncated = true;
+                break;
+            }
+            descriptors[desc.id] = desc;
+        } else if( 'M' == kind ) {
+            Message message;
+            if( !readMessage(in, message) ) {
+                truncated = true;
+                break;
+            }
+            messages.push_back(std::move(message));
+        } else {
+            std::cerr << "Unknown entry '" << static_cast<char>(kind) << "' at offset "
+                      << static_cast<long long>(in.tellg()) - 1 << std::endl;
+            return 1;
+        }
+    }
+
+    // Each thread's messages are in order, but they're written a batch of
+    // one thread's at a time.
+    std::stable_sort(messages.begin(), messages.end(),
+                     [](const Message& a, const Message& b) { return a.time < b.time; });
+
+    std::string line;
+    for( const auto& message : messages ) {
+        auto it = descriptors.find(message.id);
+        if( it == descriptors.end() ) {
+            std::cerr << "Message with unknown descriptor " << message.id << std::endl;
+            continue;
+        }
+        const binlog::Descriptor& desc = it->second;
+
+        line = binlog::FormatTime(message.time);
+        line += " [" + std::to_string(message.thread) + "] ";
+
+        std::string level = cpplog::LogMessage::getLevelName(desc.level);
+        level.resize(5, ' ');
+        line += level + " - " + desc.file + "(" + std::to_string(desc.line) + "): ";
+
+        if( !binlog::Render(desc, message.args.data(), message.args.size(), line) ) {
+            // The flight recorder leaves out arguments that don't fit.
+            line += message.args.empty() ? " [arguments not recorded]" : " [bad arguments]";
+        }
+        std::cout << line << '\n';
+    }
+
+    if( truncated ) {
+        std::cerr << "The log ends part-way through an entry" << std::endl;
+    }
+    return 0;
+}
@@ -14,6 +14,8 @@
 #include <cstdlib>
 #include <streambuf>
 #include <ostream>
+#include <atomic>
+#include <mutex>
 
 // The following #define's will change the behaviour of this library.
 //      #define CPPLOG_FILTER_LEVEL     <level>
@@ -30,7 +32,7 @@
 //          NOTE: Only useful if you also #define CPPLOG_SYSTEM_IDS
 //
 //      #define CPPLOG_THREADING
-//          Enables threading (BackgroundLogger).  Note that defining this or
+//          Enables threading (BackgroundLogger, AsyncFileLogger).  Note that defining
 //          CPPLOG_SYSTEM_IDS introduces a dependency on Boost;
 //          this means that the library is no longer truly header-only.
 //
@@ -72,7 +74,7 @@
 //#define CPPLOG_FILTER_LEVEL               LL_WARN
 //#define CPPLOG_SYSTEM_IDS
 //#define CPPLOG_USE_SYSCALL_FOR_THREAD_ID
-//#define CPPLOG_THREADING
+#define CPPLOG_THREADING
 #define CPPLOG_HELPER_MACROS
 #define CPPLOG_FATAL_EXIT
 //#define CPPLOG_FATAL_EXIT_DEBUG
@@ -90,8 +92,17 @@
 #endif
 
 #ifdef CPPLOG_THREADING
-#include <boost/thread.hpp>
-#include "concurrent_queue.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#ifndef _WIN32
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 #endif
 
 #ifdef _WIN32
@@ -178,6 +189,38 @@ namespace cpplog
 #endif
         }
 
+        // Gets the current time, and the same as UTC.  Log messages only
+        // record whole seconds, so each thread keeps the broken-down time
+        // for the last second it saw, and only calls gmtime() again when
+        // that changes.  Where we can, we also read the coarse clock, which
+        // is cheaper than time().
+        inline void coarseTime(::time_t& now, ::tm& utc)
+        {
+            struct CachedTime
+            {
+                ::time_t    seconds;
+                ::tm        utc;
+            };
+            static thread_local CachedTime cached = { -1, ::tm() };
+
+#if defined(CLOCK_REALTIME_COARSE)
+            ::timespec ts;
+            if( ::clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0 )
+                now = ts.tv_sec;
+            else
+                now = ::time(NULL);
+#else
+            now = ::time(NULL);
+#endif
+
+            if( now != cached.seconds )
+            {
+                sgmtime(&cached.utc, &now);
+                cached.seconds = now;
+            }
+            utc = cached.utc;
+        }
+
         // Below we have a bunch of macros, typedefs and such that make getting our
         // current process/thread ID simpler.
 #ifdef CPPLOG_SYSTEM_IDS
@@ -277,6 +320,12 @@ namespace cpplog
                 m_buffer[k_logBufferCapacity] = '\0';
             }
 
+            // Empty the buffer, for reuse.
+            void reset()
+            {
+                setp(m_buffer, m_buffer + k_logBufferCapacity);
+            }
+
             std::streamsize length()   const { return pptr() - pbase();       }
             std::streamsize capacity() const { return k_logBufferCapacity;    }
             bool empty()               const { return length() == 0;          }
@@ -338,6 +387,9 @@ namespace cpplog
         helpers::thread_id_t  threadId;
 #endif
 
+        // Link for the BackgroundLogger's queue.
+        std::atomic<LogData*> queueNext;
+
 
         // Constructor that initializes our stream.
         LogData(loglevel_t logLevel)
@@ -345,13 +397,173 @@ namespace cpplog
 #ifdef CPPLOG_SYSTEM_IDS
               , processId(0), threadId(0)
 #endif
+              , queueNext(NULL)
         {
+            reset(logLevel);
         }
 
         virtual ~LogData()
         { }
+
+        // Make this ready to hold a new message.
+        void reset(loglevel_t logLevel)
+        {
+            streamBuffer.reset();
+            stream.clear();
+            stream.flags(std::ios_base::dec | std::ios_base::skipws);
+            stream.fill(' ');
+            stream.width(0);
+            stream.precision(6);
+            level = logLevel;
+        }
     };
 
+    namespace helpers
+    {
+        // Recycles LogData objects (and their large buffers), so that logging
+        // a message doesn't need to allocate.
+        //
+        // Each thread keeps a small cache of free objects, and swaps whole
+        // batches of them with a shared free list when its cache runs out
+        // or fills up - so the shared list's lock is only taken once per
+        // batch.  Messages are often freed by a different thread from the
+        // one that logged them (e.g. by a BackgroundLogger), and the batches
+        // carry them back.
+        class LogDataPool
+        {
+        private:
+            enum
+            {
+                k_batchSize = 32,
+                k_maxShared = 64 * k_batchSize
+            };
+
+            std::mutex              m_mutex;
+            std::vector<LogData*>   m_free;
+
+            struct ThreadCache
+            {
+                std::vector<LogData*> items;
+
+                ~ThreadCache()
+                {
+                    LogDataPool::instance().putBatch(items);
+                }
+            };
+
+            static ThreadCache& threadCache()
+            {
+                static thread_local ThreadCache cache;
+                return cache;
+            }
+
+            LogDataPool()
+            { }
+
+            ~LogDataPool()
+            {
+                for( size_t i = 0; i < m_free.size(); i++ )
+                    delete m_free[i];
+            }
+
+            // Take up to a batch from the shared list.
+            void getBatch(std::vector<LogData*>& into)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                size_t count = m_free.size() < size_t(k_batchSize) ? m_free.size() : size_t(k_batchSize);
+                into.insert(into.end(), m_free.end() - count, m_free.end());
+                m_free.resize(m_free.size() - count);
+            }
+
+            // Give everything in 'from' to the shared list, freeing what
+            // doesn't fit.
+            void putBatch(std::vector<LogData*>& from)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    while( !from.empty() && m_free.size() < k_maxShared )
+                    {
+                        m_free.push_back(from.back());
+                        from.pop_back();
+                    }
+                }
+
+                for( size_t i = 0; i < from.size(); i++ )
+                    delete from[i];
+                from.clear();
+            }
+
+        public:
+            static LogDataPool& instance()
+            {
+                static LogDataPool pool;
+                return pool;
+            }
+
+            LogData* acquire(loglevel_t logLevel)
+            {
+                std::vector<LogData*>& items = threadCache().items;
+                if( items.empty() )
+                    getBatch(items);
+
+                if( items.empty() )
+                    return new LogData(logLevel);
+
+                LogData* logData = items.back();
+                items.pop_back();
+                logData->reset(logLevel);
+                return logData;
+            }
+
+            void release(LogData* logData)
+            {
+                std::vector<LogData*>& items = threadCache().items;
+                items.push_back(logData);
+
+                // Keep one batch here, and pass the rest on.
+                if( items.size() >= 2 * k_batchSize )
+                {
+                    std::vector<LogData*> batch(items.end() - k_batchSize, items.end());
+                    items.resize(items.size() - k_batchSize);
+                    putBatch(batch);
+                }
+            }
+        };
+    }
+
+    // Get a LogData to fill in, and give it back when it's been logged.
+    // Loggers that return false from sendLogMessage() take over this
+    // responsibility.  (Plain 'delete' also works, but doesn't recycle the
+    // object.)
+    inline LogData* allocLogData(loglevel_t logLevel)
+    {
+        return helpers::LogDataPool::instance().acquire(logLevel);
+    }
+
+    inline void freeLogData(LogData* logData)
+    {
+        helpers::LogDataPool::instance().release(logData);
+    }
+
+    // Called once, on the first fatal message, after it's been logged (and
+    // before exiting, if fatal messages do).  E.g. to save state that would
+    // help debug whatever went wrong.
+    typedef void (*fatal_handler_t)();
+
+    namespace helpers
+    {
+        inline std::atomic<fatal_handler_t>& fatalHandler()
+        {
+            static std::atomic<fatal_handler_t> handler(NULL);
+            return handler;
+        }
+    }
+
+    inline void setFatalHandler(fatal_handler_t handler)
+    {
+        helpers::fatalHandler().store(handler);
+    }
+
     // Base interface for a logger.
     class BaseLogger
     {
@@ -409,7 +621,7 @@ namespace cpplog
 
             if( m_deleteMessage )
             {
-                delete m_logData;
+                freeLogData(m_logData);
             }
         }
 
@@ -430,15 +642,44 @@ namespace cpplog
             m_logData->stream << "] ";
 #endif
 
-            m_logData->stream << std::setfill(' ') << std::setw(5) << std::left << std::dec
-                        << LogMessage::getLevelName(m_logData->level) << " - "
-                        << m_logData->fileName << "(" << m_logData->line << "): ";
+            // This is written straight into the buffer, since it's done for
+            // every message, and the stream's formatting is slow.  It's the
+            // same as:
+            //      stream << std::setw(5) << std::left << levelName << " - "
+            //             << fileName << "(" << line << "): ";
+            helpers::fixed_streambuf* const sb = &m_logData->streamBuffer;
+
+            const char* levelName = LogMessage::getLevelName(m_logData->level);
+            std::streamsize levelLength = static_cast<std::streamsize>(strlen(levelName));
+            sb->sputn(levelName, levelLength);
+            for( std::streamsize i = levelLength; i < 5; i++ )
+                sb->sputc(' ');
+
+            sb->sputn(" - ", 3);
+            sb->sputn(m_logData->fileName, static_cast<std::streamsize>(strlen(m_logData->fileName)));
+            sb->sputc('(');
+
+            char digits[24];
+            char* end = digits + sizeof(digits);
+            char* start = end;
+            unsigned long line = m_logData->line;
+            do
+            {
+                *--start = static_cast<char>('0' + line % 10);
+                line /= 10;
+            } while( line > 0 );
+            sb->sputn(start, end - start);
+
+            sb->sputn("): ", 3);
+
+            // The stream's left as the manipulators above would leave it.
+            m_logData->stream.setf(std::ios_base::left, std::ios_base::adjustfield);
         }
 
     private:
         void Init(const char* file, unsigned int line, loglevel_t logLevel, bool useDefaultLogFormat=true)
         {
-            m_logData = new LogData(logLevel);
+            m_logData = allocLogData(logLevel);
             m_flushed = false;
             m_deleteMessage = false;
 
@@ -446,12 +687,9 @@ namespace cpplog
             m_logData->fullPath     = file;
             m_logData->fileName     = cpplog::helpers::fileNameFromPath(file);
             m_logData->line         = line;
-            m_logData->messageTime  = ::time(NULL);
 
             // Get current time.
-            ::tm gmt;
-            cpplog::helpers::sgmtime(&gmt, &m_logData->messageTime);
-            memcpy(&m_logData->utcTime, &gmt, sizeof(tm));
+            cpplog::helpers::coarseTime(m_logData->messageTime, m_logData->utcTime);
 
 #ifdef CPPLOG_SYSTEM_IDS
             // Get process/thread ID.
@@ -497,6 +735,10 @@ namespace cpplog
                     // Set our fatal flag.
                     getSetFatal(false, true);
 
+                    fatal_handler_t handler = helpers::fatalHandler().load();
+                    if( handler )
+                        handler();
+
 #ifdef _DEBUG
 // Only exit in debug mode if CPPLOG_FATAL_EXIT_DEBUG is set.
 #if defined(CPPLOG_FATAL_EXIT_DEBUG) || defined(CPPLOG_FATAL_EXIT)
@@ -966,15 +1208,143 @@ namespace cpplog
     // Logger that moves all processing of log messages to a background thread.
     // Only include if we have support for threading.
 #ifdef CPPLOG_THREADING
+    namespace helpers
+    {
+        // A queue of LogData objects with any number of producers but only
+        // one consumer, linked through LogData::queueNext, so pushing never
+        // allocates or takes a lock.  This is Dmitry Vyukov's intrusive
+        // MPSC queue: a push is a single atomic exchange.
+        class LogDataQueue
+        {
+        private:
+            std::atomic<LogData*>   m_head;     // Most recently pushed.
+            LogData*                m_tail;     // Next to pop; consumer only.
+            LogData                 m_stub;
+
+        public:
+            LogDataQueue()
+                : m_head(&m_stub), m_tail(&m_stub), m_stub(LL_TRACE)
+            { }
+
+            void push(LogData* logData)
+            {
+                logData->queueNext.store(NULL, std::memory_order_relaxed);
+                LogData* prev = m_head.exchange(logData, std::memory_order_seq_cst);
+
+                // Between the exchange and this store, the consumer can't
+                // see this item (or any pushed after it) yet.
+                prev->queueNext.store(logData, std::memory_order_release);
+            }
+
+            // Returns NULL if there's nothing to pop right now - either
+            // because the queue is empty, or because a push is only half
+            // done (see empty()).
+            LogData* pop()
+            {
+                LogData* tail = m_tail;
+                LogData* next = tail->queueNext.load(std::memory_order_acquire);
+
+                if( tail == &m_stub )
+                {
+                    if( next == NULL )
+                        return NULL;
+                    m_tail = next;
+                    tail = next;
+                    next = next->queueNext.load(std::memory_order_acquire);
+                }
+
+                if( next != NULL )
+                {
+                    m_tail = next;
+                    return tail;
+                }
+
+                // 'tail' is the last item we can see.  Unless a push is in
+                // progress, put the stub back behind it so that we can take
+                // it without leaving the queue without a node.
+                if( tail != m_head.load(std::memory_order_acquire) )
+                    return NULL;
+
+                push(&m_stub);
+
+                next = tail->queueNext.load(std::memory_order_acquire);
+                if( next != NULL )
+                {
+                    m_tail = next;
+                    return tail;
+                }
+                return NULL;
+            }
+
+            // Whether there's definitely nothing queued.  If pop() returns
+            // NULL but this is false, a push is in progress, and will be
+            // visible very shortly.  Consumer only.
+            bool empty() const
+            {
+                LogData* head = m_head.load(std::memory_order_seq_cst);
+                return head == m_tail ||
+                       (m_tail == &m_stub && head == &m_stub);
+            }
+        };
+    }
+
+    // Logger that moves all processing of log messages to a background
+    // thread.  Logging a message just pushes it onto a lock-free queue; the
+    // background thread only needs waking (which takes a lock) if it has
+    // run out of work and gone to sleep.
     class BackgroundLogger : public BaseLogger
     {
     private:
         BaseLogger*                 m_forwardTo;
-        concurrent_queue<LogData*>  m_queue;
+        helpers::LogDataQueue       m_queue;
 
-        boost::thread               m_backgroundThread;
+        // For waking up the background thread, when it's idle.
+        std::atomic<bool>           m_sleeping;
+        std::mutex                  m_wakeMutex;
+        std::condition_variable     m_wakeCond;
+
+        std::thread                 m_backgroundThread;
         LogData*                    m_dummyItem;
 
+        LogData* waitAndPop()
+        {
+            for( unsigned spins = 0; ; spins++ )
+            {
+                LogData* logData = m_queue.pop();
+                if( logData != NULL )
+                    return logData;
+
+                if( !m_queue.empty() || spins < 64 )
+                {
+                    // Either a push is about to finish, or more messages
+                    // are likely to come soon.
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                // Go to sleep.  We say so before checking the queue one last
+                // time, and a producer checks after pushing, so one of us
+                // always sees the other.  The timeout is just a backstop.
+                std::unique_lock<std::mutex> lock(m_wakeMutex);
+                m_sleeping.store(true, std::memory_order_seq_cst);
+                if( m_queue.empty() )
+                    m_wakeCond.wait_for(lock, std::chrono::milliseconds(100));
+                m_sleeping.store(false, std::memory_order_relaxed);
+                spins = 0;
+            }
+        }
+
+        void push(LogData* logData)
+        {
+            m_queue.push(logData);
+
+            if( m_sleeping.load(std::memory_order_seq_cst) )
+            {
+                std::lock_guard<std::mutex> lock(m_wakeMutex);
+                m_wakeCond.notify_one();
+            }
+        }
+
         void backgroundFunction()
         {
             LogData* nextLogEntry;
@@ -982,42 +1352,47 @@ namespace cpplog
 
             do
             {
-                m_queue.wait_and_pop(nextLogEntry);
+                nextLogEntry = waitAndPop();
 
                 if( nextLogEntry != m_dummyItem )
                     deleteMessage = m_forwardTo->sendLogMessage(nextLogEntry);
+                else
+                    deleteMessage = true;
 
                 if( deleteMessage )
-                    delete nextLogEntry;
+                    freeLogData(nextLogEntry);
             } while( nextLogEntry != m_dummyItem );
         }
 
         void Init()
         {
             // Create dummy item.
-            m_dummyItem = new LogData(LL_TRACE);
+            m_dummyItem = allocLogData(LL_TRACE);
 
             // And create background thread.
-            m_backgroundThread = boost::thread(&BackgroundLogger::backgroundFunction, this);
+            m_backgroundThread = std::thread(&BackgroundLogger::backgroundFunction, this);
         }
 
     public:
         BackgroundLogger(BaseLogger* forwardTo)
-            : m_forwardTo(forwardTo)
+            : m_forwardTo(forwardTo), m_sleeping(false)
         {
             Init();
         }
 
         BackgroundLogger(BaseLogger& forwardTo)
-            : m_forwardTo(&forwardTo)
+            : m_forwardTo(&forwardTo), m_sleeping(false)
         {
             Init();
         }
 
         void Stop()
         {
+            if( !m_backgroundThread.joinable() )
+                return;
+
             // Push our "dummy" item on the queue ...
-            m_queue.push(m_dummyItem);
+            push(m_dummyItem);
 
             // ... and wait for thread to terminate.
             m_backgroundThread.join();
@@ -1032,7 +1407,7 @@ namespace cpplog
 
         virtual bool sendLogMessage(LogData* logData)
         {
-            m_queue.push(logData);
+            push(logData);
 
             // Don't delete - the background thread should handle this.
             return false;
@@ -1040,6 +1415,399 @@ namespace cpplog
 
     };
 
+#ifndef _WIN32
+    // How an AsyncFileLogger behaves.
+    struct AsyncFileOptions
+    {
+        // Messages are collected into buffers of this size ...
+        size_t          bufferSize;
+
+        // ... and at most this many exist at once, which bounds the memory
+        // used when the disk can't keep up.
+        size_t          maxBuffers;
+
+        // What to do when every buffer is full: wait for one to be written
+        // (true), or drop the message (false).
+        bool            blockWhenFull;
+
+        // A partly-filled buffer is written once it's this old.
+        unsigned long   flushIntervalMs;
+
+        // Start a new file once the current one would go over this size,
+        // or has been open this long.  Zero means never.
+        std::streamoff  rotateSize;
+        unsigned long   rotateSeconds;
+
+        AsyncFileOptions()
+            : bufferSize(256 * 1024), maxBuffers(16), blockWhenFull(false),
+              flushIntervalMs(100), rotateSize(0), rotateSeconds(0)
+        { }
+    };
+
+    // Log to file, with all of the writing - and rotating - done on a
+    // background thread, so logging never waits on the disk.
+    //
+    // Messages are copied into large buffers, and the background thread
+    // writes every buffer that's ready with a single writev(), so a burst
+    // of messages costs one system call rather than one each.  If messages
+    // come faster than they can be written, and all of the buffers fill
+    // up, they're dropped (and counted) or the caller waits, depending on
+    // the options.
+    class AsyncFileLogger : public BaseLogger
+    {
+    public:
+        // The same as TimeRotateFileLogger's.
+        typedef void (*pfBuildFileName)(::tm* time, unsigned long logNumber,
+                                        std::string& newFileName, void* context);
+
+    private:
+        struct Buffer
+        {
+            char*   data;
+            size_t  used;
+
+            Buffer(size_t size) : data(new char[size]), used(0) { }
+            ~Buffer() { delete[] data; }
+        };
+
+        AsyncFileOptions            m_options;
+
+        std::string                 m_path;         // If not rotating.
+        pfBuildFileName             m_buildFunc;
+        void*                       m_context;
+
+        // Everything below is protected by m_mutex, except for the file,
+        // which only the background thread touches.
+        std::mutex                  m_mutex;
+        std::condition_variable     m_readyCond;    // Something to write.
+        std::condition_variable     m_doneCond;     // Something written.
+
+        std::vector<Buffer*>        m_all;
+        std::vector<Buffer*>        m_free;
+        std::vector<Buffer*>        m_ready;
+        Buffer*                     m_current;
+        std::chrono::steady_clock::time_point m_currentStarted;
+
+        unsigned long long          m_queued;       // Buffers ever made ready.
+        unsigned long long          m_written;      // ... and since written.
+        unsigned long long          m_dropped;
+        unsigned long long          m_writes;
+        unsigned long long          m_writeErrors;
+        bool                        m_stopping;
+
+        int                         m_fd;
+        std::streamoff              m_fileSize;
+        ::time_t                    m_openedAt;
+        unsigned long               m_logNumber;
+
+        std::thread                 m_thread;
+
+    public:
+        AsyncFileLogger(std::string logFilePath,
+                        const AsyncFileOptions& options = AsyncFileOptions())
+            : m_options(options), m_path(logFilePath), m_buildFunc(NULL), m_context(NULL)
+        {
+            Init();
+        }
+
+        // Rotate as the options say, naming each file with 'nameFunc'.
+        AsyncFileLogger(pfBuildFileName nameFunc, void* context,
+                        const AsyncFileOptions& options)
+            : m_options(options), m_buildFunc(nameFunc), m_context(context)
+        {
+            Init();
+        }
+
+        virtual ~AsyncFileLogger()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping = true;
+            }
+            m_readyCond.notify_one();
+            m_thread.join();
+
+            if( m_fd >= 0 )
+                ::close(m_fd);
+            for( size_t i = 0; i < m_all.size(); i++ )
+                delete m_all[i];
+        }
+
+        virtual bool sendLogMessage(LogData* logData)
+        {
+            helpers::fixed_streambuf* const sb = &logData->streamBuffer;
+            append(sb->c_str(), static_cast<size_t>(sb->length()));
+            return true;
+        }
+
+        // Write everything logged so far, and wait until it's done.
+        void Flush()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if( m_current != NULL && m_current->used > 0 )
+                queueCurrent();
+
+            unsigned long long target = m_queued;
+            m_readyCond.notify_one();
+            while( m_written < target )
+                m_doneCond.wait(lock);
+        }
+
+        // Messages dropped because every buffer was full.
+        unsigned long long Dropped()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_dropped;
+        }
+
+        // How many writev() calls it's taken to write everything.
+        unsigned long long Writes()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_writes;
+        }
+
+        unsigned long long WriteErrors()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_writeErrors;
+        }
+
+    private:
+        void Init()
+        {
+            if( m_options.bufferSize == 0 )
+                m_options.bufferSize = 4096;
+            if( m_options.maxBuffers < 2 )
+                m_options.maxBuffers = 2;
+
+            m_current = NULL;
+            m_queued = m_written = m_dropped = m_writes = m_writeErrors = 0;
+            m_stopping = false;
+            m_fd = -1;
+            m_fileSize = 0;
+            m_openedAt = 0;
+            m_logNumber = 0;
+
+            // Open the first file now, so a bad path shows up straight away
+            // (as a write error).
+            openFile(::time(NULL));
+
+            m_thread = std::thread(&AsyncFileLogger::backgroundFunction, this);
+        }
+
+        // Called with m_mutex held.
+        void queueCurrent()
+        {
+            m_ready.push_back(m_current);
+            m_current = NULL;
+            m_queued++;
+        }
+
+        // Called with m_mutex held.  Returns false if there's no buffer to
+        // be had, and we're not to wait for one.  If we do wait, another
+        // thread might have started a new buffer in the meantime, which
+        // might not have room for our message.
+        bool nextBuffer(std::unique_lock<std::mutex>& lock)
+        {
+            for( ;; )
+            {
+                if( !m_free.empty() )
+                {
+                    m_current = m_free.back();
+                    m_free.pop_back();
+                    break;
+                }
+                if( m_all.size() < m_options.maxBuffers )
+                {
+                    m_current = new Buffer(m_options.bufferSize);
+                    m_all.push_back(m_current);
+                    break;
+                }
+                if( !m_options.blockWhenFull || m_stopping )
+                    return false;
+                m_doneCond.wait(lock);
+                if( m_current != NULL )
+                    return true;
+            }
+
+            m_current->used = 0;
+            m_currentStarted = std::chrono::steady_clock::now();
+            return true;
+        }
+
+        void append(const char* data, size_t length)
+        {
+            // A message longer than a buffer is cut short.
+            if( length > m_options.bufferSize )
+                length = m_options.bufferSize;
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while( m_current == NULL ||
+                   m_current->used + length > m_options.bufferSize )
+            {
+                if( m_current != NULL )
+                {
+                    queueCurrent();
+                    m_readyCond.notify_one();
+                }
+
+                if( !nextBuffer(lock) )
+                {
+                    m_dropped++;
+                    return;
+                }
+            }
+
+            std::memcpy(m_current->data + m_current->used, data, length);
+            m_current->used += length;
+        }
+
+        void backgroundFunction()
+        {
+            std::chrono::milliseconds interval(m_options.flushIntervalMs);
+            std::vector<Buffer*> batch;
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            for( ;; )
+            {
+                if( m_ready.empty() && !m_stopping )
+                    m_readyCond.wait_for(lock, interval);
+
+                // Take a partly-filled buffer too, once it's old enough.
+                if( m_current != NULL && m_current->used > 0 &&
+                    (m_stopping ||
+                     std::chrono::steady_clock::now() - m_currentStarted >= interval) )
+                {
+                    queueCurrent();
+                }
+
+                if( m_ready.empty() )
+                {
+                    if( m_stopping )
+                        return;
+                    continue;
+                }
+
+                batch.swap(m_ready);
+                lock.unlock();
+
+                unsigned long long writes = 0;
+                bool ok = writeBatch(batch, writes);
+
+                lock.lock();
+                m_writes += writes;
+                if( !ok )
+                    m_writeErrors++;
+                m_written += batch.size();
+                for( size_t i = 0; i < batch.size(); i++ )
+                    m_free.push_back(batch[i]);
+                batch.clear();
+                m_doneCond.notify_all();
+            }
+        }
+
+        // Write some buffers, in as few writev() calls as we can, starting
+        // new files as we go if we're rotating.  Background thread only.
+        bool writeBatch(const std::vector<Buffer*>& batch, unsigned long long& writes)
+        {
+            ::time_t now = ::time(NULL);
+            if( m_buildFunc != NULL && m_options.rotateSeconds > 0 &&
+                static_cast<unsigned long>(difftime(now, m_openedAt)) >= m_options.rotateSeconds )
+            {
+                rotate(now);
+            }
+
+            bool ok = true;
+            std::vector<struct iovec> iov;
+            std::streamoff pending = 0;
+
+            for( size_t i = 0; i < batch.size(); i++ )
+            {
+                std::streamoff size = static_cast<std::streamoff>(batch[i]->used);
+                if( m_buildFunc != NULL && m_options.rotateSize > 0 &&
+                    m_fileSize + pending > 0 &&
+                    m_fileSize + pending + size > m_options.rotateSize )
+                {
+                    ok = writeAll(iov, writes) && ok;
+                    pending = 0;
+                    rotate(now);
+                }
+
+                struct iovec vec;
+                vec.iov_base = batch[i]->data;
+                vec.iov_len = batch[i]->used;
+                iov.push_back(vec);
+                pending += size;
+            }
+
+            return writeAll(iov, writes) && ok;
+        }
+
+        // writev() everything in 'iov', and empty it.
+        bool writeAll(std::vector<struct iovec>& iov, unsigned long long& writes)
+        {
+            size_t first = 0;
+            bool ok = m_fd >= 0;
+
+            while( ok && first < iov.size() )
+            {
+                int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+                ssize_t ret = ::writev(m_fd, &iov[first], count);
+                if( ret < 0 && errno == EINTR )
+                    continue;
+                if( ret <= 0 )
+                {
+                    ok = false;
+                    break;
+                }
+                writes++;
+                m_fileSize += ret;
+
+                // Skip past whatever was written, which might end part-way
+                // through a buffer.
+                size_t done = static_cast<size_t>(ret);
+                while( first < iov.size() && done >= iov[first].iov_len )
+                {
+                    done -= iov[first].iov_len;
+                    first++;
+                }
+                if( first < iov.size() )
+                {
+                    iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + done;
+                    iov[first].iov_len -= done;
+                }
+            }
+
+            iov.clear();
+            return ok;
+        }
+
+        void rotate(::time_t now)
+        {
+            m_logNumber++;
+            openFile(now);
+        }
+
+        void openFile(::time_t now)
+        {
+            std::string fileName = m_path;
+            if( m_buildFunc != NULL )
+            {
+                ::tm timeInfo;
+                cpplog::helpers::slocaltime(&timeInfo, &now);
+                m_buildFunc(&timeInfo, m_logNumber, fileName, m_context);
+            }
+
+            if( m_fd >= 0 )
+                ::close(m_fd);
+            m_fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            m_fileSize = 0;
+            m_openedAt = now;
+        }
+    };
+#endif
+
 #endif
 
     // Seperate namespace for loggers that use templates.
@@ -1,22 +1,52 @@
+#include "BinaryLog.hpp"
+#include "Cancellation.hpp"
+#include "Ciphers.hpp"
+#include "ConcurrencyController.hpp"
+#include "FdBudget.hpp"
+#include "FlightRecorder.hpp"
+#include "FramePool.hpp"
+#include "Histogram.hpp"
 #include "OptionParser.hpp"
+#include "PerfCounters.hpp"
+#include "Probe.hpp"
+#include "Results.hpp"
 #include "SSL.hpp"
 #include "ScopeGuard.hpp"
+#include "ShardedLogger.hpp"
+#include "Shards.hpp"
+#include "Socket.hpp"
+#include "RetryPolicy.hpp"
+#include "RttEstimator.hpp"
+#include "ScanReactor.hpp"
+#include "Stats.hpp"
+#include "StatsServer.hpp"
+#include "SubnetScheduler.hpp"
+#include "Sweep.hpp"
+#include "Target.hpp"
 #include "ThreadPool.h"
+#include "TimerQueue.hpp"
+#include "Trace.hpp"
+#include "WaitGroup.hpp"
 #include "cpplog.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <unordered_map>
 
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netdb.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <boost/lexical_cast.hpp>
 
 
-typedef std::vector<ssl::SSLCipher> CipherList;
-
-
 static const char* const VERSION = "0.0.1";
 static const std::unordered_map<const ::SSL_METHOD*, const char*> ssl_methods({
     {::SSLv2_method(), "SSLv2"},
@@ -27,285 +57,243 @@ static const std::unordered_map<const ::SSL_METHOD*, const char*> ssl_methods({
 });
 
 
-class ConcurrentLogger : public cpplog::BaseLogger {
-public:
-    virtual bool sendLogMessage(LogData* logData)
-    {
-        bool deleteMessage = true;
-
-        deleteMessage = deleteMessage && m_logger1->sendLogMessage(logData);
-        deleteMessage = deleteMessage && m_logger2->sendLogMessage(logData);
+typedef Expected<std::vector<SocketAddress>> ResolveResult;
 
-        return deleteMessage;
-    }
-};
 
-
-class AddressError : public std::runtime_error {
-private:
-    char m_whatText[200];
-public:
-    AddressError(int status)
-        : std::runtime_error("address error")
-    {
-        boost::iostreams::stream<boost::iostreams::array_sink> out(m_whatText, 200);
-        out << "error resolving address: "
-            << status
-            << " (" << gai_strerror(status) << ")"
-            << std::ends;
-    }
-
-    virtual const char* what() const noexcept override {
-        return m_whatText;
-    }
-};
+// Serializes output, so that each target's results are printed together.
+static std::mutex outputMutex;
 
 
-class SocketError : public std::runtime_error {
-private:
-    char m_whatText[200];
-public:
-    SocketError()
-        : std::runtime_error("socket error")
-    {
-        int err = errno;
+// What each shard of the pool has to itself.
+struct ShardState {
+    ssl::SSLContextCache            contexts;
 
-        char errorBuff[200+1];
-        strerror_r(err, errorBuff, 200);
+    // The frames of the shard's TargetScans.
+    FramePool                       frames;
 
-        boost::iostreams::stream<boost::iostreams::array_sink> out(m_whatText, 200);
-        out << "socket error: "
-            << err
-            << " (" << errorBuff << ")"
-            << std::ends;
-    }
+    // With --reactor, the shard's scans run here, rather than each holding
+    // a worker while it waits.
+    std::unique_ptr<ScanReactor>    reactor;
 
-    virtual const char* what() const noexcept override {
-        return m_whatText;
-    }
+    explicit ShardState(size_t probes)
+        : contexts(probes)
+    { }
 };
 
 
-class SocketAddress {
-private:
-    struct addrinfo m_address;
-
-public:
-    static Expected<std::vector<SocketAddress>> ResolveHost(
-            std::string host,
-            std::string service = "",
-            int family = AF_UNSPEC)
-    {
-        const char* theService;
-
-        if( 0 == service.length() ) {
-            theService = "443";
-        } else {
-            theService = service.c_str();
-        }
-
-        struct addrinfo hints;
-        memset(&hints, 0, sizeof(struct addrinfo));
-        hints.ai_family = family;
-        hints.ai_socktype = SOCK_STREAM;
-
-        struct addrinfo* addresses = nullptr;
-        int status = getaddrinfo(host.c_str(), theService, &hints, &addresses);
-        if( status != 0 ) {
-            return Expected<std::vector<SocketAddress>>::fromException(AddressError(status));
-        }
-
-        SCOPE_EXIT {
-            if( addresses != nullptr ) {
-                freeaddrinfo(addresses);
-            }
-        };
-
-        std::vector<SocketAddress> ret;
-        for( struct addrinfo *p = addresses;
-             p != nullptr;
-             p = p->ai_next )
-        {
-            ret.emplace_back(p);
-        }
+// Everything that the scan tasks share.
+struct ScanContext {
+    const std::vector<CipherProbe>& probes;
+    const ScanOptions&              options;
+    HostTimings&                    timings;
+    RetryPolicy&                    retries;
+    LatencyRecorder&                latencies;
+    ScanStats&                      stats;
+    Tracer*                         tracer;
+    PerfProfiler*                   perf;
+    ResultWriter*                   results;
+    cpplog::BaseLogger&             log;
+
+    // For the messages logged for every target, which are too many to
+    // format as we go.
+    binlog::BinaryLogger&           targetLog;
+
+    // One per shard of the pool.
+    const std::vector<std::unique_ptr<ShardState>>& shards;
+
+    ThreadPool&                     pool;
+    TimerQueue&                     timers;
+
+    // Every (host, port) that has been queued, but not finished, and how
+    // many of those may run at once on each network.
+    WaitGroup&                      pending;
+    SubnetScheduler&                subnets;
+
+    // Stops the scan, on SIGINT or at its deadline, and how long each host
+    // may take.
+    const CancellationToken&        cancel;
+    HostBudgets&                    budgets;
+};
 
-        return ret;
-    }
 
-    explicit SocketAddress(struct addrinfo* address)
-        : m_address(*address)
-    { }
+// Every task for a host runs in the same shard of the pool.
+static size_t shardOf(const ScanContext& ctx, const std::string& host)
+{
+    return ShardFor(host, ctx.pool.Shards());
+}
 
-    // Operators to convert to an addrinfo structure / pointer.
-    operator struct addrinfo ()
-    {
-        return m_address;
-    }
-    operator struct addrinfo* ()
-    {
-        return &m_address;
-    }
+// ... and at its target's priority, as is its wait for room on its network.
+static_assert(static_cast<int>(NUM_TARGET_PRIORITIES) == static_cast<int>(ThreadPool::PRIORITIES),
+              "every target priority needs a class in the pool");
+static_assert(static_cast<int>(NUM_TARGET_PRIORITIES) == static_cast<int>(SubnetScheduler::PRIORITIES),
+              "every target priority needs a class in the subnet scheduler");
 
-    // Accessor functions for the members.
-    inline int              ai_flags() const     { return m_address.ai_flags; }
-    inline int              ai_family() const    { return m_address.ai_family; }
-    inline int              ai_socktype() const  { return m_address.ai_socktype; }
-    inline int              ai_protocol() const  { return m_address.ai_protocol; }
-    inline socklen_t        ai_addrlen() const   { return m_address.ai_addrlen; }
-    inline struct sockaddr *ai_addr() const      { return m_address.ai_addr; }
-    inline char            *ai_canonname() const { return m_address.ai_canonname; }
-};
+static size_t poolPriority(TargetPriority priority)
+{
+    return static_cast<size_t>(priority);
+}
 
 
-class Socket {
-private:
-    int m_socketDescriptor;
+// A target is finished with, so the next one waiting on its network can
+// start.
+static void targetDone(ScanContext& ctx, const std::vector<SocketAddress>& addresses)
+{
+    ctx.subnets.Done(SubnetScheduler::PrefixOf(addresses));
+    ctx.pending.Done();
+}
 
-public:
-    Socket(int family, int socktype, int protocol)
-        : m_socketDescriptor(-1)
-    {
-        int socketDescriptor = -1;
 
-        socketDescriptor = socket(family, socktype, protocol);
-        if( -1 == socketDescriptor ) {
-            throw SocketError();
-        }
-        m_socketDescriptor = socketDescriptor;
+// Record and print a target's results, once its scan is done.
+void finishTargetScan(const TargetScan& scan, ScanContext& ctx)
+{
+    ctx.stats.Add(ScanCounter::TargetsDone);
+    if( ScanStop::None != scan.Stopped() ) {
+        ctx.stats.Add(ScanCounter::TargetsCutShort);
+        BINLOG(LL_INFO, ctx.targetLog, "{}: stopped early ({})",
+               Target::Endpoint(scan.Host(), scan.Port()), ScanStopName(scan.Stopped()));
     }
+    BINLOG(LL_DEBUG, ctx.targetLog, "{}: {} probe(s) done",
+           Target::Endpoint(scan.Host(), scan.Port()), scan.Results().size());
 
-    // Allow creating with the proper params from a resolved address.
-    explicit Socket(SocketAddress& fromAddr)
-        : Socket(fromAddr.ai_family(),
-                 fromAddr.ai_socktype(),
-                 fromAddr.ai_protocol())
-    { }
-
-    Socket(Socket&& other)
-        : m_socketDescriptor(-1)
-    {
-        std::swap(m_socketDescriptor, other.m_socketDescriptor);
+    TraceSpan writeSpan(scan.GetTracer(), "write", "output", scan.TraceId());
+    if( ctx.results != nullptr ) {
+        ctx.results->Write(scan, shardOf(ctx, scan.Host()));
     }
 
-    virtual ~Socket()
-    {
-        if( -1 != m_socketDescriptor ) {
-            close(m_socketDescriptor);
-        }
-    }
+    std::unique_lock<std::mutex> lock(outputMutex);
+    scan.Print(std::cout);
+}
 
-    Socket& operator=(Socket&& other)
-    {
-        if( this != &other ) {
-            // TODO: abstract from destructor
-            if( -1 != m_socketDescriptor ) {
-                close(m_socketDescriptor);
-                m_socketDescriptor = -1;
-            }
 
-            // Swap the two descriptors
-            std::swap(m_socketDescriptor, other.m_socketDescriptor);
+// Run a target's probes, until they're all done or one of them needs to be
+// retried.  In that case, we come back to it once the retry is due,
+// instead of holding on to this worker while we wait.  'queuedAt' is when
+// this was handed to the pool, for tracing.
+void continueTargetScan(std::shared_ptr<TargetScan> scan,
+                        TargetPriority priority,
+                        ProbeClock::time_point queuedAt,
+                        ScanContext& ctx)
+{
+    bool rescheduled = false;
+    SCOPE_EXIT {
+        if( !rescheduled ) {
+            targetDone(ctx, scan->Addresses());
         }
+    };
 
-        return *this;
+    // NOTE: Declared after the SCOPE_EXIT, so these are recorded before
+    // the main thread can see we're done and write out the trace.
+    Tracer* tracer = scan->GetTracer();
+    if( tracer ) {
+        tracer->Record("queued", "pool", scan->TraceId(), queuedAt, ProbeClock::now());
     }
-
-    // Delete copy constructor and assignment.
-    // We want it to be impossible to copy an open socket, though we
-    // allow moving one.
-    Socket(Socket const&) = delete;
-    Socket& operator=(Socket const&) = delete;
-
-    // TODO: bind to local address
-
-    void Connect(SocketAddress& addr)
-    {
-        int status = connect(m_socketDescriptor, addr.ai_addr(), addr.ai_addrlen());
-        if( -1 == status ) {
-            throw SocketError();
+    TraceSpan runSpan(tracer, "run", "pool", scan->TraceId());
+
+    ProbeClock::duration retryAfter;
+    if( !scan->Run(retryAfter) ) {
+        if( scan->WaitingForFd() ) {
+            BINLOG(LL_DEBUG, ctx.targetLog, "{}: waiting for a descriptor",
+                   Target::Endpoint(scan->Host(), scan->Port()));
+
+            // The scan is picked up again once it's handed one, which can
+            // be on another thread before this returns - so we have to be
+            // done with it first.
+            runSpan.End();
+            rescheduled = true;
+
+            ScanContext* pctx = &ctx;
+            auto waitFrom = ProbeClock::now();
+            scan->AwaitFd([scan, priority, pctx, waitFrom]() {
+                auto now = ProbeClock::now();
+                if( scan->GetTracer() ) {
+                    scan->GetTracer()->Record("fdwait", "pool", scan->TraceId(), waitFrom, now);
+                }
+                pctx->pool.enqueueWith(shardOf(*pctx, scan->Host()), poolPriority(priority),
+                                       continueTargetScan, scan, priority, now, std::ref(*pctx));
+            });
+            return;
         }
-    }
-
-    int GetFd() const
-    {
-        return m_socketDescriptor;
-    }
-};
 
+        BINLOG(LL_DEBUG, ctx.targetLog, "{}: retrying a probe in {} ms",
+               Target::Endpoint(scan->Host(), scan->Port()),
+               std::chrono::duration_cast<std::chrono::milliseconds>(retryAfter).count());
 
-Expected<Socket> createAndConnectSocket(std::string& host)
-{
-    auto addresses = SocketAddress::ResolveHost(host);
-    if( !addresses.valid() ) {
-        return Expected<Socket>::fromException(addresses);
-    }
-
-    // For each address, we try and create a socket.
-    for( auto& addr: addresses.get() ) {
-        try {
-            Socket sock(addr);
-
-            sock.Connect(addr);
-
-            // If we get here, no error - so return it.
-            return std::move(sock);
-        } catch( const SocketError& e ) {
-            std::cerr << e.what() << std::endl;
-            continue;
-        }
+        ScanContext* pctx = &ctx;
+        auto waitFrom = ProbeClock::now();
+        ctx.timers.Schedule(retryAfter, [scan, priority, pctx, waitFrom]() {
+            auto now = ProbeClock::now();
+            if( scan->GetTracer() ) {
+                scan->GetTracer()->Record("backoff", "pool", scan->TraceId(), waitFrom, now);
+            }
+            pctx->pool.enqueueWith(shardOf(*pctx, scan->Host()), poolPriority(priority),
+                                   continueTargetScan, scan, priority, now, std::ref(*pctx));
+        });
+        rescheduled = true;
+        return;
     }
 
-    // TODO: better exception here
-    return Expected<Socket>::fromException(
-            std::runtime_error("couldn't create"));
+    finishTargetScan(*scan, ctx);
 }
 
 
-void scanOneHost(std::string host,
-                 std::unordered_map<const ::SSL_METHOD*, CipherList>& ciphers)
+// Scan a single (host, port) pair.  The addresses should already have the
+// right port set.  The caller must have added this target to the context's
+// pending count.  If the scan has been cancelled by the time this runs, the
+// target is skipped.
+void scanOneTarget(std::string host,
+                   uint16_t port,
+                   std::vector<SocketAddress> addresses,
+                   TargetPriority priority,
+                   ProbeClock::time_point queuedAt,
+                   ScanContext& ctx)
 {
-    std::cout << "Scanning: " << host << std::endl;
-
-    auto maybeSock = createAndConnectSocket(host);
-    if( !maybeSock.valid() ) {
-        std::cerr << "Error connecting" << std::endl;
+    if( ctx.cancel.Cancelled() ) {
+        ctx.stats.Add(ScanCounter::TargetsSkipped);
+        targetDone(ctx, addresses);
         return;
     }
-    Socket& sock = maybeSock.get();
 
-    // This is a (very) simple string we send to the remote end to
-    // verify that the connection is working.
-    std::string requestString = "GET / HTTP/1.1\r\n"
-                                "User-Agent: SSLScan\r\n"
-                                "Host: " + host + "\r\n\r\n";
-
-    for( auto it: ciphers ) {
-        for( auto cipher: it.second ) {
-            /* std::cout << ssl_methods.at(it.first) */
-            /*           << ": " */
-            /*           << cipher.Name() */
-            /*           << std::endl; */
-
-            ssl::SSLContext ctx(it.first);
-            ctx.SetCipherList(cipher.Name());
-
-            ssl::SSL ssl(ctx);
-
-            // TODO: connect to the server and actually test.
+    ctx.stats.Add(ScanCounter::TargetsStarted);
+    {
+        std::unique_lock<std::mutex> lock(outputMutex);
+        std::cout << "Scanning: " << Target::Endpoint(host, port) << std::endl;
+    }
 
-        }
+    ShardState& shard = *ctx.shards[shardOf(ctx, host)];
+    auto scan = std::allocate_shared<TargetScan>(FrameAllocator<TargetScan>(shard.frames),
+                                                 host, port, std::move(addresses),
+                                                 ctx.probes, ctx.options,
+                                                 ctx.timings, ctx.retries,
+                                                 &ctx.latencies, &ctx.stats,
+                                                 ctx.tracer, ctx.perf,
+                                                 &shard.contexts, &ctx.cancel,
+                                                 ctx.budgets.Deadline(host));
+    if( shard.reactor ) {
+        shard.reactor->Add(std::move(scan));
+        return;
     }
+    continueTargetScan(scan, priority, queuedAt, ctx);
 }
 
 
-CipherList getSupportedCiphers(const SSL_METHOD* method) {
-    CipherList res;
-
-    ssl::SSLContext ctx(method);
-    ctx.SetCipherList("ALL:COMPLEMENTOFALL");
-
-    ssl::SSL ssl(ctx);
-    return ssl.GetCipherList();
+// Queue a (host, port) pair to be scanned, once its network has room for
+// it.  The addresses should already have the right port set.
+void queueTarget(std::string host,
+                 uint16_t port,
+                 std::vector<SocketAddress> addresses,
+                 TargetPriority priority,
+                 ScanContext& ctx)
+{
+    ctx.stats.Add(ScanCounter::TargetsQueued);
+    ctx.pending.Add();
+
+    std::string prefix = SubnetScheduler::PrefixOf(addresses);
+    ScanContext* pctx = &ctx;
+    ctx.subnets.Submit(prefix, [host, port, addresses, priority, pctx]() {
+        pctx->pool.enqueueWith(shardOf(*pctx, host), poolPriority(priority),
+                               scanOneTarget, host, port, addresses, priority,
+                               ProbeClock::now(), std::ref(*pctx));
+    }, poolPriority(priority));
 }
 
 
@@ -314,6 +302,29 @@ int main(int argc, char* argv[]) {
 
     int verbosity = 0,
         threads = 5;
+    std::vector<uint16_t> defaultPorts = { 443 };
+    std::string inputFile,
+                outputFile;
+    ScanOptions options;
+    int retries = 2,
+        hostRetryBudget = 50;
+    long retryBudget = -1;
+    int statsPort = -1;
+    std::string traceFile;
+    size_t traceSample = 1,
+           traceBuffer = 100000;
+    bool perfCounters = false;
+    bool shardPerCore = false;
+    bool useReactor = false;
+    size_t perSubnet = 0,
+           maxConcurrency = 0;
+    int deadlineSecs = 0,
+        hostBudgetSecs = 0,
+        drainSecs = 10;
+    std::string flightFile = "sslscan-" + std::to_string(getpid()) + ".flight";
+    std::string logFile,
+                binaryLogFile;
+    size_t flightEvents = 256;
 
     OptionParser parser;
 
@@ -326,12 +337,318 @@ int main(int argc, char* argv[]) {
           .SetCallback([&threads](const std::string& arg)
     {
         try {
-            threads = boost::lexical_cast<int>(arg);
+            // We need at least one thread to do any scanning.
+            int value = boost::lexical_cast<int>(arg);
+            if( value < 1 ) {
+                std::cerr << "Invalid value for 'threads': '" << arg << "'" << std::endl;
+                return;
+            }
+
+            threads = value;
             std::cout << "Scanning with " << threads << " threads" << std::endl;
         } catch( const boost::bad_lexical_cast& ) {
             std::cerr << "Invalid value for 'threads': '" << arg << "'" << std::endl;
         }
     });
+    parser.On("p", "ports")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&defaultPorts](const std::string& arg)
+    {
+        auto ports = Target::ParsePorts(arg);
+        if( ports.valid() ) {
+            defaultPorts = ports.get();
+        } else {
+            std::cerr << "Invalid value for 'ports': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("s", "source")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&options](const std::string& arg)
+    {
+        // A comma-separated list of local addresses.
+        size_t start = 0;
+        while( start <= arg.length() ) {
+            size_t end = arg.find(',', start);
+            if( std::string::npos == end ) {
+                end = arg.length();
+            }
+
+            std::string addr = arg.substr(start, end - start);
+            auto resolved = SocketAddress::ResolveHost(addr);
+            if( resolved.valid() && !resolved.get().empty() ) {
+                options.sources.Add(resolved.get()[0]);
+            } else {
+                std::cerr << "Invalid value for 'source': '" << addr << "'" << std::endl;
+            }
+
+            start = end + 1;
+        }
+    });
+    parser.On("", "abortive-close")
+          .SetParameter(false)
+          .SetCallback([&options]()
+    {
+        options.abortiveClose = true;
+    });
+    parser.On("", "timeout")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&options](const std::string& arg)
+    {
+        try {
+            // The handshake gets twice as long, which mustn't overflow.
+            int value = boost::lexical_cast<int>(arg);
+            if( value < 1 || value > std::numeric_limits<int>::max() / 2 ) {
+                std::cerr << "Invalid value for 'timeout': '" << arg << "'" << std::endl;
+                return;
+            }
+
+            options.connectTimeoutMs = value;
+            options.handshakeTimeoutMs = 2 * value;
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'timeout': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "max-timeout")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&options](const std::string& arg)
+    {
+        try {
+            int value = boost::lexical_cast<int>(arg);
+            if( value < 1 ) {
+                std::cerr << "Invalid value for 'max-timeout': '" << arg << "'" << std::endl;
+                return;
+            }
+
+            options.maxTimeoutMs = value;
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'max-timeout': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "fixed-timeouts")
+          .SetParameter(false)
+          .SetCallback([&options]()
+    {
+        options.adaptiveTimeouts = false;
+    });
+    parser.On("", "retries")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&retries](const std::string& arg)
+    {
+        try {
+            retries = boost::lexical_cast<int>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'retries': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "retry-budget")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&retryBudget](const std::string& arg)
+    {
+        try {
+            retryBudget = boost::lexical_cast<long>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'retry-budget': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "host-retry-budget")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&hostRetryBudget](const std::string& arg)
+    {
+        try {
+            hostRetryBudget = boost::lexical_cast<int>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'host-retry-budget': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "deadline")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&deadlineSecs](const std::string& arg)
+    {
+        try {
+            deadlineSecs = boost::lexical_cast<int>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'deadline': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "host-budget")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&hostBudgetSecs](const std::string& arg)
+    {
+        try {
+            hostBudgetSecs = boost::lexical_cast<int>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'host-budget': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "drain-timeout")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&drainSecs](const std::string& arg)
+    {
+        try {
+            drainSecs = boost::lexical_cast<int>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'drain-timeout': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "no-sweep")
+          .SetParameter(false)
+          .SetCallback([&options]()
+    {
+        options.sweep = false;
+    });
+    parser.On("", "sweep-concurrency")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&options](const std::string& arg)
+    {
+        try {
+            options.sweepConcurrency = boost::lexical_cast<size_t>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'sweep-concurrency': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "shard-per-core")
+          .SetParameter(false)
+          .SetCallback([&shardPerCore]()
+    {
+        shardPerCore = true;
+    });
+    parser.On("", "reactor")
+          .SetParameter(false)
+          .SetCallback([&useReactor]()
+    {
+        useReactor = true;
+    });
+    parser.On("", "per-subnet")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&perSubnet](const std::string& arg)
+    {
+        try {
+            perSubnet = boost::lexical_cast<size_t>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'per-subnet': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "max-concurrency")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&maxConcurrency](const std::string& arg)
+    {
+        try {
+            maxConcurrency = boost::lexical_cast<size_t>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'max-concurrency': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "no-io-uring")
+          .SetParameter(false)
+          .SetCallback([&options]()
+    {
+        options.ioUring = false;
+    });
+    parser.On("", "stats-port")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&statsPort](const std::string& arg)
+    {
+        try {
+            statsPort = boost::lexical_cast<uint16_t>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'stats-port': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "trace")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&traceFile](const std::string& arg)
+    {
+        traceFile = arg;
+    });
+    parser.On("", "trace-sample")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&traceSample](const std::string& arg)
+    {
+        try {
+            traceSample = boost::lexical_cast<size_t>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'trace-sample': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "trace-buffer")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&traceBuffer](const std::string& arg)
+    {
+        try {
+            traceBuffer = boost::lexical_cast<size_t>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'trace-buffer': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "perf-counters")
+          .SetParameter(false)
+          .SetCallback([&perfCounters]()
+    {
+        perfCounters = true;
+    });
+    parser.On("", "flight-recorder")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&flightFile](const std::string& arg)
+    {
+        flightFile = arg;
+    });
+    parser.On("", "flight-events")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&flightEvents](const std::string& arg)
+    {
+        try {
+            flightEvents = boost::lexical_cast<size_t>(arg);
+        } catch( const boost::bad_lexical_cast& ) {
+            std::cerr << "Invalid value for 'flight-events': '" << arg << "'" << std::endl;
+        }
+    });
+    parser.On("", "log-file")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&logFile](const std::string& arg)
+    {
+        logFile = arg;
+    });
+    parser.On("", "binary-log")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&binaryLogFile](const std::string& arg)
+    {
+        binaryLogFile = arg;
+    });
+    parser.On("o", "output")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&outputFile](const std::string& arg)
+    {
+        outputFile = arg;
+    });
+    parser.On("i", "input")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&inputFile](const std::string& arg)
+    {
+        inputFile = arg;
+    });
 
     Expected<std::vector<std::string>> args = parser.Parse(argc, argv);
     if( !args.valid() ) {
@@ -347,10 +664,93 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    // Gather the targets from the command line and the input file (one per
+    // line, with blank lines and '#' comments ignored).
+    std::vector<std::string> specs = args.get();
+    if( !inputFile.empty() ) {
+        std::ifstream in(inputFile);
+        if( !in ) {
+            std::cerr << "Could not open input file: '" << inputFile << "'" << std::endl;
+            return 1;
+        }
+
+        std::string line;
+        while( std::getline(in, line) ) {
+            size_t first = line.find_first_not_of(" \t\r");
+            if( std::string::npos == first || '#' == line[first] ) {
+                continue;
+            }
+            size_t last = line.find_last_not_of(" \t\r");
+            specs.push_back(line.substr(first, last - first + 1));
+        }
+    }
+
+    std::vector<Target> targets;
+    for( auto& spec : specs ) {
+        auto target = Target::Parse(spec, defaultPorts);
+        if( !target.valid() ) {
+            try {
+                target.get();
+            } catch( const TargetError& e ) {
+                std::cerr << e.what() << std::endl;
+            }
+            return 1;
+        }
+        targets.push_back(target.get());
+    }
+
+    // The most urgent targets go first, so they're the first to be
+    // resolved, swept and queued.  Their tasks then jump the pool's queue
+    // too, e.g. when they're retried.
+    std::stable_sort(targets.begin(), targets.end(), [](const Target& a, const Target& b) {
+        return a.priority < b.priority;
+    });
+
     // Init. SSL
     SSL_library_init();
     SSL_load_error_strings();
 
+    // A peer resetting the connection mid-write shouldn't kill us.
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 dumps the live stats; this has to happen before we start any
+    // threads, so that they all inherit it.
+    BlockStatsSignal();
+
+    // Likewise SIGUSR2, which dumps the flight recorder, and SIGINT and
+    // SIGTERM, which stop the scan.
+    BlockFlightSignal();
+    BlockInterruptSignals();
+
+    // Warnings and errors go to stderr (and more with -v or -vv), and
+    // everything to the log file, if there is one.  Declared in this order
+    // so that the logger stops before its sinks go away.
+    cpplog::StdErrLogger stderrLog;
+    std::unique_ptr<cpplog::AsyncFileLogger> fileLog;
+    ShardedLogger log;
+    log.AddSink(stderrLog, verbosity >= 2 ? LL_DEBUG : verbosity == 1 ? LL_INFO : LL_WARN);
+    if( !logFile.empty() ) {
+        fileLog.reset(new cpplog::AsyncFileLogger(logFile));
+        log.AddSink(*fileLog, LL_DEBUG);
+    }
+    log.Start();
+
+    // Messages about each target are formatted in the background, and
+    // logged with the rest - or with --binary-log, written to a file as
+    // they are, for binlogdump to format.
+    std::unique_ptr<binlog::BinaryLogger> targetLog;
+    if( binaryLogFile.empty() ) {
+        targetLog.reset(new binlog::BinaryLogger(log));
+    } else {
+        targetLog.reset(new binlog::BinaryLogger(binaryLogFile));
+        if( !targetLog->IsOpen() ) {
+            std::cerr << "Could not open binary log file: '" << binaryLogFile << "'" << std::endl;
+            return 1;
+        }
+    }
+    LOG(LL_INFO, log) << "Scanning " << targets.size() << " target(s) with "
+                      << threads << " threads";
+
     std::unordered_map<const ::SSL_METHOD*, CipherList> ciphers;
     for( auto it: ssl_methods ) {
         std::cout << "Getting ciphers for: " << it.second << std::endl;
@@ -364,21 +764,422 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // Flatten everything into the list of probes to run against each target.
+    std::vector<CipherProbe> probes;
+    for( auto& it : ciphers ) {
+        for( auto& cipher : it.second ) {
+            CipherProbe probe = { it.first, ssl_methods.at(it.first), cipher };
+            probes.push_back(probe);
+        }
+    }
+
+    // Take every descriptor we're allowed, and share them out: the sweep
+    // gets up to half, and the probes the rest, less some headroom for
+    // everything else.  Past that, probes wait for a descriptor to come
+    // free instead of failing.
+    size_t fdLimit = RaiseFdLimit();
+    size_t fdSpare = fdLimit > FdBudget::HEADROOM ? fdLimit - FdBudget::HEADROOM : 1;
+    if( options.sweep && options.sweepConcurrency > fdSpare / 2 ) {
+        options.sweepConcurrency = std::max<size_t>(fdSpare / 2, 1);
+        LOG(LL_WARN, log) << "Sweeping at most " << options.sweepConcurrency
+                          << " target(s) at once, to stay within " << fdLimit
+                          << " descriptors";
+    }
+    FdBudget fds(fdSpare - (options.sweep ? options.sweepConcurrency : 0));
+    options.fds = &fds;
+    LOG(LL_INFO, log) << "Up to " << fds.Capacity() << " probe connection(s) at once, of "
+                      << fdLimit << " descriptors";
+
+    // In shard-per-core mode, the workers are split into a shard per CPU,
+    // each pinned to its CPU, and each host is always handled by the same
+    // shard - which has its own task queue, SSL contexts and result
+    // buffer.
+    size_t shards = 1;
+    if( shardPerCore ) {
+        shards = std::min<size_t>(UsableCpus(), threads);
+        LOG(LL_INFO, log) << "Running " << shards << " shard(s), one per CPU";
+    }
+
+    // NOTE: This must outlive the pool, since its tasks use it.
+    std::vector<std::unique_ptr<ShardState>> shardStates;
+    for( size_t i = 0; i < shards; i++ ) {
+        shardStates.emplace_back(new ShardState(probes.size()));
+    }
+
+    std::unique_ptr<ResultWriter> results;
+    if( !outputFile.empty() ) {
+        results.reset(new ResultWriter(outputFile, shards));
+        if( !results->IsOpen() ) {
+            std::cerr << "Could not open output file: '" << outputFile << "'" << std::endl;
+            return 1;
+        }
+    }
+
+    // The whole scan must be done within 'deadlineSecs', and each host
+    // within 'hostBudgetSecs' of starting on it.  Whatever isn't done by
+    // then is cut short - as is everything, on SIGINT or SIGTERM.
+    CancellationToken cancel(deadlineSecs > 0
+            ? ProbeClock::now() + std::chrono::seconds(deadlineSecs)
+            : ProbeClock::time_point::max());
+    HostBudgets budgets(std::chrono::seconds(std::max(hostBudgetSecs, 0)));
+    if( deadlineSecs > 0 ) {
+        LOG(LL_INFO, log) << "Stopping the scan after " << deadlineSecs << " s";
+    }
+
+    std::atomic<bool> interrupted(false);
+    InterruptWatcher interruptWatcher([&cancel, &interrupted, &log]() {
+        LOG(LL_WARN, log) << "Interrupted - finishing the targets in progress "
+                             "(interrupt again to exit at once)";
+        interrupted = true;
+        cancel.Cancel();
+    });
+
+    // Timeouts learned from a host shouldn't be shorter than we'd have
+    // given it without them.
+    if( options.maxTimeoutMs < options.handshakeTimeoutMs ) {
+        LOG(LL_WARN, log) << "Raising the maximum timeout to " << options.handshakeTimeoutMs
+                          << " ms, the handshake timeout";
+        options.maxTimeoutMs = options.handshakeTimeoutMs;
+    }
+    HostTimings timings(options.maxTimeoutMs, options.adaptiveTimeouts);
+    RetryPolicy retryPolicy(retries, hostRetryBudget, retryBudget);
+    LatencyRecorder latencies;
+    ScanStats stats;
+
+    // Count the CPU cost of each probe, by protocol and outcome.
+    // NOTE: A reactor runs many probes at once on one thread, so it can't
+    // tell which of them the counters were spent on.
+    std::unique_ptr<PerfProfiler> perf;
+    if( perfCounters && useReactor ) {
+        LOG(LL_WARN, log) << "Performance counters aren't supported with --reactor";
+    } else if( perfCounters ) {
+        std::vector<std::string> protocols, outcomes;
+        for( auto& it : ssl_methods ) {
+            protocols.push_back(it.second);
+        }
+        for( int o = 0; o < NUM_PROBE_STATUSES; o++ ) {
+            outcomes.push_back(ProbeStatusName(static_cast<ProbeStatus>(o)));
+        }
+        perf.reset(new PerfProfiler(protocols, outcomes));
+    }
+
+    // If tracing, trace one in every 'traceSample' targets, keeping the
+    // last 'traceBuffer' events of each thread.
+    std::unique_ptr<Tracer> tracer;
+    if( !traceFile.empty() ) {
+        tracer.reset(new Tracer(traceBuffer, traceSample));
+    }
+
+    // Keep the last 'flightEvents' events of each thread, to be dumped to
+    // 'flightFile' on a crash or SIGUSR2.
+    std::unique_ptr<FlightRecorder> flight;
+    std::unique_ptr<FlightDumper> flightDumper;
+    if( flightEvents > 0 ) {
+        flight.reset(new FlightRecorder(flightEvents));
+        flight->InstallCrashHandlers(flightFile);
+        flightDumper.reset(new FlightDumper(*flight, flightFile));
+    }
+
     // Do the scanning.  The ThreadPool will wait on all threads on destruction,
-    // so we do this in a new scope.
+    // so we do this in a new scope.  The pool's workers are the single
+    // in-flight budget shared by name resolution and every (host, port)
+    // probe.
     // NOTE: It's safe for us to pass unordered_maps in here, so long as we
     // DON'T mutate it - STL containers should allow for concurrent reading, so
     // long as there's no mutation involved.
     {
-        ThreadPool pool(threads);
+        // NOTE: This must outlive the pool and the sweeper, since they hold
+        // references to the resolved addresses.
+        std::unordered_map<std::string, std::shared_future<ResolveResult>> resolved;
+
+        // With --max-concurrency, how many targets are in flight is tuned
+        // as we go, starting from the number of threads.  Without a
+        // reactor, each of them needs a worker, so the pool is sized for
+        // the most we might pick.
+        std::unique_ptr<ConcurrencyController> controller;
+        size_t workers = threads;
+        if( maxConcurrency > 0 ) {
+            controller.reset(new ConcurrencyController(threads, 1,
+                                                       std::min(maxConcurrency, fds.Capacity())));
+            if( !useReactor ) {
+                workers = std::max(workers, controller->Max());
+            }
+        }
+
+        TimerQueue timers;
+        WaitGroup pending;
+        // A reactor has no limit of its own on the targets in flight, so
+        // there, and wherever there are more threads than descriptors, we
+        // hold back targets that would only wait for one.
+        size_t inFlightLimit = 0;
+        if( controller ) {
+            inFlightLimit = controller->Limit();
+        } else if( useReactor || static_cast<size_t>(threads) > fds.Capacity() ) {
+            inFlightLimit = fds.Capacity();
+        }
+        SubnetScheduler subnets(perSubnet, inFlightLimit);
+        ThreadPool::StartHook pinWorker;
+        if( shardPerCore ) {
+            pinWorker = [&log](size_t shard) {
+                if( !PinToCpu(shard) ) {
+                    LOG(LL_WARN, log) << "Could not pin shard " << shard << " to a CPU";
+                }
+            };
+        }
+        ThreadPool pool(workers, shards, pinWorker);
 
-        // TODO: parallelize by host & SSL method, not (just) by host
-        for( auto host : args.get() ) {
-            pool.enqueue(scanOneHost, host, ciphers);
+        ScanContext ctx = {
+            probes, options, timings, retryPolicy, latencies, stats,
+            tracer.get(), perf.get(), results.get(), log, *targetLog, shardStates,
+            pool, timers, pending, subnets, cancel, budgets,
+        };
+
+        // With --reactor, each shard's scans run on a reactor of its own,
+        // and the pool only resolves names and sets scans up.
+        if( useReactor ) {
+            for( size_t i = 0; i < shards; i++ ) {
+                shardStates[i]->reactor.reset(new ScanReactor(
+                    [&ctx](std::shared_ptr<TargetScan> scan) {
+                        finishTargetScan(*scan, ctx);
+                        targetDone(ctx, scan->Addresses());
+                    },
+                    [&pinWorker, i]() {
+                        if( pinWorker ) {
+                            pinWorker(i);
+                        }
+                    },
+                    &cancel,
+                    options.ioUring));
+            }
+            LOG(LL_INFO, log) << "Running scans on " << shards << " reactor(s), connecting with "
+                              << shardStates[0]->reactor->Backend();
         }
+        if( perSubnet > 0 ) {
+            LOG(LL_INFO, log) << "Scanning at most " << perSubnet << " target(s) at once per /"
+                              << SubnetScheduler::IPV4_PREFIX_BITS << " (IPv4) or /"
+                              << SubnetScheduler::IPV6_PREFIX_BITS << " (IPv6)";
+        }
+
+        // These are declared after the pool, so they stop before it does.
+        std::unique_ptr<ConcurrencyTuner> tuner;
+        if( controller ) {
+            tuner.reset(new ConcurrencyTuner(*controller,
+                [&stats, &latencies, &subnets]() {
+                    LatencyHistogram connects = latencies.Snapshot(ScanPhase::Connect);
+                    ConcurrencyController::Sample sample = {
+                        stats.Get(ScanCounter::Probes),
+                        stats.Get(ScanCounter::Timeouts),
+                        stats.Get(ScanCounter::Refused),
+                        stats.Get(ScanCounter::LocalErrors),
+                        connects.Count(),
+                        connects.Mean() * connects.Count() / 1e9,
+                        subnets.InFlight(),
+                    };
+                    return sample;
+                },
+                [&subnets, &log](size_t limit) {
+                    subnets.SetLimit(limit);
+                    LOG(LL_DEBUG, log) << "Concurrency is now " << limit << " target(s)";
+                },
+                std::chrono::milliseconds(ConcurrencyController::INTERVAL_MS)));
+            LOG(LL_INFO, log) << "Tuning concurrency between 1 and " << controller->Max()
+                              << " target(s), starting at " << controller->Limit();
+        }
+
+        StatsCollector collector(stats, pool, controller.get(), &fds);
+        StatsDumper dumper(collector, std::cerr);
+        std::unique_ptr<StatsServer> statsServer;
+        if( statsPort >= 0 ) {
+            try {
+                statsServer.reset(new StatsServer(collector, statsPort));
+                std::cout << "Serving stats on http://127.0.0.1:"
+                          << statsServer->Port() << "/metrics" << std::endl;
+            } catch( const SocketError& e ) {
+                LOG(LL_ERROR, log) << "Could not serve stats: " << e.what();
+            }
+        }
+
+        // Resolve each distinct name exactly once, in parallel.  Resolution
+        // tasks are queued ahead of any probes, so they run first.
+        for( auto& target : targets ) {
+            if( resolved.count(target.host) ) {
+                continue;
+            }
+
+            Tracer* resolveTracer = nullptr;
+            uint32_t resolveId = 0;
+            if( tracer && tracer->Sampled(target.host) ) {
+                resolveTracer = tracer.get();
+                resolveId = tracer->Register(target.host);
+            }
+
+            resolved.emplace(target.host, pool.enqueueWith(shardOf(ctx, target.host),
+                                                           poolPriority(target.priority),
+                [&latencies, &cancel, resolveTracer, resolveId](std::string host) {
+                    if( cancel.Cancelled() ) {
+                        return ResolveResult::fromException(AddressError(EAI_AGAIN));
+                    }
+
+                    PhaseTimer timer(&latencies, ScanPhase::Resolve);
+                    TraceSpan span(resolveTracer, "resolve", "phase", resolveId);
+                    return SocketAddress::ResolveHost(host);
+                }, target.host).share());
+        }
+
+        // If we're sweeping, every (host, port) is first checked for
+        // liveness, and only those that answer are queued for the TLS
+        // probes - while the sweep carries on with the rest.
+        std::unique_ptr<LivenessSweeper> sweeper;
+        if( options.sweep ) {
+            sweeper.reset(new LivenessSweeper(
+                options.sweepConcurrency,
+                options.connectTimeoutMs,
+                options.sources,
+                timings,
+                [&](const SweepTarget& target, const SocketAddress& addr,
+                    LivenessSweeper::Clock::duration rtt)
+                {
+                    latencies.Record(ScanPhase::Sweep, rtt);
+                    stats.Add(ScanCounter::SweepAlive);
+                    if( cancel.Cancelled() ) {
+                        stats.Add(ScanCounter::TargetsSkipped);
+                        return;
+                    }
+
+                    queueTarget(target.host, target.port, std::vector<SocketAddress>(1, addr),
+                                target.priority, ctx);
+                },
+                [&stats, &log](const SweepTarget& target)
+                {
+                    stats.Add(ScanCounter::SweepDead);
+                    LOG(LL_WARN, log) << Target::Endpoint(target.host, target.port)
+                                      << ": not responding";
+                },
+                options.ioUring,
+                &cancel));
+            LOG(LL_INFO, log) << "Sweeping with " << sweeper->Backend();
+        }
+
+        // Schedule every distinct (host, port) pair, as soon as that host's
+        // addresses are available - until the scan is cancelled.
+        // TODO: parallelize by SSL method too, not just by (host, port)
+        std::set<std::pair<std::string, uint16_t>> scheduled;
+        for( auto& target : targets ) {
+            if( cancel.Cancelled() ) {
+                break;
+            }
+
+            const ResolveResult& addresses = resolved.at(target.host).get();
+            if( !addresses.valid() ) {
+                try {
+                    addresses.get();
+                } catch( const AddressError& e ) {
+                    LOG(LL_WARN, log) << target.host << ": " << e.what();
+                }
+                continue;
+            }
+
+            for( auto port : target.ports ) {
+                if( !scheduled.insert(std::make_pair(target.host, port)).second ) {
+                    continue;
+                }
+
+                if( sweeper ) {
+                    SweepTarget sweepTarget = { target.host, port, &addresses.get(),
+                                                target.priority };
+                    sweeper->Add(sweepTarget);
+                    continue;
+                }
+
+                std::vector<SocketAddress> portAddresses;
+                for( auto& addr : addresses.get() ) {
+                    portAddresses.push_back(addr.WithPort(port));
+                }
+                queueTarget(target.host, port, portAddresses, target.priority, ctx);
+            }
+        }
+
+        // Wait for the sweep to finish, so that every live target has been
+        // queued, and then for every target (including any retries waiting
+        // on the timer) to finish before the pool starts shutting down.
+        //
+        // Once the scan is cancelled, the targets in progress have
+        // 'drainSecs' to wrap up.  If any haven't by then, we write out
+        // what we have, and leave without them.
+        sweeper.reset();
+        auto drainBy = ProbeClock::time_point::max();
+        while( !pending.WaitFor(std::chrono::milliseconds(CancellationToken::CHECK_INTERVAL_MS)) ) {
+            if( !cancel.Cancelled() ) {
+                continue;
+            }
+
+            auto now = ProbeClock::now();
+            if( ProbeClock::time_point::max() == drainBy ) {
+                drainBy = now + std::chrono::seconds(std::max(drainSecs, 0));
+            } else if( now >= drainBy ) {
+                LOG(LL_ERROR, log) << pending.Count() << " target(s) didn't stop within "
+                                   << drainSecs << " s; exiting without them";
+                if( results ) {
+                    results->Flush();
+                }
+                targetLog->Flush();
+                log.Stop();
+                if( fileLog ) {
+                    fileLog->Flush();
+                }
+                std::cout << std::flush;
+                _exit(interrupted ? 130 : 1);
+            }
+        }
+
+        for( auto& state : shardStates ) {
+            state->reactor.reset();
+        }
+
+        if( controller ) {
+            LOG(LL_INFO, log) << "Finished with a concurrency of " << controller->Limit()
+                              << " target(s), having backed off " << controller->Cuts()
+                              << " time(s)";
+        }
+    }
+
+    std::cout << std::endl;
+    PrintLatencies(std::cout, latencies);
+    if( results ) {
+        results->WriteLatencies(latencies);
+    }
+
+    if( perf ) {
+        std::cout << std::endl;
+        perf->Print(std::cout);
+        if( results ) {
+            results->WritePerf(*perf);
+        }
+    }
+
+    if( tracer ) {
+        if( tracer->WriteFile(traceFile) ) {
+            std::cout << "Wrote trace to: '" << traceFile << "'" << std::endl;
+        } else {
+            std::cerr << "Could not write trace file: '" << traceFile << "'" << std::endl;
+        }
+    }
+
+    if( log.Dropped() > 0 ) {
+        LOG(LL_WARN, log) << log.Dropped() << " log message(s) were dropped";
+    }
+    if( targetLog->Dropped() > 0 ) {
+        LOG(LL_WARN, log) << targetLog->Dropped() << " target log message(s) were dropped";
+    }
+
+    uint64_t cutShort = stats.Get(ScanCounter::TargetsCutShort),
+             skipped = stats.Get(ScanCounter::TargetsSkipped);
+    if( cutShort > 0 || skipped > 0 ) {
+        LOG(LL_WARN, log) << "Scan stopped early: " << cutShort << " target(s) cut short, "
+                          << skipped << " skipped";
     }
 
     std::cout << "Done!" << std::endl;
 
-    return 0;
+    return interrupted ? 130 : 0;
 }
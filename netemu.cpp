@@ -0,0 +1,1095 @@
+// Network emulation harness.  Starts thousands of endpoints on loopback
+// addresses (all of 127.0.0.0/8 routes to lo on Linux), each behaving like
+// a different kind of internet host, and optionally runs a scan against
+// them and scores it against the known ground truth.
+//
+// Profiles:
+//      tls         A TLS server with one of a few cipher policies.
+//      slow        The same, but waits before every handshake.
+//      ratelimit   The same, but resets connections over a fixed rate.
+//      stall       Accepts the connection and then never says anything.
+//      drop        Never completes a TCP handshake: the listener's accept
+//                  queue is kept full, so the kernel drops every SYN.
+//      reset       Accepts the connection and immediately resets it.
+//      closed      Nothing listening, so the kernel answers with a RST.
+//
+// Latency (plus jitter) is added before each connection is answered, and
+// "loss" stalls a random fraction of connections.  Both work a whole
+// connection at a time, rather than per packet - enough to exercise the
+// scanner's timeouts and retries without needing a packet filter.
+//
+// Typical use (see "make emulate"):
+//      netemu --endpoints 1000 --targets targets.txt --results out.json
+//             --run "sslscan -i targets.txt -o out.json"
+
+#include "OptionParser.hpp"
+#include "SSL.hpp"
+#include "Socket.hpp"
+#include "TestServer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+
+typedef std::chrono::steady_clock Clock;
+
+
+enum class Profile {
+    Tls,
+    Slow,
+    RateLimit,
+    Stall,
+    Drop,
+    Reset,
+    Closed,
+};
+
+static const std::pair<Profile, const char*> profileNames[] = {
+    { Profile::Tls,         "tls" },
+    { Profile::Slow,        "slow" },
+    { Profile::RateLimit,   "ratelimit" },
+    { Profile::Stall,       "stall" },
+    { Profile::Drop,        "drop" },
+    { Profile::Reset,       "reset" },
+    { Profile::Closed,      "closed" },
+};
+
+const char* ProfileName(Profile profile)
+{
+    for( auto& it : profileNames ) {
+        if( it.first == profile ) {
+            return it.second;
+        }
+    }
+    return "unknown";
+}
+
+// Whether a correct scan should find accepted ciphers on the endpoint.
+bool ProfileSpeaksTls(Profile profile)
+{
+    return Profile::Tls == profile ||
+           Profile::Slow == profile ||
+           Profile::RateLimit == profile;
+}
+
+
+struct EmulatorOptions {
+    size_t      endpoints;
+    std::string baseAddress;
+    uint16_t    port;
+
+    // Relative weight of each profile.
+    std::map<Profile, double> mix;
+
+    int         latencyMs;
+    int         jitterMs;
+    double      loss;
+    int         slowMs;
+    double      rateLimit;      // connections per second
+    double      rateBurst;
+    int         holdMs;         // how long any connection is kept open
+
+    size_t      loops;
+    unsigned    seed;
+
+    EmulatorOptions()
+        : endpoints(1000)
+        , baseAddress("127.1.0.1")
+        , port(443)
+        , latencyMs(0)
+        , jitterMs(0)
+        , loss(0)
+        , slowMs(500)
+        , rateLimit(20)
+        , rateBurst(10)
+        , holdMs(30000)
+        , loops(std::max(1u, std::thread::hardware_concurrency()))
+        , seed(1)
+    {
+        mix[Profile::Tls] = 50;
+        mix[Profile::Slow] = 10;
+        mix[Profile::RateLimit] = 5;
+        mix[Profile::Stall] = 10;
+        mix[Profile::Drop] = 10;
+        mix[Profile::Reset] = 10;
+        mix[Profile::Closed] = 5;
+    }
+};
+
+
+// A server cipher policy, shared by every endpoint that uses it.
+struct TlsVariant {
+    std::string                         name;
+    std::unique_ptr<ssl::SSLContext>    ctx;
+
+    // The ciphers the server will actually negotiate.
+    std::set<std::string>               ciphers;
+};
+
+// A single emulated host.  After setup, an endpoint is only touched by
+// the event loop that owns it.
+struct Endpoint {
+    SocketAddress               address;
+    Profile                     profile;
+    const TlsVariant*           variant;
+
+    std::unique_ptr<Socket>     listener;
+
+    // For 'drop': a connection that we never accept, which keeps the
+    // listener's accept queue full.
+    std::unique_ptr<Socket>     filler;
+
+    // Token bucket, for 'ratelimit'.
+    double                      tokens;
+    Clock::time_point           refilled;
+
+    Endpoint(const SocketAddress& addr, Profile prof, const TlsVariant* var)
+        : address(addr), profile(prof), variant(var), tokens(0)
+    { }
+};
+
+
+// Serves the connections for a set of endpoints from a single thread,
+// using epoll and non-blocking OpenSSL.
+class EmulatorLoop {
+private:
+    enum class State {
+        Waiting,        // Until the emulated latency has passed.
+        Stalled,        // Never answering.
+        Handshake,
+        Reading,
+        Writing,
+    };
+
+    struct Connection {
+        uint64_t                    id;
+        Socket                      sock;
+        Endpoint*                   endpoint;
+        State                       state;
+        std::unique_ptr<ssl::SSL>   ssl;
+        size_t                      written;
+        Clock::time_point           startAt;
+        Clock::time_point           deadline;
+
+        Connection(uint64_t i, Socket&& s, Endpoint* ep)
+            : id(i), sock(std::move(s)), endpoint(ep), state(State::Waiting), written(0)
+        { }
+    };
+
+    struct Timer {
+        Clock::time_point   when;
+        int                 fd;
+        uint64_t            id;
+
+        bool operator>(const Timer& other) const
+        {
+            return when > other.when;
+        }
+    };
+
+    const EmulatorOptions&  m_options;
+    int                     m_epoll;
+    std::mt19937            m_rng;
+    uint64_t                m_nextId;
+
+    std::unordered_map<int, Endpoint*>                      m_listeners;
+    std::unordered_map<int, std::unique_ptr<Connection>>    m_connections;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> m_timers;
+
+    std::atomic<bool>       m_stopping;
+    std::thread             m_thread;
+
+public:
+    EmulatorLoop(const EmulatorOptions& options, unsigned seed)
+        : m_options(options)
+        , m_epoll(epoll_create1(0))
+        , m_rng(seed)
+        , m_nextId(0)
+        , m_stopping(false)
+    {
+        if( -1 == m_epoll ) {
+            throw SocketError();
+        }
+    }
+
+    ~EmulatorLoop()
+    {
+        Stop();
+        m_connections.clear();
+        close(m_epoll);
+    }
+
+    // Delete copy constructor and assignment.
+    EmulatorLoop(EmulatorLoop const&) = delete;
+    EmulatorLoop& operator=(EmulatorLoop const&) = delete;
+
+    // Must be called before Start().
+    void AddListener(Endpoint* endpoint)
+    {
+        int fd = endpoint->listener->GetFd();
+        endpoint->listener->SetNonBlocking(true);
+        m_listeners[fd] = endpoint;
+        watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+    }
+
+    void Start()
+    {
+        m_thread = std::thread(&EmulatorLoop::run, this);
+    }
+
+    void Stop()
+    {
+        m_stopping = true;
+        if( m_thread.joinable() ) {
+            m_thread.join();
+        }
+    }
+
+private:
+    void watch(int fd, uint32_t events, int op)
+    {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.fd = fd;
+        if( -1 == epoll_ctl(m_epoll, op, fd, &ev) ) {
+            throw SocketError();
+        }
+    }
+
+    void run()
+    {
+        std::vector<struct epoll_event> events(256);
+
+        while( !m_stopping ) {
+            int timeoutMs = 100;
+            if( !m_timers.empty() ) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        m_timers.top().when - Clock::now()).count() + 1;
+                timeoutMs = static_cast<int>(std::max<long long>(0, std::min<long long>(left, timeoutMs)));
+            }
+
+            int count = epoll_wait(m_epoll, events.data(), events.size(), timeoutMs);
+            if( -1 == count ) {
+                if( EINTR == errno ) {
+                    continue;
+                }
+                throw SocketError();
+            }
+
+            for( int i = 0; i < count; i++ ) {
+                int fd = events[i].data.fd;
+
+                auto listener = m_listeners.find(fd);
+                if( listener != m_listeners.end() ) {
+                    acceptAll(listener->second);
+                    continue;
+                }
+
+                auto conn = m_connections.find(fd);
+                if( conn != m_connections.end() ) {
+                    ready(*conn->second, events[i].events);
+                }
+            }
+
+            runTimers();
+        }
+    }
+
+    void acceptAll(Endpoint* endpoint)
+    {
+        for(;;) {
+            try {
+                accepted(endpoint, endpoint->listener->Accept());
+            } catch( const SocketError& e ) {
+                if( ECONNABORTED == e.Code() || EINTR == e.Code() ) {
+                    continue;
+                }
+
+                // EAGAIN, or we're out of descriptors - in which case the
+                // connection stays queued until we have some back.
+                return;
+            }
+        }
+    }
+
+    void accepted(Endpoint* endpoint, Socket&& sock)
+    {
+        auto now = Clock::now();
+
+        switch( endpoint->profile ) {
+            case Profile::Reset:
+                sock.SetAbortiveClose();
+                return;
+
+            case Profile::RateLimit: {
+                double elapsed = std::chrono::duration<double>(now - endpoint->refilled).count();
+                endpoint->tokens = std::min(m_options.rateBurst,
+                                            endpoint->tokens + elapsed * m_options.rateLimit);
+                endpoint->refilled = now;
+                if( endpoint->tokens < 1 ) {
+                    sock.SetAbortiveClose();
+                    return;
+                }
+                endpoint->tokens -= 1;
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        sock.SetNonBlocking(true);
+        int fd = sock.GetFd();
+
+        std::unique_ptr<Connection> conn(new Connection(m_nextId++, std::move(sock), endpoint));
+        conn->deadline = now + std::chrono::milliseconds(m_options.holdMs);
+        schedule(conn->deadline, *conn);
+
+        std::uniform_real_distribution<double> uniform(0, 1);
+        if( Profile::Stall == endpoint->profile || uniform(m_rng) < m_options.loss ) {
+            conn->state = State::Stalled;
+            watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+            m_connections[fd] = std::move(conn);
+            return;
+        }
+
+        int delayMs = m_options.latencyMs;
+        if( m_options.jitterMs > 0 ) {
+            delayMs += std::uniform_int_distribution<int>(0, m_options.jitterMs)(m_rng);
+        }
+        if( Profile::Slow == endpoint->profile ) {
+            delayMs += m_options.slowMs;
+        }
+
+        // While we're waiting, we only want to hear about the peer going
+        // away - not about the ClientHello sitting there to be read.
+        conn->state = State::Waiting;
+        conn->startAt = now + std::chrono::milliseconds(delayMs);
+        watch(fd, 0, EPOLL_CTL_ADD);
+
+        Connection& ref = *conn;
+        m_connections[fd] = std::move(conn);
+
+        if( delayMs > 0 ) {
+            schedule(ref.startAt, ref);
+        } else {
+            startHandshake(ref);
+        }
+    }
+
+    void schedule(Clock::time_point when, const Connection& conn)
+    {
+        Timer timer = { when, conn.sock.GetFd(), conn.id };
+        m_timers.push(timer);
+    }
+
+    void runTimers()
+    {
+        auto now = Clock::now();
+        while( !m_timers.empty() && m_timers.top().when <= now ) {
+            Timer timer = m_timers.top();
+            m_timers.pop();
+
+            auto it = m_connections.find(timer.fd);
+            if( it == m_connections.end() || it->second->id != timer.id ) {
+                continue;
+            }
+
+            Connection& conn = *it->second;
+            if( now >= conn.deadline ) {
+                finish(conn);
+            } else if( State::Waiting == conn.state && now >= conn.startAt ) {
+                startHandshake(conn);
+            }
+        }
+    }
+
+    void ready(Connection& conn, uint32_t events)
+    {
+        switch( conn.state ) {
+            case State::Waiting:
+                if( events & (EPOLLHUP | EPOLLERR) ) {
+                    finish(conn);
+                }
+                break;
+
+            case State::Stalled: {
+                // Throw away whatever the client sends, until it gives up.
+                char buff[4096];
+                for(;;) {
+                    ssize_t ret = recv(conn.sock.GetFd(), buff, sizeof(buff), 0);
+                    if( ret > 0 ) {
+                        continue;
+                    }
+                    if( 0 == ret || (EAGAIN != errno && EWOULDBLOCK != errno) ) {
+                        finish(conn);
+                    }
+                    break;
+                }
+                break;
+            }
+
+            default:
+                advance(conn);
+                break;
+        }
+    }
+
+    void startHandshake(Connection& conn)
+    {
+        conn.ssl.reset(new ssl::SSL(*conn.endpoint->variant->ctx));
+        conn.ssl->SetFd(conn.sock.GetFd());
+        conn.state = State::Handshake;
+        advance(conn);
+    }
+
+    void advance(Connection& conn)
+    {
+        static const char response[] = "HTTP/1.0 200 OK\r\n"
+                                       "Content-Length: 0\r\n"
+                                       "Connection: close\r\n\r\n";
+        char buff[1024];
+
+        for(;;) {
+            int ret;
+            switch( conn.state ) {
+                case State::Handshake:
+                    ret = conn.ssl->Accept();
+                    if( 1 == ret ) {
+                        conn.state = State::Reading;
+                        continue;
+                    }
+                    break;
+
+                case State::Reading:
+                    ret = conn.ssl->Read(buff, sizeof(buff));
+                    if( ret > 0 ) {
+                        conn.state = State::Writing;
+                        continue;
+                    }
+                    break;
+
+                case State::Writing:
+                    ret = conn.ssl->Write(response + conn.written,
+                                          static_cast<int>(sizeof(response) - 1 - conn.written));
+                    if( ret > 0 ) {
+                        conn.written += ret;
+                        if( conn.written < sizeof(response) - 1 ) {
+                            continue;
+                        }
+                        ::SSL_shutdown(*conn.ssl);
+                        ERR_clear_error();
+                        finish(conn);
+                        return;
+                    }
+                    break;
+
+                default:
+                    return;
+            }
+
+            int err = conn.ssl->GetError(ret);
+            if( SSL_ERROR_WANT_READ == err ) {
+                watch(conn.sock.GetFd(), EPOLLIN, EPOLL_CTL_MOD);
+            } else if( SSL_ERROR_WANT_WRITE == err ) {
+                watch(conn.sock.GetFd(), EPOLLOUT, EPOLL_CTL_MOD);
+            } else {
+                ERR_clear_error();
+                finish(conn);
+            }
+            return;
+        }
+    }
+
+    // NOTE: 'conn' is destroyed by this.
+    void finish(Connection& conn)
+    {
+        int fd = conn.sock.GetFd();
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        m_connections.erase(fd);
+    }
+};
+
+
+// Scoring
+// --------------------------------------------------
+
+struct GroundTruth {
+    Profile                     profile;
+    const TlsVariant*           variant;
+};
+
+struct ProfileScore {
+    size_t  endpoints;
+    size_t  correct;
+    double  probeSeconds;
+    double  timeoutSeconds;
+
+    ProfileScore()
+        : endpoints(0), correct(0), probeSeconds(0), timeoutSeconds(0)
+    { }
+};
+
+// Compare a scan's JSON results against what each endpoint really is, and
+// print a report.  Returns false if the results couldn't be read.
+bool score(const std::string& resultsFile,
+           const std::map<std::string, GroundTruth>& truth,
+           double wallSeconds,
+           std::ostream& out)
+{
+    std::ifstream in(resultsFile);
+    if( !in ) {
+        std::cerr << "Could not open results file: '" << resultsFile << "'" << std::endl;
+        return false;
+    }
+
+    // What the scan found: accepted ciphers, and where the time went.
+    struct Found {
+        std::set<std::string>   ciphers;
+        double                  probeSeconds;
+        double                  timeoutSeconds;
+    };
+    std::map<std::string, Found> found;
+
+    std::string line;
+    size_t lineNumber = 0;
+    while( std::getline(in, line) ) {
+        lineNumber++;
+        if( line.empty() ) {
+            continue;
+        }
+
+        boost::property_tree::ptree record;
+        try {
+            std::istringstream lineStream(line);
+            boost::property_tree::read_json(lineStream, record);
+        } catch( const boost::property_tree::json_parser_error& e ) {
+            std::cerr << resultsFile << ":" << lineNumber << ": " << e.what() << std::endl;
+            continue;
+        }
+
+        if( record.get<std::string>("type", "") != "target" ) {
+            continue;
+        }
+
+        std::string key = record.get<std::string>("host") + ":" +
+                          record.get<std::string>("port");
+        Found& entry = found[key];
+
+        for( auto& it : record.get_child("probes") ) {
+            const boost::property_tree::ptree& probe = it.second;
+            double seconds = probe.get<double>("elapsed_us", 0) / 1e6;
+            std::string status = probe.get<std::string>("status");
+
+            entry.probeSeconds += seconds;
+            if( "accepted" == status ) {
+                entry.ciphers.insert(probe.get<std::string>("cipher"));
+            } else if( "timeout" == status ) {
+                entry.timeoutSeconds += seconds;
+            }
+        }
+    }
+
+    std::map<Profile, ProfileScore> profiles;
+    size_t correct = 0,
+           missedLive = 0,
+           falseLive = 0,
+           expectedCiphers = 0,
+           foundCiphers = 0,
+           unexpectedCiphers = 0;
+    double probeSeconds = 0,
+           timeoutSeconds = 0,
+           liveTimeoutSeconds = 0;
+
+    for( auto& it : truth ) {
+        const GroundTruth& expected = it.second;
+        ProfileScore& profile = profiles[expected.profile];
+        profile.endpoints++;
+
+        auto result = found.find(it.first);
+        bool speaksTls = ProfileSpeaksTls(expected.profile);
+        bool seemsLive = result != found.end() && !result->second.ciphers.empty();
+
+        if( speaksTls == seemsLive ) {
+            correct++;
+            profile.correct++;
+        } else if( speaksTls ) {
+            missedLive++;
+        } else {
+            falseLive++;
+        }
+
+        if( speaksTls ) {
+            expectedCiphers += expected.variant->ciphers.size();
+        }
+
+        if( result == found.end() ) {
+            continue;
+        }
+
+        const Found& scanned = result->second;
+        for( auto& cipher : scanned.ciphers ) {
+            if( speaksTls && expected.variant->ciphers.count(cipher) ) {
+                foundCiphers++;
+            } else {
+                unexpectedCiphers++;
+            }
+        }
+
+        profile.probeSeconds += scanned.probeSeconds;
+        profile.timeoutSeconds += scanned.timeoutSeconds;
+        probeSeconds += scanned.probeSeconds;
+        timeoutSeconds += scanned.timeoutSeconds;
+        if( speaksTls ) {
+            liveTimeoutSeconds += scanned.timeoutSeconds;
+        }
+    }
+
+    auto percent = [](double part, double whole) {
+        return whole > 0 ? 100.0 * part / whole : 0.0;
+    };
+
+    out << std::fixed << std::setprecision(1);
+    out << "Endpoints:       " << truth.size() << std::endl;
+    out << "Wall time:       " << wallSeconds << " s" << std::endl;
+    out << "Probe time:      " << probeSeconds << " s, "
+        << timeoutSeconds << " s (" << percent(timeoutSeconds, probeSeconds)
+        << "%) in timeouts, " << liveTimeoutSeconds
+        << " s of those on live endpoints" << std::endl;
+    out << "Verdicts:        " << correct << " correct (" << percent(correct, truth.size())
+        << "%), " << missedLive << " live endpoints missed, "
+        << falseLive << " reported live wrongly" << std::endl;
+    out << "Ciphers:         " << foundCiphers << " of " << expectedCiphers
+        << " found (" << percent(foundCiphers, expectedCiphers) << "%), "
+        << unexpectedCiphers << " unexpected" << std::endl;
+
+    out << std::endl;
+    out << std::left << std::setw(12) << "Profile"
+        << std::right << std::setw(10) << "Endpoints"
+        << std::setw(10) << "Correct"
+        << std::setw(12) << "Probe s"
+        << std::setw(12) << "Timeout s" << std::endl;
+    for( auto& it : profiles ) {
+        out << std::left << std::setw(12) << ProfileName(it.first)
+            << std::right << std::setw(10) << it.second.endpoints
+            << std::setw(10) << it.second.correct
+            << std::setw(12) << it.second.probeSeconds
+            << std::setw(12) << it.second.timeoutSeconds << std::endl;
+    }
+
+    return true;
+}
+
+
+// Setup
+// --------------------------------------------------
+
+static std::atomic<bool> interrupted(false);
+
+void onSignal(int)
+{
+    interrupted = true;
+}
+
+// Allow as many descriptors as we're permitted - every endpoint needs a
+// listener, on top of the connections themselves.
+void raiseFileLimit()
+{
+    struct rlimit limit;
+    if( 0 == getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max ) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+std::vector<std::unique_ptr<TlsVariant>> makeVariants(const TestCertificate& cert)
+{
+    struct Policy {
+        const char*         name;
+        const ::SSL_METHOD* method;
+        const char*         ciphers;
+        bool                serverPreference;
+    };
+    const Policy policies[] = {
+        { "modern", ::TLSv1_2_server_method(),
+          "ECDHE-RSA-AES128-GCM-SHA256:ECDHE-RSA-AES256-GCM-SHA384:AES128-GCM-SHA256", true },
+        { "compat", ::SSLv23_server_method(),
+          "ECDHE-RSA-AES128-SHA:AES128-SHA:AES256-SHA:DES-CBC3-SHA", true },
+        { "legacy", ::TLSv1_server_method(),
+          "AES128-SHA:DES-CBC3-SHA:RC4-SHA", false },
+        { "weak", ::SSLv23_server_method(),
+          "RC4-MD5:RC4-SHA:DES-CBC3-SHA:AES128-SHA", false },
+    };
+
+    std::vector<std::unique_ptr<TlsVariant>> ret;
+    for( auto& policy : policies ) {
+        TestServerConfig config;
+        config.method = policy.method;
+        config.ciphers = policy.ciphers;
+        config.serverPreference = policy.serverPreference;
+
+        std::unique_ptr<TlsVariant> variant(new TlsVariant);
+        variant->name = policy.name;
+        try {
+            variant->ctx.reset(new ssl::SSLContext(TestServer::MakeContext(config, cert)));
+        } catch( const ssl::SSLError& e ) {
+            // This OpenSSL doesn't have any of these ciphers.
+            std::cerr << "Skipping TLS policy '" << policy.name << "': "
+                      << e.what() << std::endl;
+            ERR_clear_error();
+            continue;
+        }
+
+        ssl::SSL ssl(*variant->ctx);
+        for( auto& cipher : ssl.GetCipherList() ) {
+            variant->ciphers.insert(cipher.Name());
+        }
+
+        ret.push_back(std::move(variant));
+    }
+
+    return ret;
+}
+
+Socket listenOn(const SocketAddress& addr, int backlog)
+{
+    Socket sock(addr);
+    sock.SetReuseAddress();
+    sock.Bind(addr);
+    sock.Listen(backlog);
+    return sock;
+}
+
+Expected<std::map<Profile, double>> parseMix(const std::string& spec)
+{
+    typedef Expected<std::map<Profile, double>> Result;
+    std::map<Profile, double> ret;
+
+    size_t start = 0;
+    while( start <= spec.length() ) {
+        size_t end = spec.find(',', start);
+        if( std::string::npos == end ) {
+            end = spec.length();
+        }
+
+        std::string item = spec.substr(start, end - start);
+        size_t equals = item.find('=');
+        if( std::string::npos == equals ) {
+            return Result::fromException(std::runtime_error("expected profile=weight: " + item));
+        }
+
+        std::string name = item.substr(0, equals);
+        bool known = false;
+        for( auto& it : profileNames ) {
+            if( name == it.second ) {
+                try {
+                    ret[it.first] = boost::lexical_cast<double>(item.substr(equals + 1));
+                } catch( const boost::bad_lexical_cast& ) {
+                    return Result::fromException(std::runtime_error("invalid weight: " + item));
+                }
+                known = true;
+            }
+        }
+        if( !known ) {
+            return Result::fromException(std::runtime_error("unknown profile: " + name));
+        }
+
+        start = end + 1;
+    }
+
+    return ret;
+}
+
+
+int main(int argc, char* argv[])
+{
+    EmulatorOptions options;
+    std::string targetsFile,
+                truthFile,
+                resultsFile,
+                command;
+
+    OptionParser parser;
+
+    // Every numeric option is handled the same way.
+    auto number = [&parser](const char* name, std::function<void(const std::string&)> set) {
+        parser.On("", name)
+              .SetParameter(true)
+              .SetParameterOptional(false)
+              .SetCallback([name, set](const std::string& arg)
+        {
+            try {
+                set(arg);
+            } catch( const boost::bad_lexical_cast& ) {
+                std::cerr << "Invalid value for '" << name << "': '" << arg << "'" << std::endl;
+            }
+        });
+    };
+    number("endpoints", [&](const std::string& arg) {
+        options.endpoints = boost::lexical_cast<size_t>(arg);
+    });
+    number("port", [&](const std::string& arg) {
+        options.port = boost::lexical_cast<uint16_t>(arg);
+    });
+    number("latency", [&](const std::string& arg) {
+        options.latencyMs = boost::lexical_cast<int>(arg);
+    });
+    number("jitter", [&](const std::string& arg) {
+        options.jitterMs = boost::lexical_cast<int>(arg);
+    });
+    number("loss", [&](const std::string& arg) {
+        options.loss = boost::lexical_cast<double>(arg) / 100;
+    });
+    number("slow", [&](const std::string& arg) {
+        options.slowMs = boost::lexical_cast<int>(arg);
+    });
+    number("rate", [&](const std::string& arg) {
+        options.rateLimit = boost::lexical_cast<double>(arg);
+    });
+    number("hold", [&](const std::string& arg) {
+        options.holdMs = boost::lexical_cast<int>(arg);
+    });
+    number("loops", [&](const std::string& arg) {
+        options.loops = std::max<size_t>(1, boost::lexical_cast<size_t>(arg));
+    });
+    number("seed", [&](const std::string& arg) {
+        options.seed = boost::lexical_cast<unsigned>(arg);
+    });
+
+    parser.On("", "base")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&options](const std::string& arg)
+    {
+        options.baseAddress = arg;
+    });
+    parser.On("", "mix")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&options](const std::string& arg)
+    {
+        auto mix = parseMix(arg);
+        if( mix.valid() ) {
+            options.mix = mix.get();
+        } else {
+            try {
+                mix.get();
+            } catch( const std::runtime_error& e ) {
+                std::cerr << "Invalid value for 'mix': " << e.what() << std::endl;
+            }
+        }
+    });
+    parser.On("", "targets")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&targetsFile](const std::string& arg)
+    {
+        targetsFile = arg;
+    });
+    parser.On("", "truth")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&truthFile](const std::string& arg)
+    {
+        truthFile = arg;
+    });
+    parser.On("", "results")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&resultsFile](const std::string& arg)
+    {
+        resultsFile = arg;
+    });
+    parser.On("", "run")
+          .SetParameter(true)
+          .SetParameterOptional(false)
+          .SetCallback([&command](const std::string& arg)
+    {
+        command = arg;
+    });
+
+    Expected<std::vector<std::string>> args = parser.Parse(argc, argv);
+    if( !args.valid() ) {
+        std::cerr << "Error parsing" << std::endl;
+        try {
+            args.get();
+        } catch( const OptionParserError& e ) {
+            std::cerr << e.what() << std::endl;
+        }
+        return 1;
+    }
+
+    struct in_addr base;
+    if( 1 != inet_pton(AF_INET, options.baseAddress.c_str(), &base) ||
+        (ntohl(base.s_addr) >> 24) != 127 )
+    {
+        std::cerr << "Base address must be in 127.0.0.0/8: '"
+                  << options.baseAddress << "'" << std::endl;
+        return 1;
+    }
+
+    SSL_library_init();
+    SSL_load_error_strings();
+    signal(SIGPIPE, SIG_IGN);
+    raiseFileLimit();
+
+    TestCertificate cert;
+    auto variants = makeVariants(cert);
+    if( variants.empty() ) {
+        std::cerr << "No usable TLS policies" << std::endl;
+        return 2;
+    }
+
+    // Lay out the endpoints.  The same seed always gives the same layout.
+    std::mt19937 rng(options.seed);
+    std::vector<Profile> weightedProfiles;
+    std::vector<double> weights;
+    for( auto& it : options.mix ) {
+        weightedProfiles.push_back(it.first);
+        weights.push_back(it.second);
+    }
+    std::discrete_distribution<size_t> pickProfile(weights.begin(), weights.end());
+    std::uniform_int_distribution<size_t> pickVariant(0, variants.size() - 1);
+
+    std::vector<std::unique_ptr<Endpoint>> endpoints;
+    std::map<std::string, GroundTruth> truth;
+    uint32_t first = ntohl(base.s_addr);
+
+    for( size_t i = 0; i < options.endpoints; i++ ) {
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(options.port);
+        sin.sin_addr.s_addr = htonl(first + static_cast<uint32_t>(i));
+
+        SocketAddress addr(reinterpret_cast<struct sockaddr*>(&sin), sizeof(sin));
+        Profile profile = weightedProfiles[pickProfile(rng)];
+        const TlsVariant* variant = variants[pickVariant(rng)].get();
+
+        std::unique_ptr<Endpoint> endpoint(new Endpoint(addr, profile, variant));
+        try {
+            switch( profile ) {
+                case Profile::Closed:
+                    break;
+
+                case Profile::Drop:
+                    endpoint->listener.reset(new Socket(listenOn(addr, 0)));
+                    endpoint->filler.reset(new Socket(addr));
+                    endpoint->filler->Connect(addr);
+                    break;
+
+                default:
+                    endpoint->listener.reset(new Socket(listenOn(addr, SOMAXCONN)));
+                    endpoint->tokens = options.rateBurst;
+                    endpoint->refilled = Clock::now();
+                    break;
+            }
+        } catch( const SocketError& e ) {
+            std::cerr << "Could not set up " << addr.ToString() << ": "
+                      << e.what() << std::endl;
+            return 2;
+        }
+
+        GroundTruth expected = { profile, variant };
+        truth[addr.ToString() + ":" + std::to_string(options.port)] = expected;
+        endpoints.push_back(std::move(endpoint));
+    }
+
+    if( !targetsFile.empty() ) {
+        std::ofstream out(targetsFile);
+        for( auto& endpoint : endpoints ) {
+            out << endpoint->address.ToString() << ":" << options.port << "\n";
+        }
+    }
+
+    if( !truthFile.empty() ) {
+        std::ofstream out(truthFile);
+        for( auto& endpoint : endpoints ) {
+            out << "{\"host\":\"" << endpoint->address.ToString() << "\""
+                << ",\"port\":" << options.port
+                << ",\"profile\":\"" << ProfileName(endpoint->profile) << "\"";
+            if( ProfileSpeaksTls(endpoint->profile) ) {
+                out << ",\"policy\":\"" << endpoint->variant->name << "\",\"ciphers\":[";
+                bool firstCipher = true;
+                for( auto& cipher : endpoint->variant->ciphers ) {
+                    out << (firstCipher ? "" : ",") << "\"" << cipher << "\"";
+                    firstCipher = false;
+                }
+                out << "]";
+            }
+            out << "}\n";
+        }
+    }
+
+    std::vector<std::unique_ptr<EmulatorLoop>> loops;
+    for( size_t i = 0; i < options.loops; i++ ) {
+        loops.emplace_back(new EmulatorLoop(options, options.seed + static_cast<unsigned>(i)));
+    }
+    for( size_t i = 0; i < endpoints.size(); i++ ) {
+        if( endpoints[i]->listener && Profile::Drop != endpoints[i]->profile ) {
+            loops[i % loops.size()]->AddListener(endpoints[i].get());
+        }
+    }
+    for( auto& loop : loops ) {
+        loop->Start();
+    }
+
+    std::cout << "Emulating " << endpoints.size() << " endpoints from "
+              << options.baseAddress << ", port " << options.port << std::endl;
+
+    int ret = 0;
+    if( command.empty() ) {
+        signal(SIGINT, onSignal);
+        signal(SIGTERM, onSignal);
+        while( !interrupted ) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    } else {
+        auto started = Clock::now();
+        int status = std::system(command.c_str());
+        double wallSeconds = std::chrono::duration<double>(Clock::now() - started).count();
+
+        if( 0 != status ) {
+            std::cerr << "Scan command failed with status " << status << std::endl;
+            ret = 1;
+        }
+
+        for( auto& loop : loops ) {
+            loop->Stop();
+        }
+
+        if( !resultsFile.empty() && !score(resultsFile, truth, wallSeconds, std::cout) ) {
+            ret = 1;
+        } else if( resultsFile.empty() ) {
+            std::cout << "Wall time: " << wallSeconds << " s" << std::endl;
+        }
+    }
+
+    for( auto& loop : loops ) {
+        loop->Stop();
+    }
+    return ret;
+}